@@ -1 +1 @@
-qemu-system-i386 -fda build/main_floppy.img
\ No newline at end of file
+qemu-system-i386 -fda build/main_floppy.img -serial stdio -smp 4
\ No newline at end of file
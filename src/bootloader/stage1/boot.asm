@@ -12,12 +12,17 @@
 ;
 ; The bootloader is loaded by BIOS at address 0x7C00
 ; and must be exactly 512 bytes (sector size)
+;
+; It records boot time checkpoints with RDTSC (see boot_times.inc), so it
+; needs a Pentium or later, like the rest of NBOS (the kernel is built for
+; the i686)
 
 org 0x7C00
 bits 16
 
 %define ENDL 0x0D, 0x0A
 
+%include "boot_times.inc"
 
 
 ; =============================================================================
@@ -73,13 +78,23 @@ ebr_system_id:              db 'FAT12   '          ; Filesystem type (8 bytes)
 
 start:
     ; Initialize data segments
-    mov ax, 0                   ; Load 0 in the accumulator register to initialize
+    xor ax, ax                  ; Load 0 in the accumulator register to initialize
     mov ds, ax                  ; Set the data segment register to 0
     mov es, ax                  ; Set the extra segment register to 0
 
     ; Initialize stack
+    ; It grows downward from the end of the first boot time slot, so the
+    ; first two pushes fill that slot and the rest of the stack lies below
+    ; the table
     mov ss, ax                  ; Set the stack pointer to 0
-    mov sp, 0x7C00              ; Stack grows downward from 0x7C00
+    mov sp, BOOT_TIMES_ADDRESS + BOOT_TIME_SLOT_SIZE
+
+    ; Checkpoint: BIOS done (RDTSC overwrites DL, the boot drive)
+    mov bx, dx                  ; Save boot drive
+    rdtsc                       ; EDX:EAX = time stamp counter
+    push edx                    ; Slot BOOT_TIME_STAGE1_ENTRY, high dword
+    push eax                    ; Low dword
+    mov dx, bx                  ; Restore boot drive
 
     push es
     push word .after
@@ -93,6 +108,19 @@ start:
     mov si, msg_loading         ; Load the message in the SI register
     call puts                   ; Display loading message
 
+    ; Check for the INT 13h extensions (EDD): hard disks and USB/HDD emulation
+    ; can then be read by LBA with function 42h, real floppies keep using CHS
+    mov ah, 41h                 ; BIOS function: check extensions present
+    mov bx, 55AAh               ; Signature expected by the BIOS
+    int 13h                     ; Call BIOS disk service (DL = boot drive)
+    jc .no_edd                  ; Carry set: no extensions
+    cmp bx, 0AA55h              ; Extensions report the swapped signature
+    jne .no_edd                 ; No signature: no extensions
+    test cl, 1                  ; Bit 0: fixed disk access subset (functions 42h-44h, 47h, 48h)
+    jz .no_edd                  ; Extended read not supported
+    mov byte [disk_read_function], 42h ; Use extended read from now on
+
+.no_edd:
     ; Get disk parameters
     push es
     mov ah, 08h                 ; BIOS function: get drive parameters
@@ -101,49 +129,46 @@ start:
     pop es
 
     ; Extract sectors per track
-    and cl, 0x3f                ; Mask upper 2 bits (cylinder bits)
-    xor ch, ch                  ; Clear CH register
+    and cx, 0x3f                ; Mask upper 2 bits (cylinder bits), clear CH
     mov [bdb_sectors_per_track], cx  ; Store sectors per track
 
     ; Extract number of heads
     inc dh                      ; Heads are 0-based, so increment to get count
     mov [bdb_heads], dh         ; Store number of heads
 
+    ; Calculate root directory size in sectors, rounded up
+    ; 16 entries of 32 bytes per sector (512-byte sectors, like disk_read)
+    mov ax, [bdb_dir_entries_count] ; Load number of directory entries
+    add ax, 15                     ; Round up to a whole sector
+    shr ax, 4                      ; Divide by 16 entries per sector
+    xchg ax, cx                    ; CX = number of sectors to read (root directory size)
+
     ; Calculate root directory location
     ; First, compute FAT size: sectors_per_fat * fat_count
-    mov ax, [bdb_sectors_per_fat]  ; Load sectors per FAT
-    mov bl, [bdb_fat_count]        ; Load number of FATs
-    xor bh, bh                     ; Clear upper byte of BX
-    mul bx                         ; AX = sectors_per_fat * fat_count
+    mov al, [bdb_fat_count]        ; Load number of FATs
+    cbw                            ; AX = number of FATs
+    mul word [bdb_sectors_per_fat] ; AX = sectors_per_fat * fat_count
     add ax, [bdb_reserved_sectors] ; Add reserved sectors (boot sector)
-    push ax                        ; Save FAT location + reserved sectors
-
-    ; Calculate root directory size in sectors
-    mov ax, [bdb_dir_entries_count] ; Load number of directory entries
-    shl ax, 5                      ; Multiply by 32 (bytes per entry)
-    xor dx, dx                     ; Clear DX for division
-    div word [bdb_bytes_per_sector] ; Divide by sector size to get sectors
-
-    ; Round up if there's a remainder
-    test dx, dx                    ; Check if remainder is zero
-    jz .root_dir_after            ; If no remainder, skip increment
-    inc ax                        ; Increment to account for partial sector
 
-.root_dir_after:
     ; Read root directory into memory
-    mov cl, al                    ; Number of sectors to read (root directory size)
-    pop ax                        ; Restore starting sector (after FAT)
-    mov dl, [ebr_drive_number]    ; Load drive number
     mov bx, buffer                ; Load destination buffer address
     call disk_read                ; Read root directory sectors
 
+    ; The data area (cluster 2) starts right after the root directory
+    add ax, cx                    ; AX = root directory start + root directory size
+    push ax                       ; Save first sector of the data area
+
+    ; Checkpoint: root directory read (low dword only, see boot_times.inc)
+    rdtsc
+    mov [BOOT_TIMES_ADDRESS + BOOT_TIME_STAGE1_ROOT_READ * BOOT_TIME_SLOT_SIZE], eax
+
     ; Search for kernel file in root directory
-    xor bx, bx                    ; Clear BX (entry counter)
-    mov di, buffer                ; Point DI to start of directory buffer
+    mov dx, [bdb_dir_entries_count] ; DX = entries left to search
+    mov di, bx                    ; Point DI to start of directory buffer
 
 .search_kernel:
     mov si, file_kernel_bin       ; Point SI to kernel filename
-    mov cx, 11                    ; Compare 11 characters (8.3 format)
+    mov cl, 11                    ; Compare 11 characters (8.3 format, CH is 0)
     push di                       ; Save current directory entry position
     repe cmpsb                    ; Compare strings
     pop di                        ; Restore directory entry position
@@ -151,90 +176,87 @@ start:
 
     ; Move to next directory entry
     add di, 32                    ; Each directory entry is 32 bytes
-    inc bx                        ; Increment entry counter
-    cmp bx, [bdb_dir_entries_count] ; Check if all entries searched
-    jl .search_kernel             ; Continue searching if more entries
+    dec dx                        ; One entry less to search
+    jnz .search_kernel            ; Continue searching if more entries
 
     ; Kernel not found - display error
     jmp kernel_not_found_error
 
 .found_kernel:
+    ; Checkpoint: root directory scanned
+    rdtsc
+    mov [BOOT_TIMES_ADDRESS + BOOT_TIME_STAGE1_ROOT_SCAN * BOOT_TIME_SLOT_SIZE], eax
+
     ; Extract kernel cluster number from directory entry
-    mov ax, [di + 26]             ; Cluster number is at offset 26
-    mov [kernel_cluster], ax      ; Store kernel starting cluster
+    ; BP holds the current cluster while loading (disk_read preserves it)
+    mov bp, [di + 26]             ; Cluster number is at offset 26
+    pop di                        ; DI = first sector of the data area while loading
 
-    ; Read FAT into memory
+    ; Read FAT into memory (BX still points to buffer, CX = 0 after the compare)
     mov ax, [bdb_reserved_sectors] ; Start of FAT (after boot sector)
-    mov bx, buffer                ; Destination buffer
     mov cl, [bdb_sectors_per_fat] ; Number of FAT sectors to read
-    mov dl, [ebr_drive_number]    ; Drive number
     call disk_read                ; Read FAT into buffer
 
+    ; Checkpoint: FAT read (the next one is the first of stage2)
+    rdtsc
+    mov [BOOT_TIMES_ADDRESS + BOOT_TIME_STAGE1_FAT_READ * BOOT_TIME_SLOT_SIZE], eax
+
     ; Set up segment for kernel loading
-    mov bx, KERNEL_LOAD_SEGMENT   ; Load kernel segment
-    mov es, bx                    ; Set ES to kernel segment
+    push KERNEL_LOAD_SEGMENT      ; Load kernel segment
+    pop es                        ; Set ES to kernel segment
     mov bx, KERNEL_LOAD_OFFSET    ; Load kernel offset
 
 .load_kernel_loop:
-    ; Convert cluster to LBA address
-    mov ax, [kernel_cluster]      ; Load current cluster number
-    add ax, 31                    ; Add data area offset (hardcoded for FAT12)
-
-    ; Read cluster sector
-    mov cl, 1                     ; Read one sector
-    mov dl, [ebr_drive_number]    ; Drive number
-    call disk_read                ; Read cluster sector
-
-    ; Advance buffer pointer
-    add bx, [bdb_bytes_per_sector] ; Move to next sector in memory
-
-    ; Find next cluster in FAT chain
-    mov ax, [kernel_cluster]      ; Load current cluster
-    mov cx, 3                     ; Multiply by 3 (each FAT12 entry is 1.5 bytes)
-    mul cx                        ; AX = cluster * 3
-    mov cx, 2                     ; Divide by 2 to get byte offset
-    div cx                        ; AX = byte offset in FAT
-
-    ; Calculate FAT entry address
-    mov si, buffer                ; Point to FAT buffer
-    add si, ax                    ; Add byte offset
-    mov ax, [ds:si]               ; Load FAT entry (2 bytes)
-
-    ; Check if cluster was even or odd
-    or dx, dx                     ; Check remainder from division
-    jz .even                      ; Jump if even cluster
-
-.odd:
-    shr ax, 4                     ; Odd cluster: shift right 4 bits
-    jmp .next_cluster_after       ; Continue processing
-
-.even:
-    and ax, 0x0FFF                ; Even cluster: mask upper 4 bits
+    ; Start a run of consecutive clusters at the current cluster
+    ; The whole run is read with a single disk_read, which splits it at
+    ; track boundaries, instead of one BIOS call per cluster
+    push bp                       ; Save first cluster of the run
+    xor cx, cx                    ; CX = number of clusters in the run
+
+.extend_run:
+    ; Add the current cluster to the run and find the next one
+    inc cx                        ; One more cluster in the run
+    mov ax, bp                    ; Load current cluster
+    call fat12_next_cluster       ; AX = next cluster in the chain
+    inc bp                        ; BP = cluster that would continue the run
+    xchg ax, bp                   ; BP = next cluster, AX = adjacent cluster
+    cmp ax, bp                    ; Is the next cluster adjacent?
+    je .extend_run                ; Yes: extend the run further
+
+.read_run:
+    ; Convert the run to sectors: LBA = data area + (cluster - 2) * sectors per cluster
+    pop ax                        ; Restore first cluster of the run
+    dec ax                        ; Clusters are numbered from 2
+    dec ax
+    movzx si, byte [bdb_sectors_per_cluster] ; SI = sectors per cluster
+    mul si                        ; AX = sector offset in the data area
+    add ax, di                    ; AX = LBA of the first sector of the run
+    xchg ax, cx                   ; AX = clusters in the run
+    mul si                        ; AX = sectors in the run
+    xchg ax, cx                   ; CX = sectors, AX = LBA
+
+    ; Read the whole run at once
+    call disk_read                ; Read CX sectors
+
+    ; Advance buffer pointer past the run
+    shl cx, 9                     ; CX = bytes read by this run (512 bytes per sector)
+    add bx, cx                    ; Move to the end of the run in memory
 
-.next_cluster_after:
     ; Check for end of cluster chain
-    cmp ax, 0x0FF8                ; Compare with end of chain marker
-    jae .read_finish              ; Jump if end of chain reached
-
-    ; Continue with next cluster
-    mov [kernel_cluster], ax      ; Store next cluster number
-    jmp .load_kernel_loop         ; Continue loading
+    cmp bp, 0x0FF8                ; Compare with end of chain marker
+    jb .load_kernel_loop          ; Continue loading if more clusters follow
 
 .read_finish:
     ; Prepare for kernel execution
+    ; The BPB (with the geometry from function 08h) and the FAT in buffer are
+    ; left in place: stage2 takes them over instead of reading them again
     mov dl, [ebr_drive_number]    ; Pass drive number to kernel
-    mov ax, KERNEL_LOAD_SEGMENT   ; Set up segments for kernel
-    mov ds, ax                    ; Set data segment to kernel segment
-    mov es, ax                    ; Set extra segment to kernel segment
+    push es                       ; ES is still the kernel segment (disk_read preserves it)
+    pop ds                        ; Set data segment to kernel segment
 
-    ; Jump to kernel entry point
+    ; Jump to kernel entry point (does not return)
     jmp KERNEL_LOAD_SEGMENT:KERNEL_LOAD_OFFSET
 
-    ; Fallback: reboot if kernel doesn't start
-    jmp wait_key_and_reboot
-    cli                           ; Disable interrupts
-    hlt                           ; Halt processor
-
 
 
 ; =============================================================================
@@ -243,20 +265,19 @@ start:
 
 floppy_error:
     mov si, msg_floppy_read_failed     ; Load error message string
-    call puts                          ; Display error message
-    jmp wait_key_and_reboot            ; Jump to reboot handler
+    jmp short show_error               ; Display it and reboot
 
 kernel_not_found_error:
     mov si, msg_kernel_not_found       ; Load kernel not found message
+
+show_error:
     call puts                          ; Display error message
-    jmp wait_key_and_reboot            ; Jump to reboot handler
+                                       ; Fall through to the reboot handler
 
 wait_key_and_reboot:
     mov ah, 0                          ; BIOS function: wait for keypress
     int 16h                            ; Call BIOS keyboard service
     jmp 0FFFFh:0                       ; Jump to BIOS reset vector (reboot system)
-    cli                                ; Disable interrupts
-    hlt                                ; Halt execution
 
 
 
@@ -267,11 +288,9 @@ wait_key_and_reboot:
 ; Prints a null-terminated string to video using BIOS teletype output
 ; Parameters:
 ;   ds:si - pointer to null-terminated string to print
+; Modifies: ax, bh, si (no caller needs them preserved)
 
 puts:
-    push si                 ; Save SI register value
-    push ax                 ; Save AX register value
-
 .loop:
     lodsb                   ; Load byte from [SI] into AL, increment SI
     or al, al               ; Check for end of string (AL = 0)
@@ -284,8 +303,35 @@ puts:
     jmp .loop               ; Continue with next character
 
 .done:
-    pop ax                  ; Restore AX register value
-    pop si                  ; Restore SI register value
+    ret                     ; Return from function
+
+
+
+; =============================================================================
+; FAT12 NEXT CLUSTER FUNCTION
+; =============================================================================
+;
+; Looks up the next cluster of a chain in the FAT loaded at buffer
+; Each FAT12 entry is 1.5 bytes: the entry of cluster N starts at byte N * 3 / 2,
+; even entries use the low 12 bits of that word, odd entries the high 12 bits
+; Parameters:
+;   ax - cluster number
+; Returns:
+;   ax - next cluster number (0x0FF8 or above at the end of the chain)
+; Modifies: si
+
+fat12_next_cluster:
+    mov si, ax              ; SI = cluster
+    shr si, 1               ; SI = cluster / 2
+    add si, ax              ; SI = cluster * 3 / 2 (byte offset in FAT)
+    test al, 1              ; Check if cluster is odd (flags survive the load below)
+    mov ax, [buffer + si]   ; Load the 2 bytes holding the entry
+    jz .even                ; Even cluster: entry is in the low 12 bits
+
+    shr ax, 4               ; Odd cluster: shift right 4 bits
+
+.even:
+    and ax, 0x0FFF          ; Keep the 12-bit entry
     ret                     ; Return from function
 
 
@@ -294,25 +340,42 @@ puts:
 ; DISK OPERATION ROUTINES
 ; =============================================================================
 
-; LBA to CHS conversion function
-; Converts Logical Block Addressing to Cylinder-Head-Sector addressing
+; Disk read function
+; Reads sectors from disk using BIOS interrupt 13h
+; The sectors are read in chunks that end at track boundaries, so any
+; number of sectors can be requested with one call. Each chunk converts
+; its LBA to CHS (cylinder, head, sector) for function 02h
+; With the extensions the sectors are read by LBA (function 42h) through a
+; disk address packet built on the stack, otherwise by CHS (function 02h).
+; Both sets of registers are always prepared, so there is no branch:
+; each function ignores the registers of the other one
 ; Parameters:
-;   ax: LBA address to convert
-; Returns:
-;   cx [bits 0-5]: sector number
-;   cx [bits 6-15]: cylinder number
-;   dh: head number
+;   ax: LBA address to read from
+;   cx: number of sectors to read
+;   es:bx: memory address where data will be stored (512 bytes per sector)
+; The boot drive is taken from ebr_drive_number
+
+disk_read:
+    pusha                               ; Save all registers
 
-lba_to_chs:
-    push ax                             ; Save original LBA value
-    push dx                             ; Save DX register
+.next_chunk:
+    pusha                               ; Save LBA, sectors left and buffer of this chunk
+    mov bp, sp                          ; Remember the stack to drop the packet afterwards
 
+    ; LBA to CHS conversion, limiting the chunk to the end of the track
     xor dx, dx                          ; Clear DX for division
     div word [bdb_sectors_per_track]    ; AX = LBA / sectors per track
                                         ; DX = LBA % sectors per track (sector number - 1)
+    mov di, [bdb_sectors_per_track]     ; Load sectors per track
+    sub di, dx                          ; DI = sectors left on this track
+    cmp cx, di                          ; Does the rest of the request fit on the track?
+    jae .track_limit                    ; No: read up to the end of the track
+    mov di, cx                          ; Yes: read all remaining sectors
+.track_limit:
+    mov [bp], di                        ; Popped into DI after the read (saved DI slot)
+
     inc dx                              ; DX = sector number (1-based)
     mov cx, dx                          ; Store sector number in CL
-    
     xor dx, dx                          ; Clear DX for division
     div word [bdb_heads]                ; AX = cylinder number
                                         ; DX = head number
@@ -321,69 +384,50 @@ lba_to_chs:
     shl ah, 6                           ; Shift upper 2 bits of cylinder to bits 6-7
     or cl, ah                           ; Combine sector and cylinder bits in CL
 
-    pop ax                              ; Restore original DX value
-    mov dl, al                          ; Move drive number to DL
-    pop ax                              ; Restore original AX value
-    ret                                 ; Return from function
-
-; Disk read function
-; Reads sectors from disk using BIOS interrupt 13h
-; Parameters:
-;   ax: LBA address to read from
-;   cl: number of sectors to read (up to 128)
-;   dl: drive number
-;   es:bx: memory address where data will be stored
-
-disk_read:
-    push ax                             ; Save registers that will be modified
-    push bx                             ; Save BX register
-    push cx                             ; Save CX register
-    push dx                             ; Save DX register
-    push di                             ; Save DI register
-
-    push cx                             ; Save sector count
-    call lba_to_chs                     ; Convert LBA to CHS format
-    pop ax                              ; AL = number of sectors to read
-    mov ah, 02h                         ; BIOS function: read sectors
+    ; Disk address packet (DS = SS = 0, so DS:SI points to it)
+    push dword 0                        ; LBA bits 32-63
+    push word 0                         ; LBA bits 16-31
+    push word [bp + 14]                 ; LBA bits 0-15 (saved AX)
+    push es                             ; Buffer segment
+    push bx                             ; Buffer offset
+    push di                             ; Number of sectors
+    push word 10h                       ; Packet size (16 bytes), reserved byte
+    mov si, sp                          ; DS:SI = disk address packet
+
+    xchg ax, di                         ; AL = number of sectors to read
+    mov ah, [disk_read_function]        ; BIOS function: read sectors (02h) or extended read (42h)
+    mov dl, [ebr_drive_number]          ; Read from the boot drive
     mov di, 3                           ; Retry counter (3 attempts)
 
 .retry:
+    mov [si + 2], al                    ; Number of sectors: a failed extended read leaves
+                                        ; the number actually read there
     pusha                               ; Save all registers
     stc                                 ; Set carry flag (some BIOSes require this)
     int 13h                             ; Call BIOS disk service
     jnc .done                           ; Jump if operation succeeded
 
-    ; Operation failed - retry
+    ; Operation failed - reset the disk controller and retry
+    xor ah, ah                          ; BIOS function: reset disk system
+    int 13h                             ; Call BIOS disk service (a failed reset is retried too)
     popa                                ; Restore registers
-    call disk_reset                     ; Reset disk controller
     dec di                              ; Decrement retry counter
-    test di, di                         ; Check if retries exhausted
     jnz .retry                          ; Retry if attempts remaining
 
 .fail:
     jmp floppy_error                    ; Jump to error handler
 
 .done:
-    popa                                ; Restore registers saved by pusha
-    
-    pop di                              ; Restore original register values
-    pop dx                              ; Restore DX register
-    pop cx                              ; Restore CX register
-    pop bx                              ; Restore BX register
-    pop ax                              ; Restore AX register
-    ret                                 ; Return from function
-
-; Disk reset function
-; Resets the disk controller using BIOS interrupt 13h
-; Parameters: None
-; Returns: None (carry flag indicates success/failure)
-disk_reset:
-    pusha                               ; Save all general-purpose registers
-    mov ah, 0                           ; BIOS function: reset disk system
-    stc                                 ; Set carry flag
-    int 13h                             ; Call BIOS disk service
-    jc floppy_error                     ; Jump to error handler if reset failed
-    popa                                ; Restore all general-purpose registers
+    mov sp, bp                          ; Drop the registers saved by pusha and the packet
+    popa                                ; AX = LBA, CX = sectors left, BX = buffer, DI = sectors read
+    add ax, di                          ; Next LBA
+    sub cx, di                          ; Sectors still to read
+    shl di, 9                           ; Bytes read by this chunk
+    add bx, di                          ; Move the buffer past them
+    test cx, cx                         ; All sectors read?
+    jnz .next_chunk                     ; No: read the next chunk
+
+    popa                                ; Restore original register values
     ret                                 ; Return from function
 
 
@@ -392,11 +436,11 @@ disk_reset:
 ; DATA SECTION - MESSAGES AND CONSTANTS
 ; =============================================================================
 
-msg_loading:            db 'Qvantum Loading...', ENDL, 0
-msg_floppy_read_failed: db 'Failed to read from floppy', ENDL, 0
-msg_kernel_not_found:   db 'STAGE2 not found', ENDL, 0
+msg_loading:            db 'Loading...', ENDL, 0
+msg_floppy_read_failed: db 'Disk error', ENDL, 0
+msg_kernel_not_found:   db 'No STAGE2', ENDL, 0
 file_kernel_bin:        db 'STAGE2  BIN'        ; stage 2 filename in 8.3 format
-kernel_cluster:         dw 0                    ; Storage for stage 2 starting cluster
+disk_read_function:     db 02h                  ; BIOS read function: 02h (CHS) or 42h (extended LBA)
 
 ; Kernel loading address constants
 KERNEL_LOAD_SEGMENT     equ 0x2000              ; Segment where kernel will be loaded
@@ -1,35 +1,177 @@
 ; =============================================================================
-; SIMPLE BOOTLOADER FOR NBOS OPERATING SYSTEM
+; STAGE2 BOOTLOADER FOR NBOS OPERATING SYSTEM
 ; =============================================================================
 ;
-; Basic bootloader that displays a welcome message on screen
-; Loaded by BIOS at address 0x7C00 and must be exactly 512 bytes
+; Loaded by stage1 as STAGE2.BIN at KERNEL_LOAD_SEGMENT of stage1 (0x2000:0)
+; Loads KERNEL.BIN from the FAT12 filesystem at 1MB, unpacks it there if the
+; fat tool packed it (see unpack.inc), switches the processor to 32-bit
+; protected mode and transfers execution to the kernel
+;
+; Stage1 hands over (see STAGE1 HANDOVER below):
+; - DL: BIOS drive number of the boot drive
+; - DS: stage2 segment
+; - The boot sector with its BPB at 0000:7C00, where stage1 already replaced
+;   the geometry with the values reported by the BIOS
+; - The first FAT at 0000:7E00, read by stage1 to follow the STAGE2.BIN chain
+; - The boot time table at 0000:7B00 with the checkpoints of stage1, to which
+;   stage2 adds its own (see boot_times.inc); the stack is right below it
+;
+; Neither the BPB nor the FAT is read from disk again. Only the root directory
+; and the kernel clusters are read, through the track cache of disk.inc
+;
+; Memory layout while loading:
+; - ...     - 0x07AFF  stack (from stage1)
+; - 0x07B00 - 0x07B3F  boot time table
+; - 0x07C00 - 0x07DFF  boot sector / BPB (from stage1)
+; - 0x07E00 - ...      FAT (from stage1)
+; - 0x10000 - 0x17FFF  track buffer (up to 63 sectors, within one 64KB block)
+; - 0x20000 - ...      stage2 (with the boot information and memory map for the kernel)
+; - 0x100000 - ...     kernel (copied there sector by sector, see high_copy;
+;                      a packed kernel is unpacked in place, see unpack.inc)
+;
+; The kernel is entered in protected mode with flat 4GB segments, interrupts
+; disabled, and EBX pointing to the boot information (see BOOT INFORMATION)
 
-org 0x0                  ; BIOS loads bootloader at this address
+org 0x0                  ; Stage1 jumps to offset 0 of the stage2 segment
 bits 16                  ; 16-bit real mode
 
-%define ENDL 0x0D, 0x0A 
+%define ENDL 0x0D, 0x0A
+
+%include "boot_times.inc"
+
+; =============================================================================
+; STAGE1 HANDOVER
+; =============================================================================
+
+STAGE1_SEGMENT          equ 0                   ; Segment of the boot sector and FAT
+STAGE1_BPB              equ 7C00h               ; Boot sector loaded by the BIOS
+STAGE1_FAT              equ 7E00h               ; FAT read by stage1 (its buffer)
+
+; BPB fields, as offsets in STAGE1_SEGMENT
+bpb_sectors_per_cluster equ STAGE1_BPB + 13     ; byte
+bpb_reserved_sectors    equ STAGE1_BPB + 14     ; word
+bpb_fat_count           equ STAGE1_BPB + 16     ; byte
+bpb_dir_entries_count   equ STAGE1_BPB + 17     ; word
+bpb_sectors_per_fat     equ STAGE1_BPB + 22     ; word
+bpb_sectors_per_track   equ STAGE1_BPB + 24     ; word
+bpb_heads               equ STAGE1_BPB + 26     ; word
+
+; =============================================================================
+; LOAD ADDRESSES
+; =============================================================================
+
+TRACK_BUFFER_SEGMENT    equ 1000h               ; Track buffer of disk.inc
+KERNEL_LOAD_ADDRESS     equ 100000h             ; Kernel is loaded and entered at 1MB
+KERNEL_MAX_SIZE         equ 0F00000h            ; Up to the ISA memory hole at 16MB
 
 ; =============================================================================
 ; ENTRY POINT
 ; =============================================================================
 
 start:
-    ; Print welcome messages
-    mov si, msg_q1        ; Load address of first message line into SI register
-    call puts             ; Call print string function to display first line
-    mov si, msg_q2        ; Load address of second message line into SI register
-    call puts             ; Call print string function to display second line
-    mov si, msg_q3        ; Load address of third message line into SI register
-    call puts             ; Call print string function to display third line
-    mov si, msg_q4        ; Load address of fourth message line into SI register
-    call puts             ; Call print string function to display fourth line
-    mov si, msg_q5        ; Load address of fifth message line into SI register
-    call puts             ; Call print string function to display fifth line
+    ; Address the data handed over by stage1 through FS
+    xor ax, ax
+    mov fs, ax                  ; FS = STAGE1_SEGMENT
+
+    ; Checkpoint: STAGE2.BIN loaded by stage1
+    mov bx, BOOT_TIME_STAGE2_ENTRY
+    call boot_time_checkpoint
+
+    ; Take over the drive and the geometry stage1 already queried
+    call disk_init              ; DL = boot drive, detect the INT 13h extensions
+    mov ax, [fs:bpb_sectors_per_track]
+    mov [disk_sectors_per_track], ax
+    mov ax, [fs:bpb_heads]
+    mov [disk_heads], ax
+
+    call console_init           ; Continue output where stage1 left the cursor
+    call serial_init            ; Copy all output to COM1
+    mov si, msg_loading         ; Show loading message
+    call puts
+
+    ; Collect the memory map for the kernel while the BIOS is available
+    push ds
+    pop es
+    mov di, memory_map          ; ES:DI = buffer after the end of stage2
+    call memory_map_read        ; CX = number of entries
+    jc memory_map_error
+    mov [boot_info_memory_map_count], cx
+
+    ; Locate the root directory and the data area from the BPB
+    call fat_init
+
+    ; Find the kernel in the root directory
+    mov si, file_kernel_bin     ; Name to look for
+    call fat_find_root_entry    ; AX = first cluster, ECX = file size
+    jc disk_error               ; Root directory could not be read
+    jnz kernel_not_found_error  ; Not found
+    mov bx, BOOT_TIME_STAGE2_KERNEL_FOUND
+    call boot_time_checkpoint
+
+    ; The kernel has to fit between 1MB and 16MB
+    cmp ecx, KERNEL_MAX_SIZE
+    ja kernel_too_large_error
+    mov [boot_info_kernel_size], ecx
+
+    ; Addresses above 1MB must not wrap around
+    call a20_enable
+    jc a20_error
+
+    ; Load the cluster chain at KERNEL_LOAD_ADDRESS
+    mov ebx, KERNEL_LOAD_ADDRESS ; EBX = linear destination
+    mov ecx, KERNEL_MAX_SIZE    ; ECX = space for the kernel
+    call fat_load_chain         ; Copy every cluster out of the track buffer
+    jc disk_error               ; A read failed
+    mov bx, BOOT_TIME_STAGE2_KERNEL_LOADED
+    call boot_time_checkpoint
+
+    ; Unpack a packed kernel in place (a plain kernel is left as it is)
+    call kernel_unpack
+    jc kernel_too_large_error   ; The unpacked kernel does not fit
+    mov bx, BOOT_TIME_STAGE2_KERNEL_UNPACKED
+    call boot_time_checkpoint
+
+    ; Prepare for kernel execution
+    call serial_flush           ; Send the rest of the log before the kernel takes over COM1
+    movzx eax, byte [disk_drive]
+    mov [boot_info_drive], eax  ; Pass drive number to kernel
+
+    ; Switch to protected mode and jump to the kernel entry point (does not return)
+    mov eax, KERNEL_LOAD_ADDRESS
+    mov ebx, STAGE2_LINEAR + boot_info
+    jmp enter_protected_mode
+
 
-.halt:
-    cli                   ; Clear interrupt flag to disable interrupts
-    hlt                   ; Halt processor execution
+
+; =============================================================================
+; ERROR HANDLING ROUTINES
+; =============================================================================
+
+disk_error:
+    mov si, msg_disk_error             ; Load error message string
+    jmp error_and_reboot
+
+kernel_not_found_error:
+    mov si, msg_kernel_not_found       ; Load kernel not found message
+    jmp error_and_reboot
+
+kernel_too_large_error:
+    mov si, msg_kernel_too_large       ; Load kernel too large message
+    jmp error_and_reboot
+
+memory_map_error:
+    mov si, msg_memory_map_failed      ; Load memory map failure message
+    jmp error_and_reboot
+
+a20_error:
+    mov si, msg_a20_failed             ; Load A20 failure message
+
+error_and_reboot:
+    call puts                          ; Display error message
+    call serial_flush                  ; Make sure the error reaches the log
+    mov ah, 0                          ; BIOS function: wait for keypress
+    int 16h                            ; Call BIOS keyboard service
+    jmp 0FFFFh:0                       ; Jump to BIOS reset vector (reboot system)
 
 
 
@@ -37,40 +179,84 @@ start:
 ; PUTS FUNCTION
 ; =============================================================================
 ;
-; Prints a null-terminated string to screen using BIOS interrupt
+; Prints a null-terminated string on the console and logs it to COM1
 ; Parameters:
 ;   ds:si - pointer to string to print
 
 puts:
-    push si                 ; Save SI register value to stack for preservation
-    push ax                 ; Save AX register value to stack for preservation
-    push bx                 ; Save BX register value to stack for preservation
+    call console_puts       ; Show the string on screen
+    call serial_puts        ; Queue the string for the serial log
+    ret                     ; Return to caller
 
-.loop:  
-    lodsb                   ; Load byte from memory address [SI] into AL register, increment SI
-    or al, al               ; Perform logical OR operation to check if AL = 0 (end of string)
-    jz .done                ; Jump to done label if zero flag set (end of string reached)
 
-    mov ah, 0x0E            ; Set AH register to 0x0E (BIOS teletype output function)
-    mov bh, 0               ; Set BH register to 0 (select video page 0)
-    int 0x10                ; Call BIOS video service interrupt 0x10
-    
-    jmp .loop               ; Unconditional jump back to loop label for next character
-    
-.done:
-    pop bx                  ; Restore BX register value from stack
-    pop ax                  ; Restore AX register value from stack
-    pop si                  ; Restore SI register value from stack
-    ret                     ; Return from function to calling code
+; =============================================================================
+; BOOT TIME CHECKPOINT FUNCTION
+; =============================================================================
+;
+; Stores the time stamp counter in a slot of the boot time table
+; (see boot_times.inc)
+; Parameters:
+;   bx - checkpoint (BOOT_TIME_* slot number)
+;   fs - STAGE1_SEGMENT (the table is in the first 64KB)
+
+boot_time_checkpoint:
+    push eax                ; Save registers
+    push edx
+    push bx
 
+    rdtsc                   ; EDX:EAX = time stamp counter
+    shl bx, 3               ; BX = slot offset (BOOT_TIME_SLOT_SIZE bytes per slot)
+    mov [fs:BOOT_TIMES_ADDRESS + bx], eax
+    mov [fs:BOOT_TIMES_ADDRESS + bx + 4], edx
+
+    pop bx                  ; Restore registers
+    pop edx
+    pop eax
+    ret                     ; Return to caller
+
+
+%include "console.inc"
+%include "serial.inc"
+%include "disk.inc"
+%include "fat.inc"
+%include "memory.inc"
+%include "pmode.inc"
+%include "unpack.inc"
 
 ; =============================================================================
-; WELCOME MESSAGES
+; DATA SECTION - MESSAGES AND CONSTANTS
 ; =============================================================================
 
-msg_q1 db '    ___                   _                   _____ _     _      ___  ____', ENDL, 0
-msg_q2 db '   / _ \__   ____ _ _ __ | |_ _   _ _ __ ___ |  ___(_)___| |__  / _ \/ ___| ', ENDL, 0
-msg_q3 db '  | | | \ \ / / _  |  _ \| __| | | |  _   _ \| |_  | / __|  _ \| | | \___ \ ', ENDL, 0
-msg_q4 db '  | |_| |\ V / (_| | | | | |_| |_| | | | | | |  _| | \__ \ | | | |_| |___) |', ENDL, 0
-msg_q5 db '   \__\_\ \_/ \__ _|_| |_|\__|\__ _|_| |_| |_|_|   |_|___/_| |_|\___/|____/ ', ENDL, 0
+msg_loading:            db 'Loading KERNEL.BIN...', ENDL, 0
+msg_disk_error:         db 'Disk read failed', ENDL, 0
+msg_kernel_not_found:   db 'KERNEL.BIN not found', ENDL, 0
+msg_kernel_too_large:   db 'KERNEL.BIN too large', ENDL, 0
+msg_a20_failed:         db 'Cannot enable A20', ENDL, 0
+msg_memory_map_failed:  db 'No memory map', ENDL, 0
+file_kernel_bin:        db 'KERNEL  BIN'        ; kernel filename in 8.3 format
+
+; =============================================================================
+; BOOT INFORMATION
+; =============================================================================
+;
+; Handed to the kernel in EBX, same layout as BootInfo in src/kernel/boot_info.h
+
+BOOT_INFO_MAGIC         equ 'NBOS'              ; Identifies the structure
+
+align 4
+boot_info:
+boot_info_magic:        dd BOOT_INFO_MAGIC      ; Magic
+boot_info_drive:        dd 0                    ; BootDrive: BIOS drive number
+boot_info_kernel_size:  dd 0                    ; KernelSize: size of the (unpacked) kernel in bytes
+boot_info_memory_map:   dd STAGE2_LINEAR + memory_map ; MemoryMap: linear address of the entries
+boot_info_memory_map_count: dd 0                ; MemoryMapCount: number of entries
+
+; =============================================================================
+; MEMORY MAP BUFFER
+; =============================================================================
+;
+; Filled by memory_map_read: MEMORY_MAP_MAX_ENTRIES entries right after the
+; end of stage2 in its segment, not part of the binary (nothing may follow)
 
+align 8
+memory_map:
@@ -0,0 +1,256 @@
+// =============================================================================
+// FAT12/16/32 FILESYSTEM LIBRARY
+// =============================================================================
+//
+// The parts of the library that are too large to be inline: volume layout,
+// FAT encoding and decoding of whole tables, and 8.3 names
+
+#include "fat.h"
+
+#include <string.h>
+
+// =============================================================================
+// VOLUME LAYOUT
+// =============================================================================
+
+// Determines the FAT type and the layout of the volume from the boot sector
+// The type depends only on the number of data clusters, as specified by Microsoft:
+// fewer than 4085 clusters is FAT12, fewer than 65525 is FAT16, otherwise FAT32
+// Parameters:
+//   boot - Boot sector of the volume
+//   layoutOut - Receives the layout of the volume
+// Returns: true if the boot sector describes a valid volume, false otherwise
+bool fatReadLayout(const BootSector* boot, FatLayout* layoutOut)
+{
+    if (boot->BytesPerSector == 0 || boot->SectorsPerCluster == 0 || boot->FatCount == 0)
+        return false;
+
+    FatLayout layout;
+    uint32_t totalSectors = boot->TotalSectors ? boot->TotalSectors : boot->LargeSectorCount;
+    layout.BytesPerSector = boot->BytesPerSector;
+    layout.SectorsPerCluster = boot->SectorsPerCluster;
+    layout.SectorsPerFat = boot->SectorsPerFat ? boot->SectorsPerFat : boot->SectorsPerFat32;
+
+    // Root directory (FAT12/16 only) follows reserved sectors and FAT tables
+    uint32_t rootSectors = (sizeof(DirectoryEntry) * boot->DirEntryCount + boot->BytesPerSector - 1)
+                           / boot->BytesPerSector;
+    uint64_t rootStart = boot->ReservedSectors + (uint64_t) layout.SectorsPerFat * boot->FatCount;
+    if (rootStart + rootSectors > totalSectors)
+        return false;
+
+    layout.RootDirectoryStart = (uint32_t) rootStart;
+    layout.RootEntryCount = boot->DirEntryCount;
+    layout.DataStart = (uint32_t) rootStart + rootSectors;
+    uint32_t dataClusters = (totalSectors - layout.DataStart) / boot->SectorsPerCluster;
+    layout.FatType = dataClusters < 4085 ? 12 : dataClusters < 65525 ? 16 : 32;
+    layout.RootCluster = layout.FatType == 32 ? boot->RootCluster : 0;
+
+    // Limit the cluster count to what the FAT can describe. Only 32-bit
+    // divisions (the kernel has no 64-bit one): the remainder term is only
+    // non-zero for FAT12, whose FAT is small
+    uint32_t sectorBits = boot->BytesPerSector * 8;
+    uint64_t fatEntries = (uint64_t) layout.SectorsPerFat * (sectorBits / layout.FatType)
+                          + layout.SectorsPerFat * (sectorBits % layout.FatType) / layout.FatType;
+    layout.ClusterCount = dataClusters + 2;
+    if (layout.ClusterCount > fatEntries)
+        layout.ClusterCount = (uint32_t) fatEntries;
+
+    // FAT is located after reserved sectors; FAT32 can disable mirroring and
+    // select which FAT copy is the active one
+    uint32_t activeFat = 0;
+    if (layout.FatType == 32 && (boot->ExtendedFlags & 0x80))
+        activeFat = boot->ExtendedFlags & 0x0F;
+    if (activeFat >= boot->FatCount)
+        return false;
+    layout.FatStart = boot->ReservedSectors + activeFat * layout.SectorsPerFat;
+
+    // FAT32 keeps the root directory in a cluster chain and has no fixed root directory
+    *layoutOut = layout;
+    return layout.FatType == 32 ? boot->DirEntryCount == 0 : boot->DirEntryCount != 0;
+}
+
+// =============================================================================
+// FAT ENTRIES
+// =============================================================================
+
+// Sets a raw entry of a FAT in memory
+// Parameters:
+//   fatType - FAT entry width: 12, 16 or 32
+//   fat - FAT contents
+//   cluster - Cluster number
+//   value - Raw entry value (the reserved FAT32 bits are preserved)
+void fatPutEntry(uint8_t fatType, uint8_t* fat, uint32_t cluster, uint32_t value)
+{
+    uint8_t* entry = fat + fatEntryOffset(fatType, cluster);
+    if (fatType == 12)
+    {
+        uint32_t word = entry[0] | (entry[1] << 8);
+        word = (cluster & 1) ? (word & 0x000F) | (value << 4) : (word & 0xF000) | (value & 0x0FFF);
+        entry[0] = (uint8_t) word;
+        entry[1] = (uint8_t) (word >> 8);
+    }
+    else if (fatType == 16)
+    {
+        entry[0] = (uint8_t) value;
+        entry[1] = (uint8_t) (value >> 8);
+    }
+    else
+    {
+        uint32_t old;
+        memcpy(&old, entry, sizeof(old));
+        value = (old & 0xF0000000) | (value & 0x0FFFFFFF);
+        memcpy(entry, &value, sizeof(value));
+    }
+}
+
+// Decodes a FAT12 table
+// Every 3 bytes hold two 12-bit entries, so entries are decoded pairwise
+// without the even/odd test on every lookup (the table has one spare entry)
+static void decodeFat12(const uint8_t* fat, uint32_t* table, uint32_t count)
+{
+    for (uint32_t cluster = 0; cluster < count; cluster += 2)
+    {
+        const uint8_t* entry = fat + cluster * 3 / 2;
+        table[cluster] = fatNormalizeEntry(entry[0] | ((entry[1] & 0x0F) << 8), count);
+        table[cluster + 1] = cluster + 1 < count ? fatNormalizeEntry((entry[1] >> 4) | (entry[2] << 4), count) : 0;
+    }
+}
+
+// Decodes a FAT16 table (16-bit little endian entries)
+static void decodeFat16(const uint8_t* fat, uint32_t* table, uint32_t count)
+{
+    for (uint32_t cluster = 0; cluster < count; cluster++)
+        table[cluster] = fatNormalizeEntry(fat[cluster * 2] | (fat[cluster * 2 + 1] << 8), count);
+}
+
+// Decodes a FAT32 table (32-bit little endian entries, upper 4 bits reserved)
+static void decodeFat32(const uint8_t* fat, uint32_t* table, uint32_t count)
+{
+    for (uint32_t cluster = 0; cluster < count; cluster++)
+    {
+        uint32_t value;
+        memcpy(&value, fat + cluster * 4, sizeof(value));
+        table[cluster] = fatNormalizeEntry(value & 0x0FFFFFFF, count);
+    }
+}
+
+// Decodes a whole FAT into a flat next-cluster table of normalized entries
+// The decoder matching the FAT type is selected once, so the decoding loop and
+// every later chain walk work on plain 32-bit entries with no per-entry type test
+// Parameters:
+//   layout - Volume layout
+//   fat - FAT contents
+//   table - ClusterCount + 1 entries (the pairwise FAT12 decode never needs a tail case)
+void fatDecodeTable(const FatLayout* layout, const uint8_t* fat, uint32_t* table)
+{
+    if (layout->FatType == 12)
+        decodeFat12(fat, table, layout->ClusterCount);
+    else if (layout->FatType == 16)
+        decodeFat16(fat, table, layout->ClusterCount);
+    else
+        decodeFat32(fat, table, layout->ClusterCount);
+}
+
+// =============================================================================
+// DIRECTORY ENTRIES AND NAMES
+// =============================================================================
+
+// Hashes any bytes (FNV-1a), such as a file name for the directory indexes
+// or the contents of a whole file
+// Parameters:
+//   data - Bytes to hash (8.3 names are hashed over all 11 bytes)
+//   size - Number of bytes
+// Returns: 32-bit hash value
+uint32_t fatHashName(const uint8_t* data, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+}
+
+// Converts the 8.3 name of a directory entry to its display form ("NAME.EXT")
+// Parameters:
+//   entry - Pointer to the directory entry
+//   nameOut - Buffer of at least 13 characters receiving the name
+void fatDisplayName(const DirectoryEntry* entry, char* nameOut)
+{
+    int length = 0;
+    for (int i = 0; i < 8 && entry->Name[i] != ' '; i++)
+        nameOut[length++] = entry->Name[i];
+
+    if (entry->Name[8] != ' ')
+    {
+        nameOut[length++] = '.';
+        for (int i = 8; i < 11 && entry->Name[i] != ' '; i++)
+            nameOut[length++] = entry->Name[i];
+    }
+    nameOut[length] = '\0';
+}
+
+// Upper-cases an ASCII character (8.3 names are stored upper-case)
+static inline char toUpper(char c)
+{
+    return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+}
+
+// Converts a user supplied file name to the 11-character 8.3 form
+// Names that are already 11 characters long without a dot are taken as-is,
+// otherwise "name.ext" is upper-cased and padded with spaces
+// Parameters:
+//   name - File name given by the user (need not be terminated, e.g. a path component)
+//   length - Length of the name
+//   nameOut - Buffer of 11 characters receiving the 8.3 name
+// Returns: true if the name fits in 8.3 format, false otherwise
+bool fatToName(const char* name, size_t length, char* nameOut)
+{
+    const char* dot = NULL;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (name[i] == '.')
+            dot = name + i;
+    }
+
+    if (length == 11 && !dot)
+    {
+        memcpy(nameOut, name, 11);
+        return true;
+    }
+
+    size_t baseLength = dot ? (size_t)(dot - name) : length;
+    size_t extLength = dot ? length - baseLength - 1 : 0;
+    if (baseLength == 0 || baseLength > 8 || extLength > 3)
+        return false;
+
+    memset(nameOut, ' ', 11);
+    for (size_t i = 0; i < baseLength; i++)
+        nameOut[i] = toUpper(name[i]);
+    for (size_t i = 0; i < extLength; i++)
+        nameOut[8 + i] = toUpper(dot[1 + i]);
+    return true;
+}
+
+// Searches a block of directory entries for a name
+// Meant for directories that are read piece by piece (e.g. sector by sector),
+// so the end of the directory is reported separately from a miss
+// Parameters:
+//   entries - Directory entries
+//   count - Number of directory entries
+//   name - 11-character filename in 8.3 format (without dot)
+//   endOut - Set to true if the end of the directory was reached in this block
+// Returns: Pointer to the first entry with the name, NULL if not in this block
+const DirectoryEntry* fatFindEntry(const DirectoryEntry* entries, uint32_t count, const char* name, bool* endOut)
+{
+    *endOut = false;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (fatIsDirectoryEnd(&entries[i]))
+        {
+            *endOut = true;
+            return NULL;
+        }
+        if (fatIsNamedEntry(&entries[i]) && memcmp(entries[i].Name, name, 11) == 0)
+            return &entries[i];
+    }
+    return NULL;
+}
@@ -0,0 +1,334 @@
+// =============================================================================
+// FAT12/16/32 FILESYSTEM LIBRARY
+// =============================================================================
+//
+// On-disk structures and the logic of the FAT filesystem shared by the fat
+// tool and the kernel: volume layout, FAT entry encoding, cluster chain
+// walking and 8.3 names. The library is freestanding, it does no I/O and no
+// allocation and only needs memcpy, memcmp and memset; how sectors and FAT
+// entries are fetched is left to its users
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// =============================================================================
+// ON-DISK STRUCTURES
+// =============================================================================
+
+// Boot Sector structure - represents the first sector of a FAT filesystem
+// FAT12/16 and FAT32 share the BIOS parameter block, the extended boot record
+// that follows it differs and is described by the union
+typedef struct
+{
+    uint8_t BootJumpInstruction[3];    // Jump instruction to boot code
+    uint8_t OemIdentifier[8];          // OEM name/identifier
+    uint16_t BytesPerSector;           // Bytes per sector (usually 512)
+    uint8_t SectorsPerCluster;         // Sectors per cluster
+    uint16_t ReservedSectors;          // Number of reserved sectors
+    uint8_t FatCount;                  // Number of FAT tables (usually 2)
+    uint16_t DirEntryCount;            // Number of root directory entries
+    uint16_t TotalSectors;             // Total sectors in filesystem
+    uint8_t MediaDescriptorType;       // Media descriptor type
+    uint16_t SectorsPerFat;            // Sectors per FAT table
+    uint16_t SectorsPerTrack;          // Sectors per track
+    uint16_t Heads;                    // Number of heads
+    uint32_t HiddenSectors;            // Number of hidden sectors
+    uint32_t LargeSectorCount;         // Large sector count (if TotalSectors is 0)
+
+    union
+    {
+        // Extended boot record fields (FAT12/16)
+        struct
+        {
+            uint8_t DriveNumber;       // Drive number
+            uint8_t _Reserved;         // Reserved byte
+            uint8_t Signature;         // Extended boot signature
+            uint32_t VolumeId;         // Volume serial number
+            uint8_t VolumeLabel[11];   // Volume label (11 bytes, padded with spaces)
+            uint8_t SystemId[8];       // Filesystem type identifier
+        } __attribute__((packed));
+
+        // Extended boot record fields (FAT32)
+        struct
+        {
+            uint32_t SectorsPerFat32;  // Sectors per FAT table (SectorsPerFat is 0)
+            uint16_t ExtendedFlags;    // Bit 7: only one FAT is active, bits 0-3: active FAT
+            uint16_t FsVersion;        // Filesystem version
+            uint32_t RootCluster;      // First cluster of the root directory
+            uint16_t FsInfoSector;     // Sector of the FSInfo structure
+            uint16_t BackupBootSector; // Sector of the boot sector copy
+            uint8_t _Reserved32[12];   // Reserved bytes
+            uint8_t DriveNumber32;     // Drive number
+            uint8_t _Reserved32b;      // Reserved byte
+            uint8_t Signature32;       // Extended boot signature
+            uint32_t VolumeId32;       // Volume serial number
+            uint8_t VolumeLabel32[11]; // Volume label (11 bytes, padded with spaces)
+            uint8_t SystemId32[8];     // Filesystem type identifier
+        } __attribute__((packed));
+    } __attribute__((packed));
+
+} __attribute__((packed)) BootSector;
+
+// Directory Entry structure - represents a file or directory entry
+typedef struct
+{
+    uint8_t Name[11];                  // 8.3 filename (8 name + 3 extension)
+    uint8_t Attributes;                // File attributes (read-only, hidden, etc.)
+    uint8_t _Reserved;                 // Reserved byte
+    uint8_t CreatedTimeTenths;         // Created time tenths of seconds
+    uint16_t CreatedTime;              // Created time
+    uint16_t CreatedDate;              // Created date
+    uint16_t AccessedDate;             // Last accessed date
+    uint16_t FirstClusterHigh;         // High word of first cluster number (FAT32 only)
+    uint16_t ModifiedTime;             // Last modified time
+    uint16_t ModifiedDate;             // Last modified date
+    uint16_t FirstClusterLow;          // Low word of first cluster number
+    uint32_t Size;                     // File size in bytes
+
+} __attribute__((packed)) DirectoryEntry;
+
+// Directory entry attribute flags
+#define ATTRIBUTE_VOLUME_ID 0x08
+#define ATTRIBUTE_DIRECTORY 0x10
+#define ATTRIBUTE_ARCHIVE   0x20
+#define ATTRIBUTE_LFN       0x0F       // Long file name entries set read-only, hidden, system and volume id
+
+// First byte of the name of free and deleted directory entries
+#define DIRECTORY_END       0x00       // Free entry, no used entry follows
+#define DIRECTORY_DELETED   0xE5
+
+// =============================================================================
+// VOLUME LAYOUT
+// =============================================================================
+
+// Volume layout structure - where the parts of a volume are, derived from the boot sector
+typedef struct
+{
+    uint8_t FatType;                   // FAT entry width: 12, 16 or 32
+    uint32_t BytesPerSector;           // Bytes per sector
+    uint32_t SectorsPerCluster;        // Sectors per cluster
+    uint32_t SectorsPerFat;            // Sectors per FAT table (from the FAT12/16 or FAT32 field)
+    uint32_t FatStart;                 // LBA address of the active FAT
+    uint32_t RootDirectoryStart;       // LBA address of the fixed root directory (FAT12/16)
+    uint32_t RootEntryCount;           // Entries of the fixed root directory (0 for FAT32)
+    uint32_t RootCluster;              // First cluster of the root directory (FAT32, 0 otherwise)
+    uint32_t DataStart;                // LBA address of cluster 2, where the root directory ends
+    uint32_t ClusterCount;             // Number of cluster numbers in use (data clusters + 2)
+
+} FatLayout;
+
+// Marker used for end of chain (and bad or out of range entries) once entries are normalized
+#define CLUSTER_END 0xFFFFFFFF
+
+bool fatReadLayout(const BootSector* boot, FatLayout* layoutOut);
+
+// Calculates the LBA address of a cluster
+// Formula: DataStart + (cluster - 2) * sectors per cluster
+// (cluster numbers start at 2, with 0 and 1 being special values)
+// Parameters:
+//   layout - Volume layout
+//   cluster - Cluster number
+// Returns: LBA address of the first sector of the cluster
+static inline uint32_t fatClusterToLba(const FatLayout* layout, uint32_t cluster)
+{
+    return layout->DataStart + (cluster - 2) * layout->SectorsPerCluster;
+}
+
+// Gets the first cluster of a directory entry
+// Parameters:
+//   layout - Volume layout
+//   entry - Pointer to the directory entry
+// Returns: First cluster number (the high word is only used by FAT32)
+static inline uint32_t fatFirstCluster(const FatLayout* layout, const DirectoryEntry* entry)
+{
+    uint32_t high = layout->FatType == 32 ? entry->FirstClusterHigh : 0;
+    return (high << 16) | entry->FirstClusterLow;
+}
+
+// =============================================================================
+// FAT ENTRIES
+// =============================================================================
+
+// Normalizes a raw FAT entry
+// Free entries stay 0, every value that is not a valid cluster number (end of
+// chain, bad cluster, reserved or out of range) becomes CLUSTER_END. Since the
+// cluster count of each FAT type is below its end/bad markers, one range check
+// covers all entry widths
+static inline uint32_t fatNormalizeEntry(uint32_t value, uint32_t count)
+{
+    return value - 2 < count - 2 ? value : (value ? CLUSTER_END : 0);
+}
+
+// Gets the byte offset of the entry of a cluster in the FAT
+// FAT12 entries are 1.5 bytes, so the entry starts in the middle of a byte
+// pair for odd clusters; entries may straddle a sector boundary
+static inline uint32_t fatEntryOffset(uint8_t fatType, uint32_t cluster)
+{
+    return fatType == 12 ? cluster + cluster / 2 : cluster * (fatType / 8);
+}
+
+// Gets the number of bytes to read at fatEntryOffset to decode an entry
+static inline uint32_t fatEntrySize(uint8_t fatType)
+{
+    return fatType == 32 ? 4 : 2;
+}
+
+// Decodes a raw FAT entry from its bytes
+// Parameters:
+//   fatType - FAT entry width: 12, 16 or 32
+//   entry - fatEntrySize bytes of the FAT at fatEntryOffset
+//   cluster - Cluster number (selects the half of a FAT12 byte pair)
+// Returns: Raw entry value (the reserved FAT32 bits are masked out)
+static inline uint32_t fatDecodeEntry(uint8_t fatType, const uint8_t* entry, uint32_t cluster)
+{
+    if (fatType == 32)
+        return (entry[0] | (entry[1] << 8) | (entry[2] << 16) | ((uint32_t) entry[3] << 24)) & 0x0FFFFFFF;
+
+    uint32_t value = entry[0] | (entry[1] << 8);
+    if (fatType == 16)
+        return value;
+
+    // Odd entries use the upper 12 bits of the 16-bit word they share
+    return (cluster & 1) ? value >> 4 : value & 0x0FFF;
+}
+
+// Gets a raw entry of a FAT in memory
+// Parameters:
+//   fatType - FAT entry width: 12, 16 or 32
+//   fat - FAT contents
+//   cluster - Cluster number
+// Returns: Raw entry value (the reserved FAT32 bits are masked out)
+static inline uint32_t fatGetEntry(uint8_t fatType, const uint8_t* fat, uint32_t cluster)
+{
+    return fatDecodeEntry(fatType, fat + fatEntryOffset(fatType, cluster), cluster);
+}
+
+void fatPutEntry(uint8_t fatType, uint8_t* fat, uint32_t cluster, uint32_t value);
+void fatDecodeTable(const FatLayout* layout, const uint8_t* fat, uint32_t* table);
+
+// Gets the end of chain marker of a FAT type
+static inline uint32_t fatEndOfChain(uint8_t fatType)
+{
+    return fatType == 12 ? 0x0FFF : fatType == 16 ? 0xFFFF : 0x0FFFFFFF;
+}
+
+// =============================================================================
+// CLUSTER CHAINS
+// =============================================================================
+
+// Extent structure - a run of physically contiguous clusters of a file
+typedef struct
+{
+    uint32_t FirstCluster;             // First cluster of the run
+    uint32_t ClusterCount;             // Number of consecutive clusters in the run
+
+} Extent;
+
+// Cluster iterator structure - walks a cluster chain one extent at a time
+typedef struct
+{
+    uint32_t Cluster;                  // Next cluster to visit (CLUSTER_END when done)
+    uint32_t Visited;                  // Clusters visited so far (loop detection)
+    bool Ok;                           // false if the chain turned out to be invalid
+
+} ClusterIterator;
+
+// Lookup of the next cluster of a chain
+// Parameters:
+//   context - Caller supplied context
+//   cluster - Cluster number
+// Returns: Normalized FAT entry of the cluster (see fatNormalizeEntry),
+//          0 if it cannot be read
+typedef uint32_t (*FatNextCluster)(void* context, uint32_t cluster);
+
+// Starts iterating over a cluster chain
+// Parameters:
+//   iterator - Iterator to initialize
+//   layout - Volume layout
+//   firstCluster - First cluster of the chain (0 for an empty file)
+static inline void fatBeginChain(ClusterIterator* iterator, const FatLayout* layout, uint32_t firstCluster)
+{
+    iterator->Cluster = firstCluster == 0 ? CLUSTER_END : firstCluster;
+    iterator->Visited = 0;
+    iterator->Ok = firstCluster == 0 || (firstCluster >= 2 && firstCluster < layout->ClusterCount);
+}
+
+// Gets the next extent of a cluster chain
+// Consecutive clusters are merged so that each extent can be read with a single I/O.
+// Only the iterator state is kept, so walking a chain needs no memory at all.
+// Inline so that a constant lookup function is inlined into the walk
+// Parameters:
+//   iterator - Cluster iterator
+//   layout - Volume layout
+//   next - Lookup of the next cluster
+//   context - Context passed to next
+//   extentOut - Receives the next run of contiguous clusters
+// Returns: true if an extent was returned, false at the end of the chain or
+//          if the chain is invalid (iterator->Ok is then false)
+static inline bool fatNextExtent(ClusterIterator* iterator, const FatLayout* layout,
+                                 FatNextCluster next, void* context, Extent* extentOut)
+{
+    if (!iterator->Ok || iterator->Cluster == CLUSTER_END)
+        return false;
+
+    extentOut->FirstCluster = iterator->Cluster;
+    extentOut->ClusterCount = 0;
+
+    uint32_t cluster = iterator->Cluster;
+    for (;;)
+    {
+        // A chain can never be longer than the volume, anything else is a loop;
+        // a free cluster inside a chain means the FAT is damaged
+        if (cluster == 0 || ++iterator->Visited > layout->ClusterCount)
+        {
+            iterator->Ok = false;
+            return false;
+        }
+
+        extentOut->ClusterCount++;
+        uint32_t following = next(context, cluster);
+        if (following != cluster + 1)
+        {
+            iterator->Cluster = following;
+            return true;
+        }
+        cluster = following;
+    }
+}
+
+// =============================================================================
+// DIRECTORY ENTRIES AND NAMES
+// =============================================================================
+
+// Checks whether a directory entry marks the end of its directory
+static inline bool fatIsDirectoryEnd(const DirectoryEntry* entry)
+{
+    return entry->Name[0] == DIRECTORY_END;
+}
+
+// Checks whether a directory entry holds a name that can be looked up
+// Returns: false for free, deleted and long file name entries
+static inline bool fatIsNamedEntry(const DirectoryEntry* entry)
+{
+    return entry->Name[0] != DIRECTORY_END && entry->Name[0] != DIRECTORY_DELETED
+           && entry->Attributes != ATTRIBUTE_LFN;
+}
+
+// Checks whether a directory entry describes a regular file
+// Parameters:
+//   entry - Pointer to the directory entry
+// Returns: true for files, false for free, deleted, volume label, LFN and directory entries
+static inline bool fatIsFileEntry(const DirectoryEntry* entry)
+{
+    if (entry->Name[0] == DIRECTORY_END || entry->Name[0] == DIRECTORY_DELETED)
+        return false;
+    return (entry->Attributes & (ATTRIBUTE_VOLUME_ID | ATTRIBUTE_DIRECTORY)) == 0;
+}
+
+uint32_t fatHashName(const uint8_t* data, size_t size);
+void fatDisplayName(const DirectoryEntry* entry, char* nameOut);
+bool fatToName(const char* name, size_t length, char* nameOut);
+const DirectoryEntry* fatFindEntry(const DirectoryEntry* entries, uint32_t count, const char* name, bool* endOut);
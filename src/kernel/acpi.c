@@ -0,0 +1,172 @@
+// =============================================================================
+// ACPI TABLES
+// =============================================================================
+//
+// The RSDP is searched on 16-byte boundaries in the first KB of the extended
+// BIOS data area, then in the BIOS ROM area 0xE0000 - 0xFFFFF. Tables live
+// in memory the firmware reserved, usually at the top of RAM: below
+// DIRECT_MAP_SIZE they are read through the direct map, above it they are
+// mapped into the device window. Every table is checksummed before it is
+// handed out
+
+#include "acpi.h"
+
+#include <stddef.h>
+
+#include "log.h"
+#include "paging.h"
+#include "string.h"
+
+#define BDA_EBDA_SEGMENT        0x40E           // BIOS data area: real mode segment of the EBDA
+#define EBDA_SEARCH_SIZE        1024
+#define BIOS_AREA_START         0xE0000
+#define BIOS_AREA_END           0x100000
+
+#define RSDP_V1_SIZE            20              // Bytes covered by the ACPI 1.0 checksum
+
+// Root system description pointer
+typedef struct
+{
+    char Signature[8];                         // "RSD PTR "
+    uint8_t Checksum;                          // First RSDP_V1_SIZE bytes add up to 0
+    char OemId[6];
+    uint8_t Revision;                          // 0 = ACPI 1.0, 2 = ACPI 2.0 and later
+    uint32_t RsdtAddress;
+
+    // ACPI 2.0 and later
+    uint32_t Length;
+    uint64_t XsdtAddress;
+    uint8_t ExtendedChecksum;                  // Whole structure adds up to 0
+    uint8_t Reserved[3];
+
+} __attribute__((packed)) AcpiRsdp;
+
+static const AcpiTableHeader* g_RootTable;     // RSDT or XSDT, NULL without ACPI
+static unsigned g_RootEntrySize;               // 4 (RSDT) or 8 (XSDT)
+static uint8_t g_Revision;                     // RSDP revision
+
+// Returns true if size bytes add up to 0
+static bool checksumValid(const void* data, uint32_t size)
+{
+    const uint8_t* bytes = data;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < size; i++)
+        sum += bytes[i];
+    return sum == 0;
+}
+
+// Makes firmware memory readable
+// Returns its virtual address, NULL if the device window is full
+static const void* acpiMap(uint32_t physical, uint32_t size)
+{
+    if (physical < DIRECT_MAP_SIZE && size <= DIRECT_MAP_SIZE - physical)
+        return physicalToVirtual(physical);
+    return pagingMapDevice(physical, size);
+}
+
+// Maps and checks a whole table
+// Returns NULL if it cannot be mapped or its checksum is wrong
+static const AcpiTableHeader* acpiMapTable(uint64_t physical)
+{
+    if (physical >> 32)
+        return NULL;                           // Not reachable without PAE
+
+    const AcpiTableHeader* header = acpiMap(physical, sizeof(AcpiTableHeader));
+    if (!header || header->Length < sizeof(AcpiTableHeader))
+        return NULL;
+
+    const AcpiTableHeader* table = acpiMap(physical, header->Length);
+    return table && checksumValid(table, table->Length) ? table : NULL;
+}
+
+// Searches a range of low memory for the RSDP
+static const AcpiRsdp* rsdpSearch(uint32_t start, uint32_t end)
+{
+    for (uint32_t address = start; address + sizeof(AcpiRsdp) <= end; address += 16)
+    {
+        const AcpiRsdp* rsdp = physicalToVirtual(address);
+        if (memcmp(rsdp->Signature, "RSD PTR ", sizeof(rsdp->Signature)) == 0
+            && checksumValid(rsdp, RSDP_V1_SIZE))
+            return rsdp;
+    }
+    return NULL;
+}
+
+// Finds the RSDP and the root table
+// Returns false if the firmware has no (valid) ACPI tables
+bool acpiInit(void)
+{
+    uint32_t ebda = (uint32_t) *(const uint16_t*) physicalToVirtual(BDA_EBDA_SEGMENT) << 4;
+    const AcpiRsdp* rsdp = NULL;
+    if (ebda && ebda < BIOS_AREA_START)
+        rsdp = rsdpSearch(ebda, ebda + EBDA_SEARCH_SIZE);
+    if (!rsdp)
+        rsdp = rsdpSearch(BIOS_AREA_START, BIOS_AREA_END);
+    if (!rsdp)
+        return false;
+
+    g_Revision = rsdp->Revision;
+    if (rsdp->Revision >= 2 && rsdp->XsdtAddress && checksumValid(rsdp, rsdp->Length))
+    {
+        g_RootTable = acpiMapTable(rsdp->XsdtAddress);
+        g_RootEntrySize = sizeof(uint64_t);
+    }
+    if (!g_RootTable)
+    {
+        g_RootTable = acpiMapTable(rsdp->RsdtAddress);
+        g_RootEntrySize = sizeof(uint32_t);
+    }
+    return g_RootTable != NULL;
+}
+
+// Looks a table up by its signature
+// Parameters:
+//   signature - 4 characters, e.g. "APIC"
+// Returns the first valid table with that signature, NULL if there is none
+const AcpiTableHeader* acpiFindTable(const char* signature)
+{
+    if (!g_RootTable)
+        return NULL;
+
+    const uint8_t* entries = (const uint8_t*) (g_RootTable + 1);
+    unsigned count = (g_RootTable->Length - sizeof(AcpiTableHeader)) / g_RootEntrySize;
+    for (unsigned i = 0; i < count; i++)
+    {
+        uint64_t address = 0;
+        memcpy(&address, entries + i * g_RootEntrySize, g_RootEntrySize); // Entries are unaligned
+
+        const AcpiTableHeader* header = acpiMap(address, sizeof(AcpiTableHeader));
+        if (address >> 32 || !header || memcmp(header->Signature, signature, 4) != 0)
+            continue;
+
+        const AcpiTableHeader* table = acpiMapTable(address);
+        if (table)
+            return table;
+    }
+    return NULL;
+}
+
+// Logs the ACPI revision and the signature of every table
+void acpiDump(void)
+{
+    if (!g_RootTable)
+    {
+        logPuts("ACPI: no tables\n");
+        return;
+    }
+
+    const char* root = g_RootTable->Signature;
+    logPrintf("ACPI: revision %u, %c%c%c%c with tables:", g_Revision, root[0], root[1], root[2], root[3]);
+    const uint8_t* entries = (const uint8_t*) (g_RootTable + 1);
+    unsigned count = (g_RootTable->Length - sizeof(AcpiTableHeader)) / g_RootEntrySize;
+    for (unsigned i = 0; i < count; i++)
+    {
+        uint64_t address = 0;
+        memcpy(&address, entries + i * g_RootEntrySize, g_RootEntrySize);
+        const AcpiTableHeader* header = address >> 32 ? NULL : acpiMap(address, sizeof(AcpiTableHeader));
+        if (header)
+            logPrintf(" %c%c%c%c", header->Signature[0], header->Signature[1],
+                      header->Signature[2], header->Signature[3]);
+    }
+    logPuts("\n");
+}
@@ -0,0 +1,32 @@
+// =============================================================================
+// ACPI TABLES
+// =============================================================================
+//
+// Finds the root system description pointer the firmware leaves in low
+// memory and looks tables up by signature through the RSDT (or the XSDT of
+// ACPI 2.0 and later). Only reading tables is supported, there is no AML
+// interpreter
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Common header of every system description table
+typedef struct
+{
+    char Signature[4];                         // e.g. "APIC" for the MADT
+    uint32_t Length;                           // Bytes including this header
+    uint8_t Revision;
+    uint8_t Checksum;                          // All bytes of the table add up to 0
+    char OemId[6];
+    char OemTableId[8];
+    uint32_t OemRevision;
+    uint32_t CreatorId;
+    uint32_t CreatorRevision;
+
+} __attribute__((packed)) AcpiTableHeader;
+
+bool acpiInit(void);
+const AcpiTableHeader* acpiFindTable(const char* signature);
+void acpiDump(void);
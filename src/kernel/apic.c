@@ -0,0 +1,202 @@
+// =============================================================================
+// LOCAL APIC
+// =============================================================================
+//
+// The registers are mapped uncached into the device window of paging.h. The
+// APIC is enabled through the spurious interrupt vector register with LINT0
+// as ExtINT (the PIC) and LINT1 as NMI, the virtual wire setup of the MP
+// specification, so the PIC drivers keep working unchanged. Application
+// processors mask LINT0: PIC interrupts only go to the bootstrap processor.
+//
+// Every CPU sees its own APIC at the same physical address, so one mapping
+// serves all of them. Application processors are started with the INIT and
+// startup inter-processor interrupts of the interrupt command register.
+//
+// Timer modes:
+// - periodic: counts down from an initial count at the bus clock divided by
+//   APIC_TIMER_DIVISOR and reloads itself
+// - TSC-deadline: interrupts once the time stamp counter reaches the value
+//   written to IA32_TSC_DEADLINE; the tick handler writes the next deadline
+// The timer rates are unknown, apicTimerMeasure calibrates both against the
+// PIT
+
+#include "apic.h"
+
+#include <stddef.h>
+
+#include "cpu.h"
+#include "idt.h"
+#include "paging.h"
+#include "pit.h"
+
+#define MSR_APIC_BASE           0x1B
+#define MSR_APIC_BASE_ENABLE    0x800           // APIC globally enabled
+#define MSR_APIC_BASE_MASK      0xFFFFF000
+#define MSR_TSC_DEADLINE        0x6E0
+
+// Register offsets
+#define APIC_ID                 0x020
+#define APIC_EOI                0x0B0
+#define APIC_SPURIOUS           0x0F0           // Spurious interrupt vector, software enable
+#define APIC_ICR_LOW            0x300           // Interrupt command: writing it sends the IPI
+#define APIC_ICR_HIGH           0x310           // Interrupt command: destination APIC ID
+#define APIC_LVT_TIMER          0x320
+#define APIC_LVT_LINT0          0x350
+#define APIC_LVT_LINT1          0x360
+#define APIC_TIMER_INITIAL      0x380
+#define APIC_TIMER_CURRENT      0x390
+#define APIC_TIMER_DIVIDE       0x3E0
+#define APIC_REGISTERS_SIZE     0x400
+
+#define APIC_SOFTWARE_ENABLE    0x100
+#define APIC_LVT_MASKED         0x10000
+#define APIC_LVT_EXTINT         0x700           // Delivery mode ExtINT
+#define APIC_LVT_NMI            0x400           // Delivery mode NMI
+#define APIC_TIMER_PERIODIC     0x20000
+#define APIC_TIMER_TSC_DEADLINE 0x40000
+#define APIC_TIMER_DIVIDE_16    0x3             // Divide configuration: bus clock / 16
+
+#define APIC_ICR_INIT           0x00000500      // Delivery mode INIT
+#define APIC_ICR_STARTUP        0x00000600      // Delivery mode startup, vector = start page
+#define APIC_ICR_PENDING        0x00001000      // Delivery status: not yet accepted
+#define APIC_ICR_ASSERT         0x00004000      // Level assert (required for INIT and startup)
+#define APIC_ICR_DESTINATION_SHIFT 24
+
+static volatile uint32_t* g_ApicRegisters;     // NULL without a local APIC
+
+static inline uint32_t apicRead(uint32_t reg)
+{
+    return g_ApicRegisters[reg / 4];
+}
+
+static inline void apicWrite(uint32_t reg, uint32_t value)
+{
+    g_ApicRegisters[reg / 4] = value;
+}
+
+// The APIC raises its spurious vector for a request that went away; it is
+// not in service and gets no end of interrupt
+static void apicSpurious(InterruptFrame* frame)
+{
+    (void) frame;
+}
+
+// Enables the APIC of the executing CPU, timer stopped
+// Parameters:
+//   lint0 - local vector entry of LINT0 (PIC in virtual wire mode, or masked)
+static void apicEnable(uint32_t lint0)
+{
+    writeMsr(MSR_APIC_BASE, readMsr(MSR_APIC_BASE) | MSR_APIC_BASE_ENABLE);
+
+    apicWrite(APIC_LVT_TIMER, APIC_LVT_MASKED | APIC_TIMER_VECTOR);
+    apicWrite(APIC_LVT_LINT0, lint0);
+    apicWrite(APIC_LVT_LINT1, APIC_LVT_NMI);
+    apicWrite(APIC_SPURIOUS, APIC_SOFTWARE_ENABLE | APIC_SPURIOUS_VECTOR);
+    apicWrite(APIC_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    apicEndOfInterrupt();                      // Nothing may stay in service from the BIOS
+}
+
+// Detects, maps and enables the local APIC of the bootstrap processor
+// Returns false if the processor has none (or it cannot be mapped)
+bool apicInit(void)
+{
+    CpuFeatures features = cpuFeatures();
+    if (!(features.Edx & CPUID_FEATURE_APIC) || !(features.Edx & CPUID_FEATURE_MSR))
+        return false;
+
+    uint64_t base = readMsr(MSR_APIC_BASE);
+    g_ApicRegisters = pagingMapDevice(base & MSR_APIC_BASE_MASK, APIC_REGISTERS_SIZE);
+    if (!g_ApicRegisters)
+        return false;
+
+    interruptSetHandler(APIC_SPURIOUS_VECTOR, apicSpurious);
+    apicEnable(APIC_LVT_EXTINT);
+    return true;
+}
+
+// Enables the local APIC of an application processor (after apicInit)
+void apicInitCpu(void)
+{
+    apicEnable(APIC_LVT_MASKED);
+}
+
+bool apicAvailable(void)
+{
+    return g_ApicRegisters != NULL;
+}
+
+// Returns the APIC ID of the processor
+uint32_t apicId(void)
+{
+    return apicRead(APIC_ID) >> 24;
+}
+
+// Acknowledges the interrupt in service (not for PIC interrupts, which
+// arrive as ExtINT)
+void apicEndOfInterrupt(void)
+{
+    apicWrite(APIC_EOI, 0);
+}
+
+// Sends an inter-processor interrupt and waits until the target accepted it
+static void apicSendIpi(uint32_t apicId, uint32_t command)
+{
+    apicWrite(APIC_ICR_HIGH, apicId << APIC_ICR_DESTINATION_SHIFT);
+    apicWrite(APIC_ICR_LOW, command);
+    while (apicRead(APIC_ICR_LOW) & APIC_ICR_PENDING)
+        __asm__ volatile ("pause");
+}
+
+// Resets a processor into its wait-for-startup state
+void apicSendInit(uint32_t apicId)
+{
+    apicSendIpi(apicId, APIC_ICR_INIT | APIC_ICR_ASSERT);
+}
+
+// Starts a processor waiting for startup in real mode at page * 4KB
+// Parameters:
+//   apicId - APIC ID of the processor
+//   page - physical address of the start-up code / 4KB (below 1MB)
+void apicSendStartup(uint32_t apicId, uint8_t page)
+{
+    apicSendIpi(apicId, APIC_ICR_STARTUP | APIC_ICR_ASSERT | page);
+}
+
+// Starts the timer in periodic mode, one interrupt every count timer clocks
+void apicTimerStartPeriodic(uint32_t count)
+{
+    apicWrite(APIC_LVT_TIMER, APIC_TIMER_PERIODIC | APIC_TIMER_VECTOR);
+    apicWrite(APIC_TIMER_INITIAL, count);
+}
+
+// Switches the timer to TSC-deadline mode (no interrupt until the first
+// apicTimerSetDeadline); the processor must have CPUID_FEATURE_TSC_DEADLINE
+void apicTimerStartDeadline(void)
+{
+    apicWrite(APIC_LVT_TIMER, APIC_TIMER_TSC_DEADLINE | APIC_TIMER_VECTOR);
+}
+
+// Arms the timer in TSC-deadline mode for a time stamp counter value
+void apicTimerSetDeadline(uint64_t timestamp)
+{
+    writeMsr(MSR_TSC_DEADLINE, timestamp);
+}
+
+// Measures the timer and the time stamp counter against the PIT
+// Parameters:
+//   pitTicks - length of the measurement in PIT clocks
+//   timestampDelta - receives the time stamp counter cycles meanwhile
+// Returns the timer clocks meanwhile (the timer is stopped afterwards)
+uint32_t apicTimerMeasure(uint16_t pitTicks, uint64_t* timestampDelta)
+{
+    apicWrite(APIC_LVT_TIMER, APIC_LVT_MASKED | APIC_TIMER_VECTOR); // One-shot, no interrupt
+    apicWrite(APIC_TIMER_INITIAL, 0xFFFFFFFF);
+    uint64_t start = readTimestamp();
+
+    pitWait(pitTicks);
+
+    uint32_t remaining = apicRead(APIC_TIMER_CURRENT);
+    *timestampDelta = readTimestamp() - start;
+    apicWrite(APIC_TIMER_INITIAL, 0);          // Stop
+    return 0xFFFFFFFF - remaining;
+}
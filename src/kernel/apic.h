@@ -0,0 +1,27 @@
+// =============================================================================
+// LOCAL APIC
+// =============================================================================
+//
+// The local APIC of the processor: its timer replaces the PIT as the tick
+// source, and interrupts of the PIC still arrive through it (LINT0 in
+// virtual wire mode). It also starts the application processors (smp.h)
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define APIC_TIMER_VECTOR       0xF0
+#define APIC_SPURIOUS_VECTOR    0xFF
+
+bool apicInit(void);
+void apicInitCpu(void);
+bool apicAvailable(void);
+uint32_t apicId(void);
+void apicEndOfInterrupt(void);
+void apicSendInit(uint32_t apicId);
+void apicSendStartup(uint32_t apicId, uint8_t page);
+void apicTimerStartPeriodic(uint32_t count);
+void apicTimerStartDeadline(void);
+void apicTimerSetDeadline(uint64_t timestamp);
+uint32_t apicTimerMeasure(uint16_t pitTicks, uint64_t* timestampDelta);
@@ -0,0 +1,471 @@
+// =============================================================================
+// ATA DISKS
+// =============================================================================
+//
+// The two disks of a channel share its registers, so their worker threads
+// take turns: a worker owns the channel for a whole transfer and the other
+// one sleeps on the channel's wait queue meanwhile. The interrupt handler
+// of the channel reads the status (which acknowledges the disk), notes it
+// and wakes the owner.
+//
+// DMA transfers describe the buffers of the merged requests with the PRD
+// table of the channel, one entry per physically contiguous piece within a
+// 64KB block, so a merged transfer still needs a single command. Kernel
+// buffers are all in the direct map, whose physical addresses follow from
+// the virtual ones. A transfer that fails by DMA is retried by PIO, and
+// the disk stays on PIO from then on.
+//
+// Disks are detected with polling and the interrupts of the disks turned
+// off (nIEN), since ataInit runs on the boot thread, which must not sleep.
+// There is no timeout for a missing interrupt yet
+
+#include "ata.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "block.h"
+#include "cpu.h"
+#include "io.h"
+#include "irq.h"
+#include "log.h"
+#include "paging.h"
+#include "pci.h"
+#include "scheduler.h"
+#include "spinlock.h"
+
+// Command block registers, from the base port of the channel
+#define ATA_DATA                0
+#define ATA_ERROR               1
+#define ATA_SECTOR_COUNT        2
+#define ATA_LBA_LOW             3
+#define ATA_LBA_MID             4
+#define ATA_LBA_HIGH            5
+#define ATA_DRIVE_SELECT        6
+#define ATA_STATUS_COMMAND      7               // Status (read), command (write)
+
+#define ATA_STATUS_ERROR        0x01
+#define ATA_STATUS_DRQ          0x08            // Data request: the disk has data for the CPU
+#define ATA_STATUS_FAULT        0x20
+#define ATA_STATUS_BUSY         0x80
+#define ATA_CONTROL_NIEN        0x02            // Device control: interrupts of the disks off
+
+#define ATA_SELECT_LBA          0xE0            // Drive select: LBA addressing (and the obsolete bits)
+#define ATA_SELECT_SLAVE        0x10
+
+#define ATA_IDENTIFY            0xEC
+#define ATA_READ_SECTORS        0x20            // PIO, LBA28
+#define ATA_READ_DMA            0xC8            // DMA, LBA28
+
+#define ATA_IDENTIFY_MODEL      27              // Words 27-46: model name, bytes swapped
+#define ATA_IDENTIFY_CAPS       49
+#define ATA_IDENTIFY_SECTORS    60              // Words 60-61: sectors addressable with LBA28
+#define ATA_CAPS_DMA            0x0100
+#define ATA_CAPS_LBA            0x0200
+
+// Bus master IDE registers, from the bus master base of the channel
+#define ATA_BM_COMMAND          0
+#define ATA_BM_STATUS           2
+#define ATA_BM_PRD_TABLE        4
+#define ATA_BM_START            0x01
+#define ATA_BM_READ             0x08            // Transfer to memory
+#define ATA_BM_STATUS_ERROR     0x02
+#define ATA_BM_STATUS_INTERRUPT 0x04
+
+#define ATA_CLASS_STORAGE       0x01            // PCI class of the IDE controller
+#define ATA_SUBCLASS_IDE        0x01
+#define ATA_PCI_BAR_BUS_MASTER  (PCI_BAR0 + 4 * 4)
+#define ATA_PROG_IF_BUS_MASTER  0x80            // Programming interface: bus master capable
+#define ATA_PROG_IF_NATIVE      0x05            // Either channel in PCI native mode
+
+#define ATA_MAX_TRANSFER        128             // Sectors per command (64KB)
+#define ATA_PRD_ENTRIES         256
+#define ATA_PRD_END             0x8000          // Last entry of the table
+#define ATA_RETRIES             3
+#define ATA_POLLS               1000000         // Status reads while detecting at most
+
+// Physical region descriptor of the bus master
+typedef struct
+{
+    uint32_t Address;
+    uint16_t Bytes;                            // 0 means 64KB
+    uint16_t Flags;
+
+} AtaPrd;
+
+typedef struct
+{
+    uint16_t Base;                             // Command block registers
+    uint16_t Control;                          // Device control / alternate status
+    uint16_t BusMaster;                        // Bus master registers, 0 without
+    uint8_t Irq;
+    AtaPrd* Prd;
+
+    Spinlock Lock;                             // Protects Owner and Waiters
+    struct Thread* Owner;                      // Worker using the channel
+    WaitQueue Waiters;                         // Workers waiting for it
+    volatile bool Interrupt;                   // Set by the interrupt handler
+    volatile uint8_t Status;                   // ATA status read by the handler
+    volatile uint8_t BusMasterStatus;          // Bus master status read by the handler
+
+} AtaChannel;
+
+typedef struct
+{
+    BlockDevice Device;
+    AtaChannel* Channel;
+    uint8_t Select;                            // Drive select bits of the disk
+    bool Dma;                                  // Transfers by DMA
+    char Name[4];
+
+} AtaDisk;
+
+static AtaChannel g_AtaChannels[] =
+{
+    { .Base = 0x1F0, .Control = 0x3F6, .Irq = 14 },
+    { .Base = 0x170, .Control = 0x376, .Irq = 15 },
+};
+
+#define ATA_CHANNEL_COUNT       (sizeof(g_AtaChannels) / sizeof(g_AtaChannels[0]))
+
+static AtaDisk g_AtaDisks[ATA_CHANNEL_COUNT * 2];
+static AtaPrd g_AtaPrd[ATA_CHANNEL_COUNT][ATA_PRD_ENTRIES]
+    __attribute__((aligned(ATA_PRD_ENTRIES * sizeof(AtaPrd)))); // A table must not cross 64KB
+
+static void channelInterrupt(AtaChannel* channel)
+{
+    if (channel->BusMaster)
+    {
+        uint8_t status = inb(channel->BusMaster + ATA_BM_STATUS);
+        outb(channel->BusMaster + ATA_BM_STATUS, status);  // Writing 1 clears interrupt and error
+        channel->BusMasterStatus |= status;
+    }
+    channel->Status = inb(channel->Base + ATA_STATUS_COMMAND);
+    channel->Interrupt = true;
+
+    struct Thread* owner = channel->Owner;
+    if (owner)
+        threadWake(owner);
+}
+
+static void primaryInterrupt(InterruptFrame* frame)
+{
+    (void) frame;
+    channelInterrupt(&g_AtaChannels[0]);
+}
+
+static void secondaryInterrupt(InterruptFrame* frame)
+{
+    (void) frame;
+    channelInterrupt(&g_AtaChannels[1]);
+}
+
+// Takes the channel for the running worker, sleeping while the other disk's worker has it
+static void channelAcquire(AtaChannel* channel)
+{
+    uint32_t flags = interruptsSave();
+    spinLock(&channel->Lock);
+    while (channel->Owner)
+    {
+        waitQueueAdd(&channel->Waiters);
+        spinUnlock(&channel->Lock);
+        interruptsRestore(flags);
+        threadBlock();
+        flags = interruptsSave();
+        spinLock(&channel->Lock);
+        waitQueueRemove(&channel->Waiters);
+    }
+    channel->Owner = threadCurrent();
+    spinUnlock(&channel->Lock);
+    interruptsRestore(flags);
+}
+
+static void channelRelease(AtaChannel* channel)
+{
+    uint32_t flags = interruptsSave();
+    spinLock(&channel->Lock);
+    channel->Owner = NULL;
+    waitQueueWakeAll(&channel->Waiters);
+    spinUnlock(&channel->Lock);
+    interruptsRestore(flags);
+}
+
+// Sleeps until the interrupt of the channel (channel owned)
+static void waitInterrupt(AtaChannel* channel)
+{
+    while (!channel->Interrupt)
+        threadBlock();
+}
+
+// Waits 400ns for the status to be valid after selecting a disk
+static void selectDelay(AtaChannel* channel)
+{
+    for (unsigned i = 0; i < 4; i++)
+        inb(channel->Control);                 // About 100ns per ISA read
+}
+
+// Polls until the disk is no longer busy (channel owned or boot thread)
+// Returns: the status, 0xFF if the disk stays busy
+static uint8_t pollNotBusy(AtaChannel* channel)
+{
+    for (unsigned i = 0; i < ATA_POLLS; i++)
+    {
+        uint8_t status = inb(channel->Control);
+        if (!(status & ATA_STATUS_BUSY))
+            return status;
+    }
+    return 0xFF;
+}
+
+// Selects the disk and sector range and issues a read command
+static bool issueRead(AtaDisk* disk, BlockRequest* request, uint8_t command)
+{
+    AtaChannel* channel = disk->Channel;
+    uint32_t lba = request->Lba;
+
+    outb(channel->Base + ATA_DRIVE_SELECT, disk->Select | ((lba >> 24) & 0x0F));
+    selectDelay(channel);
+    if (pollNotBusy(channel) & (ATA_STATUS_BUSY | ATA_STATUS_ERROR | ATA_STATUS_FAULT))
+        return false;
+
+    channel->Interrupt = false;
+    channel->BusMasterStatus = 0;
+    outb(channel->Base + ATA_SECTOR_COUNT, (uint8_t) request->MergedCount);  // 256 is written as 0
+    outb(channel->Base + ATA_LBA_LOW, lba & 0xFF);
+    outb(channel->Base + ATA_LBA_MID, (lba >> 8) & 0xFF);
+    outb(channel->Base + ATA_LBA_HIGH, (lba >> 16) & 0xFF);
+    outb(channel->Base + ATA_STATUS_COMMAND, command);
+    return true;
+}
+
+// Reads a transfer by PIO: one interrupt per sector, then its data from the data port
+static bool readPio(AtaDisk* disk, BlockRequest* request)
+{
+    AtaChannel* channel = disk->Channel;
+    if (!issueRead(disk, request, ATA_READ_SECTORS))
+        return false;
+
+    for (uint32_t sector = 0; sector < request->MergedCount; sector++)
+    {
+        waitInterrupt(channel);
+        uint8_t status = channel->Status;
+        if ((status & (ATA_STATUS_ERROR | ATA_STATUS_FAULT)) || !(status & ATA_STATUS_DRQ))
+            return false;
+
+        channel->Interrupt = false;            // Before the data: the next sector interrupts after it
+        insw(channel->Base + ATA_DATA, blockRequestSector(request, sector), BLOCK_SECTOR_SIZE / 2);
+    }
+    return true;
+}
+
+// Fills the PRD table of the channel with the buffers of a transfer
+// Returns: true if successful, false if the table is too small
+static bool buildPrdTable(AtaChannel* channel, BlockRequest* request)
+{
+    AtaPrd* prd = channel->Prd;
+    unsigned count = 0;
+
+    for (; request; request = request->MergeNext)
+    {
+        uint32_t address = virtualToPhysical(request->Buffer);
+        uint32_t bytes = request->Count * BLOCK_SECTOR_SIZE;
+        while (bytes > 0)
+        {
+            // An entry must not cross a 64KB boundary
+            uint32_t piece = 0x10000 - (address & 0xFFFF);
+            if (piece > bytes)
+                piece = bytes;
+
+            AtaPrd* last = count ? &prd[count - 1] : NULL;
+            uint32_t lastBytes = last ? (last->Bytes ? last->Bytes : 0x10000) : 0;
+            if (last && last->Address + lastBytes == address && (address & 0xFFFF) != 0)
+            {
+                last->Bytes = (uint16_t) (lastBytes + piece);  // Continues the previous piece
+            }
+            else
+            {
+                if (count == ATA_PRD_ENTRIES)
+                    return false;
+                prd[count++] = (AtaPrd) { .Address = address, .Bytes = (uint16_t) piece };
+            }
+
+            address += piece;
+            bytes -= piece;
+        }
+    }
+
+    prd[count - 1].Flags = ATA_PRD_END;
+    return true;
+}
+
+// Reads a transfer by DMA: one interrupt at the end
+static bool readDma(AtaDisk* disk, BlockRequest* request)
+{
+    AtaChannel* channel = disk->Channel;
+    if (!buildPrdTable(channel, request))
+        return false;
+
+    outl(channel->BusMaster + ATA_BM_PRD_TABLE, virtualToPhysical(channel->Prd));
+    outb(channel->BusMaster + ATA_BM_COMMAND, ATA_BM_READ);
+    outb(channel->BusMaster + ATA_BM_STATUS, ATA_BM_STATUS_INTERRUPT | ATA_BM_STATUS_ERROR);
+    if (!issueRead(disk, request, ATA_READ_DMA))
+        return false;
+
+    outb(channel->BusMaster + ATA_BM_COMMAND, ATA_BM_READ | ATA_BM_START);
+    waitInterrupt(channel);
+    outb(channel->BusMaster + ATA_BM_COMMAND, ATA_BM_READ);  // Stop the engine
+
+    return !(channel->BusMasterStatus & ATA_BM_STATUS_ERROR)
+           && !(channel->Status & (ATA_STATUS_ERROR | ATA_STATUS_FAULT));
+}
+
+// Transfers a request (BlockTransferFunction, worker thread)
+static bool ataTransfer(BlockDevice* device, BlockRequest* request)
+{
+    AtaDisk* disk = device->Driver;
+    AtaChannel* channel = disk->Channel;
+
+    channelAcquire(channel);
+    bool ok = false;
+    for (unsigned attempt = 0; attempt < ATA_RETRIES && !ok; attempt++)
+    {
+        if (disk->Dma)
+        {
+            ok = readDma(disk, request);
+            if (!ok)
+            {
+                logPrintf("ATA: DMA read failed on %s, using PIO\n", device->Name);
+                disk->Dma = false;
+            }
+        }
+        else
+        {
+            ok = readPio(disk, request);
+        }
+    }
+    channelRelease(channel);
+    return ok;
+}
+
+// Identifies a disk by polling (interrupts of the channel off)
+// Parameters:
+//   channel - Channel of the disk
+//   select - Drive select bits
+//   identify - Receives the 256 words of IDENTIFY DEVICE
+// Returns: true if there is an ATA disk, false for none, ATAPI or SATA devices
+static bool identifyDisk(AtaChannel* channel, uint8_t select, uint16_t* identify)
+{
+    outb(channel->Base + ATA_DRIVE_SELECT, select);
+    selectDelay(channel);
+    outb(channel->Base + ATA_SECTOR_COUNT, 0);
+    outb(channel->Base + ATA_LBA_LOW, 0);
+    outb(channel->Base + ATA_LBA_MID, 0);
+    outb(channel->Base + ATA_LBA_HIGH, 0);
+    outb(channel->Base + ATA_STATUS_COMMAND, ATA_IDENTIFY);
+
+    if (inb(channel->Base + ATA_STATUS_COMMAND) == 0 || pollNotBusy(channel) & ATA_STATUS_BUSY)
+        return false;                          // No disk
+
+    if (inb(channel->Base + ATA_LBA_MID) || inb(channel->Base + ATA_LBA_HIGH))
+        return false;                          // Signature of a packet or SATA device
+
+    for (unsigned i = 0; i < ATA_POLLS; i++)
+    {
+        uint8_t status = inb(channel->Base + ATA_STATUS_COMMAND);
+        if (status & ATA_STATUS_ERROR)
+            return false;
+        if (status & ATA_STATUS_DRQ)
+        {
+            insw(channel->Base + ATA_DATA, identify, 256);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Sets up the bus master registers of the channels of the PCI IDE controller, if any
+static void findBusMaster(void)
+{
+    PciAddress address;
+    if (!pciFindClass(ATA_CLASS_STORAGE, ATA_SUBCLASS_IDE, &address))
+        return;
+
+    // Only controllers in compatibility mode use the ports and IRQs of the channels
+    uint8_t progIf = (pciRead(address, PCI_CLASS) >> 8) & 0xFF;
+    uint32_t bar = pciRead(address, ATA_PCI_BAR_BUS_MASTER);
+    if ((progIf & ATA_PROG_IF_NATIVE) || !(progIf & ATA_PROG_IF_BUS_MASTER) || !(bar & 1) || !(bar & 0xFFFC))
+        return;
+
+    uint32_t command = pciRead(address, PCI_COMMAND);
+    pciWrite(address, PCI_COMMAND, command | PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+    for (unsigned i = 0; i < ATA_CHANNEL_COUNT; i++)
+    {
+        g_AtaChannels[i].BusMaster = (bar & 0xFFFC) + i * 8;
+        g_AtaChannels[i].Prd = g_AtaPrd[i];
+    }
+}
+
+// Copies the model name of IDENTIFY DEVICE (bytes swapped, padded with spaces)
+static void modelName(const uint16_t* identify, char* nameOut)
+{
+    unsigned length = 0;
+    for (unsigned i = 0; i < 20; i++)
+    {
+        nameOut[length++] = identify[ATA_IDENTIFY_MODEL + i] >> 8;
+        nameOut[length++] = identify[ATA_IDENTIFY_MODEL + i] & 0xFF;
+    }
+    while (length && nameOut[length - 1] == ' ')
+        length--;
+    nameOut[length] = '\0';
+}
+
+// Detects the disks of both channels and registers them as "hd0" to "hd3"
+// (hd0/hd1: master and slave of the primary channel)
+void ataInit(void)
+{
+    findBusMaster();
+
+    for (unsigned c = 0; c < ATA_CHANNEL_COUNT; c++)
+    {
+        AtaChannel* channel = &g_AtaChannels[c];
+        if (inb(channel->Base + ATA_STATUS_COMMAND) == 0xFF)
+            continue;                          // Floating bus: no disks
+
+        outb(channel->Control, ATA_CONTROL_NIEN);
+        bool found = false;
+        for (unsigned d = 0; d < 2; d++)
+        {
+            uint16_t identify[256];
+            uint8_t select = ATA_SELECT_LBA | (d ? ATA_SELECT_SLAVE : 0);
+            if (!identifyDisk(channel, select, identify) || !(identify[ATA_IDENTIFY_CAPS] & ATA_CAPS_LBA))
+                continue;
+
+            AtaDisk* disk = &g_AtaDisks[c * 2 + d];
+            disk->Channel = channel;
+            disk->Select = select;
+            disk->Dma = channel->BusMaster && (identify[ATA_IDENTIFY_CAPS] & ATA_CAPS_DMA);
+            disk->Name[0] = 'h';
+            disk->Name[1] = 'd';
+            disk->Name[2] = '0' + c * 2 + d;
+            disk->Device.Name = disk->Name;
+            disk->Device.SectorCount = identify[ATA_IDENTIFY_SECTORS] | (identify[ATA_IDENTIFY_SECTORS + 1] << 16);
+            disk->Device.MaxTransfer = ATA_MAX_TRANSFER;
+            disk->Device.Transfer = ataTransfer;
+            disk->Device.Driver = disk;
+            if (!blockRegister(&disk->Device))
+                continue;
+
+            char model[41];
+            modelName(identify, model);
+            logPrintf("ATA: %s is %s, %u sectors, %s\n", disk->Name, model, disk->Device.SectorCount,
+                      disk->Dma ? "DMA" : "PIO");
+            found = true;
+        }
+
+        if (found)
+        {
+            irqRegister(channel->Irq, c == 0 ? primaryInterrupt : secondaryInterrupt);
+            outb(channel->Control, 0);         // Interrupts of the disks on
+        }
+    }
+}
@@ -0,0 +1,13 @@
+// =============================================================================
+// ATA DISKS
+// =============================================================================
+//
+// Block devices "hd0" to "hd3" for the disks on the primary and secondary
+// channels of the legacy IDE controller (LBA28). With a PCI bus master IDE
+// controller the disks transfer by DMA with one interrupt per transfer,
+// otherwise by PIO with one interrupt per sector; either way the worker
+// thread of the device sleeps until the interrupt of the channel
+
+#pragma once
+
+void ataInit(void);
@@ -0,0 +1,289 @@
+// =============================================================================
+// BLOCK DEVICES
+// =============================================================================
+//
+// Every device has a queue of waiting requests sorted by sector and a worker
+// thread that takes them one at a time. The worker serves the queue like an
+// elevator going up (C-LOOK): it takes the first request at or after the
+// sector where the last transfer ended and wraps around to the lowest one
+// when there is none, so the heads sweep across the disk instead of seeking
+// back and forth between requests in arrival order.
+//
+// A submitted request that continues a waiting one (or that the waiting one
+// continues) is merged into it instead of being queued, up to MaxTransfer
+// sectors in total, and a merge that closes the gap to the next waiting
+// request joins the two. The merged requests stay separate, each with its
+// own buffer: the driver finds the buffer of every sector of the transfer
+// with blockRequestSector, and each request is completed on its own.
+//
+// The queue lock is held with interrupts disabled, so requests may be
+// submitted from anywhere; only waiting for one needs a thread
+
+#include "block.h"
+
+#include <stddef.h>
+
+#include "cpu.h"
+#include "log.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "string.h"
+
+static BlockDevice* g_BlockDevices[BLOCK_MAX_DEVICES];
+static unsigned g_BlockDeviceCount;
+
+// Appends the chain of one request to the chain of another (queue locked)
+static void chainAppend(BlockRequest* head, BlockRequest* chain)
+{
+    BlockRequest* tail = head;
+    while (tail->MergeNext)
+        tail = tail->MergeNext;
+    tail->MergeNext = chain;
+    head->MergedCount += chain->MergedCount;
+}
+
+// Merges a request into an adjacent waiting one (queue locked)
+// Returns true if merged, false if the request must be queued on its own
+static bool queueMerge(BlockDevice* device, BlockRequest* request)
+{
+    for (BlockRequest** link = &device->Queue; *link; link = &(*link)->Next)
+    {
+        BlockRequest* queued = *link;
+        if (queued->MergedCount + request->Count > device->MaxTransfer)
+            continue;
+
+        if (queued->Lba + queued->MergedCount == request->Lba)
+        {
+            // Behind a waiting request, possibly closing the gap to the next one
+            chainAppend(queued, request);
+            BlockRequest* next = queued->Next;
+            if (next && queued->Lba + queued->MergedCount == next->Lba
+                && queued->MergedCount + next->MergedCount <= device->MaxTransfer)
+            {
+                queued->Next = next->Next;
+                chainAppend(queued, next);
+                device->Merges++;
+            }
+            device->Merges++;
+            return true;
+        }
+
+        if (request->Lba + request->Count == queued->Lba)
+        {
+            // In front of a waiting request: takes its place in the queue
+            request->Next = queued->Next;
+            chainAppend(request, queued);
+            *link = request;
+            device->Merges++;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Inserts a request into the queue in sector order (queue locked)
+static void queueInsert(BlockDevice* device, BlockRequest* request)
+{
+    BlockRequest** link = &device->Queue;
+    while (*link && (*link)->Lba < request->Lba)
+        link = &(*link)->Next;
+    request->Next = *link;
+    *link = request;
+}
+
+// Takes the next request in elevator order (queue locked)
+// Returns NULL if the queue is empty
+static BlockRequest* queueTake(BlockDevice* device)
+{
+    BlockRequest** link = &device->Queue;
+    while (*link && (*link)->Lba < device->Position)
+        link = &(*link)->Next;
+    if (!*link)
+        link = &device->Queue;                 // End of the sweep: back to the lowest sector
+
+    BlockRequest* request = *link;
+    if (request)
+    {
+        *link = request->Next;
+        device->Position = request->Lba + request->MergedCount;
+    }
+    return request;
+}
+
+// Completes one request
+static void finishRequest(BlockRequest* request, bool ok)
+{
+    // Nothing of the request may be used once its waiter sees the status
+    BlockCompletion completion = request->Completion;
+    Thread* waiter = request->Waiter;
+    __atomic_store_n(&request->Status, ok ? BLOCK_DONE : BLOCK_ERROR, __ATOMIC_RELEASE);
+
+    if (completion)
+        completion(request);
+    else
+        threadWake(waiter);
+}
+
+// Worker thread of a device: transfers the queued requests one at a time
+static void blockWorker(void* argument)
+{
+    BlockDevice* device = argument;
+    for (;;)
+    {
+        uint32_t flags = interruptsSave();
+        spinLock(&device->QueueLock);
+        BlockRequest* request = queueTake(device);
+        spinUnlock(&device->QueueLock);
+        interruptsRestore(flags);
+
+        if (!request)
+        {
+            threadBlock();                     // Until blockSubmit (returns at once if it came meanwhile)
+            continue;
+        }
+
+        traceBegin(TRACE_DISK_READ, request->Lba);
+        bool ok = device->Transfer(device, request);
+        traceEnd(TRACE_DISK_READ, request->MergedCount);
+        device->Transfers++;
+        if (ok)
+            device->SectorsRead += request->MergedCount;
+        else
+            device->Errors++;
+
+        while (request)
+        {
+            BlockRequest* next = request->MergeNext;  // Read before completion hands it back
+            finishRequest(request, ok);
+            request = next;
+        }
+    }
+}
+
+// Makes a device available and starts its worker thread
+// The driver fills in Name, SectorCount, MaxTransfer, Transfer and Driver
+// Returns: true if successful, false if there are too many devices or no memory
+bool blockRegister(BlockDevice* device)
+{
+    if (g_BlockDeviceCount == BLOCK_MAX_DEVICES)
+        return false;
+
+    device->QueueLock = (Spinlock) SPINLOCK_INIT;
+    device->Queue = NULL;
+    device->Position = 0;
+    device->Worker = threadCreate(device->Name, blockWorker, device);
+    if (!device->Worker)
+        return false;
+
+    g_BlockDevices[g_BlockDeviceCount++] = device;
+    return true;
+}
+
+// Finds a registered device by name ("fd0", "hd0" ...)
+// Returns: the device, NULL if there is none with that name
+BlockDevice* blockFind(const char* name)
+{
+    for (unsigned i = 0; i < g_BlockDeviceCount; i++)
+    {
+        if (strcmp(g_BlockDevices[i]->Name, name) == 0)
+            return g_BlockDevices[i];
+    }
+    return NULL;
+}
+
+// Queues a read request and returns at once
+// The caller fills in Lba, Count (at most MaxTransfer), Buffer and either
+// Completion (and Context) or no completion to wait with blockWait. The
+// request must stay valid until it has completed. An invalid request
+// completes at once with BLOCK_ERROR
+// Parameters:
+//   device - Device to read from
+//   request - Request to queue
+void blockSubmit(BlockDevice* device, BlockRequest* request)
+{
+    request->Status = BLOCK_PENDING;
+    request->Waiter = request->Completion ? NULL : threadCurrent();
+    request->Next = NULL;
+    request->MergeNext = NULL;
+    request->MergedCount = request->Count;
+
+    if (request->Count == 0 || request->Count > device->MaxTransfer
+        || request->Lba >= device->SectorCount || request->Count > device->SectorCount - request->Lba)
+    {
+        finishRequest(request, false);
+        return;
+    }
+
+    uint32_t flags = interruptsSave();
+    spinLock(&device->QueueLock);
+    device->Requests++;
+    if (!queueMerge(device, request))
+        queueInsert(device, request);
+    spinUnlock(&device->QueueLock);
+    interruptsRestore(flags);
+
+    threadWake(device->Worker);
+}
+
+// Waits until a request submitted without completion function has completed
+// Blocks the calling thread, so it must not be called by an idle thread
+// Returns: true if the request succeeded, false on an I/O error
+bool blockWait(BlockRequest* request)
+{
+    while (__atomic_load_n(&request->Status, __ATOMIC_ACQUIRE) == BLOCK_PENDING)
+        threadBlock();
+    return request->Status == BLOCK_DONE;
+}
+
+// Reads sectors and waits for them (in transfers of at most MaxTransfer sectors)
+// Parameters:
+//   device - Device to read from
+//   lba - First sector
+//   count - Number of sectors
+//   buffer - Receives count * BLOCK_SECTOR_SIZE bytes
+// Returns: true if successful, false on an I/O error
+bool blockRead(BlockDevice* device, uint32_t lba, uint32_t count, void* buffer)
+{
+    uint8_t* output = buffer;
+    while (count > 0)
+    {
+        uint32_t chunk = count < device->MaxTransfer ? count : device->MaxTransfer;
+        BlockRequest request = { .Lba = lba, .Count = chunk, .Buffer = output };
+        blockSubmit(device, &request);
+        if (!blockWait(&request))
+            return false;
+
+        lba += chunk;
+        count -= chunk;
+        output += chunk * BLOCK_SECTOR_SIZE;
+    }
+    return true;
+}
+
+// Finds the buffer of a sector of a transfer, for drivers
+// Parameters:
+//   request - Request passed to the Transfer function
+//   sector - Sector of the transfer, counted from request->Lba
+// Returns: Address of BLOCK_SECTOR_SIZE bytes, NULL past the end of the transfer
+void* blockRequestSector(BlockRequest* request, uint32_t sector)
+{
+    for (; request; request = request->MergeNext)
+    {
+        if (sector < request->Count)
+            return (uint8_t*) request->Buffer + sector * BLOCK_SECTOR_SIZE;
+        sector -= request->Count;
+    }
+    return NULL;
+}
+
+// Logs every device with its request counters
+void blockDump(void)
+{
+    for (unsigned i = 0; i < g_BlockDeviceCount; i++)
+    {
+        const BlockDevice* device = g_BlockDevices[i];
+        logPrintf("%s: %u sectors, %u requests (%u merged), %u transfers, %u sectors read, %u errors\n",
+                  device->Name, device->SectorCount, device->Requests, device->Merges,
+                  device->Transfers, device->SectorsRead, device->Errors);
+    }
+}
@@ -0,0 +1,93 @@
+// =============================================================================
+// BLOCK DEVICES
+// =============================================================================
+//
+// A block device transfers whole sectors of BLOCK_SECTOR_SIZE bytes. Reads
+// are asynchronous requests: blockSubmit queues a request and returns, the
+// device's worker thread starts the transfers in elevator order and the
+// driver waits for the completion interrupt of each one, so no CPU polls
+// during I/O. A request for sectors adjacent to a queued request is merged
+// into it, so a run of single-sector requests becomes one transfer.
+// Filesystems do not read devices directly but through the buffer cache
+// (see buffer_cache.h)
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "spinlock.h"
+
+#define BLOCK_SECTOR_SIZE       512
+#define BLOCK_MAX_DEVICES       8
+
+struct BlockDevice;
+struct BlockRequest;
+struct Thread;
+
+typedef enum
+{
+    BLOCK_PENDING,                             // Queued or being transferred
+    BLOCK_DONE,
+    BLOCK_ERROR,
+
+} BlockStatus;
+
+// Called when a request has completed, in the worker thread of the device
+// (not in an interrupt handler, so it may take locks and submit requests)
+typedef void (*BlockCompletion)(struct BlockRequest* request);
+
+typedef struct BlockRequest
+{
+    uint32_t Lba;                              // First sector
+    uint32_t Count;                            // Number of sectors
+    void* Buffer;                              // Count * BLOCK_SECTOR_SIZE bytes
+    BlockCompletion Completion;                // NULL: wake Waiter instead
+    struct Thread* Waiter;                     // Blocked in blockWait, set by blockSubmit
+    void* Context;                             // For the completion function
+    volatile BlockStatus Status;
+
+    // Queue state, owned by the block layer
+    struct BlockRequest* Next;                 // Elevator queue, sorted by Lba
+    struct BlockRequest* MergeNext;            // Requests merged behind this one, in Lba order
+    uint32_t MergedCount;                      // Sectors of this one and those merged behind it
+
+} BlockRequest;
+
+// Transfers the sectors of a request and of the requests merged behind it
+// (request->MergedCount sectors from request->Lba, see blockRequestSector).
+// Runs in the worker thread of the device and may block, typically until
+// the completion interrupt of the controller
+// Returns: true if successful, false on an I/O error (after retries)
+typedef bool (*BlockTransferFunction)(struct BlockDevice* device, BlockRequest* request);
+
+typedef struct BlockDevice
+{
+    const char* Name;
+    uint32_t SectorCount;                      // Size of the device in sectors
+    uint32_t MaxTransfer;                      // Sectors per transfer at most
+    BlockTransferFunction Transfer;
+    void* Driver;                              // Private data of the driver
+
+    // Request queue
+    Spinlock QueueLock;                        // Protects Queue and Position
+    BlockRequest* Queue;                       // Waiting requests, sorted by Lba
+    uint32_t Position;                         // Sector after the last transfer (elevator)
+    struct Thread* Worker;
+
+    // Counters for tuning
+    uint32_t Requests;                         // Requests submitted
+    uint32_t Merges;                           // ... merged into another one
+    uint32_t Transfers;                        // Transfers started by the worker
+    uint32_t SectorsRead;
+    uint32_t Errors;                           // Failed transfers
+
+} BlockDevice;
+
+bool blockRegister(BlockDevice* device);
+BlockDevice* blockFind(const char* name);
+void blockSubmit(BlockDevice* device, BlockRequest* request);
+bool blockWait(BlockRequest* request);
+bool blockRead(BlockDevice* device, uint32_t lba, uint32_t count, void* buffer);
+void* blockRequestSector(BlockRequest* request, uint32_t sector);
+void blockDump(void);
@@ -0,0 +1,37 @@
+// =============================================================================
+// BOOT INFORMATION
+// =============================================================================
+//
+// Structure handed over by stage2 in EBX (physical address, entry.asm hands
+// it to kernelMain through the direct map)
+// The layout must match the BOOT INFORMATION section of
+// src/bootloader/stage2/main.asm
+
+#pragma once
+
+#include <stdint.h>
+
+#define BOOT_INFO_MAGIC 0x534F424E             // "NBOS" as stored by stage2
+
+#define MEMORY_TYPE_USABLE 1                   // Usable RAM, any other type is reserved
+
+// Physical memory range of the BIOS memory map (layout of E820, ACPI 3.0),
+// see src/bootloader/stage2/memory.inc
+typedef struct
+{
+    uint64_t Base;                     // Physical start address
+    uint64_t Length;                   // Size in bytes
+    uint32_t Type;                     // MEMORY_TYPE_USABLE or reserved
+    uint32_t Attributes;               // ACPI 3.0 extended attributes
+
+} __attribute__((packed)) MemoryMapEntry;
+
+typedef struct
+{
+    uint32_t Magic;                    // BOOT_INFO_MAGIC
+    uint32_t BootDrive;                // BIOS drive number of the boot drive
+    uint32_t KernelSize;               // Size of the kernel in bytes (unpacked, see stage2 unpack.inc)
+    uint32_t MemoryMap;                // Physical address of the memory map entries
+    uint32_t MemoryMapCount;           // Number of memory map entries
+
+} __attribute__((packed)) BootInfo;
@@ -0,0 +1,102 @@
+// =============================================================================
+// BOOT TIME CHECKPOINTS
+// =============================================================================
+//
+// The bootloader table is copied into the kernel at entry, so it does not
+// matter what later happens to low memory. Stage1 only stores the low dword
+// of its checkpoints after the first one; the high dword is restored from the
+// previous checkpoint, carrying one when the low dword wrapped around.
+//
+// Kernels built with -DBOOT_BENCH (make bench_boot) end the boot with
+// bootTimesBenchExit, which logs the checkpoints in one line for the
+// benchmark script and powers QEMU off through its isa-debug-exit device.
+
+#include "boot_times.h"
+
+#include "io.h"
+#include "log.h"
+#include "paging.h"
+#include "serial.h"
+#include "timer.h"
+
+static uint64_t g_BootTimes[BOOT_TIME_COUNT];  // Counter value of each checkpoint, 0 = not reached
+
+// Phase ending at each checkpoint
+static const char* const g_BootTimeNames[BOOT_TIME_COUNT] =
+{
+    [BOOT_TIME_STAGE1_ENTRY]          = "BIOS (reset to stage1)",
+    [BOOT_TIME_STAGE1_ROOT_READ]      = "stage1: disk setup, root directory read",
+    [BOOT_TIME_STAGE1_ROOT_SCAN]      = "stage1: root directory scan",
+    [BOOT_TIME_STAGE1_FAT_READ]       = "stage1: FAT read",
+    [BOOT_TIME_STAGE2_ENTRY]          = "stage1: STAGE2.BIN load",
+    [BOOT_TIME_STAGE2_KERNEL_FOUND]   = "stage2: KERNEL.BIN lookup",
+    [BOOT_TIME_STAGE2_KERNEL_LOADED]  = "stage2: KERNEL.BIN load",
+    [BOOT_TIME_STAGE2_KERNEL_UNPACKED] = "stage2: KERNEL.BIN unpack",
+    [BOOT_TIME_KERNEL_ENTRY]          = "stage2: A20, protected mode switch",
+    [BOOT_TIME_KERNEL_LOG]            = "kernel: console and serial setup",
+    [BOOT_TIME_KERNEL_MEMORY]         = "kernel: paging, page and slab allocators",
+    [BOOT_TIME_KERNEL_INTERRUPTS]     = "kernel: interrupts, timer calibration",
+    [BOOT_TIME_KERNEL_SMP]            = "kernel: application processor start-up",
+    [BOOT_TIME_KERNEL_INIT]           = "kernel: initialization",
+};
+
+// Records the kernel entry and takes over the checkpoints of the bootloader
+void bootTimesInit(void)
+{
+    g_BootTimes[BOOT_TIME_KERNEL_ENTRY] = readTimestamp();
+
+    const volatile uint64_t* table = (const volatile uint64_t*) physicalToVirtual(BOOT_TIMES_ADDRESS);
+    for (unsigned i = 0; i < BOOT_TIME_HANDOVER_SLOTS; i++)
+        g_BootTimes[i] = table[i];
+
+    // Stage1 checkpoints after the first one hold only the low dword
+    for (unsigned i = BOOT_TIME_STAGE1_ENTRY + 1; i < BOOT_TIME_STAGE2_ENTRY; i++)
+    {
+        uint64_t previous = g_BootTimes[i - 1];
+        uint64_t time = (previous & 0xFFFFFFFF00000000ull) | (uint32_t) g_BootTimes[i];
+        if (time < previous)
+            time += 1ull << 32;                // Low dword wrapped around
+        g_BootTimes[i] = time;
+    }
+}
+
+// Records a kernel checkpoint
+void bootTimeRecord(BootTime checkpoint)
+{
+    g_BootTimes[checkpoint] = readTimestamp();
+}
+
+// Logs the cycles spent in each phase and in total since reset
+void bootTimesDump(void)
+{
+    logPuts("Boot times (TSC cycles):\n");
+
+    uint64_t previous = 0;
+    for (unsigned i = 0; i < BOOT_TIME_COUNT; i++)
+    {
+        if (!g_BootTimes[i])
+            continue;                          // Checkpoint not reached (yet)
+
+        logPrintf("  %14llu  %s\n", g_BootTimes[i] - previous, g_BootTimeNames[i]);
+        previous = g_BootTimes[i];
+    }
+
+    logPrintf("  %14llu  total\n", previous);
+}
+
+// Ends a benchmark boot: logs the line read by tools/bench_boot.sh, then
+// leaves QEMU (a write to isa-debug-exit exits with status 1)
+// "BOOT_BENCH kernel=<cycles> init=<cycles> tsc_khz=<rate>": cycles since
+// reset at the kernel entry and at the end of the kernel initialization,
+// rate 0 if the TSC was not calibrated
+void bootTimesBenchExit(void)
+{
+    uint64_t khz = timerTimestampFrequency();
+    divide64(&khz, 1000);
+    logPrintf("BOOT_BENCH kernel=%llu init=%llu tsc_khz=%llu\n", g_BootTimes[BOOT_TIME_KERNEL_ENTRY],
+              g_BootTimes[BOOT_TIME_KERNEL_INIT], khz);
+    serialFlush();
+
+    outb(BOOT_BENCH_EXIT_PORT, 0);
+    cpuHalt();                                 // No such device: not under make bench_boot
+}
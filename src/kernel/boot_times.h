@@ -0,0 +1,47 @@
+// =============================================================================
+// BOOT TIME CHECKPOINTS
+// =============================================================================
+//
+// Time stamp counter values at the checkpoints of the boot. The bootloader
+// stages record theirs in a table in low memory (src/common/boot_times.inc,
+// same slot numbers), the kernel takes the table over and adds its own.
+// Each checkpoint ends the phase it is named after.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "cpu.h"                               // readTimestamp
+
+#define BOOT_TIMES_ADDRESS 0x7B00              // Table of the bootloader stages
+#define BOOT_BENCH_EXIT_PORT 0xF4              // isa-debug-exit device of make bench_boot
+
+typedef enum
+{
+    // Recorded by the bootloader (BOOT_TIME_HANDOVER_SLOTS of boot_times.inc)
+    BOOT_TIME_STAGE1_ENTRY,                    // BIOS done, stage1 running
+    BOOT_TIME_STAGE1_ROOT_READ,                // Disk setup and root directory read
+    BOOT_TIME_STAGE1_ROOT_SCAN,                // STAGE2.BIN found in the root directory
+    BOOT_TIME_STAGE1_FAT_READ,                 // FAT read
+    BOOT_TIME_STAGE2_ENTRY,                    // STAGE2.BIN loaded, stage2 running
+    BOOT_TIME_STAGE2_KERNEL_FOUND,             // KERNEL.BIN found in the root directory
+    BOOT_TIME_STAGE2_KERNEL_LOADED,            // KERNEL.BIN loaded at 1MB
+    BOOT_TIME_STAGE2_KERNEL_UNPACKED,          // Packed KERNEL.BIN unpacked (right away for a plain one)
+    BOOT_TIME_HANDOVER_SLOTS,
+
+    // Recorded by the kernel
+    BOOT_TIME_KERNEL_ENTRY = BOOT_TIME_HANDOVER_SLOTS, // Protected mode, kernel running
+    BOOT_TIME_KERNEL_LOG,                      // Console and serial log ready
+    BOOT_TIME_KERNEL_MEMORY,                   // Page allocator and slab caches ready
+    BOOT_TIME_KERNEL_INTERRUPTS,               // PIC, local APIC and timer ready, interrupts on
+    BOOT_TIME_KERNEL_SMP,                      // Application processors started
+    BOOT_TIME_KERNEL_INIT,                     // Kernel initialization done
+
+    BOOT_TIME_COUNT
+
+} BootTime;
+
+void bootTimesInit(void);
+void bootTimeRecord(BootTime checkpoint);
+void bootTimesDump(void);
+void __attribute__((noreturn)) bootTimesBenchExit(void);
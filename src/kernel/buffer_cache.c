@@ -0,0 +1,350 @@
+// =============================================================================
+// BUFFER CACHE
+// =============================================================================
+//
+// A fixed set of BUFFER_COUNT buffers, found by (device, sector) through a
+// hash table. A buffer that nobody references sits in the LRU list, least
+// recently used first; a miss recycles the head of the list. Empty buffers
+// (never used, or whose read failed) are put at the head, so they are
+// recycled before any cached sector.
+//
+// The cache lock is never held during I/O: a miss claims a buffer in the
+// LOADING state, reads the sector without the lock, then marks the buffer
+// VALID. Other threads that want the same sector in the meantime find the
+// LOADING buffer and sleep until the read is done, so each sector is read
+// only once. Threads that find every buffer referenced sleep the same way,
+// on the same wait queue, until a buffer is released.
+//
+// Read-ahead claims the run of missing sectors after a position and submits
+// one request per buffer (embedded in the buffer); they are completed in
+// the worker thread of the device, which marks each buffer VALID
+
+#include "buffer_cache.h"
+
+#include "cpu.h"
+#include "log.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "spinlock.h"
+#include "string.h"
+
+#define BUFFER_HASH_BITS        8               // 256 buckets: 2 buffers per bucket
+#define BUFFER_HASH_SIZE        (1u << BUFFER_HASH_BITS)
+
+static Buffer g_Buffers[BUFFER_COUNT];
+static Buffer* g_BufferHash[BUFFER_HASH_SIZE];
+static Buffer* g_LruHead;                      // Recycled first
+static Buffer* g_LruTail;                      // Most recently used
+static WaitQueue g_BufferWaiters;              // Waiting for a load or a release
+static Spinlock g_BufferLock = SPINLOCK_INIT;  // Protects everything above but the sector data
+
+// Counters for tuning
+static uint32_t g_Hits;                        // bufferGet served from the cache
+static uint32_t g_Misses;                      // bufferGet that read the device
+static uint32_t g_ReadAheadSectors;            // Sectors read ahead
+static uint32_t g_ReadAheadHits;               // ... that were used afterwards
+
+static uint32_t cacheLock(void)
+{
+    uint32_t flags = interruptsSave();
+    spinLock(&g_BufferLock);
+    return flags;
+}
+
+static void cacheUnlock(uint32_t flags)
+{
+    spinUnlock(&g_BufferLock);
+    interruptsRestore(flags);
+}
+
+// Fibonacci hashing: consecutive sectors land in different buckets
+static inline uint32_t hashSlot(const BlockDevice* device, uint32_t lba)
+{
+    return ((lba + (uint32_t) (uintptr_t) device) * 2654435761u) >> (32 - BUFFER_HASH_BITS);
+}
+
+static Buffer* hashLookup(const BlockDevice* device, uint32_t lba)
+{
+    for (Buffer* buffer = g_BufferHash[hashSlot(device, lba)]; buffer; buffer = buffer->HashNext)
+    {
+        if (buffer->Lba == lba && buffer->Device == device)
+            return buffer;
+    }
+    return NULL;
+}
+
+static void hashInsert(Buffer* buffer)
+{
+    Buffer** bucket = &g_BufferHash[hashSlot(buffer->Device, buffer->Lba)];
+    buffer->HashNext = *bucket;
+    *bucket = buffer;
+}
+
+static void hashRemove(Buffer* buffer)
+{
+    Buffer** link = &g_BufferHash[hashSlot(buffer->Device, buffer->Lba)];
+    while (*link != buffer)
+        link = &(*link)->HashNext;
+    *link = buffer->HashNext;
+}
+
+// LRU list: doubly linked, holds exactly the unreferenced buffers
+static void lruRemove(Buffer* buffer)
+{
+    if (buffer->LruPrevious)
+        buffer->LruPrevious->LruNext = buffer->LruNext;
+    else
+        g_LruHead = buffer->LruNext;
+    if (buffer->LruNext)
+        buffer->LruNext->LruPrevious = buffer->LruPrevious;
+    else
+        g_LruTail = buffer->LruPrevious;
+}
+
+static void lruPushTail(Buffer* buffer)
+{
+    buffer->LruNext = NULL;
+    buffer->LruPrevious = g_LruTail;
+    if (g_LruTail)
+        g_LruTail->LruNext = buffer;
+    else
+        g_LruHead = buffer;
+    g_LruTail = buffer;
+}
+
+static void lruPushHead(Buffer* buffer)
+{
+    buffer->LruPrevious = NULL;
+    buffer->LruNext = g_LruHead;
+    if (g_LruHead)
+        g_LruHead->LruPrevious = buffer;
+    else
+        g_LruTail = buffer;
+    g_LruHead = buffer;
+}
+
+// Recycles the least recently used buffer for a sector (cache locked)
+// Returns the buffer in the LOADING state with one reference, NULL if every
+// buffer is referenced
+static Buffer* claimBuffer(BlockDevice* device, uint32_t lba)
+{
+    Buffer* buffer = g_LruHead;
+    if (!buffer)
+        return NULL;
+
+    lruRemove(buffer);
+    if (buffer->State != BUFFER_EMPTY)
+        hashRemove(buffer);
+
+    buffer->Device = device;
+    buffer->Lba = lba;
+    buffer->State = BUFFER_LOADING;
+    buffer->References = 1;
+    buffer->ReadAhead = false;
+    hashInsert(buffer);
+    return buffer;
+}
+
+// Ends the read of a claimed buffer (cache locked)
+static void finishLoad(Buffer* buffer, bool ok)
+{
+    if (ok)
+    {
+        buffer->State = BUFFER_VALID;
+    }
+    else
+    {
+        hashRemove(buffer);
+        buffer->State = BUFFER_EMPTY;
+    }
+    waitQueueWakeAll(&g_BufferWaiters);
+}
+
+// Drops a reference (cache locked)
+static void releaseLocked(Buffer* buffer)
+{
+    if (--buffer->References)
+        return;
+
+    if (buffer->State == BUFFER_VALID)
+        lruPushTail(buffer);
+    else
+        lruPushHead(buffer);
+    waitQueueWakeAll(&g_BufferWaiters);
+}
+
+// Sleeps until a buffer was loaded or released (cache locked, and again on return)
+static uint32_t waitForBuffers(uint32_t flags)
+{
+    waitQueueAdd(&g_BufferWaiters);
+    cacheUnlock(flags);
+    threadBlock();
+    flags = cacheLock();
+    waitQueueRemove(&g_BufferWaiters);
+    return flags;
+}
+
+// Sets up the buffers, all empty
+void bufferCacheInit(void)
+{
+    uint8_t* data = pageAlloc(BUFFER_CACHE_ORDER);
+    if (!data)
+    {
+        logPuts("Buffer cache: out of memory\n");
+        return;                                // Every bufferGet fails
+    }
+
+    for (unsigned i = 0; i < BUFFER_COUNT; i++)
+    {
+        g_Buffers[i].Data = data + i * BLOCK_SECTOR_SIZE;
+        g_Buffers[i].State = BUFFER_EMPTY;
+        lruPushTail(&g_Buffers[i]);
+    }
+}
+
+// Gets a sector of a device, reading it unless it is cached
+// Sleeps while the sector is being read by another thread or
+// while every buffer is in use
+// Parameters:
+//   device - Device of the sector
+//   lba - Sector number
+// Returns: Buffer holding the sector, to be passed to bufferRelease,
+//          NULL on an I/O error
+Buffer* bufferGet(BlockDevice* device, uint32_t lba)
+{
+    if (lba >= device->SectorCount || !g_Buffers[0].Data)
+        return NULL;
+
+    uint32_t flags = cacheLock();
+    Buffer* buffer;
+    for (;;)
+    {
+        buffer = hashLookup(device, lba);
+        if (buffer)
+        {
+            if (buffer->References++ == 0)
+                lruRemove(buffer);
+            if (buffer->ReadAhead)
+            {
+                buffer->ReadAhead = false;
+                g_ReadAheadHits++;
+            }
+            g_Hits++;
+            break;
+        }
+
+        buffer = claimBuffer(device, lba);
+        if (buffer)
+        {
+            g_Misses++;
+            trace(TRACE_BUFFER_MISS, lba);
+            cacheUnlock(flags);
+
+            bool ok = blockRead(device, lba, 1, buffer->Data);
+
+            flags = cacheLock();
+            finishLoad(buffer, ok);
+            break;
+        }
+
+        flags = waitForBuffers(flags);         // Every buffer is referenced
+    }
+
+    // Wait for the read of the sector by another thread or by read-ahead
+    while (buffer->State == BUFFER_LOADING)
+        flags = waitForBuffers(flags);
+
+    if (buffer->State != BUFFER_VALID)
+    {
+        releaseLocked(buffer);                 // The read failed
+        buffer = NULL;
+    }
+    cacheUnlock(flags);
+    return buffer;
+}
+
+// Releases a buffer returned by bufferGet
+void bufferRelease(Buffer* buffer)
+{
+    uint32_t flags = cacheLock();
+    releaseLocked(buffer);
+    cacheUnlock(flags);
+}
+
+// Completes the read-ahead request of a buffer (worker thread of the device)
+static void readAheadDone(BlockRequest* request)
+{
+    Buffer* buffer = request->Context;
+    bool ok = request->Status == BLOCK_DONE;
+
+    uint32_t flags = cacheLock();
+    finishLoad(buffer, ok);
+    buffer->ReadAhead = ok;
+    releaseLocked(buffer);
+    cacheUnlock(flags);
+}
+
+// Starts reading sectors that will be needed soon into the cache, without
+// waiting for them. Sectors already cached at the start are skipped, the
+// run of missing sectors after them is queued as one request per buffer,
+// which the block layer merges into one transfer. Nothing is read if no
+// buffer is free; read errors are left for bufferGet to report
+// Parameters:
+//   device - Device of the sectors
+//   lba - First sector
+//   count - Number of sectors, at most BUFFER_READ_AHEAD_MAX are read
+void bufferReadAhead(BlockDevice* device, uint32_t lba, uint32_t count)
+{
+    if (lba >= device->SectorCount)
+        return;
+    if (count > device->SectorCount - lba)
+        count = device->SectorCount - lba;
+    if (count > BUFFER_READ_AHEAD_MAX)
+        count = BUFFER_READ_AHEAD_MAX;
+
+    Buffer* run[BUFFER_READ_AHEAD_MAX];
+    uint32_t claimed = 0;
+
+    uint32_t flags = cacheLock();
+    while (count && hashLookup(device, lba))
+    {
+        lba++;
+        count--;
+    }
+    while (claimed < count && !hashLookup(device, lba + claimed))
+    {
+        Buffer* buffer = claimBuffer(device, lba + claimed);
+        if (!buffer)
+            break;
+        run[claimed++] = buffer;
+    }
+    g_ReadAheadSectors += claimed;
+    cacheUnlock(flags);
+
+    for (uint32_t i = 0; i < claimed; i++)
+    {
+        Buffer* buffer = run[i];
+        buffer->Request = (BlockRequest) {
+            .Lba = buffer->Lba, .Count = 1, .Buffer = buffer->Data,
+            .Completion = readAheadDone, .Context = buffer,
+        };
+        blockSubmit(device, &buffer->Request);
+    }
+}
+
+// Logs the use of the cache
+void bufferCacheDump(void)
+{
+    unsigned valid = 0;
+    uint32_t flags = cacheLock();
+    for (unsigned i = 0; i < BUFFER_COUNT; i++)
+    {
+        if (g_Buffers[i].State == BUFFER_VALID)
+            valid++;
+    }
+    cacheUnlock(flags);
+
+    logPrintf("Buffer cache: %u of %u buffers hold sectors, %u hits, %u misses, "
+              "%u sectors read ahead (%u used)\n",
+              valid, BUFFER_COUNT, g_Hits, g_Misses, g_ReadAheadSectors, g_ReadAheadHits);
+}
@@ -0,0 +1,55 @@
+// =============================================================================
+// BUFFER CACHE
+// =============================================================================
+//
+// Cache of disk sectors in RAM, shared by all block devices: repeated reads
+// of the FAT and of directories are served from memory. Unreferenced buffers
+// are recycled in least recently used order. bufferReadAhead queues the
+// sectors a reader will need next and returns without waiting; the block
+// layer merges them into one transfer, so a sequential reader costs one
+// transfer per window instead of one per sector, overlapped with its work.
+// Waiting for a sector blocks the calling thread, so the cache must not be
+// used by idle threads
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "block.h"
+#include "page_alloc.h"
+#include "scheduler.h"
+
+#define BUFFER_CACHE_ORDER      4               // Sector data: 2^4 pages = 64KB
+#define BUFFER_COUNT            ((PAGE_SIZE << BUFFER_CACHE_ORDER) / BLOCK_SECTOR_SIZE)
+#define BUFFER_READ_AHEAD_MAX   16              // Sectors per bufferReadAhead at most
+
+typedef enum
+{
+    BUFFER_EMPTY,                              // Holds no sector, not in the hash table
+    BUFFER_LOADING,                            // Being read, other users wait
+    BUFFER_VALID,
+
+} BufferState;
+
+typedef struct Buffer
+{
+    BlockDevice* Device;
+    uint32_t Lba;
+    uint8_t* Data;                             // BLOCK_SECTOR_SIZE bytes
+    volatile BufferState State;
+    uint32_t References;                       // Users between bufferGet and bufferRelease
+    bool ReadAhead;                            // Read ahead and not used since
+    BlockRequest Request;                      // Read-ahead request of the buffer
+
+    struct Buffer* HashNext;                   // Hash bucket of (Device, Lba)
+    struct Buffer* LruNext;                    // LRU list, only while unreferenced
+    struct Buffer* LruPrevious;
+
+} Buffer;
+
+void bufferCacheInit(void);
+Buffer* bufferGet(BlockDevice* device, uint32_t lba);
+void bufferRelease(Buffer* buffer);
+void bufferReadAhead(BlockDevice* device, uint32_t lba, uint32_t count);
+void bufferCacheDump(void);
@@ -0,0 +1,105 @@
+// =============================================================================
+// VGA TEXT CONSOLE
+// =============================================================================
+//
+// Protected mode port of src/common/console.inc: characters are written
+// straight into the VGA text buffer at 0xB8000 (80x25, 2 bytes per cell),
+// addressed through the direct map like the BIOS data area
+//
+// - Scrolling moves rows 1-24 up with one block move and clears the last row
+// - The hardware cursor (CRTC registers 0Eh/0Fh) and the cursor position in
+//   the BIOS data area are updated once per write, not per character
+//
+// consoleInit picks the position up from the BIOS data area, where stage2
+// left it, so output continues below the boot messages
+
+#include "console.h"
+
+#include <stdint.h>
+
+#include "io.h"
+#include "paging.h"
+#include "string.h"
+
+#define CONSOLE_BUFFER          ((volatile uint16_t*) physicalToVirtual(0xB8000))
+#define CONSOLE_COLUMNS         80
+#define CONSOLE_ROWS            25
+#define CONSOLE_CELLS           (CONSOLE_COLUMNS * CONSOLE_ROWS)
+#define CONSOLE_ATTRIBUTE       0x07            // Light grey on black
+
+#define CRTC_INDEX_PORT         0x3D4
+#define CRTC_CURSOR_HIGH        0x0E
+#define CRTC_CURSOR_LOW         0x0F
+
+#define BDA_CURSOR_PAGE0        ((volatile uint8_t*) physicalToVirtual(0x450)) // Column and row of page 0
+
+static unsigned g_ConsolePosition;             // Cell index of the cursor
+
+// Moves rows 1-24 up to rows 0-23 and clears row 24
+static void consoleScroll(void)
+{
+    uint16_t* buffer = (uint16_t*) CONSOLE_BUFFER;
+    memmove(buffer, buffer + CONSOLE_COLUMNS,
+            (CONSOLE_CELLS - CONSOLE_COLUMNS) * sizeof(uint16_t));
+
+    for (unsigned i = CONSOLE_CELLS - CONSOLE_COLUMNS; i < CONSOLE_CELLS; i++)
+        CONSOLE_BUFFER[i] = (CONSOLE_ATTRIBUTE << 8) | ' ';
+}
+
+// Moves the hardware cursor to g_ConsolePosition and stores the position in
+// the BIOS data area
+static void consoleUpdateCursor(void)
+{
+    // Index in the low byte, data in the high byte (port 3D5h)
+    outw(CRTC_INDEX_PORT, CRTC_CURSOR_LOW | (g_ConsolePosition & 0xFF) << 8);
+    outw(CRTC_INDEX_PORT, CRTC_CURSOR_HIGH | (g_ConsolePosition & 0xFF00));
+
+    BDA_CURSOR_PAGE0[0] = g_ConsolePosition % CONSOLE_COLUMNS;
+    BDA_CURSOR_PAGE0[1] = g_ConsolePosition / CONSOLE_COLUMNS;
+}
+
+// Takes over the cursor position left in the BIOS data area
+void consoleInit(void)
+{
+    g_ConsolePosition = BDA_CURSOR_PAGE0[1] * CONSOLE_COLUMNS + BDA_CURSOR_PAGE0[0];
+    if (g_ConsolePosition >= CONSOLE_CELLS)
+        g_ConsolePosition = CONSOLE_CELLS - CONSOLE_COLUMNS;
+}
+
+// Prints size characters at the cursor position
+// Handles CR and LF (LF also returns to the start of the row), wraps at the
+// end of a row and scrolls at the end of the screen
+void consoleWrite(const char* buffer, size_t size)
+{
+    unsigned position = g_ConsolePosition;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        char c = buffer[i];
+        if (c == '\r')
+        {
+            position -= position % CONSOLE_COLUMNS;
+            continue;
+        }
+
+        if (c == '\n')
+            position += CONSOLE_COLUMNS - position % CONSOLE_COLUMNS;
+        else
+            CONSOLE_BUFFER[position++] = (CONSOLE_ATTRIBUTE << 8) | (uint8_t) c;
+
+        if (position >= CONSOLE_CELLS)
+        {
+            consoleScroll();
+            position -= CONSOLE_COLUMNS;
+        }
+    }
+
+    g_ConsolePosition = position;
+    consoleUpdateCursor();
+}
+
+// Prints a null-terminated string at the cursor position
+void consolePuts(const char* string)
+{
+    consoleWrite(string, strlen(string));
+}
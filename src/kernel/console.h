@@ -0,0 +1,11 @@
+// =============================================================================
+// VGA TEXT CONSOLE
+// =============================================================================
+
+#pragma once
+
+#include <stddef.h>
+
+void consoleInit(void);
+void consoleWrite(const char* buffer, size_t size);
+void consolePuts(const char* string);
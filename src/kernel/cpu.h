@@ -0,0 +1,206 @@
+// =============================================================================
+// PROCESSOR CONTROL
+// =============================================================================
+//
+// Inline wrappers for CPUID, the control registers, the time stamp counter,
+// model specific registers, the interrupt flag and the TLB, and the 64-bit
+// division the kernel needs
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CR0_WRITE_PROTECT       0x00010000      // Read-only pages also apply to ring 0
+#define CR0_PAGING              0x80000000
+
+#define CR4_PSE                 0x00000010      // 4MB pages
+#define CR4_PGE                 0x00000080      // Global pages
+
+// Feature bits of CPUID leaf 1 (EDX)
+#define CPUID_FEATURE_PSE       0x00000008
+#define CPUID_FEATURE_TSC       0x00000010
+#define CPUID_FEATURE_MSR       0x00000020
+#define CPUID_FEATURE_APIC      0x00000200
+#define CPUID_FEATURE_PGE       0x00002000
+
+// Feature bits of CPUID leaf 1 (ECX)
+#define CPUID_FEATURE_TSC_DEADLINE 0x01000000
+
+#define CACHE_LINE_SIZE         64              // Unit of coherence between CPUs (P6 and later)
+
+#define EFLAGS_INTERRUPT        0x00000200      // IF
+#define EFLAGS_ID               0x00200000      // Toggleable where CPUID exists
+
+// Feature flags of CPUID leaf 1
+typedef struct
+{
+    uint32_t Edx;                              // CPUID_FEATURE_PSE ...
+    uint32_t Ecx;                              // CPUID_FEATURE_TSC_DEADLINE ...
+
+} CpuFeatures;
+
+// Returns true if the processor has the CPUID instruction
+static inline bool cpuidAvailable(void)
+{
+    uint32_t before, after;
+    __asm__ volatile ("pushfl\n\t"
+                      "pushfl\n\t"
+                      "popl %0\n\t"
+                      "movl %0, %1\n\t"
+                      "xorl %2, %1\n\t"
+                      "pushl %1\n\t"
+                      "popfl\n\t"
+                      "pushfl\n\t"
+                      "popl %1\n\t"
+                      "popfl"
+                      : "=&r"(before), "=&r"(after) : "i"(EFLAGS_ID));
+    return (before ^ after) & EFLAGS_ID;
+}
+
+// Executes CPUID for a leaf
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx)
+{
+    __asm__ volatile ("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+// Returns the processor features of CPUID leaf 1, none without CPUID
+static inline CpuFeatures cpuFeatures(void)
+{
+    CpuFeatures features = { 0, 0 };
+    if (!cpuidAvailable())
+        return features;
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 1)
+    {
+        cpuid(1, &eax, &ebx, &features.Ecx, &features.Edx);
+    }
+    return features;
+}
+
+// Reads the time stamp counter
+static inline uint64_t readTimestamp(void)
+{
+    uint64_t value;
+    __asm__ volatile ("rdtsc" : "=A"(value));
+    return value;
+}
+
+// Divides a 64-bit value in place and returns the remainder
+// Two 32-bit divisions, since there is no libgcc for the 64-bit division
+static inline uint32_t divide64(uint64_t* value, uint32_t divisor)
+{
+    uint32_t high = (uint32_t) (*value >> 32);
+    uint32_t low = (uint32_t) *value;
+    uint32_t quotientHigh = high / divisor;
+    uint32_t remainder;
+
+    // (high % divisor):low / divisor always fits in 32 bits
+    __asm__ ("divl %4"
+             : "=a"(low), "=d"(remainder)
+             : "a"(low), "d"(high % divisor), "rm"(divisor));
+
+    *value = (uint64_t) quotientHigh << 32 | low;
+    return remainder;
+}
+
+// Model specific registers
+static inline uint64_t readMsr(uint32_t msr)
+{
+    uint64_t value;
+    __asm__ volatile ("rdmsr" : "=A"(value) : "c"(msr));
+    return value;
+}
+
+static inline void writeMsr(uint32_t msr, uint64_t value)
+{
+    __asm__ volatile ("wrmsr" : : "c"(msr), "A"(value) : "memory");
+}
+
+// Disables interrupts
+// Returns the previous EFLAGS for interruptsRestore
+static inline uint32_t interruptsSave(void)
+{
+    uint32_t flags;
+    __asm__ volatile ("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Enables interrupts again if they were enabled before interruptsSave
+static inline void interruptsRestore(uint32_t flags)
+{
+    if (flags & EFLAGS_INTERRUPT)
+        __asm__ volatile ("sti" : : : "memory");
+}
+
+static inline void interruptsEnable(void)
+{
+    __asm__ volatile ("sti" : : : "memory");
+}
+
+// Control registers
+static inline uint32_t readCr0(void)
+{
+    uint32_t value;
+    __asm__ volatile ("movl %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void writeCr0(uint32_t value)
+{
+    __asm__ volatile ("movl %0, %%cr0" : : "r"(value) : "memory");
+}
+
+static inline uint32_t readCr2(void)
+{
+    uint32_t value;
+    __asm__ volatile ("movl %%cr2, %0" : "=r"(value));
+    return value;
+}
+
+static inline uint32_t readCr3(void)
+{
+    uint32_t value;
+    __asm__ volatile ("movl %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+// Loading CR3 also flushes every non-global TLB entry
+static inline void writeCr3(uint32_t value)
+{
+    __asm__ volatile ("movl %0, %%cr3" : : "r"(value) : "memory");
+}
+
+static inline uint32_t readCr4(void)
+{
+    uint32_t value;
+    __asm__ volatile ("movl %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void writeCr4(uint32_t value)
+{
+    __asm__ volatile ("movl %0, %%cr4" : : "r"(value) : "memory");
+}
+
+// Drops the TLB entry of the page containing an address
+static inline void invalidatePage(const void* address)
+{
+    __asm__ volatile ("invlpg (%0)" : : "r"(address) : "memory");
+}
+
+// Waits for the next interrupt with interrupts enabled. STI takes effect after
+// the next instruction, so no interrupt can slip in between and be missed
+static inline void cpuIdle(void)
+{
+    __asm__ volatile ("sti; hlt" : : : "memory");
+}
+
+// Stops the processor for good (interrupts disabled)
+static inline void __attribute__((noreturn)) cpuHalt(void)
+{
+    for (;;)
+        __asm__ volatile ("cli; hlt");
+}
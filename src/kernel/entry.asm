@@ -0,0 +1,102 @@
+; =============================================================================
+; NBOS KERNEL ENTRY POINT
+; =============================================================================
+;
+; First code of the kernel, placed at the load address (1MB) by linker.ld
+; Entered by stage2 in 32-bit protected mode with flat 4GB segments,
+; interrupts disabled, paging disabled and EBX pointing to the boot
+; information (BootInfo)
+;
+; The kernel is linked in the higher half (KERNEL_VIRTUAL_BASE + physical
+; address, see paging.h), but this section runs at its physical address.
+; It clears the BSS, maps the first 4MB of physical memory twice through
+; one page table, at 0 (identity, so the next instruction after enabling
+; paging still runs) and at KERNEL_VIRTUAL_BASE, enables paging and jumps to
+; the higher half. pagingInit replaces these boot mappings later
+;
+; Then it switches to the kernel stack and calls kernelMain
+
+bits 32
+
+KERNEL_VIRTUAL_BASE     equ 0C0000000h          ; See paging.h and linker.ld
+KERNEL_STACK_SIZE       equ 16384               ; Boot stack of the kernel
+
+PAGE_PRESENT            equ 001h
+PAGE_WRITABLE           equ 002h
+CR0_PAGING              equ 80000000h
+
+extern kernelMain
+extern __bss_start
+extern __bss_end
+
+global start
+global boot_page_directory
+global boot_page_table
+
+section .entry
+
+start:
+    cld                         ; C code expects the direction flag clear
+
+    ; Clear the BSS (the stack lives there too, so nothing is pushed yet)
+    mov edi, __bss_start - KERNEL_VIRTUAL_BASE
+    mov ecx, __bss_end
+    sub ecx, __bss_start        ; ECX = BSS size in bytes
+    xor eax, eax
+    rep stosb
+
+    ; Boot page table: the first 4MB of physical memory in 4KB pages
+    mov edi, boot_page_table - KERNEL_VIRTUAL_BASE
+    mov eax, PAGE_PRESENT | PAGE_WRITABLE
+    mov ecx, 1024
+.fill_table:
+    stosd
+    add eax, 1000h              ; Next physical page
+    loop .fill_table
+
+    ; Same table at 0 (identity) and at KERNEL_VIRTUAL_BASE
+    mov eax, (boot_page_table - KERNEL_VIRTUAL_BASE) + (PAGE_PRESENT | PAGE_WRITABLE)
+    mov [boot_page_directory - KERNEL_VIRTUAL_BASE], eax
+    mov [boot_page_directory - KERNEL_VIRTUAL_BASE + (KERNEL_VIRTUAL_BASE >> 22) * 4], eax
+
+    mov eax, boot_page_directory - KERNEL_VIRTUAL_BASE
+    mov cr3, eax
+    mov eax, cr0
+    or eax, CR0_PAGING
+    mov cr0, eax                ; Enable paging (still running through the identity map)
+
+    mov eax, higher_half
+    jmp eax                     ; Continue at the linked address
+
+section .text
+
+higher_half:
+    mov esp, kernel_stack_top   ; Kernel stack
+
+    add ebx, KERNEL_VIRTUAL_BASE ; Boot information through the higher half mapping
+    push ebx                    ; kernelMain(BootInfo* bootInfo)
+    call kernelMain
+
+.halt:
+    cli                         ; kernelMain does not return, halt if it does
+    hlt
+    jmp .halt
+
+section .bss
+
+align 16
+kernel_stack:
+    resb KERNEL_STACK_SIZE
+kernel_stack_top:
+
+; Page directory of the kernel and the page table of the first 4MB, used by
+; paging.c after the switch
+section .page_tables nobits alloc noexec write align=4096
+
+boot_page_directory:
+    resb 4096
+boot_page_table:
+    resb 4096
+
+; No executable stack needed (keeps the linker from warning about it)
+section .note.GNU-stack noalloc noexec nowrite progbits
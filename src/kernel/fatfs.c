@@ -0,0 +1,300 @@
+// =============================================================================
+// FAT FILESYSTEM
+// =============================================================================
+//
+// Nothing of a volume is kept in memory but its layout: FAT entries,
+// directories and file data are read through the buffer cache whenever they
+// are needed, so a FAT sector or directory that is used again costs a hash
+// lookup instead of a disk access. Chains are walked with the cluster
+// iterator of the FAT library, whose next-cluster lookup reads the entry of
+// the active FAT from the cache.
+//
+// Reading a file queues up to BUFFER_READ_AHEAD_MAX sectors ahead, which the
+// block layer merges into one transfer. The window follows the cluster
+// chain: when it reaches the end of an extent, it continues with the next
+// extent (found with a copy of the file's iterator), and it never goes past
+// the end of the file
+
+#include "fatfs.h"
+
+#include "buffer_cache.h"
+#include "log.h"
+#include "profile.h"
+#include "string.h"
+
+static inline uint32_t minimum(uint32_t a, uint32_t b)
+{
+    return a < b ? a : b;
+}
+
+// Reads bytes of the volume through the cache, across sector boundaries
+// Parameters:
+//   volume - Mounted volume
+//   lba - Sector the offset is relative to
+//   offset - Byte offset from the start of that sector
+//   bufferOut - Receives the bytes
+//   size - Number of bytes
+// Returns: true if successful, false on an I/O error
+static bool readBytes(FatVolume* volume, uint32_t lba, uint32_t offset, void* bufferOut, uint32_t size)
+{
+    uint8_t* output = bufferOut;
+    while (size > 0)
+    {
+        Buffer* sector = bufferGet(volume->Device, lba + offset / BLOCK_SECTOR_SIZE);
+        if (!sector)
+            return false;
+
+        uint32_t at = offset % BLOCK_SECTOR_SIZE;
+        uint32_t chunk = minimum(BLOCK_SECTOR_SIZE - at, size);
+        memcpy(output, sector->Data + at, chunk);
+        bufferRelease(sector);
+
+        output += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+// Looks up the next cluster in the active FAT (FatNextCluster of the library)
+static uint32_t nextCluster(void* context, uint32_t cluster)
+{
+    FatVolume* volume = context;
+    const FatLayout* layout = &volume->Layout;
+
+    uint8_t entry[4];
+    if (!readBytes(volume, layout->FatStart, fatEntryOffset(layout->FatType, cluster),
+                   entry, fatEntrySize(layout->FatType)))
+        return 0;                              // Ends the walk like a damaged chain
+
+    return fatNormalizeEntry(fatDecodeEntry(layout->FatType, entry, cluster), layout->ClusterCount);
+}
+
+// Mounts the FAT volume of a block device
+// Parameters:
+//   volume - Volume to set up
+//   device - Device holding the volume from sector 0
+// Returns: true if the device holds a valid FAT volume, false otherwise
+bool fatMount(FatVolume* volume, BlockDevice* device)
+{
+    Buffer* sector = bufferGet(device, 0);
+    if (!sector)
+        return false;
+
+    BootSector boot;
+    memcpy(&boot, sector->Data, sizeof(boot));
+    bufferRelease(sector);
+
+    volume->Device = device;
+    if (!fatReadLayout(&boot, &volume->Layout) || volume->Layout.BytesPerSector != BLOCK_SECTOR_SIZE)
+        return false;
+
+    // Every lookup starts with the FAT, start reading its first sectors
+    bufferReadAhead(device, volume->Layout.FatStart, volume->Layout.SectorsPerFat);
+    return true;
+}
+
+// Searches consecutive directory sectors for a name
+// Parameters:
+//   volume - Mounted volume
+//   lba - First sector
+//   count - Number of sectors
+//   name - 11-character filename in 8.3 format (without dot)
+//   entryOut - Receives the directory entry
+//   endOut - Set to true at the end of the directory or on an I/O error
+// Returns: true if the name was found, false otherwise
+static bool searchSectors(FatVolume* volume, uint32_t lba, uint32_t count, const char* name,
+                          DirectoryEntry* entryOut, bool* endOut)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (i % BUFFER_READ_AHEAD_MAX == 0)
+            bufferReadAhead(volume->Device, lba + i, count - i);
+
+        Buffer* sector = bufferGet(volume->Device, lba + i);
+        if (!sector)
+        {
+            *endOut = true;
+            return false;
+        }
+
+        const DirectoryEntry* entry = fatFindEntry((const DirectoryEntry*) sector->Data,
+                                                   BLOCK_SECTOR_SIZE / sizeof(DirectoryEntry), name, endOut);
+        if (entry)
+            *entryOut = *entry;
+        bufferRelease(sector);
+
+        if (entry)
+            return true;
+        if (*endOut)
+            return false;
+    }
+    return false;
+}
+
+// Looks up a name in a directory
+// Parameters:
+//   volume - Mounted volume
+//   directoryCluster - First cluster of the directory, 0 for the root directory
+//   name - 11-character filename in 8.3 format (without dot)
+//   entryOut - Receives the directory entry
+// Returns: true if the name was found, false otherwise
+static bool findEntry(FatVolume* volume, uint32_t directoryCluster, const char* name, DirectoryEntry* entryOut)
+{
+    const FatLayout* layout = &volume->Layout;
+    bool end = false;
+
+    // FAT12/16 have a fixed root directory before the data area
+    if (directoryCluster == 0 && layout->FatType != 32)
+        return searchSectors(volume, layout->RootDirectoryStart, layout->DataStart - layout->RootDirectoryStart,
+                             name, entryOut, &end);
+
+    if (directoryCluster == 0)
+        directoryCluster = layout->RootCluster;
+
+    ClusterIterator chain;
+    Extent extent;
+    fatBeginChain(&chain, layout, directoryCluster);
+    while (!end && fatNextExtent(&chain, layout, nextCluster, volume, &extent))
+    {
+        if (searchSectors(volume, fatClusterToLba(layout, extent.FirstCluster),
+                          extent.ClusterCount * layout->SectorsPerCluster, name, entryOut, &end))
+            return true;
+    }
+    return false;
+}
+
+// Opens a file by path ("/BOOT/KERNEL.BIN", every component in 8.3 form)
+// Parameters:
+//   volume - Mounted volume
+//   path - Path of the file from the root directory
+//   fileOut - Receives the open file, positioned at its start
+// Returns: true if the path names a file, false otherwise
+bool fatOpen(FatVolume* volume, const char* path, FatFile* fileOut)
+{
+    const FatLayout* layout = &volume->Layout;
+    uint32_t directory = 0;
+    DirectoryEntry entry;
+    bool found = false;
+
+    const char* component = path;
+    for (;;)
+    {
+        while (*component == '/')
+            component++;
+        if (!*component)
+            break;
+
+        size_t length = 0;
+        while (component[length] && component[length] != '/')
+            length++;
+
+        // Every component but the last one must be a directory
+        if (found)
+        {
+            if (!(entry.Attributes & ATTRIBUTE_DIRECTORY))
+                return false;
+            directory = fatFirstCluster(layout, &entry);
+        }
+
+        char name[11];
+        if (!fatToName(component, length, name))
+            return false;
+        traceBegin(TRACE_FAT_LOOKUP, directory);
+        bool inDirectory = findEntry(volume, directory, name, &entry);
+        traceEnd(TRACE_FAT_LOOKUP, inDirectory);
+        if (!inDirectory)
+            return false;
+
+        found = true;
+        component += length;
+    }
+
+    if (!found || !fatIsFileEntry(&entry))
+        return false;
+
+    *fileOut = (FatFile) { .Volume = volume, .Size = entry.Size };
+    fatBeginChain(&fileOut->Chain, layout, fatFirstCluster(layout, &entry));
+    return true;
+}
+
+// Reads ahead from the current sector of a file, along its cluster chain
+// Parameters:
+//   file - Open file, positioned at the start of a sector
+//   lba - Current sector
+//   extentSectors - Sectors of the current extent
+static void readAhead(FatFile* file, uint32_t lba, uint32_t extentSectors)
+{
+    FatVolume* volume = file->Volume;
+    const FatLayout* layout = &volume->Layout;
+
+    uint32_t fileSectors = (file->Size - file->Position + BLOCK_SECTOR_SIZE - 1) / BLOCK_SECTOR_SIZE;
+    uint32_t window = minimum(fileSectors, BUFFER_READ_AHEAD_MAX);
+    uint32_t inExtent = extentSectors - file->ExtentSector;
+    bufferReadAhead(volume->Device, lba, minimum(window, inExtent));
+    if (window <= inExtent)
+        return;
+
+    // The window goes past the extent: continue with the next one
+    ClusterIterator chain = file->Chain;
+    Extent next;
+    if (fatNextExtent(&chain, layout, nextCluster, volume, &next))
+        bufferReadAhead(volume->Device, fatClusterToLba(layout, next.FirstCluster),
+                        minimum(window - inExtent, next.ClusterCount * layout->SectorsPerCluster));
+}
+
+// Reads the next bytes of a file
+// Parameters:
+//   file - Open file
+//   buffer - Receives the bytes
+//   size - Number of bytes wanted
+// Returns: Number of bytes read, less than size at the end of the file or
+//          if the cluster chain is damaged or a sector cannot be read
+uint32_t fatRead(FatFile* file, void* buffer, uint32_t size)
+{
+    FatVolume* volume = file->Volume;
+    const FatLayout* layout = &volume->Layout;
+    uint8_t* output = buffer;
+
+    size = minimum(size, file->Size - file->Position);
+    uint32_t done = 0;
+    while (done < size)
+    {
+        uint32_t extentSectors = file->Extent.ClusterCount * layout->SectorsPerCluster;
+        if (file->ExtentSector == extentSectors)
+        {
+            if (!fatNextExtent(&file->Chain, layout, nextCluster, volume, &file->Extent))
+                break;                         // Chain shorter than the file, or damaged
+            file->ExtentSector = 0;
+            extentSectors = file->Extent.ClusterCount * layout->SectorsPerCluster;
+        }
+
+        uint32_t lba = fatClusterToLba(layout, file->Extent.FirstCluster) + file->ExtentSector;
+        uint32_t offset = file->Position % BLOCK_SECTOR_SIZE;
+        if (offset == 0 && file->ExtentSector % BUFFER_READ_AHEAD_MAX == 0)
+            readAhead(file, lba, extentSectors);
+
+        Buffer* sector = bufferGet(volume->Device, lba);
+        if (!sector)
+            break;
+
+        uint32_t chunk = minimum(BLOCK_SECTOR_SIZE - offset, size - done);
+        memcpy(output + done, sector->Data + offset, chunk);
+        bufferRelease(sector);
+
+        done += chunk;
+        file->Position += chunk;
+        if (file->Position % BLOCK_SECTOR_SIZE == 0)
+            file->ExtentSector++;
+    }
+    return done;
+}
+
+// Logs the layout of a mounted volume
+void fatDump(const FatVolume* volume)
+{
+    const FatLayout* layout = &volume->Layout;
+    logPrintf("FAT%u volume on %s: %u clusters of %u bytes, FAT at sector %u, data at sector %u\n",
+              layout->FatType, volume->Device->Name, layout->ClusterCount - 2,
+              layout->SectorsPerCluster * layout->BytesPerSector, layout->FatStart, layout->DataStart);
+}
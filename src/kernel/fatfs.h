@@ -0,0 +1,40 @@
+// =============================================================================
+// FAT FILESYSTEM
+// =============================================================================
+//
+// Read-only FAT12/16/32 driver on top of the buffer cache, built on the FAT
+// library shared with the fat tool (src/common/fat.h). Every sector, of the
+// FAT as well as of directories and files, is read through the cache, and
+// files are read ahead along their cluster chain
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "block.h"
+#include "fat.h"
+
+typedef struct
+{
+    BlockDevice* Device;
+    FatLayout Layout;
+
+} FatVolume;
+
+// Open file, read sequentially
+typedef struct
+{
+    FatVolume* Volume;
+    uint32_t Size;                             // File size in bytes
+    uint32_t Position;                         // Next byte to read
+    ClusterIterator Chain;                     // Positioned after Extent
+    Extent Extent;                             // Extent holding Position
+    uint32_t ExtentSector;                     // Sector of Position in Extent
+
+} FatFile;
+
+bool fatMount(FatVolume* volume, BlockDevice* device);
+bool fatOpen(FatVolume* volume, const char* path, FatFile* fileOut);
+uint32_t fatRead(FatFile* file, void* buffer, uint32_t size);
+void fatDump(const FatVolume* volume);
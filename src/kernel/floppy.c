@@ -0,0 +1,340 @@
+// =============================================================================
+// FLOPPY DISK CONTROLLER
+// =============================================================================
+//
+// Only the worker thread of fd0 talks to the controller, so there is no
+// controller lock. Every command that ends with an interrupt is followed by
+// threadBlock until IRQ 6 has set g_FloppyInterrupt; the loop also absorbs
+// the wakes of blockSubmit, which share the worker's threadBlock.
+//
+// The controller is reset and the motor started with the first transfer
+// (the worker may sleep, the boot thread calling floppyInit may not). The
+// motor is left on. A failed read is retried FLOPPY_RETRIES times after a
+// recalibration, like the BIOS read loop of stage1. There is no timeout for
+// a missing interrupt yet: a controller that never answers stalls fd0 only
+
+#include "floppy.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "block.h"
+#include "io.h"
+#include "irq.h"
+#include "log.h"
+#include "paging.h"
+#include "scheduler.h"
+#include "string.h"
+#include "timer.h"
+
+#define FLOPPY_DOR              0x3F2           // Digital output register
+#define FLOPPY_MSR              0x3F4           // Main status register
+#define FLOPPY_FIFO             0x3F5           // Command, parameter and result bytes
+#define FLOPPY_CCR              0x3F7           // Configuration control register (data rate)
+#define FLOPPY_IRQ              6
+
+#define FLOPPY_DOR_ENABLE       0x04            // Controller out of reset
+#define FLOPPY_DOR_DMA          0x08            // IRQ and DMA requests enabled
+#define FLOPPY_DOR_MOTOR0       0x10            // Motor of drive 0
+#define FLOPPY_MSR_DIO          0x40            // FIFO direction: controller to CPU
+#define FLOPPY_MSR_RQM          0x80            // FIFO ready for the next byte
+
+#define FLOPPY_SPECIFY          0x03            // Step rate, head load and unload times
+#define FLOPPY_RECALIBRATE      0x07
+#define FLOPPY_SENSE_INTERRUPT  0x08
+#define FLOPPY_SEEK             0x0F
+#define FLOPPY_READ_DATA        0xE6            // Multi-track, MFM, skip deleted sectors
+
+#define FLOPPY_SPECIFY_STEP     0xDF            // 3ms step rate, 240ms head unload
+#define FLOPPY_SPECIFY_LOAD     0x02            // 4ms head load, DMA mode
+#define FLOPPY_ST0_ABNORMAL     0xC0            // Interrupt code other than normal termination
+#define FLOPPY_SECTOR_SIZE_CODE 2               // 128 << 2 = 512 bytes
+#define FLOPPY_HEADS            2
+#define FLOPPY_RETRIES          3
+#define FLOPPY_MOTOR_SPIN_MS    300             // Spin-up time before the first transfer
+#define FLOPPY_FIFO_POLLS       100000          // MSR reads per FIFO byte at most
+
+// Channel 2 of the first ISA DMA controller
+#define DMA_ADDRESS2            0x04
+#define DMA_COUNT2              0x05
+#define DMA_MASK                0x0A            // Single channel mask
+#define DMA_MODE                0x0B
+#define DMA_FLIP_FLOP           0x0C            // Any write clears the byte flip-flop
+#define DMA_PAGE2               0x81            // Bits 16-23 of the address
+#define DMA_MASK_SET            0x04
+#define DMA_CHANNEL2            0x02
+#define DMA_MODE_WRITE2         0x46            // Single mode, increment, device to memory, channel 2
+
+#define CMOS_ADDRESS            0x70
+#define CMOS_DATA               0x71
+#define CMOS_FLOPPY_TYPES       0x10            // Type of drive 0 in the high nibble
+
+// One cylinder of a 1.44MB disk. ISA DMA reaches the first 16MB and cannot
+// cross a 64KB boundary: the kernel image is below 4MB and the alignment
+// keeps the buffer inside one 64KB block
+#define FLOPPY_DMA_SECTORS      36
+#define FLOPPY_DMA_ALIGNMENT    0x8000
+
+typedef struct
+{
+    const char* Name;
+    uint8_t Cylinders;
+    uint8_t SectorsPerTrack;
+    uint8_t DataRate;                          // CCR value
+    uint8_t Gap;                               // GAP3 length for READ DATA
+
+} FloppyGeometry;
+
+// Formats by CMOS drive type, the disk is taken to have the largest format of the drive
+static const FloppyGeometry g_FloppyGeometries[] =
+{
+    [1] = { "360KB 5.25\"",  40,  9, 2, 0x2A },
+    [2] = { "1.2MB 5.25\"",  80, 15, 0, 0x1B },
+    [3] = { "720KB 3.5\"",   80,  9, 2, 0x1B },
+    [4] = { "1.44MB 3.5\"",  80, 18, 0, 0x1B },
+    [5] = { "2.88MB 3.5\"",  80, 36, 3, 0x1B },
+};
+
+static BlockDevice g_Floppy;
+static const FloppyGeometry* g_FloppyGeometry;
+static bool g_FloppyReady;                     // Reset, specified and motor spinning
+static int g_FloppyCylinder = -1;              // Cylinder under the heads, -1 if unknown
+static volatile bool g_FloppyInterrupt;        // Set by IRQ 6
+static uint8_t g_FloppyDma[FLOPPY_DMA_SECTORS * BLOCK_SECTOR_SIZE]
+    __attribute__((aligned(FLOPPY_DMA_ALIGNMENT)));
+
+static void floppyInterrupt(InterruptFrame* frame)
+{
+    (void) frame;
+    g_FloppyInterrupt = true;
+    if (g_Floppy.Worker)
+        threadWake(g_Floppy.Worker);
+}
+
+// Sleeps until IRQ 6 (worker thread)
+static void waitInterrupt(void)
+{
+    while (!g_FloppyInterrupt)
+        threadBlock();
+}
+
+// Sends a command or parameter byte
+// Returns: true if successful, false if the controller does not take it
+static bool writeFifo(uint8_t value)
+{
+    for (unsigned i = 0; i < FLOPPY_FIFO_POLLS; i++)
+    {
+        if ((inb(FLOPPY_MSR) & (FLOPPY_MSR_RQM | FLOPPY_MSR_DIO)) == FLOPPY_MSR_RQM)
+        {
+            outb(FLOPPY_FIFO, value);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Receives a result byte
+// Returns: true if successful, false if the controller has none
+static bool readFifo(uint8_t* valueOut)
+{
+    for (unsigned i = 0; i < FLOPPY_FIFO_POLLS; i++)
+    {
+        if ((inb(FLOPPY_MSR) & (FLOPPY_MSR_RQM | FLOPPY_MSR_DIO)) == (FLOPPY_MSR_RQM | FLOPPY_MSR_DIO))
+        {
+            *valueOut = inb(FLOPPY_FIFO);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Sends a command with its parameters; a following waitInterrupt waits for its interrupt
+static bool sendCommand(const uint8_t* bytes, unsigned count)
+{
+    g_FloppyInterrupt = false;
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (!writeFifo(bytes[i]))
+            return false;
+    }
+    return true;
+}
+
+// Ends a seek, recalibration or reset with SENSE INTERRUPT STATUS
+// Returns: true if successful, false if the controller did not answer
+static bool senseInterrupt(uint8_t* st0Out, uint8_t* cylinderOut)
+{
+    uint8_t command = FLOPPY_SENSE_INTERRUPT;
+    return sendCommand(&command, 1) && readFifo(st0Out) && readFifo(cylinderOut);
+}
+
+// Moves the heads to a cylinder (0 with recalibrate)
+// Returns: true if the heads are on the cylinder, false otherwise
+static bool moveHeads(bool recalibrate, uint8_t cylinder)
+{
+    uint8_t seek[] = { FLOPPY_SEEK, 0, cylinder };
+    uint8_t calibrate[] = { FLOPPY_RECALIBRATE, 0 };
+    bool sent = recalibrate ? sendCommand(calibrate, sizeof(calibrate)) : sendCommand(seek, sizeof(seek));
+    if (!sent)
+        return false;
+    waitInterrupt();
+
+    uint8_t st0, at;
+    g_FloppyCylinder = -1;
+    if (!senseInterrupt(&st0, &at) || (st0 & FLOPPY_ST0_ABNORMAL) || at != cylinder)
+        return false;
+
+    g_FloppyCylinder = cylinder;
+    return true;
+}
+
+// Resets the controller, selects the data rate and timings of the drive
+// and spins up its motor
+// Returns: true if successful, false if the controller does not answer
+static bool resetController(void)
+{
+    g_FloppyInterrupt = false;
+    outb(FLOPPY_DOR, 0);
+    outb(FLOPPY_DOR, FLOPPY_DOR_ENABLE | FLOPPY_DOR_DMA | FLOPPY_DOR_MOTOR0);
+    waitInterrupt();
+
+    // One status per drive after a reset
+    uint8_t st0, cylinder;
+    for (unsigned drive = 0; drive < 4; drive++)
+    {
+        if (!senseInterrupt(&st0, &cylinder))
+            return false;
+    }
+
+    outb(FLOPPY_CCR, g_FloppyGeometry->DataRate);
+    uint8_t specify[] = { FLOPPY_SPECIFY, FLOPPY_SPECIFY_STEP, FLOPPY_SPECIFY_LOAD };
+    if (!sendCommand(specify, sizeof(specify)))
+        return false;
+
+    // No timed sleep yet: give up the CPU until the spin-up time has passed
+    uint32_t start = timerTicks();
+    while (timerTicks() - start < (TIMER_FREQUENCY * FLOPPY_MOTOR_SPIN_MS + 999) / 1000)
+        threadYield();
+
+    g_FloppyCylinder = -1;
+    return true;
+}
+
+// Programs DMA channel 2 to receive bytes into the DMA buffer
+static void startDma(uint32_t bytes)
+{
+    uint32_t address = virtualToPhysical(g_FloppyDma);
+    uint32_t count = bytes - 1;
+
+    outb(DMA_MASK, DMA_MASK_SET | DMA_CHANNEL2);
+    outb(DMA_FLIP_FLOP, 0xFF);
+    outb(DMA_MODE, DMA_MODE_WRITE2);
+    outb(DMA_ADDRESS2, address & 0xFF);
+    outb(DMA_ADDRESS2, (address >> 8) & 0xFF);
+    outb(DMA_PAGE2, (address >> 16) & 0xFF);
+    outb(DMA_FLIP_FLOP, 0xFF);
+    outb(DMA_COUNT2, count & 0xFF);
+    outb(DMA_COUNT2, (count >> 8) & 0xFF);
+    outb(DMA_MASK, DMA_CHANNEL2);              // Unmask: ready for the controller
+}
+
+// Reads sectors of one cylinder into the DMA buffer
+// Parameters:
+//   lba - First sector
+//   count - Number of sectors, up to the end of the cylinder
+// Returns: true if successful, false on an error
+static bool readCylinder(uint32_t lba, uint32_t count)
+{
+    const FloppyGeometry* geometry = g_FloppyGeometry;
+    uint8_t cylinder = lba / (geometry->SectorsPerTrack * FLOPPY_HEADS);
+    uint8_t head = (lba / geometry->SectorsPerTrack) % FLOPPY_HEADS;
+    uint8_t sector = lba % geometry->SectorsPerTrack + 1;
+
+    if (g_FloppyCylinder != cylinder && !moveHeads(false, cylinder))
+        return false;
+
+    startDma(count * BLOCK_SECTOR_SIZE);
+
+    // Multi-track: from the end of the track of head 0 on to head 1; the DMA
+    // terminal count ends the command after count sectors
+    uint8_t command[] = {
+        FLOPPY_READ_DATA, head << 2, cylinder, head, sector,
+        FLOPPY_SECTOR_SIZE_CODE, geometry->SectorsPerTrack, geometry->Gap, 0xFF,
+    };
+    if (!sendCommand(command, sizeof(command)))
+        return false;
+    waitInterrupt();
+
+    // ST0, ST1, ST2, then the cylinder, head, sector and size where it stopped
+    uint8_t result[7];
+    for (unsigned i = 0; i < sizeof(result); i++)
+    {
+        if (!readFifo(&result[i]))
+            return false;
+    }
+    return !(result[0] & FLOPPY_ST0_ABNORMAL);
+}
+
+// Transfers a request cylinder by cylinder (BlockTransferFunction, worker thread)
+static bool floppyTransfer(BlockDevice* device, BlockRequest* request)
+{
+    (void) device;
+    uint32_t cylinderSectors = g_FloppyGeometry->SectorsPerTrack * FLOPPY_HEADS;
+
+    uint32_t done = 0;
+    while (done < request->MergedCount)
+    {
+        uint32_t lba = request->Lba + done;
+        uint32_t count = cylinderSectors - lba % cylinderSectors;
+        if (count > request->MergedCount - done)
+            count = request->MergedCount - done;
+        if (count > FLOPPY_DMA_SECTORS)
+            count = FLOPPY_DMA_SECTORS;
+
+        bool ok = false;
+        for (unsigned attempt = 0; attempt < FLOPPY_RETRIES && !ok; attempt++)
+        {
+            if (!g_FloppyReady)
+                g_FloppyReady = resetController();
+            ok = g_FloppyReady && readCylinder(lba, count);
+            if (!ok && g_FloppyReady && !moveHeads(true, 0))
+                g_FloppyReady = false;         // Reset again before the next try
+        }
+        if (!ok)
+            return false;
+
+        for (uint32_t i = 0; i < count; i++)
+            memcpy(blockRequestSector(request, done + i), g_FloppyDma + i * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE);
+        done += count;
+    }
+    return true;
+}
+
+// Detects drive 0 through the CMOS and registers it as "fd0"
+void floppyInit(void)
+{
+    outb(CMOS_ADDRESS, CMOS_FLOPPY_TYPES);
+    uint8_t type = inb(CMOS_DATA) >> 4;
+    if (type >= sizeof(g_FloppyGeometries) / sizeof(g_FloppyGeometries[0]) || !g_FloppyGeometries[type].Name)
+        return;                                // No drive, or one of unknown type
+
+    uint32_t physical = virtualToPhysical(g_FloppyDma);
+    if (physical + sizeof(g_FloppyDma) > 0x1000000)
+    {
+        logPuts("Floppy: DMA buffer above 16MB\n");
+        return;
+    }
+
+    const FloppyGeometry* geometry = &g_FloppyGeometries[type];
+    uint32_t cylinderSectors = geometry->SectorsPerTrack * FLOPPY_HEADS;
+    g_FloppyGeometry = geometry;
+    g_Floppy.Name = "fd0";
+    g_Floppy.SectorCount = geometry->Cylinders * cylinderSectors;
+    g_Floppy.MaxTransfer = cylinderSectors < FLOPPY_DMA_SECTORS ? cylinderSectors : FLOPPY_DMA_SECTORS;
+    g_Floppy.Transfer = floppyTransfer;
+    if (!blockRegister(&g_Floppy))
+        return;
+
+    irqRegister(FLOPPY_IRQ, floppyInterrupt);
+    logPrintf("Floppy: fd0 is a %s drive, %u sectors\n", geometry->Name, g_Floppy.SectorCount);
+}
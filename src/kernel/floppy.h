@@ -0,0 +1,12 @@
+// =============================================================================
+// FLOPPY DISK CONTROLLER
+// =============================================================================
+//
+// Block device "fd0" for the first drive of the 82077AA compatible floppy
+// controller. Transfers go through ISA DMA channel 2 into a buffer below
+// 16MB and end with IRQ 6; the worker thread of the device sleeps until
+// then. A transfer reads up to one cylinder (both heads) with one command
+
+#pragma once
+
+void floppyInit(void);
@@ -0,0 +1,69 @@
+// =============================================================================
+// GLOBAL DESCRIPTOR TABLE
+// =============================================================================
+//
+// The table lives in the kernel image, so it stays mapped once paging drops
+// the identity map of low memory. Loading it reloads every segment register.
+// All CPUs share the table; their per-CPU entries are filled before each one
+// loads it
+
+#include "gdt.h"
+
+#include "percpu.h"
+
+#define GDT_ENTRIES             (GDT_CPU_ENTRY + MAX_CPUS)
+
+typedef struct
+{
+    uint16_t Limit;                            // Size of the table - 1
+    uint32_t Base;                             // Linear (virtual) address of the table
+
+} __attribute__((packed)) GdtDescriptor;
+
+// Null descriptor, then base 0, limit 4GB (4KB granularity, 32-bit), ring 0,
+// then one per-CPU segment per CPU (gdtSetCpuSegment)
+static uint64_t g_Gdt[GDT_ENTRIES] __attribute__((aligned(8))) =
+{
+    0,
+    0x00CF9A000000FFFFull,                     // KERNEL_CODE_SELECTOR: code, readable
+    0x00CF92000000FFFFull,                     // KERNEL_DATA_SELECTOR: data, writable
+};
+
+// Loads the kernel GDT and its selectors (GS = KERNEL_DATA_SELECTOR until the
+// CPU loads its per-CPU segment)
+void gdtInit(void)
+{
+    static const GdtDescriptor descriptor = { sizeof(g_Gdt) - 1, (uint32_t) g_Gdt };
+
+    __asm__ volatile ("lgdt %0\n\t"
+                      "ljmp %1, $1f\n"         // Reload CS
+                      "1:\n\t"
+                      "movw %w2, %%ds\n\t"
+                      "movw %w2, %%es\n\t"
+                      "movw %w2, %%fs\n\t"
+                      "movw %w2, %%gs\n\t"
+                      "movw %w2, %%ss"
+                      : : "m"(descriptor), "i"(KERNEL_CODE_SELECTOR), "r"(KERNEL_DATA_SELECTOR)
+                      : "memory");
+}
+
+// Sets the per-CPU data segment of a CPU: writable, byte granular, 32-bit
+// Parameters:
+//   cpu - CPU index (below MAX_CPUS)
+//   base - start of the segment
+//   size - size of the segment in bytes
+// Returns the selector of the segment
+uint16_t gdtSetCpuSegment(unsigned cpu, const void* base, uint32_t size)
+{
+    uint32_t address = (uint32_t) base;
+    uint32_t limit = size - 1;
+
+    g_Gdt[GDT_CPU_ENTRY + cpu] = (limit & 0xFFFF)
+        | (uint64_t) (address & 0xFFFFFF) << 16
+        | 0x92ull << 40                        // Present, ring 0, data, writable
+        | (uint64_t) ((limit >> 16) & 0xF) << 48
+        | 0x40ull << 48                        // 32-bit, byte granularity
+        | (uint64_t) (address >> 24) << 56;
+
+    return (GDT_CPU_ENTRY + cpu) * 8;
+}
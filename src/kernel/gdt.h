@@ -0,0 +1,20 @@
+// =============================================================================
+// GLOBAL DESCRIPTOR TABLE
+// =============================================================================
+//
+// Flat 4GB code and data segments of the kernel. The selectors are the same
+// as in the GDT of stage2 (src/bootloader/stage2/pmode.inc), which the kernel
+// replaces because that table is only reachable through the identity map.
+// Each CPU also gets a small data segment over its PerCpu structure, loaded
+// into GS (see percpu.h)
+
+#pragma once
+
+#include <stdint.h>
+
+#define KERNEL_CODE_SELECTOR    0x08
+#define KERNEL_DATA_SELECTOR    0x10
+#define GDT_CPU_ENTRY           3               // Entry of the segment of CPU 0
+
+void gdtInit(void);
+uint16_t gdtSetCpuSegment(unsigned cpu, const void* base, uint32_t size);
@@ -0,0 +1,116 @@
+// =============================================================================
+// INTERRUPT DESCRIPTOR TABLE
+// =============================================================================
+//
+// Every vector gets an interrupt gate (interrupts stay disabled in the
+// handler) to its stub in isr.asm. The stubs call interruptDispatch with the
+// saved registers, which runs the handler installed for the vector
+
+#include "idt.h"
+
+#include "cpu.h"
+#include "gdt.h"
+#include "log.h"
+#include "serial.h"
+
+#define IDT_INTERRUPT_GATE      0x8E            // Present, ring 0, 32-bit interrupt gate
+
+typedef struct
+{
+    uint16_t OffsetLow;                        // Handler address bits 0-15
+    uint16_t Selector;                         // Code segment of the handler
+    uint8_t Reserved;
+    uint8_t Flags;                             // Type, ring, present
+    uint16_t OffsetHigh;                       // Handler address bits 16-31
+
+} __attribute__((packed)) IdtGate;
+
+typedef struct
+{
+    uint16_t Limit;                            // Size of the table - 1
+    uint32_t Base;                             // Linear (virtual) address of the table
+
+} __attribute__((packed)) IdtDescriptor;
+
+extern const uint32_t isr_table[IDT_ENTRIES];   // Stub addresses, from isr.asm
+
+static IdtGate g_Idt[IDT_ENTRIES] __attribute__((aligned(8)));
+static InterruptHandler g_Handlers[IDT_ENTRIES];
+
+static const char* const g_ExceptionNames[EXCEPTION_COUNT] =
+{
+    "Divide error", "Debug", "Non-maskable interrupt", "Breakpoint",
+    "Overflow", "Bound range exceeded", "Invalid opcode", "Device not available",
+    "Double fault", "Coprocessor segment overrun", "Invalid TSS", "Segment not present",
+    "Stack fault", "General protection fault", "Page fault", "Reserved",
+    "x87 floating point error", "Alignment check", "Machine check", "SIMD floating point error",
+    "Virtualization exception", "Control protection exception", "Reserved", "Reserved",
+    "Reserved", "Reserved", "Reserved", "Reserved",
+    "Hypervisor injection exception", "VMM communication exception", "Security exception", "Reserved",
+};
+
+// Points a vector at a handler address
+static void idtSetGate(unsigned vector, uint32_t handler)
+{
+    g_Idt[vector] = (IdtGate)
+    {
+        .OffsetLow = handler & 0xFFFF,
+        .Selector = KERNEL_CODE_SELECTOR,
+        .Flags = IDT_INTERRUPT_GATE,
+        .OffsetHigh = handler >> 16,
+    };
+}
+
+// Installs the interrupt stubs and loads the IDT
+void idtInit(void)
+{
+    for (unsigned vector = 0; vector < IDT_ENTRIES; vector++)
+        idtSetGate(vector, isr_table[vector]);
+
+    idtLoad();
+}
+
+// Loads the IDT on the executing CPU (all CPUs share it and its handlers)
+void idtLoad(void)
+{
+    static const IdtDescriptor descriptor = { sizeof(g_Idt) - 1, (uint32_t) g_Idt };
+
+    __asm__ volatile ("lidt %0" : : "m"(descriptor));
+}
+
+// Installs the C handler of a vector (NULL: the vector is fatal again)
+void interruptSetHandler(unsigned vector, InterruptHandler handler)
+{
+    g_Handlers[vector] = handler;
+}
+
+// Called by isr_common for every interrupt
+void interruptDispatch(InterruptFrame* frame)
+{
+    InterruptHandler handler = g_Handlers[frame->Vector];
+    if (handler)
+        handler(frame);
+    else
+        interruptPanic(frame, frame->Vector < EXCEPTION_COUNT
+                              ? g_ExceptionNames[frame->Vector] : "Unexpected interrupt");
+}
+
+// Logs the interrupted state and stops the kernel
+// Parameters:
+//   frame - registers saved by the interrupt stub
+//   reason - what went wrong
+void interruptPanic(const InterruptFrame* frame, const char* reason)
+{
+    logPrintf("\n%s (vector %u, error code %08x)\n", reason, frame->Vector, frame->ErrorCode);
+    logPrintf("  EIP %08x  CS %04x  EFLAGS %08x  CR2 %08x\n",
+              frame->Eip, frame->Cs, frame->Eflags, readCr2());
+    logPrintf("  EAX %08x  EBX %08x  ECX %08x  EDX %08x\n",
+              frame->Eax, frame->Ebx, frame->Ecx, frame->Edx);
+    logPrintf("  ESI %08x  EDI %08x  EBP %08x  ESP %08x\n",
+              frame->Esi, frame->Edi, frame->Ebp, frame->Esp + 20); // ESP before the interrupt
+    logPrintf("  DS %04x  ES %04x  FS %04x\n",
+              frame->Ds & 0xFFFF, frame->Es & 0xFFFF, frame->Fs & 0xFFFF);
+
+    serialFlush();
+    cpuHalt();
+}
@@ -0,0 +1,36 @@
+// =============================================================================
+// INTERRUPT DESCRIPTOR TABLE
+// =============================================================================
+//
+// Routes every interrupt vector through the stubs of isr.asm to C handlers.
+// Vectors 0-31 are the processor exceptions, hardware interrupts are routed
+// by irq.h (PIC) and apic.h (local APIC). A vector without a handler stops
+// the kernel with a register dump
+
+#pragma once
+
+#include <stdint.h>
+
+#define IDT_ENTRIES             256
+#define EXCEPTION_COUNT         32              // Vectors reserved for processor exceptions
+
+#define EXCEPTION_PAGE_FAULT    14
+
+// Registers saved by the stubs of isr.asm, lowest address first
+typedef struct
+{
+    uint32_t Fs, Es, Ds;                       // Pushed by the common stub (GS is per CPU)
+    uint32_t Edi, Esi, Ebp, Esp, Ebx, Edx, Ecx, Eax; // PUSHAD (ESP before it)
+    uint32_t Vector;                           // Pushed by the vector stub
+    uint32_t ErrorCode;                        // Pushed by the processor or 0
+    uint32_t Eip, Cs, Eflags;                  // Pushed by the processor (ring 0, no stack switch)
+
+} InterruptFrame;
+
+typedef void (*InterruptHandler)(InterruptFrame* frame);
+
+void idtInit(void);
+void idtLoad(void);
+void interruptSetHandler(unsigned vector, InterruptHandler handler);
+void interruptDispatch(InterruptFrame* frame);   // Called by isr.asm
+void __attribute__((noreturn)) interruptPanic(const InterruptFrame* frame, const char* reason);
@@ -0,0 +1,57 @@
+// =============================================================================
+// PORT I/O
+// =============================================================================
+//
+// Inline wrappers for the x86 IN/OUT instructions
+
+#pragma once
+
+#include <stdint.h>
+
+// Writes a byte to an I/O port
+static inline void outb(uint16_t port, uint8_t value)
+{
+    __asm__ volatile ("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+// Reads a byte from an I/O port
+static inline uint8_t inb(uint16_t port)
+{
+    uint8_t value;
+    __asm__ volatile ("inb %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+// Writes a word to an I/O port
+static inline void outw(uint16_t port, uint16_t value)
+{
+    __asm__ volatile ("outw %0, %1" : : "a"(value), "Nd"(port));
+}
+
+// Reads a word from an I/O port
+static inline uint16_t inw(uint16_t port)
+{
+    uint16_t value;
+    __asm__ volatile ("inw %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+// Writes a doubleword to an I/O port
+static inline void outl(uint16_t port, uint32_t value)
+{
+    __asm__ volatile ("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
+// Reads a doubleword from an I/O port
+static inline uint32_t inl(uint16_t port)
+{
+    uint32_t value;
+    __asm__ volatile ("inl %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+// Reads count words from an I/O port into memory (REP INSW)
+static inline void insw(uint16_t port, void* buffer, uint32_t count)
+{
+    __asm__ volatile ("rep insw" : "+D"(buffer), "+c"(count) : "d"(port) : "memory");
+}
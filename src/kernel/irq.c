@@ -0,0 +1,57 @@
+// =============================================================================
+// HARDWARE INTERRUPTS (IRQ)
+// =============================================================================
+//
+// Every PIC vector is dispatched to irqDispatch, which filters spurious IRQs,
+// counts the IRQ, acknowledges it at the PIC and runs the driver handler
+
+#include "irq.h"
+
+#include <stddef.h>
+
+#include "pic.h"
+
+static InterruptHandler g_IrqHandlers[PIC_IRQ_COUNT];
+static unsigned g_IrqCounts[PIC_IRQ_COUNT];    // Interrupts handled per IRQ
+
+// Interrupt handler of every PIC vector
+static void irqDispatch(InterruptFrame* frame)
+{
+    unsigned irq = frame->Vector - PIC_VECTOR_BASE;
+    if (picIsSpurious(irq))
+        return;
+
+    g_IrqCounts[irq]++;
+    picEndOfInterrupt(irq);
+    if (g_IrqHandlers[irq])
+        g_IrqHandlers[irq](frame);
+}
+
+// Remaps the PIC and routes its vectors (all IRQs masked)
+// The IDT must be loaded
+void irqInit(void)
+{
+    picInit();
+    for (unsigned irq = 0; irq < PIC_IRQ_COUNT; irq++)
+        interruptSetHandler(PIC_VECTOR_BASE + irq, irqDispatch);
+}
+
+// Installs the handler of an IRQ and unmasks it
+void irqRegister(unsigned irq, InterruptHandler handler)
+{
+    g_IrqHandlers[irq] = handler;
+    picUnmask(irq);
+}
+
+// Masks an IRQ and removes its handler
+void irqUnregister(unsigned irq)
+{
+    picMask(irq);
+    g_IrqHandlers[irq] = NULL;
+}
+
+// Returns the number of interrupts of an IRQ so far
+unsigned irqCount(unsigned irq)
+{
+    return g_IrqCounts[irq];
+}
@@ -0,0 +1,18 @@
+// =============================================================================
+// HARDWARE INTERRUPTS (IRQ)
+// =============================================================================
+//
+// Drivers register a handler for an IRQ of the PIC; the IRQ is unmasked as
+// soon as it has one. Handlers run with interrupts disabled. The IRQ is
+// acknowledged before its handler runs (the ISA IRQs are edge triggered, a
+// new request needs a new edge from the device), so a handler may switch to
+// another thread without blocking the IRQs of lower priority
+
+#pragma once
+
+#include "idt.h"
+
+void irqInit(void);
+void irqRegister(unsigned irq, InterruptHandler handler);
+void irqUnregister(unsigned irq);
+unsigned irqCount(unsigned irq);
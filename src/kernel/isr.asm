@@ -0,0 +1,72 @@
+; =============================================================================
+; NBOS KERNEL INTERRUPT STUBS
+; =============================================================================
+;
+; One stub per vector: processor exceptions (0-31), the IRQs of the PIC
+; (32-47, see pic.h) and the local APIC vectors (see apic.h). Each stub brings the stack
+; to the same layout (a dummy error code where the processor pushes none, then
+; the vector number) and jumps to isr_common, which saves the registers as an
+; InterruptFrame (see idt.h) and calls interruptDispatch
+;
+; isr_table holds the stub addresses for idt.c
+
+bits 32
+
+KERNEL_DATA_SELECTOR    equ 10h                 ; See gdt.h
+
+extern interruptDispatch
+
+global isr_table
+
+section .text
+
+; Exceptions for which the processor pushes an error code (never for vectors 32-255)
+%define HAS_ERROR_CODE(v) ((v) == 8 || ((v) >= 10 && (v) <= 14) || (v) == 17 || (v) == 21 || (v) == 29 || (v) == 30)
+
+%assign vector 0
+%rep 256
+isr_ %+ vector:
+%if !HAS_ERROR_CODE(vector)
+    push dword 0                ; Dummy error code
+%endif
+    push dword vector           ; Vector number
+    jmp isr_common
+%assign vector vector + 1
+%endrep
+
+; Saves the interrupted state, calls interruptDispatch(InterruptFrame* frame)
+; and returns to the interrupted code
+isr_common:
+    pushad                      ; General purpose registers
+    push ds                     ; Segment registers (not GS: the per-CPU
+    push es                     ; segment of this CPU, see percpu.h)
+    push fs
+
+    mov ax, KERNEL_DATA_SELECTOR
+    mov ds, ax
+    mov es, ax
+    cld                         ; C code expects the direction flag clear
+
+    push esp                    ; Pointer to the InterruptFrame
+    call interruptDispatch
+    add esp, 4
+
+    pop fs                      ; Restore segment registers
+    pop es
+    pop ds
+    popad                       ; Restore general purpose registers
+    add esp, 8                  ; Drop the vector number and error code
+    iretd                       ; Return from interrupt
+
+section .rodata
+
+align 4
+isr_table:
+%assign vector 0
+%rep 256
+    dd isr_ %+ vector
+%assign vector vector + 1
+%endrep
+
+; No executable stack needed (keeps the linker from warning about it)
+section .note.GNU-stack noalloc noexec nowrite progbits
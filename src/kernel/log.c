@@ -0,0 +1,213 @@
+// =============================================================================
+// KERNEL LOG
+// =============================================================================
+//
+// logPrintf supports the conversions the kernel needs: %s %c %d %u %x %p and
+// %%, with an optional '0' or '-' (left-justify) flag and field width
+// (e.g. %08x, %-10s), and the ll
+// length modifier for 64-bit values (e.g. %llu). The output is
+// formatted into a local buffer and written to both sinks in one call, so the
+// console cursor and the serial FIFO are handled once per message. A
+// spinlock (held with interrupts disabled) keeps the messages of different
+// CPUs from interleaving
+
+#include "log.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "console.h"
+#include "cpu.h"
+#include "serial.h"
+#include "spinlock.h"
+#include "string.h"
+
+#define LOG_BUFFER_SIZE         256             // Longest formatted message
+
+typedef struct
+{
+    char Data[LOG_BUFFER_SIZE];
+    unsigned Length;
+
+} LogBuffer;
+
+static Spinlock g_LogLock = SPINLOCK_INIT;     // Serializes the writers of both sinks
+
+// Initializes both log sinks
+void logInit(void)
+{
+    consoleInit();
+    serialInit();
+}
+
+// Writes a message to both sinks
+static void logWrite(const char* data, size_t length)
+{
+    uint32_t flags = interruptsSave();
+    spinLock(&g_LogLock);
+    consoleWrite(data, length);
+    serialWrite(data, length);
+    spinUnlock(&g_LogLock);
+    interruptsRestore(flags);
+}
+
+// Writes binary data to the serial log only (not between the bytes of a
+// message of another CPU)
+void logWriteBinary(const void* data, size_t length)
+{
+    uint32_t flags = interruptsSave();
+    spinLock(&g_LogLock);
+    serialWriteBinary(data, length);
+    spinUnlock(&g_LogLock);
+    interruptsRestore(flags);
+}
+
+// Writes a null-terminated string to the console and the serial log
+void logPuts(const char* string)
+{
+    logWrite(string, strlen(string));
+}
+
+// Appends a character, dropping it when the buffer is full
+static void logPutChar(LogBuffer* buffer, char c)
+{
+    if (buffer->Length < LOG_BUFFER_SIZE)
+        buffer->Data[buffer->Length++] = c;
+}
+
+// Appends spaces after a left-justified field of length characters
+static void logPutPadding(LogBuffer* buffer, unsigned length, unsigned width)
+{
+    for (; length < width; length++)
+        logPutChar(buffer, ' ');
+}
+
+// Appends an unsigned number in the given base, padded to width
+// (pad '-' left-justifies it)
+static void logPutNumber(LogBuffer* buffer, uint64_t value, unsigned base,
+                         bool negative, unsigned width, char pad)
+{
+    char digits[20];
+    unsigned count = 0;
+
+    do
+    {
+        digits[count++] = "0123456789abcdef"[divide64(&value, base)];
+    } while (value);
+
+    unsigned length = count + (negative ? 1 : 0);
+    if (pad == '-')
+    {
+        if (negative)
+            logPutChar(buffer, '-');
+        while (count)
+            logPutChar(buffer, digits[--count]);
+        logPutPadding(buffer, length, width);
+        return;
+    }
+
+    if (negative && pad == '0')
+        logPutChar(buffer, '-');
+    for (; length < width; length++)
+        logPutChar(buffer, pad);
+    if (negative && pad != '0')
+        logPutChar(buffer, '-');
+    while (count)
+        logPutChar(buffer, digits[--count]);
+}
+
+// Formats a message like printf and writes it to both sinks
+void logPrintf(const char* format, ...)
+{
+    LogBuffer buffer;
+    buffer.Length = 0;
+
+    va_list args;
+    va_start(args, format);
+
+    for (const char* p = format; *p; p++)
+    {
+        if (*p != '%')
+        {
+            logPutChar(&buffer, *p);
+            continue;
+        }
+
+        p++;
+        char pad = ' ';
+        unsigned width = 0;
+        if (*p == '0' || *p == '-')
+            pad = *p++;
+        while (*p >= '0' && *p <= '9')
+            width = width * 10 + (*p++ - '0');
+
+        // Length modifier: l is 32 bits like int, ll is 64 bits
+        bool isLong = false;
+        if (*p == 'l')
+        {
+            p++;
+            if (*p == 'l')
+            {
+                isLong = true;
+                p++;
+            }
+        }
+
+        switch (*p)
+        {
+        case 'c':
+            logPutChar(&buffer, (char) va_arg(args, int));
+            break;
+
+        case 's':
+        {
+            const char* string = va_arg(args, const char*);
+            unsigned length = strlen(string);
+            if (pad != '-')
+                logPutPadding(&buffer, length, width);
+            while (*string)
+                logPutChar(&buffer, *string++);
+            if (pad == '-')
+                logPutPadding(&buffer, length, width);
+            break;
+        }
+
+        case 'd':
+        {
+            int64_t value = isLong ? va_arg(args, int64_t) : va_arg(args, int32_t);
+            logPutNumber(&buffer, value < 0 ? -(uint64_t) value : (uint64_t) value,
+                         10, value < 0, width, pad);
+            break;
+        }
+
+        case 'u':
+        case 'x':
+        {
+            uint64_t value = isLong ? va_arg(args, uint64_t) : va_arg(args, uint32_t);
+            logPutNumber(&buffer, value, *p == 'u' ? 10 : 16, false, width, pad);
+            break;
+        }
+
+        case 'p':
+            logPutNumber(&buffer, (uintptr_t) va_arg(args, void*), 16, false, 8, '0');
+            break;
+
+        case '%':
+            logPutChar(&buffer, '%');
+            break;
+
+        default:                               // Unknown conversion: print it as is
+            logPutChar(&buffer, '%');
+            if (*p == '\0')
+                p--;
+            else
+                logPutChar(&buffer, *p);
+            break;
+        }
+    }
+
+    va_end(args);
+
+    logWrite(buffer.Data, buffer.Length);
+}
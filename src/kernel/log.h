@@ -0,0 +1,14 @@
+// =============================================================================
+// KERNEL LOG
+// =============================================================================
+//
+// Log output goes to the VGA console and to the serial log
+
+#pragma once
+
+#include <stddef.h>
+
+void logInit(void);
+void logPuts(const char* string);
+void logPrintf(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void logWriteBinary(const void* data, size_t length);
@@ -0,0 +1,158 @@
+// =============================================================================
+// NBOS KERNEL
+// =============================================================================
+//
+// Entered from entry.asm in 32-bit protected mode with the boot information
+// of stage2, already running in the higher half. Shows the welcome banner and
+// the boot information, loads the kernel GDT and IDT, takes over paging, sets
+// up the memory allocators and the buffer cache, the interrupt controllers,
+// the scheduler and the timer, starts the application processors and the
+// disk drivers, shows the time spent in each boot phase, then becomes the
+// idle thread of the bootstrap processor. The boot drive is read by a
+// thread of its own, since reading sleeps and the idle thread must not
+
+#include <stdint.h>
+
+#include "acpi.h"
+#include "apic.h"
+#include "ata.h"
+#include "block.h"
+#include "boot_info.h"
+#include "boot_times.h"
+#include "buffer_cache.h"
+#include "cpu.h"
+#include "fatfs.h"
+#include "floppy.h"
+#include "gdt.h"
+#include "idt.h"
+#include "irq.h"
+#include "log.h"
+#include "page_alloc.h"
+#include "paging.h"
+#include "percpu.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "serial.h"
+#include "slab.h"
+#include "smp.h"
+#include "timer.h"
+
+extern char __kernel_start[];                  // Start of the image, from linker.ld
+
+// Welcome banner
+static const char* const g_Banner[] =
+{
+    "    ___                   _                   _____ _     _      ___  ____\n",
+    "   / _ \\__   ____ _ _ __ | |_ _   _ _ __ ___ |  ___(_)___| |__  / _ \\/ ___| \n",
+    "  | | | \\ \\ / / _  |  _ \\| __| | | |  _   _ \\| |_  | / __|  _ \\| | | \\___ \\ \n",
+    "  | |_| |\\ V / (_| | | | | |_| |_| | | | | | |  _| | \\__ \\ | | | |_| |___) |\n",
+    "   \\__\\_\\ \\_/ \\__ _|_| |_|\\__|\\__ _|_| |_| |_|_|   |_|___/_| |_|\\___/|____/ \n",
+};
+
+#define STORAGE_TEST_FILE       "/TEST.TXT"     // Put on the boot floppy by the image build
+
+// Stops the processor for good
+static void __attribute__((noreturn)) halt(void)
+{
+    serialFlush();                             // Send the rest of the log before halting
+    cpuHalt();
+}
+
+// Mounts the FAT volume of the boot drive and reads a file through the
+// block layer and the buffer cache (thread "storage")
+// Parameters:
+//   argument - Name of the block device of the boot drive
+static void storageThread(void* argument)
+{
+    const char* name = argument;
+    BlockDevice* device = blockFind(name);
+    static FatVolume volume;
+    if (!device || !fatMount(&volume, device))
+    {
+        logPrintf("Storage: no FAT volume on %s\n", name);
+        threadExit();
+    }
+    fatDump(&volume);
+
+    FatFile file;
+    if (fatOpen(&volume, STORAGE_TEST_FILE, &file))
+    {
+        char data[512];
+        uint32_t total = 0, chunk;
+        while ((chunk = fatRead(&file, data, sizeof(data))) > 0)
+            total += chunk;
+        logPrintf("Storage: read %u of %u bytes of %s\n", total, file.Size, STORAGE_TEST_FILE);
+    }
+    else
+    {
+        logPrintf("Storage: %s not found\n", STORAGE_TEST_FILE);
+    }
+
+    blockDump();
+    bufferCacheDump();
+    profileDump();                             // -DPROFILE kernels: the profile of the boot
+    threadExit();
+}
+
+// Kernel entry point, called by entry.asm
+// Parameters:
+//   bootInfo - boot information of stage2
+void __attribute__((noreturn)) kernelMain(const BootInfo* bootInfo)
+{
+    bootTimesInit();                           // First, records the kernel entry
+    logInit();
+    bootTimeRecord(BOOT_TIME_KERNEL_LOG);
+
+    for (unsigned i = 0; i < sizeof(g_Banner) / sizeof(g_Banner[0]); i++)
+        logPuts(g_Banner[i]);
+
+    if (bootInfo->Magic != BOOT_INFO_MAGIC)
+    {
+        logPrintf("Invalid boot information at %p\n", bootInfo);
+        halt();
+    }
+
+    logPrintf("Kernel: %u bytes at %p (physical %08x), boot drive %02x\n",
+              bootInfo->KernelSize, (void*) __kernel_start, virtualToPhysical(__kernel_start),
+              bootInfo->BootDrive);
+
+    gdtInit();
+    idtInit();
+    pagingInit();                              // Page faults map the direct map from here on
+    pageAllocInit(bootInfo);
+    slabInit();
+    bufferCacheInit();
+    bootTimeRecord(BOOT_TIME_KERNEL_MEMORY);
+
+    irqInit();
+    apicInit();
+    perCpuInit(0, apicAvailable() ? apicId() : 0);
+    schedulerInit();                           // Before the timer, which drives it
+    timerInit();
+    serialEnableInterrupts();
+    interruptsEnable();
+    bootTimeRecord(BOOT_TIME_KERNEL_INTERRUPTS);
+
+    smpInit();
+    bootTimeRecord(BOOT_TIME_KERNEL_SMP);
+    profileInit();                             // Rings for every CPU
+
+    floppyInit();
+    ataInit();
+    threadCreate("storage", storageThread, bootInfo->BootDrive >= 0x80 ? "hd0" : "fd0");
+
+    pagingDump();
+    pageAllocDump();
+    timerDump();
+    acpiDump();
+    smpDump();
+
+    bootTimeRecord(BOOT_TIME_KERNEL_INIT);
+    bootTimesDump();
+    schedulerDump();
+#ifdef BOOT_BENCH
+    bootTimesBenchExit();                      // make bench_boot: the boot is measured
+#endif
+
+    schedulerIdle();
+}
@@ -0,0 +1,378 @@
+// =============================================================================
+// PHYSICAL PAGE ALLOCATOR
+// =============================================================================
+//
+// Binary buddy allocator: free blocks of 2^order pages are kept in one list
+// per order. An allocation splits the smallest large enough block, a free
+// merges the block with its buddy (the other half of the block of the next
+// order) as long as that one is free too. Both take at most PAGE_MAX_ORDER
+// steps, and merging keeps free memory in blocks as large as possible.
+//
+// Every page below the end of the highest usable range has a PageFrame. The
+// frame array is placed in the first usable range above the kernel that is
+// large enough. Memory below 1MB (firmware, bootloader, boot time table),
+// the kernel image, the frame array and every range the memory map does not
+// report as usable are reserved. Only memory reachable through the direct map
+// (below DIRECT_MAP_SIZE, see paging.h) is managed.
+//
+// Block addresses are direct map addresses, frame index i is physical address
+// i * PAGE_SIZE. The frame array is mapped on first touch by the page fault
+// handler like the rest of the direct map; it is written completely before
+// the first block is handed out, so the allocator itself never faults.
+//
+// One spinlock, held with interrupts disabled, protects the free lists on
+// every CPU.
+
+#include "page_alloc.h"
+
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "log.h"
+#include "paging.h"
+#include "spinlock.h"
+#include "string.h"
+
+#define LOW_MEMORY_FRAMES       (0x100000 >> PAGE_SHIFT) // Below 1MB is never managed
+#define MAX_FRAMES              (DIRECT_MAP_SIZE >> PAGE_SHIFT)
+#define MAX_RESERVED_RANGES     128
+
+typedef struct
+{
+    uint32_t Start;                            // First frame
+    uint32_t End;                              // Frame after the last one
+
+} FrameRange;
+
+extern char __kernel_start[];
+extern char __kernel_end[];
+
+static PageFrame* g_PageFrames;                // Frame of every page below g_PageFrameCount
+static uint32_t g_PageFrameCount;
+static PageFrame* g_FreeLists[PAGE_MAX_ORDER + 1]; // Free blocks of each order
+static size_t g_FreeBlocks[PAGE_MAX_ORDER + 1];
+static size_t g_FreePages;
+static size_t g_ManagedPages;
+static Spinlock g_PageLock = SPINLOCK_INIT;    // Protects the free lists and counters
+
+static const MemoryMapEntry* g_MemoryMap;
+static unsigned g_MemoryMapCount;
+
+// Converts between frames, frame indexes and addresses
+static inline uint32_t frameIndex(const PageFrame* frame)
+{
+    return frame - g_PageFrames;
+}
+
+static inline void* frameAddress(uint32_t index)
+{
+    return physicalToVirtual(index << PAGE_SHIFT);
+}
+
+PageFrame* pageFrameOf(const void* address)
+{
+    return &g_PageFrames[virtualToPhysical(address) >> PAGE_SHIFT];
+}
+
+void* pageFrameAddress(const PageFrame* frame)
+{
+    return frameAddress(frameIndex(frame));
+}
+
+// Free lists: doubly linked, so a buddy is removed in constant time
+static void freeListPush(unsigned order, PageFrame* frame)
+{
+    frame->Previous = NULL;
+    frame->Next = g_FreeLists[order];
+    if (frame->Next)
+        frame->Next->Previous = frame;
+    g_FreeLists[order] = frame;
+    g_FreeBlocks[order]++;
+}
+
+static void freeListRemove(unsigned order, PageFrame* frame)
+{
+    if (frame->Previous)
+        frame->Previous->Next = frame->Next;
+    else
+        g_FreeLists[order] = frame->Next;
+    if (frame->Next)
+        frame->Next->Previous = frame->Previous;
+    g_FreeBlocks[order]--;
+}
+
+// Frees the block of 2^order pages starting at frame index, merging it with
+// its buddies
+static void buddyInsert(uint32_t index, unsigned order)
+{
+    g_FreePages += 1u << order;
+
+    while (order < PAGE_MAX_ORDER)
+    {
+        uint32_t buddyIndex = index ^ (1u << order);
+        if (buddyIndex >= g_PageFrameCount)
+            break;
+
+        PageFrame* buddy = &g_PageFrames[buddyIndex];
+        if (!(buddy->Flags & PAGE_FRAME_FREE) || buddy->Order != order)
+            break;                             // Buddy (partly) in use or reserved
+
+        freeListRemove(order, buddy);
+        buddy->Flags &= ~PAGE_FRAME_FREE;
+        index &= ~(1u << order);               // Merged block starts at the lower half
+        order++;
+    }
+
+    PageFrame* frame = &g_PageFrames[index];
+    frame->Flags = PAGE_FRAME_FREE;
+    frame->Order = order;
+    freeListPush(order, frame);
+}
+
+// Takes a block of 2^order pages off the free lists (locked)
+// Returns its first frame index, 0 if no block is free (frame 0 is reserved)
+static uint32_t buddyRemove(unsigned order)
+{
+    unsigned blockOrder = order;
+    while (!g_FreeLists[blockOrder])
+    {
+        if (++blockOrder > PAGE_MAX_ORDER)
+            return 0;                          // Out of memory
+    }
+
+    PageFrame* frame = g_FreeLists[blockOrder];
+    freeListRemove(blockOrder, frame);
+    uint32_t index = frameIndex(frame);
+
+    // Split: the upper halves go back to the free lists
+    while (blockOrder > order)
+    {
+        blockOrder--;
+        PageFrame* half = &g_PageFrames[index + (1u << blockOrder)];
+        half->Flags = PAGE_FRAME_FREE;
+        half->Order = blockOrder;
+        freeListPush(blockOrder, half);
+    }
+
+    frame->Flags = 0;
+    frame->Order = order;                      // Remembered for pageFree
+    g_FreePages -= 1u << order;
+    return index;
+}
+
+// Allocates a block of 2^order pages
+// Returns its address, NULL if no block is free
+void* pageAlloc(unsigned order)
+{
+    if (order > PAGE_MAX_ORDER)
+        return NULL;
+
+    uint32_t flags = interruptsSave();
+    spinLock(&g_PageLock);
+    uint32_t index = buddyRemove(order);
+    spinUnlock(&g_PageLock);
+    interruptsRestore(flags);
+
+    return index ? frameAddress(index) : NULL;
+}
+
+// Frees a block returned by pageAlloc
+void pageFree(void* block)
+{
+    PageFrame* frame = pageFrameOf(block);
+
+    uint32_t flags = interruptsSave();
+    spinLock(&g_PageLock);
+    buddyInsert(frameIndex(frame), frame->Order);
+    spinUnlock(&g_PageLock);
+    interruptsRestore(flags);
+}
+
+// Returns the number of free pages
+size_t pageFreeCount(void)
+{
+    return g_FreePages;
+}
+
+// Marks frames [start, end) as available (overlapping entries are harmless)
+static void markFrames(uint32_t start, uint32_t end)
+{
+    for (uint32_t i = start; i < end; i++)
+        g_PageFrames[i].Flags = 0;
+}
+
+// Hands every run of available frames to the allocator in the largest
+// aligned blocks
+static void addAvailableFrames(void)
+{
+    uint32_t start = 0;
+    while (start < g_PageFrameCount)
+    {
+        if (g_PageFrames[start].Flags & PAGE_FRAME_RESERVED)
+        {
+            start++;
+            continue;
+        }
+
+        uint32_t end = start;
+        while (end < g_PageFrameCount && !(g_PageFrames[end].Flags & PAGE_FRAME_RESERVED))
+            end++;
+
+        while (start < end)
+        {
+            unsigned order = PAGE_MAX_ORDER;
+            while (order > 0 && ((start & ((1u << order) - 1)) || start + (1u << order) > end))
+                order--;
+
+            buddyInsert(start, order);
+            g_ManagedPages += 1u << order;
+            start += 1u << order;
+        }
+    }
+}
+
+// Marks the frames of [start, end) that lie outside every reserved range
+static void markUsableFrames(uint32_t start, uint32_t end, const FrameRange* reserved, unsigned count)
+{
+    for (; count > 0 && start < end; reserved++, count--)
+    {
+        if (reserved->End <= start || reserved->Start >= end)
+            continue;                          // No overlap
+
+        if (reserved->Start > start)           // Part below the reserved range
+            markUsableFrames(start, reserved->Start, reserved + 1, count - 1);
+        start = reserved->End;                 // Continue above it
+    }
+
+    if (start < end)
+        markFrames(start, end);
+}
+
+// Returns the usable frames of a memory map entry (rounded inwards, below MAX_FRAMES)
+static bool usableFrames(const MemoryMapEntry* entry, uint32_t* start, uint32_t* end)
+{
+    if (entry->Type != MEMORY_TYPE_USABLE)
+        return false;
+
+    uint64_t first = (entry->Base + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    uint64_t last = (entry->Base + entry->Length) >> PAGE_SHIFT;
+    if (last > MAX_FRAMES)
+        last = MAX_FRAMES;
+    if (first >= last)
+        return false;
+
+    *start = first;
+    *end = last;
+    return true;
+}
+
+// Returns true if no reserved memory map entry overlaps frames [start, end)
+static bool framesAvailable(uint32_t start, uint32_t end)
+{
+    for (unsigned i = 0; i < g_MemoryMapCount; i++)
+    {
+        const MemoryMapEntry* entry = &g_MemoryMap[i];
+        if (entry->Type == MEMORY_TYPE_USABLE)
+            continue;
+
+        uint64_t first = entry->Base >> PAGE_SHIFT;
+        uint64_t last = (entry->Base + entry->Length + PAGE_SIZE - 1) >> PAGE_SHIFT;
+        if (first < end && last > start)
+            return false;
+    }
+    return true;
+}
+
+// Builds the allocator from the memory map of stage2
+void pageAllocInit(const BootInfo* bootInfo)
+{
+    g_MemoryMap = physicalToVirtual(bootInfo->MemoryMap);
+    g_MemoryMapCount = bootInfo->MemoryMapCount;
+
+    // Frames are needed up to the end of the highest usable range
+    uint32_t start, end;
+    for (unsigned i = 0; i < g_MemoryMapCount; i++)
+    {
+        if (usableFrames(&g_MemoryMap[i], &start, &end) && end > g_PageFrameCount)
+            g_PageFrameCount = end;
+    }
+
+    // Place the frame array in the first usable range above the kernel
+    uint32_t kernelStart = virtualToPhysical(__kernel_start) >> PAGE_SHIFT;
+    uint32_t kernelEnd = (virtualToPhysical(__kernel_end) + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    uint32_t arrayPages = ((uint64_t) g_PageFrameCount * sizeof(PageFrame) + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    uint32_t arrayStart = 0;
+    for (unsigned i = 0; i < g_MemoryMapCount && !arrayStart; i++)
+    {
+        if (!usableFrames(&g_MemoryMap[i], &start, &end))
+            continue;
+        if (start < kernelEnd)
+            start = kernelEnd;
+        if (start + arrayPages <= end && framesAvailable(start, start + arrayPages))
+            arrayStart = start;
+    }
+
+    if (!arrayStart)
+    {
+        logPuts("Memory: no room for the page frames\n");
+        g_PageFrameCount = 0;
+        return;
+    }
+
+    g_PageFrames = frameAddress(arrayStart);
+    for (uint32_t i = 0; i < g_PageFrameCount; i++)
+    {
+        g_PageFrames[i] = (PageFrame) { .Flags = PAGE_FRAME_RESERVED };
+    }
+
+    // Everything that must never be allocated, then the usable ranges
+    static FrameRange reserved[MAX_RESERVED_RANGES];
+    unsigned reservedCount = 0;
+    reserved[reservedCount++] = (FrameRange) { 0, LOW_MEMORY_FRAMES };
+    reserved[reservedCount++] = (FrameRange) { kernelStart, kernelEnd };
+    reserved[reservedCount++] = (FrameRange) { arrayStart, arrayStart + arrayPages };
+    for (unsigned i = 0; i < g_MemoryMapCount && reservedCount < MAX_RESERVED_RANGES; i++)
+    {
+        const MemoryMapEntry* entry = &g_MemoryMap[i];
+        if (entry->Type == MEMORY_TYPE_USABLE || entry->Base >= (uint64_t) MAX_FRAMES << PAGE_SHIFT)
+            continue;
+
+        uint64_t last = (entry->Base + entry->Length + PAGE_SIZE - 1) >> PAGE_SHIFT;
+        reserved[reservedCount++] = (FrameRange) { entry->Base >> PAGE_SHIFT,
+                                                   last > MAX_FRAMES ? MAX_FRAMES : last };
+    }
+
+    for (unsigned i = 0; i < g_MemoryMapCount; i++)
+    {
+        if (usableFrames(&g_MemoryMap[i], &start, &end))
+            markUsableFrames(start, end, reserved, reservedCount);
+    }
+
+    addAvailableFrames();
+}
+
+// Logs the memory map and the free blocks of each order
+void pageAllocDump(void)
+{
+    static const char* const typeNames[] =
+    {
+        "", "usable", "reserved", "ACPI reclaimable", "ACPI NVS", "bad",
+    };
+
+    logPuts("Memory map:\n");
+    for (unsigned i = 0; i < g_MemoryMapCount; i++)
+    {
+        const MemoryMapEntry* entry = &g_MemoryMap[i];
+        logPrintf("  %016llx - %016llx  %s\n", entry->Base, entry->Base + entry->Length - 1,
+                  entry->Type < sizeof(typeNames) / sizeof(typeNames[0]) && entry->Type
+                  ? typeNames[entry->Type] : "reserved");
+    }
+
+    logPrintf("Memory: %u KB managed, %u KB free, frames at %p\n",
+              g_ManagedPages * (PAGE_SIZE / 1024), g_FreePages * (PAGE_SIZE / 1024),
+              (void*) g_PageFrames);
+    logPuts("  Free blocks per order:");
+    for (unsigned order = 0; order <= PAGE_MAX_ORDER; order++)
+        logPrintf(" %u", g_FreeBlocks[order]);
+    logPuts("\n");
+}
@@ -0,0 +1,44 @@
+// =============================================================================
+// PHYSICAL PAGE ALLOCATOR
+// =============================================================================
+//
+// Buddy allocator for physical memory in blocks of 2^order pages, built from
+// the BIOS memory map of stage2
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "boot_info.h"
+
+#define PAGE_SIZE               4096
+#define PAGE_SHIFT              12
+#define PAGE_MAX_ORDER          10              // Largest block: 2^10 pages = 4MB
+
+#define PAGE_FRAME_RESERVED     0x01            // Not managed (firmware, kernel, hole)
+#define PAGE_FRAME_FREE         0x02            // First page of a free block
+#define PAGE_FRAME_SLAB         0x04            // Page of a slab (see slab.h)
+
+struct SlabCache;
+
+// Descriptor of one physical page
+typedef struct PageFrame
+{
+    struct PageFrame* Next;                    // Free list or slab list link
+    struct PageFrame* Previous;
+    struct SlabCache* Cache;                   // Slab pages: cache owning the slab
+    void* FreeObjects;                         // First page of a slab: free objects
+    uint16_t InUse;                            // First page of a slab: allocated objects
+    uint8_t Order;                             // First page of a block: its order
+    uint8_t Flags;                             // PAGE_FRAME_*
+
+} PageFrame;
+
+void pageAllocInit(const BootInfo* bootInfo);
+void* pageAlloc(unsigned order);
+void pageFree(void* block);
+PageFrame* pageFrameOf(const void* address);
+void* pageFrameAddress(const PageFrame* frame);
+size_t pageFreeCount(void);
+void pageAllocDump(void);
@@ -0,0 +1,260 @@
+// =============================================================================
+// PAGING
+// =============================================================================
+//
+// Takes over the page directory entry.asm enabled paging with (see paging.h
+// for the layout). The boot page table that mapped the first 4MB at 0 and at
+// KERNEL_VIRTUAL_BASE is replaced by a 4MB page where PSE is available and
+// the identity mapping is dropped. Kernel mappings are global where the
+// processor has PGE, so they survive CR3 reloads.
+//
+// Device memory (memory-mapped registers above the direct map) is mapped
+// uncached with 4KB pages into its own window, one range after the other;
+// mappings are never removed.
+//
+// Page tables are taken from a small pool in the BSS until
+// the page allocator runs, which is enough to map its frame array, then from
+// the page allocator. They are filled through the page table window of the
+// recursive directory entry, so a new table is never touched through a
+// mapping that does not exist yet. The page allocator must not fault itself:
+// pageAllocInit touches its whole frame array before anything is allocated.
+//
+// All CPUs share the page directory. Mappings are only ever added, under a
+// spinlock; a CPU faulting on a region another CPU has just mapped finds the
+// entry present and retries.
+
+#include "paging.h"
+
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "idt.h"
+#include "log.h"
+#include "page_alloc.h"
+#include "spinlock.h"
+#include "string.h"
+
+#define PAGE_PRESENT            0x001
+#define PAGE_WRITABLE           0x002
+#define PAGE_WRITE_THROUGH      0x008
+#define PAGE_CACHE_DISABLE      0x010
+#define PAGE_LARGE              0x080           // Directory entry maps a 4MB page
+#define PAGE_GLOBAL             0x100           // Kept in the TLB on CR3 reloads
+
+// Error code of a page fault
+#define PAGE_FAULT_PROTECTION   0x01            // Page present, access not allowed
+#define PAGE_FAULT_WRITE        0x02
+#define PAGE_FAULT_USER         0x04
+
+#define PAGE_ENTRIES            1024            // Entries of a page directory or table
+#define DIRECTORY_INDEX(address) ((uint32_t) (address) >> 22)
+#define RECURSIVE_INDEX         1023            // Directory entry pointing to the directory
+#define PAGE_TABLES_ADDRESS     0xFFC00000u     // Table of directory entry i at + i * PAGE_SIZE
+
+#define DEVICE_MAP_ADDRESS      (KERNEL_VIRTUAL_BASE + DIRECT_MAP_SIZE)
+#define DEVICE_MAP_END          PAGE_TABLES_ADDRESS
+
+#define EARLY_PAGE_TABLES       8               // Pool used before pageAllocInit (32MB)
+
+extern uint32_t boot_page_directory[PAGE_ENTRIES]; // From entry.asm
+extern uint32_t boot_page_table[PAGE_ENTRIES];
+
+static uint32_t g_EarlyPageTables[EARLY_PAGE_TABLES][PAGE_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
+static unsigned g_EarlyPageTablesUsed;
+
+static bool g_LargePages;                      // PSE: the direct map uses 4MB pages
+static uint32_t g_GlobalFlag;                  // PAGE_GLOBAL with PGE, 0 without
+static unsigned g_DirectMapRegions;            // 4MB regions mapped by the fault handler
+static unsigned g_PageTables;                  // Page tables allocated
+static uint32_t g_DeviceMapNext = DEVICE_MAP_ADDRESS; // Next free address of the device window
+static Spinlock g_PagingLock = SPINLOCK_INIT;  // Protects the directory, the tables and the above
+
+// Allocates a page table
+// Returns its physical address, 0 if no memory is left
+static uint32_t pageTableAlloc(void)
+{
+    if (g_EarlyPageTablesUsed < EARLY_PAGE_TABLES)
+        return virtualToPhysical(g_EarlyPageTables[g_EarlyPageTablesUsed++]);
+
+    void* page = pageAlloc(0);
+    return page ? virtualToPhysical(page) : 0;
+}
+
+// Allocates and installs the page table of a directory entry
+// Returns the table through the page table window, NULL if no memory is left
+// (the entries are not initialized)
+static uint32_t* installPageTable(uint32_t index)
+{
+    uint32_t table = pageTableAlloc();
+    if (!table)
+        return NULL;
+
+    boot_page_directory[index] = table | PAGE_WRITABLE | PAGE_PRESENT;
+    uint32_t* entries = (uint32_t*) (PAGE_TABLES_ADDRESS + index * PAGE_SIZE);
+    invalidatePage(entries);
+    g_PageTables++;
+    return entries;
+}
+
+// Maps the 4MB region of the direct map containing an address
+// Returns false if no page table could be allocated
+// Called with g_PagingLock held
+static bool mapDirectRegion(uint32_t address)
+{
+    uint32_t index = DIRECTORY_INDEX(address);
+    uint32_t physical = (address - KERNEL_VIRTUAL_BASE) & ~(LARGE_PAGE_SIZE - 1);
+
+    if (boot_page_directory[index] & PAGE_PRESENT)
+    {
+        invalidatePage((const void*) address); // Already mapped, stale TLB entry
+        return true;
+    }
+
+    if (g_LargePages)
+    {
+        boot_page_directory[index] = physical | g_GlobalFlag | PAGE_LARGE | PAGE_WRITABLE | PAGE_PRESENT;
+    }
+    else
+    {
+        uint32_t* entries = installPageTable(index);
+        if (!entries)
+            return false;
+
+        for (unsigned i = 0; i < PAGE_ENTRIES; i++)
+            entries[i] = (physical + i * PAGE_SIZE) | g_GlobalFlag | PAGE_WRITABLE | PAGE_PRESENT;
+    }
+
+    g_DirectMapRegions++;
+    return true;
+}
+
+// Page fault handler: maps the direct map on first touch, anything else is fatal
+static void pageFault(InterruptFrame* frame)
+{
+    uint32_t address = readCr2();
+
+    if (!(frame->ErrorCode & (PAGE_FAULT_PROTECTION | PAGE_FAULT_USER))
+        && address - KERNEL_VIRTUAL_BASE < DIRECT_MAP_SIZE)
+    {
+        spinLock(&g_PagingLock);               // Interrupts are disabled in the handler
+        bool mapped = mapDirectRegion(address);
+        spinUnlock(&g_PagingLock);
+        if (mapped)
+            return;                            // Retry the access
+    }
+
+    logPrintf("Page fault: %s of %08x, %s\n",
+              frame->ErrorCode & PAGE_FAULT_WRITE ? "write" : "read", address,
+              frame->ErrorCode & PAGE_FAULT_PROTECTION ? "access denied" : "not mapped");
+    interruptPanic(frame, "Page fault");
+}
+
+// Switches from the boot mappings of entry.asm to the kernel layout
+// The IDT must be loaded (installs the page fault handler)
+void pagingInit(void)
+{
+    uint32_t features = cpuFeatures().Edx;
+    uint32_t cr4 = readCr4();
+    if (features & CPUID_FEATURE_PSE)
+    {
+        g_LargePages = true;
+        cr4 |= CR4_PSE;
+    }
+    if (features & CPUID_FEATURE_PGE)
+    {
+        g_GlobalFlag = PAGE_GLOBAL;
+        cr4 |= CR4_PGE;
+    }
+    writeCr4(cr4);
+
+    interruptSetHandler(EXCEPTION_PAGE_FAULT, pageFault);
+
+    uint32_t* directory = boot_page_directory;
+    directory[RECURSIVE_INDEX] = virtualToPhysical(directory) | PAGE_WRITABLE | PAGE_PRESENT;
+
+    // First 4MB: kernel image and boot data, same translation as before
+    uint32_t kernelIndex = DIRECTORY_INDEX(KERNEL_VIRTUAL_BASE);
+    if (g_LargePages)
+    {
+        directory[kernelIndex] = g_GlobalFlag | PAGE_LARGE | PAGE_WRITABLE | PAGE_PRESENT;
+    }
+    else
+    {
+        for (unsigned i = 0; i < PAGE_ENTRIES; i++)
+            boot_page_table[i] |= g_GlobalFlag;
+    }
+
+    directory[0] = 0;                          // No identity mapping
+    writeCr3(virtualToPhysical(directory));    // Flush the TLB
+}
+
+// Maps the first 4MB at 0 again for the start-up code of application
+// processors, which enables paging while running from low memory. The entry
+// is not global and those processors start without PGE, so a CR3 reload
+// after pagingUnmapIdentity drops it from every TLB
+void pagingMapIdentity(void)
+{
+    boot_page_directory[0] = boot_page_directory[DIRECTORY_INDEX(KERNEL_VIRTUAL_BASE)] & ~PAGE_GLOBAL;
+}
+
+void pagingUnmapIdentity(void)
+{
+    boot_page_directory[0] = 0;
+    writeCr3(readCr3());
+}
+
+// Maps device registers into the device window (locked)
+static void* mapDevice(uint32_t physical, uint32_t size)
+{
+    uint32_t offset = physical & (PAGE_SIZE - 1);
+    uint32_t pages = (offset + size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    if (pages > (DEVICE_MAP_END - g_DeviceMapNext) >> PAGE_SHIFT)
+        return NULL;
+
+    uint32_t address = g_DeviceMapNext;
+    physical -= offset;
+    for (uint32_t i = 0; i < pages; i++)
+    {
+        uint32_t page = address + i * PAGE_SIZE;
+        uint32_t index = DIRECTORY_INDEX(page);
+        uint32_t* entries = (uint32_t*) (PAGE_TABLES_ADDRESS + index * PAGE_SIZE);
+        if (!(boot_page_directory[index] & PAGE_PRESENT))
+        {
+            entries = installPageTable(index);
+            if (!entries)
+                return NULL;
+            memset(entries, 0, PAGE_SIZE);
+        }
+
+        entries[(page >> PAGE_SHIFT) & (PAGE_ENTRIES - 1)] = (physical + i * PAGE_SIZE)
+            | g_GlobalFlag | PAGE_CACHE_DISABLE | PAGE_WRITE_THROUGH | PAGE_WRITABLE | PAGE_PRESENT;
+        invalidatePage((const void*) page);
+    }
+
+    g_DeviceMapNext += pages * PAGE_SIZE;
+    return (void*) (address + offset);
+}
+
+// Maps device registers (uncached) into the device window
+// Parameters:
+//   physical - physical address of the registers
+//   size - size of the register range in bytes
+// Returns the virtual address of physical, NULL if the window is full or no
+// page table could be allocated
+void* pagingMapDevice(uint32_t physical, uint32_t size)
+{
+    uint32_t flags = interruptsSave();
+    spinLock(&g_PagingLock);
+    void* address = mapDevice(physical, size);
+    spinUnlock(&g_PagingLock);
+    interruptsRestore(flags);
+    return address;
+}
+
+// Logs how the direct map was mapped so far
+void pagingDump(void)
+{
+    logPrintf("Paging: %s pages%s, %u MB of the direct map mapped on demand, %u page tables\n",
+              g_LargePages ? "4MB" : "4KB", g_GlobalFlag ? " (global)" : "",
+              g_DirectMapRegions * (LARGE_PAGE_SIZE >> 20), g_PageTables);
+}
@@ -0,0 +1,45 @@
+// =============================================================================
+// PAGING
+// =============================================================================
+//
+// Virtual memory layout of the kernel:
+// - 0xC0000000 - 0xF7FFFFFF  direct map of physical memory 0 - 896MB; the
+//                            kernel image is part of it (linked at
+//                            KERNEL_VIRTUAL_BASE + its load address)
+// - 0xF8000000 - 0xFFBFFFFF  device memory (uncached, see pagingMapDevice)
+// - 0xFFC00000 - 0xFFFFFFFF  page tables (the last directory entry points to
+//                            the page directory itself)
+// Nothing is mapped below KERNEL_VIRTUAL_BASE once pagingInit has run, so
+// null pointers fault (except while application processors start, see
+// pagingMapIdentity)
+//
+// Only the first 4MB (kernel image, boot data of the bootloader, VGA) is
+// mapped up front. The rest of the direct map is mapped on first touch by the
+// page fault handler, 4MB at a time: as one 4MB page where the processor has
+// PSE, otherwise through a page table allocated for it
+
+#pragma once
+
+#include <stdint.h>
+
+#define KERNEL_VIRTUAL_BASE     0xC0000000u     // Also in entry.asm and linker.ld
+#define DIRECT_MAP_SIZE         0x38000000u     // Physical memory reachable through the direct map
+#define LARGE_PAGE_SIZE         0x400000u       // Mapped by one page directory entry
+
+// Address of physical memory in the direct map (below DIRECT_MAP_SIZE)
+static inline void* physicalToVirtual(uint32_t physical)
+{
+    return (void*) (physical + KERNEL_VIRTUAL_BASE);
+}
+
+// Physical address of a direct map address
+static inline uint32_t virtualToPhysical(const void* address)
+{
+    return (uint32_t) address - KERNEL_VIRTUAL_BASE;
+}
+
+void pagingInit(void);
+void* pagingMapDevice(uint32_t physical, uint32_t size);
+void pagingMapIdentity(void);
+void pagingUnmapIdentity(void);
+void pagingDump(void);
@@ -0,0 +1,72 @@
+// =============================================================================
+// PCI CONFIGURATION SPACE
+// =============================================================================
+
+#include "pci.h"
+
+#include "io.h"
+
+#define PCI_CONFIG_ADDRESS      0xCF8
+#define PCI_CONFIG_DATA         0xCFC
+#define PCI_CONFIG_ENABLE       0x80000000u
+
+#define PCI_VENDOR_NONE         0xFFFF          // Vendor ID read from an empty slot
+#define PCI_HEADER_TYPE         0x0C            // Byte 2 of the register at 0x0C
+#define PCI_MULTIFUNCTION       0x80
+
+static inline uint32_t configAddress(PciAddress address, uint8_t offset)
+{
+    return PCI_CONFIG_ENABLE | (address.Bus << 16) | (address.Device << 11) | (address.Function << 8)
+           | (offset & 0xFC);
+}
+
+// Reads the configuration register that holds an offset (aligned to 4 bytes)
+uint32_t pciRead(PciAddress address, uint8_t offset)
+{
+    outl(PCI_CONFIG_ADDRESS, configAddress(address, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+// Writes a configuration register (offset aligned to 4 bytes)
+void pciWrite(PciAddress address, uint8_t offset, uint32_t value)
+{
+    outl(PCI_CONFIG_ADDRESS, configAddress(address, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+// Finds the first function of a class by scanning every bus
+// Parameters:
+//   classCode - Base class (e.g. 0x01 mass storage)
+//   subclass - Subclass (e.g. 0x01 IDE)
+//   addressOut - Receives the address of the function
+// Returns: true if found, false otherwise (or without PCI)
+bool pciFindClass(uint8_t classCode, uint8_t subclass, PciAddress* addressOut)
+{
+    for (unsigned bus = 0; bus < 256; bus++)
+    {
+        for (uint8_t device = 0; device < 32; device++)
+        {
+            for (uint8_t function = 0; function < 8; function++)
+            {
+                PciAddress address = { (uint8_t) bus, device, function };
+                if ((pciRead(address, 0) & 0xFFFF) == PCI_VENDOR_NONE)
+                {
+                    if (function == 0)
+                        break;                 // Empty slot
+                    continue;
+                }
+
+                uint32_t class = pciRead(address, PCI_CLASS);
+                if ((class >> 24) == classCode && ((class >> 16) & 0xFF) == subclass)
+                {
+                    *addressOut = address;
+                    return true;
+                }
+
+                if (function == 0 && !((pciRead(address, PCI_HEADER_TYPE) >> 16) & PCI_MULTIFUNCTION))
+                    break;                     // Single function device
+            }
+        }
+    }
+    return false;
+}
@@ -0,0 +1,29 @@
+// =============================================================================
+// PCI CONFIGURATION SPACE
+// =============================================================================
+//
+// Configuration access mechanism #1 (ports 0xCF8/0xCFC), enough for drivers
+// to find their controller by class and read its base address registers
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PCI_COMMAND             0x04            // Command register (16 bits)
+#define PCI_CLASS               0x08            // Revision, programming interface, subclass, class
+#define PCI_BAR0                0x10            // Base address registers, 4 bytes each
+#define PCI_COMMAND_IO          0x0001          // I/O space decoding
+#define PCI_COMMAND_MASTER      0x0004          // Bus mastering
+
+typedef struct
+{
+    uint8_t Bus;
+    uint8_t Device;
+    uint8_t Function;
+
+} PciAddress;
+
+uint32_t pciRead(PciAddress address, uint8_t offset);
+void pciWrite(PciAddress address, uint8_t offset, uint32_t value);
+bool pciFindClass(uint8_t classCode, uint8_t subclass, PciAddress* addressOut);
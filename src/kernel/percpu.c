@@ -0,0 +1,29 @@
+// =============================================================================
+// PER-CPU DATA
+// =============================================================================
+
+#include "percpu.h"
+
+#include "gdt.h"
+
+PerCpu g_Cpus[MAX_CPUS];
+unsigned g_CpuCount;
+
+// Sets up the PerCpu structure of the executing CPU and loads its segment
+// into GS; called once by every CPU, after gdtInit
+// Parameters:
+//   index - CPU index (0 for the bootstrap processor)
+//   apicId - local APIC ID of the CPU
+void perCpuInit(unsigned index, uint32_t apicId)
+{
+    PerCpu* cpu = &g_Cpus[index];
+    cpu->Self = cpu;
+    cpu->Index = index;
+    cpu->ApicId = apicId;
+
+    uint16_t selector = gdtSetCpuSegment(index, cpu, sizeof(PerCpu));
+    __asm__ volatile ("movw %0, %%gs" : : "r"(selector) : "memory");
+
+    if (index >= g_CpuCount)
+        g_CpuCount = index + 1;
+}
@@ -0,0 +1,64 @@
+// =============================================================================
+// PER-CPU DATA
+// =============================================================================
+//
+// Each CPU has a PerCpu structure, reachable through its own GS segment
+// (see gdt.h): cpuCurrent reads the self pointer at GS:0 in one instruction,
+// without locks or APIC accesses. GS is loaded once per CPU and never saved
+// or restored, so a thread that moves to another CPU sees the new one.
+// The structures are cache line aligned: counters one CPU updates on every
+// tick never share a line with another CPU's
+
+#pragma once
+
+#include <stdint.h>
+
+#include "cpu.h"
+#include "spinlock.h"
+
+#define MAX_CPUS                16
+
+struct Thread;
+
+// Threads ready to run on one CPU, in FIFO order
+typedef struct
+{
+    Spinlock Lock;                             // Taken by this CPU and by CPUs stealing from it
+    struct Thread* Head;
+    struct Thread* Tail;
+    volatile unsigned Length;
+
+} RunQueue;
+
+typedef struct PerCpu
+{
+    struct PerCpu* Self;                       // At GS:0, see cpuCurrent
+    unsigned Index;                            // 0 = bootstrap processor
+    uint32_t ApicId;
+
+    struct Thread* Current;                    // Running thread
+    struct Thread* Idle;                       // Runs when nothing else is ready
+    struct Thread* Previous;                   // Switched away from, see scheduler.c
+    RunQueue Queue;
+    unsigned SliceTicks;                       // Ticks left in the time slice of Current
+    uint64_t NextDeadline;                     // TSC value of the next tick (TSC-deadline timer)
+
+    uint32_t Ticks;                            // Timer ticks handled
+    uint32_t IdleTicks;                        // ... while the idle thread ran
+    uint32_t Switches;                         // Context switches
+    uint32_t Steals;                           // Threads taken from other CPUs
+
+} __attribute__((aligned(CACHE_LINE_SIZE))) PerCpu;
+
+extern PerCpu g_Cpus[MAX_CPUS];
+extern unsigned g_CpuCount;                    // CPUs running the kernel
+
+void perCpuInit(unsigned index, uint32_t apicId);
+
+// Returns the PerCpu structure of the executing CPU
+static inline PerCpu* cpuCurrent(void)
+{
+    PerCpu* cpu;
+    __asm__ volatile ("movl %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
@@ -0,0 +1,102 @@
+// =============================================================================
+// 8259A PROGRAMMABLE INTERRUPT CONTROLLER
+// =============================================================================
+//
+// Both controllers are initialized in cascade mode (slave on IRQ 2) with
+// every IRQ masked; drivers unmask their IRQ through irqRegister. The mask
+// is cached, so masking and unmasking cost one port write.
+//
+// A PIC raises IRQ 7 (master) or IRQ 15 (slave) when a request disappears
+// before it is acknowledged. Such a spurious IRQ is not in service and must
+// not get an end of interrupt, except for the master's cascade input in the
+// slave case
+
+#include "pic.h"
+
+#include <stdint.h>
+
+#include "io.h"
+
+#define PIC1_COMMAND            0x20            // Master PIC command port
+#define PIC1_DATA               0x21            // Master PIC mask register
+#define PIC2_COMMAND            0xA0            // Slave PIC command port
+#define PIC2_DATA               0xA1            // Slave PIC mask register
+
+#define PIC_ICW1_INIT           0x11            // Initialization, ICW4 follows
+#define PIC_ICW4_8086           0x01            // 8086 mode, normal end of interrupt
+#define PIC_OCW3_READ_ISR       0x0B            // Next read of the command port returns the ISR
+#define PIC_EOI                 0x20            // Non-specific end of interrupt
+#define PIC_CASCADE_IRQ         2               // Slave PIC input of the master
+
+static uint16_t g_PicMask = 0xFFFF;            // Bit set = IRQ masked (slave in the high byte)
+
+// Writes a byte to a PIC port after the previous one settled (old boards
+// need a short delay between initialization words; port 80h is unused)
+static void picWrite(uint16_t port, uint8_t value)
+{
+    outb(port, value);
+    outb(0x80, 0);
+}
+
+// Remaps both PICs to PIC_VECTOR_BASE, all IRQs masked
+void picInit(void)
+{
+    picWrite(PIC1_COMMAND, PIC_ICW1_INIT);
+    picWrite(PIC2_COMMAND, PIC_ICW1_INIT);
+    picWrite(PIC1_DATA, PIC_VECTOR_BASE);          // ICW2: vector of IRQ 0
+    picWrite(PIC2_DATA, PIC_VECTOR_BASE + 8);      // ICW2: vector of IRQ 8
+    picWrite(PIC1_DATA, 1 << PIC_CASCADE_IRQ);     // ICW3: slave on IRQ 2
+    picWrite(PIC2_DATA, PIC_CASCADE_IRQ);          // ICW3: cascade identity
+    picWrite(PIC1_DATA, PIC_ICW4_8086);
+    picWrite(PIC2_DATA, PIC_ICW4_8086);
+
+    g_PicMask = 0xFFFF & ~(1 << PIC_CASCADE_IRQ);  // The cascade input feeds IRQ 8-15
+    outb(PIC1_DATA, g_PicMask & 0xFF);
+    outb(PIC2_DATA, g_PicMask >> 8);
+}
+
+// Writes the cached mask of the PIC an IRQ belongs to
+static void picWriteMask(unsigned irq)
+{
+    if (irq < 8)
+        outb(PIC1_DATA, g_PicMask & 0xFF);
+    else
+        outb(PIC2_DATA, g_PicMask >> 8);
+}
+
+void picMask(unsigned irq)
+{
+    g_PicMask |= 1 << irq;
+    picWriteMask(irq);
+}
+
+void picUnmask(unsigned irq)
+{
+    g_PicMask &= ~(1 << irq);
+    picWriteMask(irq);
+}
+
+// Returns true if IRQ 7 or 15 was raised without being in service; a
+// spurious IRQ 15 is acknowledged at the master, which did see a request
+bool picIsSpurious(unsigned irq)
+{
+    if (irq != 7 && irq != 15)
+        return false;
+
+    uint16_t port = irq < 8 ? PIC1_COMMAND : PIC2_COMMAND;
+    outb(port, PIC_OCW3_READ_ISR);
+    if (inb(port) & 0x80)
+        return false;                          // IRQ 7 of that PIC is in service
+
+    if (irq == 15)
+        outb(PIC1_COMMAND, PIC_EOI);
+    return true;
+}
+
+// Acknowledges an IRQ (IRQs of the slave at both PICs)
+void picEndOfInterrupt(unsigned irq)
+{
+    if (irq >= 8)
+        outb(PIC2_COMMAND, PIC_EOI);
+    outb(PIC1_COMMAND, PIC_EOI);
+}
@@ -0,0 +1,20 @@
+// =============================================================================
+// 8259A PROGRAMMABLE INTERRUPT CONTROLLER
+// =============================================================================
+//
+// The master and slave PIC are remapped from the BIOS vectors (08h-0Fh and
+// 70h-77h, which collide with processor exceptions) to PIC_VECTOR_BASE
+// (IRQ 0-15 = vectors 32-47)
+
+#pragma once
+
+#include <stdbool.h>
+
+#define PIC_VECTOR_BASE         32              // Vector of IRQ 0
+#define PIC_IRQ_COUNT           16
+
+void picInit(void);
+void picMask(unsigned irq);
+void picUnmask(unsigned irq);
+bool picIsSpurious(unsigned irq);
+void picEndOfInterrupt(unsigned irq);
@@ -0,0 +1,50 @@
+// =============================================================================
+// 8253/8254 PROGRAMMABLE INTERVAL TIMER
+// =============================================================================
+
+#include "pit.h"
+
+#include "io.h"
+
+#define PIT_CHANNEL0            0x40            // Channel 0 counter (IRQ 0)
+#define PIT_CHANNEL2            0x42            // Channel 2 counter (speaker)
+#define PIT_COMMAND             0x43            // Mode/command register
+#define PIT_GATE_PORT           0x61            // System control port B
+
+#define PIT_CHANNEL0_RATE       0x34            // Channel 0, low then high byte, mode 2 (rate generator)
+#define PIT_CHANNEL2_ONE_SHOT   0xB0            // Channel 2, low then high byte, mode 0 (interrupt on terminal count)
+
+#define PIT_GATE2               0x01            // Port 61h: gate of channel 2
+#define PIT_SPEAKER             0x02            // Port 61h: speaker data enable
+#define PIT_OUT2                0x20            // Port 61h: output of channel 2
+
+// Programs channel 0 to interrupt periodically at about frequency Hz
+// Returns the frequency actually programmed (the divisor is an integer)
+uint32_t pitStartPeriodic(uint32_t frequency)
+{
+    uint32_t divisor = (PIT_FREQUENCY + frequency / 2) / frequency;
+    if (divisor < 1)
+        divisor = 1;
+    else if (divisor > 0x10000)
+        divisor = 0x10000;                     // Written as 0
+
+    outb(PIT_COMMAND, PIT_CHANNEL0_RATE);
+    outb(PIT_CHANNEL0, divisor & 0xFF);
+    outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF);
+    return (PIT_FREQUENCY + divisor / 2) / divisor;
+}
+
+// Busy-waits ticks periods of the PIT input clock (1/PIT_FREQUENCY s each)
+// using channel 2; needs no interrupts, so it works before any are set up
+void pitWait(uint16_t ticks)
+{
+    // Gate on (counting), speaker off
+    outb(PIT_GATE_PORT, (inb(PIT_GATE_PORT) & ~PIT_SPEAKER) | PIT_GATE2);
+
+    outb(PIT_COMMAND, PIT_CHANNEL2_ONE_SHOT);  // OUT2 goes low
+    outb(PIT_CHANNEL2, ticks & 0xFF);
+    outb(PIT_CHANNEL2, ticks >> 8);            // Counting starts
+
+    while (!(inb(PIT_GATE_PORT) & PIT_OUT2))
+        ;                                      // OUT2 goes high at the terminal count
+}
@@ -0,0 +1,18 @@
+// =============================================================================
+// 8253/8254 PROGRAMMABLE INTERVAL TIMER
+// =============================================================================
+//
+// Channel 0 (IRQ 0) is the periodic timer of the kernel without a local APIC.
+// Channel 2 (the speaker channel, readable through port 61h without any
+// interrupt) is the reference clock for calibrating the TSC and the local
+// APIC timer
+
+#pragma once
+
+#include <stdint.h>
+
+#define PIT_FREQUENCY           1193182         // Input clock in Hz
+#define PIT_IRQ                 0
+
+uint32_t pitStartPeriodic(uint32_t frequency);
+void pitWait(uint16_t ticks);
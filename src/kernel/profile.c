@@ -0,0 +1,238 @@
+// =============================================================================
+// SAMPLING PROFILER AND TRACEPOINTS
+// =============================================================================
+//
+// A ring holds PROFILE_RING_RECORDS records and counts them in Head, which
+// only grows: the record slot is Head modulo the size, and Head beyond the
+// size means the oldest records were overwritten. The owning CPU fills a
+// slot and then publishes it by advancing Head (release), with interrupts
+// disabled so a tick cannot record in between; nothing else writes a ring.
+//
+// The stack walk follows the saved EBP chain from the interrupted frame. It
+// only reads inside the stack of the running thread, and each frame must
+// be above the previous one, so a function that does not keep EBP as frame
+// pointer (the assembly stubs, or a sample in a prologue) ends the walk
+// instead of faulting. Threads running on a CPU boot stack get the EIP only.
+//
+// The dump, all little endian:
+//   PROFILE_MAGIC, uint32 TSC kHz (0 if not calibrated), uint32 CPU count
+//   uint32 type count, then per type: uint8 length, name (type 0: samples)
+//   uint32 thread count, then per thread: uint16 ID, uint8 length, name
+//   per CPU: uint32 records, uint32 records lost, then every record as
+//     uint64 TSC, uint8 type, uint8 count, uint16 thread ID and count
+//     uint32 of Data (ProfileRecord without its unused entries)
+//   uint32 FNV-1a hash of every byte before it, PROFILE_END_MAGIC
+// It is sent through the serial log between messages, so other CPUs may
+// keep logging; the hash tells the host tool the dump arrived intact
+
+#include "profile.h"
+
+#include <stddef.h>
+
+#include "cpu.h"
+#include "log.h"
+#include "page_alloc.h"
+#include "percpu.h"
+#include "scheduler.h"
+#include "string.h"
+#include "timer.h"
+
+#define PROFILE_RING_RECORDS    2048            // Power of 2 that fits in PROFILE_RING_ORDER pages
+#define PROFILE_RING_MASK       (PROFILE_RING_RECORDS - 1)
+#define PROFILE_MAX_THREADS     64              // Threads named in a dump
+
+typedef struct
+{
+    ProfileRecord* Records;                    // NULL: the CPU does not record
+    volatile uint32_t Head;                    // Records written so far
+
+} __attribute__((aligned(CACHE_LINE_SIZE))) ProfileRing;
+
+volatile bool g_ProfileEnabled;
+static ProfileRing g_ProfileRings[MAX_CPUS];
+
+// Names of the record types in the dump
+static const char* const g_ProfileTypeNames[TRACE_COUNT] =
+{
+    [PROFILE_SAMPLE]       = "sample",
+    [TRACE_DISK_READ]      = "disk read",
+    [TRACE_BUFFER_MISS]    = "buffer cache miss",
+    [TRACE_FAT_LOOKUP]     = "FAT directory lookup",
+    [TRACE_CONTEXT_SWITCH] = "context switch",
+};
+
+// Sets up a ring for every running CPU and starts recording in -DPROFILE
+// kernels; called once the application processors run
+void profileInit(void)
+{
+#ifdef PROFILE
+    _Static_assert(PROFILE_RING_RECORDS * sizeof(ProfileRecord) <= (PAGE_SIZE << PROFILE_RING_ORDER),
+                   "Profile ring larger than its pages");
+
+    for (unsigned i = 0; i < g_CpuCount; i++)
+    {
+        g_ProfileRings[i].Records = pageAlloc(PROFILE_RING_ORDER);
+        if (!g_ProfileRings[i].Records)
+        {
+            logPrintf("Profile: out of memory for CPU %u\n", i);
+            return;                            // The CPUs after it do not record
+        }
+    }
+    g_ProfileEnabled = true;
+    logPrintf("Profile: recording on %u CPUs, %u records each\n", g_CpuCount, PROFILE_RING_RECORDS);
+#endif
+}
+
+// Takes the next record of the ring of the executing CPU (interrupts disabled)
+// Returns NULL if the CPU does not record
+static ProfileRecord* recordBegin(PerCpu* cpu)
+{
+    ProfileRing* ring = &g_ProfileRings[cpu->Index];
+    if (!ring->Records)
+        return NULL;
+
+    ProfileRecord* record = &ring->Records[ring->Head & PROFILE_RING_MASK];
+    record->Timestamp = readTimestamp();
+    record->Thread = (uint16_t) cpu->Current->Id;
+    return record;
+}
+
+// Publishes the record taken by recordBegin
+static void recordEnd(PerCpu* cpu)
+{
+    ProfileRing* ring = &g_ProfileRings[cpu->Index];
+    __atomic_store_n(&ring->Head, ring->Head + 1, __ATOMIC_RELEASE);
+}
+
+// Records a sample of the interrupted code (timer tick, interrupts disabled)
+void profileSample(const InterruptFrame* frame)
+{
+    if (!g_ProfileEnabled)
+        return;
+
+    PerCpu* cpu = cpuCurrent();
+    ProfileRecord* record = recordBegin(cpu);
+    if (!record)
+        return;
+
+    record->Type = PROFILE_SAMPLE;
+    record->Data[0] = frame->Eip;
+    unsigned count = 1;
+
+    // The interrupted code runs on the stack the frame was pushed on
+    const Thread* thread = cpu->Current;
+    uint32_t low = (uint32_t) frame;
+    uint32_t high = (uint32_t) thread->Stack + THREAD_STACK_SIZE;
+    if (thread->Stack && low >= (uint32_t) thread->Stack && low < high)
+    {
+        uint32_t ebp = frame->Ebp;
+        while (count < PROFILE_DEPTH && ebp >= low && ebp <= high - 8 && !(ebp & 3))
+        {
+            const uint32_t* stackFrame = (const uint32_t*) ebp;
+            record->Data[count++] = stackFrame[1];  // Return address
+            if (stackFrame[0] <= ebp)
+                break;                         // Not a caller's frame
+            ebp = stackFrame[0];
+        }
+    }
+    record->Count = (uint8_t) count;
+    recordEnd(cpu);
+}
+
+// Records a tracepoint event (see trace in profile.h)
+void profileTrace(uint8_t type, uint32_t argument)
+{
+    uint32_t flags = interruptsSave();
+    PerCpu* cpu = cpuCurrent();
+    ProfileRecord* record = recordBegin(cpu);
+    if (record)
+    {
+        record->Type = type;
+        record->Count = 1;
+        record->Data[0] = argument;
+        recordEnd(cpu);
+    }
+    interruptsRestore(flags);
+}
+
+static uint32_t g_DumpHash;
+
+// Sends bytes of the dump and adds them to its hash
+static void dumpWrite(const void* data, size_t size)
+{
+    const uint8_t* bytes = data;
+    for (size_t i = 0; i < size; i++)
+        g_DumpHash = (g_DumpHash ^ bytes[i]) * 16777619u;
+    logWriteBinary(data, size);
+}
+
+static void dumpWord(uint32_t value)
+{
+    dumpWrite(&value, sizeof(value));
+}
+
+// Sends a name (at most 255 bytes) preceded by its length
+static void dumpName(const char* name)
+{
+    size_t length = strlen(name);
+    uint8_t byte = length > 255 ? 255 : (uint8_t) length;
+    dumpWrite(&byte, 1);
+    dumpWrite(name, byte);
+}
+
+// Stops recording and sends every ring over the serial port
+// Does nothing when the profiler is not recording
+void profileDump(void)
+{
+    if (!g_ProfileEnabled)
+        return;
+    g_ProfileEnabled = false;                  // No new records from here on
+
+    unsigned cpuCount = 0;
+    while (cpuCount < g_CpuCount && g_ProfileRings[cpuCount].Records)
+        cpuCount++;
+
+    logPrintf("Profile: dumping %u CPUs\n", cpuCount);
+    uint64_t khz = timerTimestampFrequency();
+    divide64(&khz, 1000);
+
+    g_DumpHash = 2166136261u;
+    dumpWrite(PROFILE_MAGIC, 8);
+    dumpWord((uint32_t) khz);
+    dumpWord(cpuCount);
+
+    dumpWord(TRACE_COUNT);
+    for (unsigned i = 0; i < TRACE_COUNT; i++)
+        dumpName(g_ProfileTypeNames[i]);
+
+    unsigned ids[PROFILE_MAX_THREADS];
+    const char* names[PROFILE_MAX_THREADS];
+    unsigned threads = threadList(ids, names, PROFILE_MAX_THREADS);
+    dumpWord(threads);
+    for (unsigned i = 0; i < threads; i++)
+    {
+        uint16_t id = (uint16_t) ids[i];
+        dumpWrite(&id, sizeof(id));
+        dumpName(names[i]);
+    }
+
+    for (unsigned i = 0; i < cpuCount; i++)
+    {
+        const ProfileRing* ring = &g_ProfileRings[i];
+        uint32_t head = __atomic_load_n(&ring->Head, __ATOMIC_ACQUIRE);
+        uint32_t count = head < PROFILE_RING_RECORDS ? head : PROFILE_RING_RECORDS;
+        dumpWord(count);
+        dumpWord(head - count);
+
+        for (uint32_t n = head - count; n != head; n++)
+        {
+            const ProfileRecord* record = &ring->Records[n & PROFILE_RING_MASK];
+            dumpWrite(record, offsetof(ProfileRecord, Data) + record->Count * sizeof(uint32_t));
+        }
+    }
+
+    uint32_t hash = g_DumpHash;
+    dumpWord(hash);
+    logWriteBinary(PROFILE_END_MAGIC, 8);
+    logPuts("\nProfile: dump done\n");
+}
@@ -0,0 +1,79 @@
+// =============================================================================
+// SAMPLING PROFILER AND TRACEPOINTS
+// =============================================================================
+//
+// Every timer tick records the interrupted EIP and the return addresses of
+// its frame pointer chain; tracepoints in hot paths record an event with
+// one argument. Records go to a ring of the executing CPU, which only that
+// CPU writes (with interrupts disabled), so recording takes no lock. When a
+// ring is full the oldest records are overwritten.
+//
+// The profiler only runs in kernels built with -DPROFILE (make
+// KERNEL_DEFINES=-DPROFILE), which also keeps the frame pointers the stack
+// walk needs; otherwise a tracepoint costs one test of g_ProfileEnabled.
+// profileDump sends the records over the serial port in the binary format
+// read by tools/profile (PROFILE_MAGIC ...), which turns them into a flame
+// graph and tracepoint statistics
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "idt.h"
+
+#define PROFILE_DEPTH           8               // EIP and return addresses kept per sample
+#define PROFILE_RING_ORDER      5               // Ring of a CPU: 2^5 pages
+#define PROFILE_MAGIC           "NBPROF01"      // Start of a dump
+#define PROFILE_END_MAGIC       "NBPROFEN"      // End of a dump, after its checksum
+
+// Record types: 0 for samples, the tracepoints from 1 on (the dump names them)
+typedef enum
+{
+    PROFILE_SAMPLE,
+    TRACE_DISK_READ,                           // Span: argument LBA, at the end sector count
+    TRACE_BUFFER_MISS,                         // Argument: LBA read by bufferGet
+    TRACE_FAT_LOOKUP,                          // Span: argument directory cluster (0 = root)
+    TRACE_CONTEXT_SWITCH,                      // Argument: ID of the next thread
+    TRACE_COUNT,
+
+} ProfileType;
+
+#define TRACE_END               0x80            // Type flag: ends the span of the tracepoint
+
+// One record of a ring, and of the dump without the unused Data entries
+typedef struct
+{
+    uint64_t Timestamp;                        // TSC
+    uint8_t Type;                              // ProfileType, with TRACE_END
+    uint8_t Count;                             // Entries of Data used
+    uint16_t Thread;                           // ID of the running thread
+    uint32_t Data[PROFILE_DEPTH];              // Samples: EIP, return addresses; tracepoints: argument
+
+} ProfileRecord;
+
+extern volatile bool g_ProfileEnabled;
+
+void profileInit(void);
+void profileSample(const InterruptFrame* frame);
+void profileTrace(uint8_t type, uint32_t argument);
+void profileDump(void);
+
+// Records an event of a tracepoint
+static inline void trace(ProfileType type, uint32_t argument)
+{
+    if (__builtin_expect(g_ProfileEnabled, 0))
+        profileTrace(type, argument);
+}
+
+// Records the start and the end of a span of a tracepoint
+static inline void traceBegin(ProfileType type, uint32_t argument)
+{
+    trace(type, argument);
+}
+
+static inline void traceEnd(ProfileType type, uint32_t argument)
+{
+    if (__builtin_expect(g_ProfileEnabled, 0))
+        profileTrace(type | TRACE_END, argument);
+}
@@ -0,0 +1,479 @@
+// =============================================================================
+// KERNEL THREADS AND SCHEDULER
+// =============================================================================
+//
+// The scheduler always runs with interrupts disabled, on the CPU it
+// schedules. A switch saves the old thread with contextSwitch and only then,
+// on the new thread's stack, puts the old thread back into the run queue
+// (finishSwitch): until its registers are saved no other CPU may steal it.
+// For the same reason threadWake waits until a blocked thread has left its
+// CPU before queueing it.
+//
+// Each CPU's idle thread is the context the CPU booted on (kernelMain on the
+// bootstrap processor). It is never queued and runs whenever the queue is
+// empty and nothing could be stolen. It tries again on every timer tick
+//
+// Dead threads are freed by the thread that runs after them, since a thread
+// cannot free the stack it runs on
+
+#include "scheduler.h"
+
+#include "cpu.h"
+#include "log.h"
+#include "percpu.h"
+#include "profile.h"
+#include "slab.h"
+#include "string.h"
+#include "timer.h"
+
+static SlabCache g_ThreadCache;
+static unsigned g_SliceTicks;                  // Timer ticks per time slice
+static unsigned g_NextThreadId;
+
+static Spinlock g_ThreadsLock = SPINLOCK_INIT; // Protects the thread list (create, exit, dump)
+static Thread* g_Threads;                      // All threads, through AllNext
+
+static const char* const g_ThreadStateNames[] =
+{
+    [THREAD_READY]   = "ready",
+    [THREAD_RUNNING] = "running",
+    [THREAD_BLOCKED] = "blocked",
+    [THREAD_WAKING]  = "waking",
+    [THREAD_DEAD]    = "dead",
+};
+
+extern void contextSwitch(uint32_t* savedStackPointer, uint32_t stackPointer); // From switch.asm
+
+// Run queue of a CPU, FIFO
+static void runQueuePush(PerCpu* cpu, Thread* thread)
+{
+    RunQueue* queue = &cpu->Queue;
+    spinLock(&queue->Lock);
+    thread->Next = NULL;
+    thread->Cpu = cpu->Index;
+    if (queue->Tail)
+        queue->Tail->Next = thread;
+    else
+        queue->Head = thread;
+    queue->Tail = thread;
+    queue->Length++;
+    spinUnlock(&queue->Lock);
+}
+
+// Removes the oldest thread of a locked run queue
+static Thread* runQueuePopLocked(RunQueue* queue)
+{
+    Thread* thread = queue->Head;
+    if (thread)
+    {
+        queue->Head = thread->Next;
+        if (!queue->Head)
+            queue->Tail = NULL;
+        queue->Length--;
+    }
+    return thread;
+}
+
+static Thread* runQueuePop(PerCpu* cpu)
+{
+    if (!cpu->Queue.Length)
+        return NULL;                           // Checked without the lock, rechecked with it
+
+    spinLock(&cpu->Queue.Lock);
+    Thread* thread = runQueuePopLocked(&cpu->Queue);
+    spinUnlock(&cpu->Queue.Lock);
+    return thread;
+}
+
+// Takes the oldest ready thread of the CPU with the longest run queue
+// Returns NULL if every other queue is empty or the chosen one is contended
+// (the next tick tries again)
+static Thread* stealThread(PerCpu* cpu)
+{
+    PerCpu* victim = NULL;
+    unsigned longest = 0;
+    for (unsigned i = 0; i < g_CpuCount; i++)
+    {
+        if (&g_Cpus[i] != cpu && g_Cpus[i].Queue.Length > longest)
+        {
+            victim = &g_Cpus[i];
+            longest = victim->Queue.Length;
+        }
+    }
+
+    if (!victim || !spinTryLock(&victim->Queue.Lock))
+        return NULL;
+    Thread* thread = runQueuePopLocked(&victim->Queue);
+    spinUnlock(&victim->Queue.Lock);
+
+    if (thread)
+        cpu->Steals++;
+    return thread;
+}
+
+// Adds and removes threads of the thread list
+static void threadListAdd(Thread* thread)
+{
+    spinLock(&g_ThreadsLock);
+    thread->AllNext = g_Threads;
+    g_Threads = thread;
+    spinUnlock(&g_ThreadsLock);
+}
+
+static void threadListRemove(Thread* thread)
+{
+    spinLock(&g_ThreadsLock);
+    Thread** link = &g_Threads;
+    while (*link != thread)
+        link = &(*link)->AllNext;
+    *link = thread->AllNext;
+    spinUnlock(&g_ThreadsLock);
+}
+
+// Completes a switch on the stack of the new thread: the previous thread is
+// saved now and may run elsewhere
+static void finishSwitch(void)
+{
+    PerCpu* cpu = cpuCurrent();
+    Thread* previous = cpu->Previous;
+    cpu->Previous = NULL;
+
+    if (previous->State == THREAD_DEAD)
+    {
+        pageFree(previous->Stack);
+        slabFree(previous);
+        return;
+    }
+
+    bool preempted = previous->State == THREAD_RUNNING && previous != cpu->Idle;
+    if (preempted)
+        previous->State = THREAD_READY;
+    __atomic_store_n(&previous->OnCpu, false, __ATOMIC_RELEASE);
+    if (preempted)
+        runQueuePush(cpu, previous);
+}
+
+// Switches from the running thread to another one of this CPU
+static void switchTo(PerCpu* cpu, Thread* current, Thread* next)
+{
+    uint64_t now = readTimestamp();
+    current->CpuTime += now - current->StartTime;
+    next->StartTime = now;
+    next->State = THREAD_RUNNING;
+    next->OnCpu = true;
+    next->Cpu = cpu->Index;
+    next->Switches++;
+
+    cpu->Previous = current;
+    cpu->Current = next;
+    cpu->SliceTicks = g_SliceTicks;
+    cpu->Switches++;
+    trace(TRACE_CONTEXT_SWITCH, next->Id);
+
+    contextSwitch(&current->StackPointer, next->StackPointer);
+    finishSwitch();                            // Back in current, possibly on another CPU
+}
+
+// Picks the next thread of this CPU and switches to it
+// Interrupts must be disabled
+static void schedule(void)
+{
+    PerCpu* cpu = cpuCurrent();
+    Thread* current = cpu->Current;
+    bool runnable = current->State == THREAD_RUNNING && current != cpu->Idle;
+
+    Thread* next = runQueuePop(cpu);
+    if (!next && !runnable)
+        next = stealThread(cpu);               // Only a CPU with nothing to do steals
+
+    if (!next)
+    {
+        if (runnable || current == cpu->Idle)
+        {
+            cpu->SliceTicks = g_SliceTicks;    // Nothing else to run: keep going
+            return;
+        }
+        next = cpu->Idle;
+    }
+
+    switchTo(cpu, current, next);
+}
+
+// Timer tick handler (interrupts disabled)
+static void schedulerTick(InterruptFrame* frame)
+{
+    (void) frame;
+    PerCpu* cpu = cpuCurrent();
+    cpu->Ticks++;
+
+    if (cpu->Current == cpu->Idle)
+    {
+        cpu->IdleTicks++;
+        schedule();                            // Look for work, steal if there is none
+    }
+    else if (cpu->SliceTicks <= 1)
+    {
+        schedule();                            // Time slice used up
+    }
+    else
+    {
+        cpu->SliceTicks--;
+    }
+}
+
+// First code of every new thread, entered from contextSwitch
+static void __attribute__((noreturn)) threadStart(void)
+{
+    finishSwitch();
+    interruptsEnable();
+
+    Thread* thread = threadCurrent();
+    thread->Entry(thread->Argument);
+    threadExit();
+}
+
+// Turns the context running on the executing CPU into the CPU's idle thread
+// and makes it the running thread; perCpuInit must have been called
+void schedulerInitCpu(void)
+{
+    PerCpu* cpu = cpuCurrent();
+    Thread* idle = slabAlloc(&g_ThreadCache);
+    memset(idle, 0, sizeof(Thread));
+    idle->Name = "idle";
+    idle->Id = __atomic_fetch_add(&g_NextThreadId, 1, __ATOMIC_RELAXED);
+    idle->State = THREAD_RUNNING;
+    idle->OnCpu = true;
+    idle->Cpu = cpu->Index;
+    idle->StartTime = readTimestamp();
+
+    cpu->Idle = idle;
+    cpu->Current = idle;
+    cpu->SliceTicks = g_SliceTicks;
+    threadListAdd(idle);
+}
+
+// Sets up scheduling on the bootstrap processor, whose boot context becomes
+// its idle thread; threads run once interrupts are enabled and the timer ticks
+void schedulerInit(void)
+{
+    slabCacheInit(&g_ThreadCache, "thread", sizeof(Thread));
+    g_SliceTicks = (TIMER_FREQUENCY * SCHEDULER_TIME_SLICE_MS + 999) / 1000;
+    schedulerInitCpu();
+    timerSetHandler(schedulerTick);
+}
+
+// Idle loop of a CPU, entered by its boot context when initialization is done
+void schedulerIdle(void)
+{
+    for (;;)
+    {
+        interruptsSave();
+        if (cpuCurrent()->Queue.Length)
+            schedule();                        // Woken threads run right away
+        cpuIdle();                             // Enables interrupts and waits
+    }
+}
+
+// Creates a thread, ready to run on the executing CPU
+// Parameters:
+//   name - name for the logs (not copied)
+//   entry - function the thread runs; returning from it ends the thread
+//   argument - passed to entry
+// Returns the thread, NULL if out of memory
+Thread* threadCreate(const char* name, ThreadFunction entry, void* argument)
+{
+    Thread* thread = slabAlloc(&g_ThreadCache);
+    void* stack = pageAlloc(THREAD_STACK_ORDER);
+    if (!thread || !stack)
+    {
+        if (thread)
+            slabFree(thread);
+        if (stack)
+            pageFree(stack);
+        return NULL;
+    }
+
+    memset(thread, 0, sizeof(Thread));
+    thread->Name = name;
+    thread->Id = __atomic_fetch_add(&g_NextThreadId, 1, __ATOMIC_RELAXED);
+    thread->Stack = stack;
+    thread->Entry = entry;
+    thread->Argument = argument;
+    thread->State = THREAD_READY;
+
+    // Stack as left by contextSwitch: EDI, ESI, EBX, EBP, return address
+    uint32_t* stackPointer = (uint32_t*) ((char*) stack + THREAD_STACK_SIZE);
+    *--stackPointer = 0;                       // Return address of threadStart (never used)
+    *--stackPointer = (uint32_t) threadStart;
+    for (unsigned i = 0; i < 4; i++)
+        *--stackPointer = 0;
+    thread->StackPointer = (uint32_t) stackPointer;
+
+    uint32_t flags = interruptsSave();
+    threadListAdd(thread);
+    runQueuePush(cpuCurrent(), thread);
+    interruptsRestore(flags);
+    return thread;
+}
+
+// Returns the running thread
+Thread* threadCurrent(void)
+{
+    return cpuCurrent()->Current;
+}
+
+// Gives the rest of the time slice to the next ready thread
+void threadYield(void)
+{
+    uint32_t flags = interruptsSave();
+    schedule();
+    interruptsRestore(flags);
+}
+
+// Waits until another thread or an interrupt handler calls threadWake
+// Returns at once if that already happened since the last threadBlock
+void threadBlock(void)
+{
+    uint32_t flags = interruptsSave();
+    Thread* current = threadCurrent();
+
+    spinLock(&current->WakeLock);
+    if (current->WakePending)
+    {
+        current->WakePending = false;
+        spinUnlock(&current->WakeLock);
+        interruptsRestore(flags);
+        return;
+    }
+    current->State = THREAD_BLOCKED;
+    spinUnlock(&current->WakeLock);
+
+    schedule();
+    interruptsRestore(flags);
+}
+
+// Makes a blocked thread ready again (on the CPU it ran on), or lets its next
+// threadBlock return at once; may be called from interrupt handlers
+void threadWake(Thread* thread)
+{
+    uint32_t flags = interruptsSave();
+
+    spinLock(&thread->WakeLock);
+    if (thread->State != THREAD_BLOCKED)
+    {
+        thread->WakePending = true;
+        spinUnlock(&thread->WakeLock);
+        interruptsRestore(flags);
+        return;
+    }
+    thread->State = THREAD_WAKING;
+    spinUnlock(&thread->WakeLock);
+
+    while (__atomic_load_n(&thread->OnCpu, __ATOMIC_ACQUIRE))
+        __asm__ volatile ("pause");            // Still switching away on its CPU
+
+    thread->State = THREAD_READY;
+    runQueuePush(&g_Cpus[thread->Cpu], thread);
+    interruptsRestore(flags);
+}
+
+// Ends the running thread
+void threadExit(void)
+{
+    interruptsSave();
+    Thread* current = threadCurrent();
+    threadListRemove(current);
+    current->State = THREAD_DEAD;
+    schedule();                                // Does not return
+
+    for (;;)
+        ;
+}
+
+// Adds the running thread to a wait queue (lock of the queue held)
+void waitQueueAdd(WaitQueue* queue)
+{
+    Thread* current = threadCurrent();
+    current->WaitNext = queue->Head;
+    queue->Head = current;
+}
+
+// Removes the running thread from a wait queue if it is still in it (lock of
+// the queue held). Called after waking up: threadBlock may also return for
+// an earlier threadWake, before the queue was woken
+void waitQueueRemove(WaitQueue* queue)
+{
+    Thread* current = threadCurrent();
+    for (Thread** link = &queue->Head; *link; link = &(*link)->WaitNext)
+    {
+        if (*link == current)
+        {
+            *link = current->WaitNext;
+            return;
+        }
+    }
+}
+
+// Wakes every thread of a wait queue (lock of the queue held)
+void waitQueueWakeAll(WaitQueue* queue)
+{
+    Thread* thread = queue->Head;
+    queue->Head = NULL;
+    while (thread)
+    {
+        Thread* next = thread->WaitNext;       // The woken thread may queue itself again
+        threadWake(thread);
+        thread = next;
+    }
+}
+
+// Lists the threads that exist now
+// Parameters:
+//   idsOut - Receives up to max thread IDs
+//   namesOut - Receives the name of each one
+//   max - Entries of both arrays
+// Returns: Number of threads listed
+unsigned threadList(unsigned* idsOut, const char** namesOut, unsigned max)
+{
+    unsigned count = 0;
+    uint32_t flags = interruptsSave();
+    spinLock(&g_ThreadsLock);
+    for (Thread* thread = g_Threads; thread && count < max; thread = thread->AllNext)
+    {
+        idsOut[count] = thread->Id;
+        namesOut[count] = thread->Name;
+        count++;
+    }
+    spinUnlock(&g_ThreadsLock);
+    interruptsRestore(flags);
+    return count;
+}
+
+// Logs every thread with its CPU time and the scheduling counters of each CPU
+void schedulerDump(void)
+{
+    uint32_t flags = interruptsSave();
+    uint64_t now = readTimestamp();
+
+    logPuts("Threads:\n  ID  Name            CPU  State     Switches        CPU cycles\n");
+    spinLock(&g_ThreadsLock);
+    for (Thread* thread = g_Threads; thread; thread = thread->AllNext)
+    {
+        uint64_t time = thread->CpuTime;
+        if (thread->State == THREAD_RUNNING)
+            time += now - thread->StartTime;   // Current run so far
+        logPrintf("  %2u  %-14s  %3u  %-8s  %8u  %16llu\n", thread->Id, thread->Name,
+                  thread->Cpu, g_ThreadStateNames[thread->State], thread->Switches, time);
+    }
+    spinUnlock(&g_ThreadsLock);
+
+    for (unsigned i = 0; i < g_CpuCount; i++)
+    {
+        const PerCpu* cpu = &g_Cpus[i];
+        logPrintf("CPU %u: %u ticks (%u idle), %u switches, %u steals, %u ready\n",
+                  cpu->Index, cpu->Ticks, cpu->IdleTicks, cpu->Switches, cpu->Steals,
+                  cpu->Queue.Length);
+    }
+
+    interruptsRestore(flags);
+}
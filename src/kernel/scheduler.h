@@ -0,0 +1,84 @@
+// =============================================================================
+// KERNEL THREADS AND SCHEDULER
+// =============================================================================
+//
+// Preemptive round-robin scheduling of kernel threads. Every CPU has its own
+// run queue (see percpu.h): creating, preempting and waking a thread only
+// takes the lock of that one queue, never a global one, and picking the next
+// thread is O(1). A CPU whose queue is empty steals the oldest ready thread
+// from the CPU with the longest queue. The timer preempts a thread after
+// SCHEDULER_TIME_SLICE_MS; the running time of every thread is accounted in
+// TSC cycles
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "page_alloc.h"
+#include "spinlock.h"
+
+#define THREAD_STACK_ORDER      1               // Stack: 2^1 pages = 8KB
+#define THREAD_STACK_SIZE       (PAGE_SIZE << THREAD_STACK_ORDER)
+#define SCHEDULER_TIME_SLICE_MS 10
+
+typedef enum
+{
+    THREAD_READY,                              // In a run queue
+    THREAD_RUNNING,                            // Running on Cpu
+    THREAD_BLOCKED,                            // Waiting for threadWake
+    THREAD_WAKING,                             // Claimed by threadWake, being queued
+    THREAD_DEAD,                               // Exited, freed by the next thread on its CPU
+
+} ThreadState;
+
+typedef void (*ThreadFunction)(void* argument);
+
+typedef struct Thread
+{
+    uint32_t StackPointer;                     // Saved by contextSwitch while not running
+    struct Thread* Next;                       // Run queue link
+    struct Thread* AllNext;                    // List of all threads
+    const char* Name;
+    unsigned Id;
+    volatile ThreadState State;
+    volatile bool OnCpu;                       // A CPU still uses its registers or stack
+    bool WakePending;                          // threadWake came before threadBlock
+    Spinlock WakeLock;                         // Orders threadBlock and threadWake
+    unsigned Cpu;                              // CPU running it, or of its run queue
+    void* Stack;                               // Stack block, NULL for a CPU boot stack
+    ThreadFunction Entry;
+    void* Argument;
+    struct Thread* WaitNext;                   // Wait queue link
+
+    uint64_t CpuTime;                          // TSC cycles spent running
+    uint64_t StartTime;                        // TSC when it was last switched to
+    uint32_t Switches;                         // Times it was switched to
+
+} Thread;
+
+// Threads waiting for a condition, protected by the lock of the condition
+// The waiter adds itself with the lock held, releases the lock, calls
+// threadBlock, takes the lock, removes itself and checks the condition
+// again; whoever changes the condition wakes the queue with the lock held
+typedef struct
+{
+    Thread* Head;
+
+} WaitQueue;
+
+void schedulerInit(void);
+void schedulerInitCpu(void);
+void __attribute__((noreturn)) schedulerIdle(void);
+void schedulerDump(void);
+
+Thread* threadCreate(const char* name, ThreadFunction entry, void* argument);
+Thread* threadCurrent(void);
+void threadYield(void);
+void threadBlock(void);
+void threadWake(Thread* thread);
+void __attribute__((noreturn)) threadExit(void);
+unsigned threadList(unsigned* idsOut, const char** namesOut, unsigned max);
+void waitQueueAdd(WaitQueue* queue);
+void waitQueueRemove(WaitQueue* queue);
+void waitQueueWakeAll(WaitQueue* queue);
@@ -0,0 +1,215 @@
+// =============================================================================
+// SERIAL (COM1) LOG OUTPUT
+// =============================================================================
+//
+// Protected mode port of src/common/serial.inc: log output is copied to the
+// first serial port (115200 baud, 8N1) through a ring buffer, so the caller
+// never waits for the UART character by character. After each write as many
+// bytes as the transmit FIFO takes (16 on a 16550A) are moved after a single
+// line-status check; only a full ring waits for the UART.
+//
+// Once interrupts are set up, serialEnableInterrupts switches the drain to
+// the THR-empty interrupt (IRQ 4), like the SERIAL_TX_IRQ mode of
+// serial.inc: a write only queues its bytes and enables the interrupt, whose
+// handler refills the FIFO whenever it ran empty and disables the interrupt
+// again once the ring is empty. Everything else that drains the ring does so
+// with interrupts disabled, so the handler is the only other consumer on the
+// same CPU; a drain lock keeps consumers on different CPUs apart, and the
+// kernel log serializes the producers.
+//
+// LF is sent as CR LF, so the log reads correctly on a terminal; binary
+// data (serialWriteBinary) is sent as is
+//
+// Without a UART (scratch register test fails) all functions do nothing
+
+#include "serial.h"
+
+#include <stdint.h>
+
+#include "cpu.h"
+#include "io.h"
+#include "irq.h"
+#include "spinlock.h"
+#include "string.h"
+
+#define SERIAL_PORT             0x3F8           // COM1 base I/O port
+#define SERIAL_DATA             (SERIAL_PORT + 0)  // THR (write), divisor low with DLAB
+#define SERIAL_IER              (SERIAL_PORT + 1)  // Interrupt enable, divisor high with DLAB
+#define SERIAL_IIR_FCR          (SERIAL_PORT + 2)  // Interrupt identification (read), FIFO control (write)
+#define SERIAL_LCR              (SERIAL_PORT + 3)  // Line control
+#define SERIAL_MCR              (SERIAL_PORT + 4)  // Modem control
+#define SERIAL_LSR              (SERIAL_PORT + 5)  // Line status
+#define SERIAL_SCRATCH          (SERIAL_PORT + 7)  // Scratch register
+
+#define SERIAL_LSR_THRE         0x20            // Transmit holding register (and FIFO) empty
+#define SERIAL_LSR_TEMT         0x40            // Transmitter completely idle
+#define SERIAL_IER_THRE         0x02            // Interrupt when the THR is empty
+#define SERIAL_IRQ              4
+#define SERIAL_FIFO_DEPTH       16              // Transmit FIFO of a 16550A
+
+#define SERIAL_RING_SIZE        4096            // Ring buffer size (power of 2)
+#define SERIAL_RING_MASK        (SERIAL_RING_SIZE - 1)
+
+static bool g_SerialPresent;                   // COM1 was detected and programmed
+static bool g_SerialInterrupts;                // Drained by the THR-empty interrupt
+static unsigned g_SerialFifoDepth = 1;         // Bytes written per empty transmitter
+static volatile unsigned g_SerialHead;         // Next free slot of the ring
+static volatile unsigned g_SerialTail;         // Oldest queued byte of the ring
+static char g_SerialRing[SERIAL_RING_SIZE];    // Queued log output
+static Spinlock g_SerialDrainLock = SPINLOCK_INIT; // Held by the CPU moving bytes into the FIFO
+
+// Detects and programs COM1: 115200 baud, 8 data bits, no parity, 1 stop bit,
+// FIFOs enabled
+// Returns true if a UART was found
+bool serialInit(void)
+{
+    // A UART keeps the value written to its scratch register
+    outb(SERIAL_SCRATCH, 0x5A);
+    if (inb(SERIAL_SCRATCH) != 0x5A)
+        return false;
+
+    outb(SERIAL_IER, 0x00);                    // No interrupts while programming
+    outb(SERIAL_LCR, 0x80);                    // DLAB = 1: access the baud rate divisor
+    outb(SERIAL_DATA, 1);                      // Divisor 1 = 115200 baud
+    outb(SERIAL_IER, 0);
+    outb(SERIAL_LCR, 0x03);                    // DLAB = 0, 8 data bits, no parity, 1 stop bit
+
+    outb(SERIAL_IIR_FCR, 0xC7);                // Enable and clear the FIFOs
+    g_SerialFifoDepth = (inb(SERIAL_IIR_FCR) & 0xC0) == 0xC0 ? SERIAL_FIFO_DEPTH : 1;
+
+    outb(SERIAL_MCR, 0x0B);                    // DTR, RTS and OUT2 (routes the UART interrupt to the PIC)
+
+    g_SerialPresent = true;
+    return true;
+}
+
+// Moves queued bytes into the transmit FIFO without waiting: when the line
+// status reports the FIFO empty, up to g_SerialFifoDepth bytes are written
+// Returns true if the ring is empty afterwards (false while another CPU
+// drains it)
+bool serialDrain(void)
+{
+    if (!spinTryLock(&g_SerialDrainLock))
+        return false;
+
+    unsigned tail = g_SerialTail;
+
+    if (inb(SERIAL_LSR) & SERIAL_LSR_THRE)
+    {
+        for (unsigned count = g_SerialFifoDepth; count > 0 && tail != g_SerialHead; count--)
+        {
+            outb(SERIAL_DATA, g_SerialRing[tail]);
+            tail = (tail + 1) & SERIAL_RING_MASK;
+        }
+        g_SerialTail = tail;
+    }
+
+    spinUnlock(&g_SerialDrainLock);
+    return tail == g_SerialHead;
+}
+
+// Waits until the transmit FIFO is empty and refills it (interrupts are
+// disabled meanwhile, so the interrupt handler cannot interleave)
+static void serialWaitDrain(void)
+{
+    uint32_t flags = interruptsSave();
+    while (!(inb(SERIAL_LSR) & SERIAL_LSR_THRE))
+        ;
+    serialDrain();
+    interruptsRestore(flags);
+}
+
+// IRQ 4 handler: refills the transmit FIFO from the ring
+static void serialInterrupt(InterruptFrame* frame)
+{
+    (void) frame;
+    inb(SERIAL_IIR_FCR);                       // Reading the IIR acknowledges the THRE interrupt
+    if (serialDrain())
+        outb(SERIAL_IER, 0x00);                // Nothing left: no more THR-empty interrupts
+}
+
+// Drains the ring by the THR-empty interrupt from now on
+// The IRQ layer must be set up
+void serialEnableInterrupts(void)
+{
+    if (!g_SerialPresent)
+        return;
+
+    irqRegister(SERIAL_IRQ, serialInterrupt);
+    g_SerialInterrupts = true;
+}
+
+// Appends one byte to the ring, waiting for the UART only when it is full
+static void serialQueue(char c)
+{
+    unsigned head = g_SerialHead;
+    unsigned next = (head + 1) & SERIAL_RING_MASK;
+
+    while (next == g_SerialTail)
+        serialWaitDrain();
+
+    g_SerialRing[head] = c;
+    g_SerialHead = next;                       // Publish the byte
+}
+
+// Queues size bytes for transmission and starts sending them
+// Parameters:
+//   buffer - Bytes to send
+//   size - Number of bytes
+//   text - LF is sent as CR LF (false: binary data, sent as is)
+static void serialSend(const char* buffer, size_t size, bool text)
+{
+    if (!g_SerialPresent)
+        return;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        if (text && buffer[i] == '\n')
+            serialQueue('\r');
+        serialQueue(buffer[i]);
+    }
+
+    if (g_SerialInterrupts)
+    {
+        // Fires right away when the FIFO is already empty; the handler also
+        // writes the IER, so it must not run in between
+        uint32_t flags = interruptsSave();
+        outb(SERIAL_IER, SERIAL_IER_THRE);
+        interruptsRestore(flags);
+    }
+    else
+    {
+        serialDrain();                         // Send what the FIFO takes right now
+    }
+}
+
+// Queues text for transmission and starts sending it
+void serialWrite(const char* buffer, size_t size)
+{
+    serialSend(buffer, size, true);
+}
+
+// Queues binary data for transmission, without LF translation
+void serialWriteBinary(const void* buffer, size_t size)
+{
+    serialSend(buffer, size, false);
+}
+
+// Queues a null-terminated string for transmission
+void serialPuts(const char* string)
+{
+    serialWrite(string, strlen(string));
+}
+
+// Sends all queued bytes and waits until the transmitter is idle
+void serialFlush(void)
+{
+    if (!g_SerialPresent)
+        return;
+
+    while (g_SerialTail != g_SerialHead)
+        serialWaitDrain();
+
+    while (!(inb(SERIAL_LSR) & SERIAL_LSR_TEMT))
+        ;
+}
@@ -0,0 +1,16 @@
+// =============================================================================
+// SERIAL (COM1) LOG OUTPUT
+// =============================================================================
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+bool serialInit(void);
+void serialEnableInterrupts(void);
+void serialWrite(const char* buffer, size_t size);
+void serialWriteBinary(const void* buffer, size_t size);
+void serialPuts(const char* string);
+bool serialDrain(void);
+void serialFlush(void);
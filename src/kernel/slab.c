@@ -0,0 +1,279 @@
+// =============================================================================
+// SLAB ALLOCATOR
+// =============================================================================
+//
+// A slab is a block of the page allocator cut into objects of one size. Free
+// objects are linked through their first word and the slab keeps its free
+// list and use count in the PageFrame of its first page, so allocating and
+// freeing an object takes constant time and objects need no header. Every
+// page of a slab points to its cache, so slabFree and kernelFree find the
+// cache from the object address alone (slabs are aligned to their size).
+//
+// Each cache keeps its slabs in three lists (partial, full, empty) and
+// allocates from partial slabs first, so objects are packed into as few
+// slabs as possible. Up to SLAB_EMPTY_KEEP empty slabs stay in the cache, so
+// an allocation right after the last object of a slab was freed does not
+// go back to the page allocator.
+//
+// kernelAlloc serves sizes up to 2KB from power-of-two caches and larger
+// sizes directly from the page allocator.
+//
+// Each cache has its own spinlock, held with interrupts disabled, so CPUs
+// only contend when they use the same cache.
+
+#include "slab.h"
+
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "log.h"
+
+#define SLAB_MIN_OBJECTS        8               // Objects per slab at least (if it fits)
+#define SLAB_MAX_ORDER          3               // Slabs of up to 8 pages
+#define SLAB_EMPTY_KEEP         1               // Empty slabs kept per cache
+#define SLAB_ALIGNMENT          8
+
+#define SIZE_CLASS_MIN_SHIFT    4               // 16 bytes
+#define SIZE_CLASS_COUNT        8               // 16 bytes to 2KB
+
+static SlabCache* g_Caches;                    // All caches, for slabDump
+static SlabCache g_SizeCaches[SIZE_CLASS_COUNT];
+static const char* const g_SizeCacheNames[SIZE_CLASS_COUNT] =
+{
+    "size-16", "size-32", "size-64", "size-128",
+    "size-256", "size-512", "size-1024", "size-2048",
+};
+
+// Slab lists: doubly linked through the first page frame of each slab
+static void slabListPush(PageFrame** list, PageFrame* slab)
+{
+    slab->Previous = NULL;
+    slab->Next = *list;
+    if (slab->Next)
+        slab->Next->Previous = slab;
+    *list = slab;
+}
+
+static void slabListRemove(PageFrame** list, PageFrame* slab)
+{
+    if (slab->Previous)
+        slab->Previous->Next = slab->Next;
+    else
+        *list = slab->Next;
+    if (slab->Next)
+        slab->Next->Previous = slab->Previous;
+}
+
+// Prepares a cache for objects of objectSize bytes
+// The slab size is the smallest one holding SLAB_MIN_OBJECTS objects with
+// at most 1/8 of it unused
+void slabCacheInit(SlabCache* cache, const char* name, size_t objectSize)
+{
+    if (objectSize < sizeof(void*))
+        objectSize = sizeof(void*);            // Room for the free list link
+    objectSize = (objectSize + SLAB_ALIGNMENT - 1) & ~(SLAB_ALIGNMENT - 1);
+
+    *cache = (SlabCache) { .Name = name, .ObjectSize = objectSize };
+
+    unsigned order = 0;
+    for (; order < SLAB_MAX_ORDER; order++)
+    {
+        uint32_t slabSize = PAGE_SIZE << order;
+        uint32_t objects = slabSize / objectSize;
+        if (objects >= SLAB_MIN_OBJECTS && (slabSize - objects * objectSize) * 8 <= slabSize)
+            break;
+    }
+    cache->SlabOrder = order;
+    cache->ObjectsPerSlab = (PAGE_SIZE << order) / objectSize;
+
+    cache->NextCache = g_Caches;
+    g_Caches = cache;
+}
+
+// Gets a new slab from the page allocator and links its objects
+static PageFrame* slabCreate(SlabCache* cache)
+{
+    uint8_t* memory = pageAlloc(cache->SlabOrder);
+    if (!memory)
+        return NULL;
+
+    PageFrame* slab = pageFrameOf(memory);
+    for (unsigned i = 0; i < 1u << cache->SlabOrder; i++)
+    {
+        slab[i].Flags |= PAGE_FRAME_SLAB;
+        slab[i].Cache = cache;
+    }
+
+    // Free list in address order
+    void** link = &slab->FreeObjects;
+    for (uint32_t i = 0; i < cache->ObjectsPerSlab; i++)
+    {
+        *link = memory + i * cache->ObjectSize;
+        link = (void**) *link;
+    }
+    *link = NULL;
+
+    slab->InUse = 0;
+    cache->Slabs++;
+    return slab;
+}
+
+// Returns a slab to the page allocator
+static void slabDestroy(SlabCache* cache, PageFrame* slab)
+{
+    for (unsigned i = 0; i < 1u << cache->SlabOrder; i++)
+    {
+        slab[i].Flags &= ~PAGE_FRAME_SLAB;
+        slab[i].Cache = NULL;
+    }
+
+    cache->Slabs--;
+    pageFree(pageFrameAddress(slab));
+}
+
+// Takes an object from the slabs of a cache (locked)
+// Returns NULL when out of memory
+static void* slabTake(SlabCache* cache)
+{
+    PageFrame* slab = cache->Partial;
+    if (slab)
+    {
+        cache->Hits++;
+    }
+    else if ((slab = cache->Empty) != NULL)
+    {
+        slabListRemove(&cache->Empty, slab);
+        cache->EmptyCount--;
+        slabListPush(&cache->Partial, slab);
+        cache->Hits++;
+    }
+    else
+    {
+        slab = slabCreate(cache);
+        if (!slab)
+            return NULL;
+        slabListPush(&cache->Partial, slab);
+        cache->Misses++;
+    }
+
+    void* object = slab->FreeObjects;
+    slab->FreeObjects = *(void**) object;
+    slab->InUse++;
+    cache->InUse++;
+
+    if (!slab->FreeObjects)                    // Slab is full now
+    {
+        slabListRemove(&cache->Partial, slab);
+        slabListPush(&cache->Full, slab);
+    }
+
+    return object;
+}
+
+// Allocates an object of the cache
+// Returns NULL when out of memory
+void* slabAlloc(SlabCache* cache)
+{
+    uint32_t flags = interruptsSave();
+    spinLock(&cache->Lock);
+    void* object = slabTake(cache);
+    spinUnlock(&cache->Lock);
+    interruptsRestore(flags);
+    return object;
+}
+
+// Puts an object back into its slab (locked)
+static void slabPut(SlabCache* cache, void* object)
+{
+    uintptr_t slabMask = ((uintptr_t) PAGE_SIZE << cache->SlabOrder) - 1;
+    PageFrame* slab = pageFrameOf((void*) ((uintptr_t) object & ~slabMask));
+
+    if (!slab->FreeObjects)                    // Was full
+    {
+        slabListRemove(&cache->Full, slab);
+        slabListPush(&cache->Partial, slab);
+    }
+
+    *(void**) object = slab->FreeObjects;
+    slab->FreeObjects = object;
+    slab->InUse--;
+    cache->InUse--;
+    cache->Frees++;
+
+    if (!slab->InUse)                          // Now empty
+    {
+        slabListRemove(&cache->Partial, slab);
+        if (cache->EmptyCount < SLAB_EMPTY_KEEP)
+        {
+            slabListPush(&cache->Empty, slab);
+            cache->EmptyCount++;
+        }
+        else
+        {
+            slabDestroy(cache, slab);
+        }
+    }
+}
+
+// Frees an object allocated by slabAlloc
+void slabFree(void* object)
+{
+    SlabCache* cache = pageFrameOf(object)->Cache;
+
+    uint32_t flags = interruptsSave();
+    spinLock(&cache->Lock);
+    slabPut(cache, object);
+    spinUnlock(&cache->Lock);
+    interruptsRestore(flags);
+}
+
+// Creates the size class caches of kernelAlloc
+void slabInit(void)
+{
+    for (unsigned i = 0; i < SIZE_CLASS_COUNT; i++)
+        slabCacheInit(&g_SizeCaches[i], g_SizeCacheNames[i], 1u << (SIZE_CLASS_MIN_SHIFT + i));
+}
+
+// Allocates size bytes: from the smallest size class cache that fits, or as
+// whole pages above 2KB
+// Returns NULL when out of memory (or for size 0)
+void* kernelAlloc(size_t size)
+{
+    if (!size)
+        return NULL;
+
+    unsigned sizeClass = 0;
+    while (sizeClass < SIZE_CLASS_COUNT && (1u << (SIZE_CLASS_MIN_SHIFT + sizeClass)) < size)
+        sizeClass++;
+    if (sizeClass < SIZE_CLASS_COUNT)
+        return slabAlloc(&g_SizeCaches[sizeClass]);
+
+    unsigned order = 0;
+    while (order <= PAGE_MAX_ORDER && ((size_t) PAGE_SIZE << order) < size)
+        order++;
+    return pageAlloc(order);
+}
+
+// Frees memory allocated by kernelAlloc
+void kernelFree(void* pointer)
+{
+    if (!pointer)
+        return;
+
+    if (pageFrameOf(pointer)->Flags & PAGE_FRAME_SLAB)
+        slabFree(pointer);
+    else
+        pageFree(pointer);
+}
+
+// Logs the counters of every cache
+void slabDump(void)
+{
+    logPuts("Slab caches:      size pages  slabs  in use      hits    misses     frees\n");
+    for (SlabCache* cache = g_Caches; cache; cache = cache->NextCache)
+    {
+        logPrintf("  %-14s %6u %5u %6u %7u %9u %9u %9u\n", cache->Name, cache->ObjectSize,
+                  1u << cache->SlabOrder, cache->Slabs, cache->InUse,
+                  cache->Hits, cache->Misses, cache->Frees);
+    }
+}
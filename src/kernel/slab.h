@@ -0,0 +1,45 @@
+// =============================================================================
+// SLAB ALLOCATOR
+// =============================================================================
+//
+// Object caches for small fixed-size kernel objects on top of the page
+// allocator, and kernelAlloc/kernelFree for variable sizes
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "page_alloc.h"
+#include "spinlock.h"
+
+typedef struct SlabCache
+{
+    const char* Name;
+    uint32_t ObjectSize;                       // Bytes per object (multiple of 8)
+    uint32_t ObjectsPerSlab;
+    uint8_t SlabOrder;                         // Slab size: 2^SlabOrder pages
+    Spinlock Lock;                             // Protects the lists and counters
+
+    PageFrame* Partial;                        // Slabs with free and allocated objects
+    PageFrame* Full;                           // Slabs without free objects
+    PageFrame* Empty;                          // Slabs without allocated objects
+    uint32_t EmptyCount;
+    struct SlabCache* NextCache;               // List of all caches
+
+    // Counters for tuning
+    uint32_t Hits;                             // Allocations served by a slab of the cache
+    uint32_t Misses;                           // Allocations that needed a new slab
+    uint32_t Frees;                            // Objects freed
+    uint32_t Slabs;                            // Slabs currently owned
+    uint32_t InUse;                            // Objects currently allocated
+
+} SlabCache;
+
+void slabInit(void);
+void slabCacheInit(SlabCache* cache, const char* name, size_t objectSize);
+void* slabAlloc(SlabCache* cache);
+void slabFree(void* object);
+void* kernelAlloc(size_t size);
+void kernelFree(void* pointer);
+void slabDump(void);
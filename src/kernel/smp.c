@@ -0,0 +1,265 @@
+// =============================================================================
+// SYMMETRIC MULTIPROCESSING
+// =============================================================================
+//
+// Each enabled processor of the MADT is started in turn with the INIT,
+// startup, startup sequence of the MP specification: INIT, 10ms, startup
+// IPI, 200us, and a second startup IPI if the processor has not answered
+// yet. It runs trampoline.asm from TRAMPOLINE_ADDRESS into smpCpuEntry on
+// the stack allocated for it, sets itself up and reports back before the
+// next one is started, so the processors never race for g_StartingCpu or
+// the parameter block.
+//
+// The trampoline claims the stack by exchanging it with 0. A processor that
+// does not answer in time gets its stack withdrawn the same way and an INIT:
+// if it starts after all, it finds no stack and halts in the trampoline
+// instead of taking the CPU index of the next processor. If it claimed the
+// stack just before, it is running and owns the index, so it gets the same
+// time again; should it still not report back, no more processors are
+// started.
+//
+// The first 4MB stay identity mapped until every processor has started (the
+// trampoline enables paging from low memory); the application processors
+// wait for g_StartupDone, flush their TLB and only then enable PGE and
+// start scheduling.
+//
+// Without a per-CPU tick (PIT timer source) or without a MADT only the
+// bootstrap processor runs
+
+#include "smp.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "acpi.h"
+#include "apic.h"
+#include "cpu.h"
+#include "gdt.h"
+#include "idt.h"
+#include "log.h"
+#include "page_alloc.h"
+#include "paging.h"
+#include "percpu.h"
+#include "pit.h"
+#include "scheduler.h"
+#include "string.h"
+#include "timer.h"
+
+#define TRAMPOLINE_ADDRESS      0x1000          // Also in trampoline.asm; free since the boot
+#define INIT_DELAY_PIT_TICKS    (PIT_FREQUENCY / 100)  // 10ms after INIT
+#define STARTUP_DELAY_PIT_TICKS (PIT_FREQUENCY / 5000) // 200us after each startup IPI
+#define STARTUP_ATTEMPTS        2
+#define MILLISECOND_PIT_TICKS   (PIT_FREQUENCY / 1000)
+#define START_TIMEOUT_MS        100             // Late answer: the processor is given up
+
+#define MADT_LOCAL_APIC         0               // Entry type of a processor
+#define MADT_LOCAL_APIC_ENABLED 0x01
+
+// Multiple APIC description table
+typedef struct
+{
+    AcpiTableHeader Header;                    // Signature "APIC"
+    uint32_t LocalApicAddress;
+    uint32_t Flags;
+
+} __attribute__((packed)) AcpiMadt;
+
+// Entries follow the table one after the other, each starting with its
+// type and length
+typedef struct
+{
+    uint8_t Type;
+    uint8_t Length;
+
+} __attribute__((packed)) MadtEntry;
+
+typedef struct
+{
+    MadtEntry Entry;                           // MADT_LOCAL_APIC
+    uint8_t ProcessorId;                       // ACPI processor UID
+    uint8_t ApicId;
+    uint32_t Flags;                            // MADT_LOCAL_APIC_ENABLED
+
+} __attribute__((packed)) MadtLocalApic;
+
+// Parameter block at trampoline_parameters (same layout)
+typedef struct
+{
+    uint32_t Cr0;
+    uint32_t Cr3;
+    uint32_t Cr4;
+    uint32_t StackPointer;                     // 0 once claimed by the trampoline (or withdrawn)
+    uint32_t Entry;
+
+} TrampolineParameters;
+
+typedef enum
+{
+    CPU_STARTED,
+    CPU_NOT_STARTED,                           // Did not answer, parked again (or no stack was left)
+    CPU_STUCK,                                 // Took its stack but did not report back
+
+} CpuStartResult;
+
+extern const char trampoline_start[];          // From trampoline.asm
+extern const char trampoline_parameters[];
+extern const char trampoline_end[];
+
+static const char* g_SmpStatus = "not started"; // Why only the bootstrap processor runs, NULL if none
+static unsigned g_ProcessorCount;              // Enabled processors of the MADT
+static unsigned g_StartFailures;               // Processors that did not answer
+static unsigned g_StartingCpu;                 // CPU index of the processor being started
+static volatile bool g_CpuStarted;             // Set by it once running on its own
+static volatile bool g_StartupDone;            // Identity mapping gone, processors may run threads
+static uint32_t g_KernelCr4;                   // CR4 of the bootstrap processor
+
+// C entry point of an application processor, from trampoline.asm, with
+// interrupts disabled and the trampoline's GDT still loaded
+static void __attribute__((noreturn)) smpCpuEntry(void)
+{
+    gdtInit();
+    idtLoad();
+    apicInitCpu();
+    perCpuInit(g_StartingCpu, apicId());
+    schedulerInitCpu();                        // This context becomes the idle thread
+    timerInitCpu();                            // Ticks once the idle loop enables interrupts
+    __atomic_store_n(&g_CpuStarted, true, __ATOMIC_RELEASE);
+
+    while (!__atomic_load_n(&g_StartupDone, __ATOMIC_ACQUIRE))
+        __asm__ volatile ("pause");
+    writeCr3(readCr3());                       // Drops the identity mapping of the TLB
+    writeCr4(g_KernelCr4);                     // Global pages from now on
+
+    schedulerIdle();
+}
+
+// Waits up to START_TIMEOUT_MS for the processor being started to report back
+static bool waitCpuStarted(void)
+{
+    for (unsigned ms = 0; ms < START_TIMEOUT_MS; ms++)
+    {
+        if (__atomic_load_n(&g_CpuStarted, __ATOMIC_ACQUIRE))
+            return true;
+        pitWait(MILLISECOND_PIT_TICKS);
+    }
+    return __atomic_load_n(&g_CpuStarted, __ATOMIC_ACQUIRE);
+}
+
+// Starts one application processor as the next CPU
+static CpuStartResult startCpu(uint32_t apicId, TrampolineParameters* parameters)
+{
+    uint8_t* stack = pageAlloc(THREAD_STACK_ORDER);
+    if (!stack)
+        return CPU_NOT_STARTED;
+
+    // Touched now: the processor has no page fault handler until it loads
+    // the IDT. Fake return address of smpCpuEntry at the top
+    uint32_t* stackPointer = (uint32_t*) (stack + THREAD_STACK_SIZE);
+    *--stackPointer = 0;
+
+    g_StartingCpu = g_CpuCount;
+    g_CpuStarted = false;
+    __atomic_store_n(&parameters->StackPointer, (uint32_t) stackPointer, __ATOMIC_RELEASE);
+
+    apicSendInit(apicId);
+    pitWait(INIT_DELAY_PIT_TICKS);
+    for (unsigned attempt = 0; attempt < STARTUP_ATTEMPTS && !g_CpuStarted; attempt++)
+    {
+        apicSendStartup(apicId, TRAMPOLINE_ADDRESS >> PAGE_SHIFT);
+        pitWait(STARTUP_DELAY_PIT_TICKS);
+    }
+
+    if (waitCpuStarted())
+        return CPU_STARTED;
+
+    // Withdraw the stack; still there means the processor never took it
+    if (__atomic_exchange_n(&parameters->StackPointer, 0, __ATOMIC_ACQ_REL))
+    {
+        apicSendInit(apicId);                  // Back to waiting for a startup IPI
+        pageFree(stack);
+        return CPU_NOT_STARTED;
+    }
+    return waitCpuStarted() ? CPU_STARTED : CPU_STUCK;
+}
+
+// Starts every enabled processor of the MADT (up to MAX_CPUS)
+// The bootstrap processor must run the scheduler and the timer
+void smpInit(void)
+{
+    if (!timerPerCpu())
+    {
+        g_SmpStatus = "no per-CPU timer";
+        return;
+    }
+    if (!acpiInit())
+    {
+        g_SmpStatus = "no ACPI tables";
+        return;
+    }
+    const AcpiMadt* madt = (const AcpiMadt*) acpiFindTable("APIC");
+    if (!madt)
+    {
+        g_SmpStatus = "no MADT";
+        return;
+    }
+
+    uint8_t* trampoline = physicalToVirtual(TRAMPOLINE_ADDRESS);
+    memcpy(trampoline, trampoline_start, trampoline_end - trampoline_start);
+    TrampolineParameters* parameters =
+        (TrampolineParameters*) (trampoline + (trampoline_parameters - trampoline_start));
+    g_KernelCr4 = readCr4();
+    parameters->Cr0 = readCr0();
+    parameters->Cr3 = readCr3();
+    parameters->Cr4 = g_KernelCr4 & ~CR4_PGE;
+    parameters->Entry = (uint32_t) smpCpuEntry;
+
+    pagingMapIdentity();
+
+    uint32_t bootstrapId = cpuCurrent()->ApicId;
+    const uint8_t* entry = (const uint8_t*) (madt + 1);
+    const uint8_t* end = (const uint8_t*) madt + madt->Header.Length;
+    for (; entry + sizeof(MadtEntry) <= end; entry += ((const MadtEntry*) entry)->Length)
+    {
+        const MadtLocalApic* processor = (const MadtLocalApic*) entry;
+        if (processor->Entry.Length < sizeof(MadtEntry))
+            break;                             // Malformed, would never advance
+        if (processor->Entry.Type != MADT_LOCAL_APIC || processor->Entry.Length < sizeof(MadtLocalApic)
+            || !(processor->Flags & MADT_LOCAL_APIC_ENABLED))
+            continue;
+
+        g_ProcessorCount++;
+        if (processor->ApicId == bootstrapId || g_CpuCount >= MAX_CPUS)
+            continue;
+        CpuStartResult result = startCpu(processor->ApicId, parameters);
+        if (result != CPU_STARTED)
+        {
+            logPrintf("SMP: processor with APIC ID %u did not start\n", processor->ApicId);
+            g_StartFailures++;
+        }
+        if (result == CPU_STUCK)
+        {
+            // It may still take CPU index g_CpuCount, which no other processor may get
+            logPuts("SMP: it is stuck starting, no more processors are started\n");
+            break;
+        }
+    }
+
+    pagingUnmapIdentity();
+    __atomic_store_n(&g_StartupDone, true, __ATOMIC_RELEASE);
+    g_SmpStatus = NULL;
+}
+
+// Logs the processors that run the kernel
+void smpDump(void)
+{
+    logPrintf("SMP: %u of %u CPUs running", g_CpuCount, g_ProcessorCount ? g_ProcessorCount : 1);
+    if (g_SmpStatus)
+        logPrintf(" (%s)", g_SmpStatus);
+    else if (g_StartFailures)
+        logPrintf(" (%u did not start)", g_StartFailures);
+
+    logPuts(", APIC IDs:");
+    for (unsigned i = 0; i < g_CpuCount; i++)
+        logPrintf(" %u", g_Cpus[i].ApicId);
+    logPuts("\n");
+}
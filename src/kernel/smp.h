@@ -0,0 +1,13 @@
+// =============================================================================
+// SYMMETRIC MULTIPROCESSING
+// =============================================================================
+//
+// Starts the application processors listed in the ACPI MADT. Each one gets
+// its own stack, per-CPU data (percpu.h) with its GS segment in the shared
+// GDT, its local APIC and timer, and an idle thread, then takes part in
+// scheduling like the bootstrap processor
+
+#pragma once
+
+void smpInit(void);
+void smpDump(void);
@@ -0,0 +1,40 @@
+// =============================================================================
+// SPINLOCKS
+// =============================================================================
+//
+// Test-and-test-and-set locks: waiters spin on a plain read (the cache line
+// stays shared) and only retry the atomic exchange once the lock looks free.
+// A lock taken by interrupt handlers must be held with interrupts disabled
+// (interruptsSave), otherwise the handler can spin on its own CPU's lock
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct
+{
+    volatile uint32_t Locked;                  // 1 while held
+
+} Spinlock;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline bool spinTryLock(Spinlock* lock)
+{
+    return !__atomic_exchange_n(&lock->Locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void spinLock(Spinlock* lock)
+{
+    while (!spinTryLock(lock))
+    {
+        while (lock->Locked)
+            __asm__ volatile ("pause");        // Spin-wait hint (REP NOP on older processors)
+    }
+}
+
+static inline void spinUnlock(Spinlock* lock)
+{
+    __atomic_store_n(&lock->Locked, 0, __ATOMIC_RELEASE);
+}
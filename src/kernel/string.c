@@ -0,0 +1,87 @@
+// =============================================================================
+// MEMORY AND STRING FUNCTIONS
+// =============================================================================
+//
+// Block operations use the string instructions, which are fast for large
+// sizes on every processor since the Pentium Pro (fast strings)
+
+#include "string.h"
+
+#include <stdint.h>
+
+// Copies memory, the regions must not overlap
+void* memcpy(void* destination, const void* source, size_t size)
+{
+    void* result = destination;
+    __asm__ volatile ("rep movsb"
+                      : "+D"(destination), "+S"(source), "+c"(size)
+                      :
+                      : "memory");
+    return result;
+}
+
+// Copies memory, the regions may overlap
+void* memmove(void* destination, const void* source, size_t size)
+{
+    if ((uintptr_t) destination <= (uintptr_t) source ||
+        (uintptr_t) destination >= (uintptr_t) source + size)
+        return memcpy(destination, source, size);
+
+    // Overlapping with the destination above the source: copy backwards
+    void* result = destination;
+    uint8_t* lastDestination = (uint8_t*) destination + size - 1;
+    const uint8_t* lastSource = (const uint8_t*) source + size - 1;
+    __asm__ volatile ("std\n\t"
+                      "rep movsb\n\t"
+                      "cld"
+                      : "+D"(lastDestination), "+S"(lastSource), "+c"(size)
+                      :
+                      : "memory");
+    return result;
+}
+
+// Fills memory with a byte value
+void* memset(void* destination, int value, size_t size)
+{
+    void* result = destination;
+    __asm__ volatile ("rep stosb"
+                      : "+D"(destination), "+c"(size)
+                      : "a"(value)
+                      : "memory");
+    return result;
+}
+
+// Compares memory, returns <0, 0 or >0 like the C library function
+int memcmp(const void* first, const void* second, size_t size)
+{
+    const uint8_t* a = (const uint8_t*) first;
+    const uint8_t* b = (const uint8_t*) second;
+    for (size_t i = 0; i < size; i++)
+    {
+        if (a[i] != b[i])
+            return a[i] - b[i];
+    }
+    return 0;
+}
+
+// Returns the length of a null-terminated string
+size_t strlen(const char* string)
+{
+    size_t length = 0;
+    while (string[length])
+        length++;
+    return length;
+}
+
+// Compares null-terminated strings, returns <0, 0 or >0 like the C library function
+int strcmp(const char* first, const char* second)
+{
+    const uint8_t* a = (const uint8_t*) first;
+    const uint8_t* b = (const uint8_t*) second;
+    while (*a && *a == *b)
+    {
+        a++;
+        b++;
+    }
+    return *a - *b;
+}
@@ -0,0 +1,17 @@
+// =============================================================================
+// MEMORY AND STRING FUNCTIONS
+// =============================================================================
+//
+// Freestanding replacements for the C library functions the kernel uses
+// (the compiler may also emit calls to memcpy, memmove and memset itself)
+
+#pragma once
+
+#include <stddef.h>
+
+void* memcpy(void* destination, const void* source, size_t size);
+void* memmove(void* destination, const void* source, size_t size);
+void* memset(void* destination, int value, size_t size);
+int memcmp(const void* first, const void* second, size_t size);
+size_t strlen(const char* string);
+int strcmp(const char* first, const char* second);
@@ -0,0 +1,40 @@
+; =============================================================================
+; NBOS KERNEL CONTEXT SWITCH
+; =============================================================================
+;
+; void contextSwitch(uint32_t* savedStackPointer, uint32_t stackPointer)
+;
+; Saves the callee-saved registers of the running thread on its stack, stores
+; its stack pointer in *savedStackPointer, loads stackPointer and restores the
+; registers of the thread saved there. Everything else is saved by the C
+; caller (cdecl) or by the interrupt stub the switch happens under, so a
+; switch costs four pushes, four pops and the stack pointer exchange
+;
+; A new thread's stack is prepared by scheduler.c in the same layout, with
+; the thread start function as return address
+
+bits 32
+
+global contextSwitch
+
+section .text
+
+contextSwitch:
+    mov eax, [esp + 4]          ; EAX = savedStackPointer
+    mov edx, [esp + 8]          ; EDX = stackPointer
+
+    push ebp                    ; Callee-saved registers of the old thread
+    push ebx
+    push esi
+    push edi
+    mov [eax], esp              ; Old thread's stack pointer
+
+    mov esp, edx                ; New thread's stack
+    pop edi                     ; Callee-saved registers of the new thread
+    pop esi
+    pop ebx
+    pop ebp
+    ret                         ; Continue where the new thread switched away
+
+; No executable stack needed (keeps the linker from warning about it)
+section .note.GNU-stack noalloc noexec nowrite progbits
@@ -0,0 +1,182 @@
+// =============================================================================
+// SYSTEM TIMER
+// =============================================================================
+//
+// Calibration counts the time stamp counter and the APIC timer during
+// CALIBRATION_PIT_TICKS clocks of PIT channel 2 (polled, no interrupts).
+//
+// Every tick source acknowledges its interrupt before the tick handler runs,
+// so the handler may switch to another thread without blocking the timer.
+//
+// With an APIC source every CPU ticks on its own local APIC timer, started
+// with the calibration of the bootstrap processor. timerTicks counts the
+// ticks of the bootstrap processor only
+
+#include "timer.h"
+
+#include <stdbool.h>
+
+#include "apic.h"
+#include "cpu.h"
+#include "irq.h"
+#include "log.h"
+#include "percpu.h"
+#include "pit.h"
+#include "profile.h"
+
+#define CALIBRATION_PIT_TICKS   (PIT_FREQUENCY / 100) // 10ms
+
+static const char* const g_TimerSourceNames[] =
+{
+    [TIMER_SOURCE_AUTO]         = "none",
+    [TIMER_SOURCE_PIT]          = "PIT",
+    [TIMER_SOURCE_APIC]         = "local APIC",
+    [TIMER_SOURCE_TSC_DEADLINE] = "local APIC TSC-deadline",
+};
+
+static unsigned g_TimerSource;                 // TIMER_SOURCE_* in use, AUTO before timerInit
+static uint32_t g_TimerFrequency;              // Actual ticks per second
+static volatile uint32_t g_TimerTicks;         // Ticks since timerInit
+static TimerHandler g_TimerHandler;            // Called on every tick
+
+static uint64_t g_TimestampFrequency;          // TSC cycles per second, 0 if not calibrated
+static uint64_t g_ApicTimerFrequency;          // APIC timer clocks per second
+static uint32_t g_ApicTimerCount;              // APIC timer clocks per tick (periodic)
+static uint64_t g_DeadlinePeriod;              // TSC cycles per tick (TSC-deadline)
+
+// Common part of every tick, IRQ 0 handler with the PIT
+static void timerTick(InterruptFrame* frame)
+{
+    profileSample(frame);
+    if (cpuCurrent()->Index == 0)
+        g_TimerTicks++;
+    if (g_TimerHandler)
+        g_TimerHandler(frame);
+}
+
+// APIC timer handler, both modes
+static void timerApicInterrupt(InterruptFrame* frame)
+{
+    if (g_TimerSource == TIMER_SOURCE_TSC_DEADLINE)
+    {
+        PerCpu* cpu = cpuCurrent();
+        uint64_t now = readTimestamp();
+        cpu->NextDeadline += g_DeadlinePeriod;
+        if (cpu->NextDeadline <= now)
+            cpu->NextDeadline = now + g_DeadlinePeriod; // Missed ticks are dropped, not made up
+        apicTimerSetDeadline(cpu->NextDeadline);
+    }
+
+    apicEndOfInterrupt();
+    timerTick(frame);
+}
+
+// Converts clocks counted during the calibration into clocks per second
+static uint64_t calibratedFrequency(uint64_t clocks)
+{
+    uint64_t frequency = clocks * PIT_FREQUENCY;
+    divide64(&frequency, CALIBRATION_PIT_TICKS);
+    return frequency;
+}
+
+// Starts the local APIC timer of the executing CPU
+static void timerStartApic(void)
+{
+    if (g_TimerSource == TIMER_SOURCE_TSC_DEADLINE)
+    {
+        PerCpu* cpu = cpuCurrent();
+        apicTimerStartDeadline();
+        cpu->NextDeadline = readTimestamp() + g_DeadlinePeriod;
+        apicTimerSetDeadline(cpu->NextDeadline);
+    }
+    else
+    {
+        apicTimerStartPeriodic(g_ApicTimerCount);
+    }
+}
+
+// Picks the tick source, calibrates it and starts it
+// The IRQ layer must be set up, the local APIC initialized (if any) and the
+// per-CPU data of the bootstrap processor set; ticks arrive once interrupts
+// are enabled
+void timerInit(void)
+{
+    bool deadline = apicAvailable() && (cpuFeatures().Ecx & CPUID_FEATURE_TSC_DEADLINE);
+    unsigned source = TIMER_SOURCE;
+    if (source == TIMER_SOURCE_AUTO || (source == TIMER_SOURCE_TSC_DEADLINE && !deadline))
+        source = deadline ? TIMER_SOURCE_TSC_DEADLINE : TIMER_SOURCE_APIC;
+    if (source == TIMER_SOURCE_APIC && !apicAvailable())
+        source = TIMER_SOURCE_PIT;
+
+    if (source == TIMER_SOURCE_PIT)
+    {
+        g_TimerFrequency = pitStartPeriodic(TIMER_FREQUENCY);
+        irqRegister(PIT_IRQ, timerTick);
+    }
+    else
+    {
+        uint64_t cycles;
+        g_ApicTimerFrequency = calibratedFrequency(apicTimerMeasure(CALIBRATION_PIT_TICKS, &cycles));
+        g_TimestampFrequency = calibratedFrequency(cycles);
+        interruptSetHandler(APIC_TIMER_VECTOR, timerApicInterrupt);
+        g_TimerFrequency = TIMER_FREQUENCY;
+
+        g_DeadlinePeriod = g_TimestampFrequency;
+        divide64(&g_DeadlinePeriod, TIMER_FREQUENCY);
+        uint64_t count = g_ApicTimerFrequency;
+        divide64(&count, TIMER_FREQUENCY);
+        g_ApicTimerCount = count ? count : 1;
+    }
+
+    g_TimerSource = source;
+    if (source != TIMER_SOURCE_PIT)
+        timerStartApic();
+}
+
+// Returns true if every CPU can have its own tick (APIC sources); the PIT
+// interrupt only reaches the bootstrap processor
+bool timerPerCpu(void)
+{
+    return g_TimerSource == TIMER_SOURCE_APIC || g_TimerSource == TIMER_SOURCE_TSC_DEADLINE;
+}
+
+// Starts the tick of an application processor (after perCpuInit), if
+// timerPerCpu
+void timerInitCpu(void)
+{
+    if (timerPerCpu())
+        timerStartApic();
+}
+
+// Installs the function called on every tick (with interrupts disabled)
+void timerSetHandler(TimerHandler handler)
+{
+    g_TimerHandler = handler;
+}
+
+// Returns the ticks since timerInit
+uint32_t timerTicks(void)
+{
+    return g_TimerTicks;
+}
+
+// Returns the TSC cycles per second, 0 if the PIT is the tick source (the TSC
+// is not calibrated then)
+uint64_t timerTimestampFrequency(void)
+{
+    return g_TimestampFrequency;
+}
+
+// Logs the tick source and the calibrated clocks
+void timerDump(void)
+{
+    logPrintf("Timer: %s at %u Hz", g_TimerSourceNames[g_TimerSource], g_TimerFrequency);
+    if (g_TimestampFrequency)
+    {
+        uint64_t tsc = g_TimestampFrequency, apic = g_ApicTimerFrequency;
+        divide64(&tsc, 1000);
+        divide64(&apic, 1000);
+        logPrintf(", TSC %llu kHz, APIC timer %llu kHz", tsc, apic);
+    }
+    logPuts("\n");
+}
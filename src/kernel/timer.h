@@ -0,0 +1,44 @@
+// =============================================================================
+// SYSTEM TIMER
+// =============================================================================
+//
+// Periodic tick of the kernel at TIMER_FREQUENCY Hz from one of:
+// - the PIT (channel 0, IRQ 0): always available
+// - the local APIC timer in periodic mode, calibrated against the PIT
+// - the local APIC timer in TSC-deadline mode: each tick arms the next
+//   deadline on the time stamp counter (calibrated against the PIT)
+// TIMER_SOURCE selects one; the default picks the best the processor has,
+// and an unavailable choice falls back to the next one. Both can be set at
+// build time, e.g. make KERNEL_DEFINES="-DTIMER_SOURCE=TIMER_SOURCE_PIT
+// -DTIMER_FREQUENCY=1000"
+// The APIC sources tick on every CPU, the PIT only on the bootstrap processor
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "idt.h"
+
+#define TIMER_SOURCE_AUTO           0           // TSC-deadline, else APIC, else PIT
+#define TIMER_SOURCE_PIT            1
+#define TIMER_SOURCE_APIC           2
+#define TIMER_SOURCE_TSC_DEADLINE   3
+
+#ifndef TIMER_SOURCE
+#define TIMER_SOURCE            TIMER_SOURCE_AUTO
+#endif
+
+#ifndef TIMER_FREQUENCY
+#define TIMER_FREQUENCY         100             // Ticks per second
+#endif
+
+typedef void (*TimerHandler)(InterruptFrame* frame);
+
+void timerInit(void);
+bool timerPerCpu(void);
+void timerInitCpu(void);
+void timerSetHandler(TimerHandler handler);
+uint32_t timerTicks(void);
+uint64_t timerTimestampFrequency(void);
+void timerDump(void);
@@ -0,0 +1,101 @@
+; =============================================================================
+; NBOS APPLICATION PROCESSOR TRAMPOLINE
+; =============================================================================
+;
+; Start-up code of the application processors. A startup IPI starts a
+; processor in real mode at CS:IP = (page * 100h):0, so smp.c copies this
+; code to TRAMPOLINE_ADDRESS (a page below 1MB) and fills the parameter
+; block at its end first. The code is never run where it is linked: every
+; address it uses is computed relative to TRAMPOLINE_ADDRESS (ABSOLUTE)
+;
+; The processor loads a GDT of its own with the kernel selectors, switches
+; to protected mode, loads the control registers of the bootstrap processor
+; (the page directory maps this page at its physical address while
+; processors start, see pagingMapIdentity) and jumps on the stack it claimed
+; to the C entry point in the higher half, which loads the kernel GDT and IDT
+;
+; The stack is claimed first, by exchanging it with 0: a processor that
+; finds 0 started too late (smp.c withdrew the stack) or after another one,
+; and halts here for good
+
+bits 16
+
+TRAMPOLINE_ADDRESS      equ 1000h               ; Also in smp.c
+CODE_SELECTOR           equ 08h                 ; KERNEL_CODE_SELECTOR of gdt.h
+DATA_SELECTOR           equ 10h                 ; KERNEL_DATA_SELECTOR of gdt.h
+CR0_PROTECTED_MODE      equ 1
+
+%define ABSOLUTE(label) (TRAMPOLINE_ADDRESS + (label) - trampoline_start)
+
+global trampoline_start
+global trampoline_parameters
+global trampoline_end
+
+section .rodata                 ; Only copied, never executed in place
+
+trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax                  ; Flat addressing of this page
+
+    xor esp, esp
+    xchg esp, [ABSOLUTE(trampoline_stack)] ; Locked: one processor gets the stack
+    test esp, esp
+    jz trampoline_parked        ; No stack for this processor
+
+    o32 lgdt [ABSOLUTE(trampoline_gdt_descriptor)]
+    mov eax, cr0
+    or eax, CR0_PROTECTED_MODE
+    mov cr0, eax
+    jmp dword CODE_SELECTOR:ABSOLUTE(trampoline_protected_mode)
+
+bits 32
+
+trampoline_protected_mode:
+    mov ax, DATA_SELECTOR
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    mov eax, [ABSOLUTE(trampoline_cr4)]
+    mov cr4, eax                ; PSE as on the bootstrap processor, no PGE yet
+    mov eax, [ABSOLUTE(trampoline_cr3)]
+    mov cr3, eax                ; Kernel page directory
+    mov eax, [ABSOLUTE(trampoline_cr0)]
+    mov cr0, eax                ; Paging on, still running from the identity mapping
+
+    jmp [ABSOLUTE(trampoline_entry)]    ; C entry point in the higher half, ESP = claimed stack
+
+bits 16
+
+trampoline_parked:
+    hlt                         ; Interrupts are disabled, only an NMI or INIT wakes it
+    jmp trampoline_parked
+
+; Null descriptor, flat 4GB code and data (same as gdt.c)
+align 8
+trampoline_gdt:
+    dq 0
+    dq 00CF9A000000FFFFh
+    dq 00CF92000000FFFFh
+
+trampoline_gdt_descriptor:
+    dw trampoline_gdt_descriptor - trampoline_gdt - 1
+    dd ABSOLUTE(trampoline_gdt)
+
+; Parameter block, filled by smp.c (TrampolineParameters)
+align 4
+trampoline_parameters:
+trampoline_cr0:     dd 0
+trampoline_cr3:     dd 0
+trampoline_cr4:     dd 0
+trampoline_stack:   dd 0        ; Initial ESP (higher half)
+trampoline_entry:   dd 0        ; C entry point (higher half)
+
+trampoline_end:
+
+; No executable stack needed (keeps the linker from warning about it)
+section .note.GNU-stack noalloc noexec nowrite progbits
@@ -0,0 +1,133 @@
+#!/bin/sh
+# =============================================================================
+# HEADLESS BOOT BENCHMARK
+# =============================================================================
+#
+# Boots a floppy image several times under QEMU without a display and
+# reports the median and 99th percentile of the time to the kernel entry and
+# of every boot phase, from the boot time checkpoints the kernel logs on the
+# serial port (see src/kernel/boot_times.h). The kernel must be built with
+# -DBOOT_BENCH, so it leaves QEMU through isa-debug-exit once it has logged
+# them; make bench_boot builds such an image and runs this script on it.
+#
+# Usage: bench_boot.sh <floppy image> [runs]
+# Environment: QEMU (default qemu-system-i386), QEMU_FLAGS (default -smp 4),
+#              BENCH_TIMEOUT (seconds per boot, default 60)
+
+set -u
+
+IMAGE=${1:?usage: bench_boot.sh <floppy image> [runs]}
+RUNS=${2:-20}
+QEMU=${QEMU:-qemu-system-i386}
+QEMU_FLAGS=${QEMU_FLAGS:--smp 4}
+BENCH_TIMEOUT=${BENCH_TIMEOUT:-60}
+
+if ! command -v "$QEMU" >/dev/null 2>&1; then
+    echo "bench_boot: $QEMU not found (set QEMU)" >&2
+    exit 1
+fi
+
+LOGS=$(mktemp -d)
+trap 'rm -rf "$LOGS"' EXIT
+
+# =============================================================================
+# BOOTS
+# =============================================================================
+
+# The image is opened read-only (snapshot), so every boot starts alike.
+# Writing 0 to isa-debug-exit makes QEMU exit with status (0 << 1) | 1 = 1
+run=1
+while [ "$run" -le "$RUNS" ]; do
+    log="$LOGS/run$run.log"
+    # shellcheck disable=SC2086 # QEMU_FLAGS holds several arguments
+    timeout "$BENCH_TIMEOUT" "$QEMU" $QEMU_FLAGS \
+        -drive file="$IMAGE",if=floppy,format=raw,snapshot=on \
+        -display none -serial stdio -no-reboot \
+        -device isa-debug-exit,iobase=0xf4,iosize=0x04 >"$log" 2>&1
+    status=$?
+
+    if [ "$status" -ne 1 ] || ! grep -q '^BOOT_BENCH ' "$log"; then
+        echo "bench_boot: boot $run failed (QEMU exit status $status), end of its log:" >&2
+        tail -n 20 "$log" >&2
+        exit 1
+    fi
+    printf '.' >&2
+    run=$((run + 1))
+done
+echo >&2
+
+# =============================================================================
+# REPORT
+# =============================================================================
+
+# Every log has the phases of bootTimesDump ("  <cycles>  <phase>" after
+# "Boot times (TSC cycles):") and the BOOT_BENCH line; the serial log ends
+# lines with CR LF
+cat "$LOGS"/run*.log | tr -d '\r' | awk -v runs="$RUNS" -v image="$IMAGE" '
+# Sorts values[1..n] in place (insertion sort: n is the number of runs)
+function sort(values, n,    i, j, value) {
+    for (i = 2; i <= n; i++) {
+        value = values[i]
+        for (j = i - 1; j > 0 && values[j] > value; j--)
+            values[j + 1] = values[j]
+        values[j + 1] = value
+    }
+}
+
+# Median and nearest-rank 99th percentile of a column of samples
+function summarize(label, key,    values, i, n, median, p99) {
+    n = count[key]
+    if (n == 0)
+        return
+    for (i = 1; i <= n; i++)
+        values[i] = sample[key, i]
+    sort(values, n)
+    median = n % 2 ? values[(n + 1) / 2] : (values[n / 2] + values[n / 2 + 1]) / 2
+    p99 = values[int((99 * n + 99) / 100)]
+    if (khz)
+        printf "  %-44s %14.0f %14.0f %10.3f %10.3f\n", label, median, p99, median / khz, p99 / khz
+    else
+        printf "  %-44s %14.0f %14.0f\n", label, median, p99
+}
+
+function add(key, value) {
+    sample[key, ++count[key]] = value
+}
+
+/^Boot times \(TSC cycles\):/ { inTimes = 1; next }
+inTimes && /^  +[0-9]+  / {
+    phase = $0
+    sub(/^ +[0-9]+  /, "", phase)
+    if (phase == "total")
+        next
+    if (!(phase in seen)) {
+        seen[phase] = 1
+        order[++phases] = phase
+    }
+    add("phase:" phase, $1)
+    next
+}
+{ inTimes = 0 }
+
+/^BOOT_BENCH / {
+    for (i = 2; i <= NF; i++) {
+        split($i, field, "=")
+        if (field[1] == "tsc_khz")
+            khz = field[2]             # The same on every boot of one machine
+        else
+            add(field[1], field[2])
+    }
+}
+
+END {
+    printf "Boot benchmark: %d boots of %s\n", runs, image
+    if (khz)
+        printf "  %-44s %14s %14s %10s %10s\n", "(TSC cycles, ms)", "median", "p99", "median ms", "p99 ms"
+    else
+        printf "  %-44s %14s %14s  (TSC not calibrated: no ms)\n", "(TSC cycles)", "median", "p99"
+    summarize("time to kernel (reset to kernel entry)", "kernel")
+    summarize("time to kernel initialized", "init")
+    print "  Phases:"
+    for (i = 1; i <= phases; i++)
+        summarize(order[i], "phase:" order[i])
+}'
@@ -0,0 +1,525 @@
+// =============================================================================
+// FAT TOOL BENCHMARK
+// =============================================================================
+//
+// This program generates synthetic FAT12, FAT16 and FAT32 disk images and
+// measures the hot paths of the fat tool on them, one phase at a time:
+// opening the image, decoding the FAT, looking up files and extracting them.
+//
+// Every FAT type is tested with three image shapes:
+// - small:      many small files in one directory (lookup and per-file costs)
+// - huge:       one large contiguous file (extent merging and raw throughput)
+// - fragmented: one large file with its clusters in random order (chain walking)
+//
+// The fat tool is compiled into this program so that its functions can be
+// timed directly. Images are generated right before they are measured, so the
+// numbers describe a warm page cache.
+
+#define FAT_TOOL_NO_MAIN
+#include "fat.c"
+
+#include <time.h>
+
+// =============================================================================
+// TYPE DEFINITIONS
+// =============================================================================
+
+// Image geometry structure - one synthetic volume per FAT type
+typedef struct
+{
+    const char* Name;                  // Name shown in the report
+    uint8_t FatType;                   // FAT entry width: 12, 16 or 32
+    uint32_t TotalSectors;             // Size of the volume in sectors
+    uint8_t SectorsPerCluster;         // Sectors per cluster
+    uint16_t RootEntries;              // Fixed root directory entries (0 for FAT32)
+    uint32_t SmallFiles;               // Number of files of the "small" shape
+    uint32_t SmallFileSize;            // Maximum size of a small file in bytes
+
+} ImageGeometry;
+
+// Image shapes
+typedef enum
+{
+    SHAPE_SMALL,                       // Many small files in the FILES directory
+    SHAPE_HUGE,                        // One contiguous file using most of the volume
+    SHAPE_FRAGMENTED,                  // One file using most of the volume, clusters shuffled
+
+} ImageShape;
+
+// Image builder structure - state used while generating an image
+typedef struct
+{
+    uint8_t* Data;                     // Mapped image
+    const ImageGeometry* Geometry;     // Geometry of the image
+    uint32_t ReservedSectors;          // Reserved sectors before the FATs
+    uint32_t SectorsPerFat;            // Sectors per FAT table
+    uint32_t DataStart;                // LBA of the first data cluster
+    uint32_t ClusterCount;             // Number of data clusters
+    uint32_t ClusterSize;              // Cluster size in bytes
+    uint32_t NextFree;                 // Next cluster handed out by the allocator
+    uint32_t* Table;                   // Next cluster for every cluster (0 = free)
+    uint32_t Random;                   // State of the random number generator
+
+} ImageBuilder;
+
+// Benchmark result structure - timings of one image
+typedef struct
+{
+    double OpenTime;                   // Opening the image and reading the FAT (seconds)
+    double DecodeTime;                 // Decoding the FAT into the cluster table (seconds)
+    double LookupTime;                 // Resolving every file path (seconds)
+    double ExtractTime;                // Streaming every file (seconds)
+    uint32_t Files;                    // Number of files
+    uint64_t Bytes;                    // Number of bytes extracted
+    uint64_t Checksum;                 // Checksum of the extracted data (keeps the reads alive)
+
+} BenchResult;
+
+// =============================================================================
+// GLOBAL VARIABLES
+// =============================================================================
+
+#define BENCH_BYTES_PER_SECTOR 512
+#define BENCH_EOC 0x0FFFFFFF           // End of chain marker before encoding
+
+static const ImageGeometry g_Geometries[] =
+{
+    { "FAT12", 12,   2880, 1, 224,  1000, 1024 },   // 1.44 MB floppy
+    { "FAT16", 16, 131072, 4, 512, 10000, 2048 },   // 64 MB, 2 KB clusters
+    { "FAT32", 32, 131072, 1,   0, 20000, 1024 },   // 64 MB, 512 byte clusters
+};
+
+static const char* g_ShapeNames[] = { "small", "huge", "fragmented" };
+
+// =============================================================================
+// IMAGE GENERATION FUNCTIONS
+// =============================================================================
+
+// Gets the next pseudo random number (xorshift32)
+uint32_t nextRandom(ImageBuilder* builder)
+{
+    builder->Random ^= builder->Random << 13;
+    builder->Random ^= builder->Random >> 17;
+    builder->Random ^= builder->Random << 5;
+    return builder->Random;
+}
+
+// Calculates the layout of the volume: FAT size, data area and cluster count
+// The FAT size depends on the cluster count and the other way round, so the
+// calculation is repeated until the FAT is big enough
+// Parameters:
+//   builder - Image builder with Geometry set
+void computeImageLayout(ImageBuilder* builder)
+{
+    const ImageGeometry* geometry = builder->Geometry;
+    uint32_t rootSectors = geometry->RootEntries * sizeof(DirectoryEntry) / BENCH_BYTES_PER_SECTOR;
+    builder->ReservedSectors = geometry->FatType == 32 ? 32 : 1;
+    builder->SectorsPerFat = 1;
+
+    for (;;)
+    {
+        builder->DataStart = builder->ReservedSectors + 2 * builder->SectorsPerFat + rootSectors;
+        builder->ClusterCount = (geometry->TotalSectors - builder->DataStart) / geometry->SectorsPerCluster;
+
+        uint64_t fatBytes = ((uint64_t) (builder->ClusterCount + 2) * geometry->FatType + 7) / 8;
+        uint32_t needed = (uint32_t) ((fatBytes + BENCH_BYTES_PER_SECTOR - 1) / BENCH_BYTES_PER_SECTOR);
+        if (needed <= builder->SectorsPerFat)
+            break;
+        builder->SectorsPerFat = needed;
+    }
+
+    builder->ClusterSize = geometry->SectorsPerCluster * BENCH_BYTES_PER_SECTOR;
+    builder->NextFree = 2;
+}
+
+// Allocates a cluster chain and fills its clusters with data
+// Parameters:
+//   builder - Image builder
+//   size - Size of the data in bytes
+//   fragmented - Link the clusters in random order instead of sequentially
+//   content - Data to store, or NULL to fill the clusters with a pattern
+// Returns: First cluster of the chain, 0 for empty data or if the volume is full
+uint32_t allocateChain(ImageBuilder* builder, uint64_t size, bool fragmented, const uint8_t* content)
+{
+    uint32_t count = (uint32_t) ((size + builder->ClusterSize - 1) / builder->ClusterSize);
+    if (count == 0 || builder->NextFree + count > builder->ClusterCount + 2)
+        return 0;
+
+    uint32_t* order = (uint32_t*) malloc(count * sizeof(uint32_t));
+    if (!order)
+        return 0;
+
+    // Take a run of free clusters, shuffle the order they are linked in if requested
+    for (uint32_t i = 0; i < count; i++)
+        order[i] = builder->NextFree + i;
+    builder->NextFree += count;
+    for (uint32_t i = count - 1; fragmented && i > 0; i--)
+    {
+        uint32_t j = nextRandom(builder) % (i + 1);
+        uint32_t swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint8_t* cluster = builder->Data + ((uint64_t) builder->DataStart
+                           + (uint64_t) (order[i] - 2) * builder->Geometry->SectorsPerCluster) * BENCH_BYTES_PER_SECTOR;
+        uint64_t offset = (uint64_t) i * builder->ClusterSize;
+        uint64_t chunk = size - offset < builder->ClusterSize ? size - offset : builder->ClusterSize;
+
+        if (content)
+            memcpy(cluster, content + offset, chunk);
+        else
+            memset(cluster, (uint8_t) order[i], chunk);
+        builder->Table[order[i]] = i + 1 < count ? order[i + 1] : BENCH_EOC;
+    }
+
+    uint32_t first = order[0];
+    free(order);
+    return first;
+}
+
+// Fills a directory entry
+// Parameters:
+//   entry - Entry to fill
+//   name - 11-character filename in 8.3 format
+//   attributes - Attribute flags
+//   cluster - First cluster
+//   size - File size in bytes
+void setEntry(DirectoryEntry* entry, const char* name, uint8_t attributes, uint32_t cluster, uint32_t size)
+{
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->Name, name, 11);
+    entry->Attributes = attributes;
+    entry->FirstClusterHigh = (uint16_t) (cluster >> 16);
+    entry->FirstClusterLow = (uint16_t) cluster;
+    entry->Size = size;
+}
+
+// Writes the boot sector and every FAT copy of a generated image
+// Parameters:
+//   builder - Image builder
+//   rootCluster - First cluster of the root directory (FAT32 only)
+void writeImageMetadata(ImageBuilder* builder, uint32_t rootCluster)
+{
+    const ImageGeometry* geometry = builder->Geometry;
+    BootSector* bootSector = (BootSector*) builder->Data;
+    memset(bootSector, 0, sizeof(*bootSector));
+
+    memcpy(bootSector->BootJumpInstruction, "\xEB\x58\x90", 3);
+    memcpy(bootSector->OemIdentifier, "MSWIN4.1", 8);
+    bootSector->BytesPerSector = BENCH_BYTES_PER_SECTOR;
+    bootSector->SectorsPerCluster = geometry->SectorsPerCluster;
+    bootSector->ReservedSectors = builder->ReservedSectors;
+    bootSector->FatCount = 2;
+    bootSector->DirEntryCount = geometry->RootEntries;
+    bootSector->TotalSectors = geometry->TotalSectors < 0x10000 ? geometry->TotalSectors : 0;
+    bootSector->LargeSectorCount = geometry->TotalSectors < 0x10000 ? 0 : geometry->TotalSectors;
+    bootSector->MediaDescriptorType = 0xF8;
+    bootSector->SectorsPerTrack = 63;
+    bootSector->Heads = 16;
+
+    if (geometry->FatType == 32)
+    {
+        bootSector->SectorsPerFat32 = builder->SectorsPerFat;
+        bootSector->RootCluster = rootCluster;
+        bootSector->Signature32 = 0x29;
+        memcpy(bootSector->VolumeLabel32, "BENCH      ", 11);
+        memcpy(bootSector->SystemId32, "FAT32   ", 8);
+    }
+    else
+    {
+        bootSector->SectorsPerFat = builder->SectorsPerFat;
+        bootSector->Signature = 0x29;
+        memcpy(bootSector->VolumeLabel, "BENCH      ", 11);
+        memcpy(bootSector->SystemId, geometry->FatType == 12 ? "FAT12   " : "FAT16   ", 8);
+    }
+    builder->Data[510] = 0x55;
+    builder->Data[511] = 0xAA;
+
+    // Encode the table with the entry width of the FAT type
+    uint8_t* fat = builder->Data + (uint64_t) builder->ReservedSectors * BENCH_BYTES_PER_SECTOR;
+    uint32_t mask = geometry->FatType == 12 ? 0x0FFF : geometry->FatType == 16 ? 0xFFFF : 0x0FFFFFFF;
+    builder->Table[0] = 0x0FFFFF00 | bootSector->MediaDescriptorType;
+    builder->Table[1] = BENCH_EOC;
+    for (uint32_t cluster = 0; cluster < builder->ClusterCount + 2; cluster++)
+    {
+        uint32_t value = builder->Table[cluster] & mask;
+        if (geometry->FatType == 12)
+        {
+            uint8_t* entry = fat + cluster * 3 / 2;
+            if (cluster % 2 == 0)
+            {
+                entry[0] = (uint8_t) value;
+                entry[1] = (entry[1] & 0xF0) | (value >> 8);
+            }
+            else
+            {
+                entry[0] = (entry[0] & 0x0F) | (uint8_t) (value << 4);
+                entry[1] = (uint8_t) (value >> 4);
+            }
+        }
+        else if (geometry->FatType == 16)
+        {
+            fat[cluster * 2] = (uint8_t) value;
+            fat[cluster * 2 + 1] = (uint8_t) (value >> 8);
+        }
+        else
+        {
+            memcpy(fat + cluster * 4, &value, sizeof(value));
+        }
+    }
+
+    // Second FAT copy
+    memcpy(fat + (uint64_t) builder->SectorsPerFat * BENCH_BYTES_PER_SECTOR, fat,
+           (uint64_t) builder->SectorsPerFat * BENCH_BYTES_PER_SECTOR);
+}
+
+// Generates a synthetic image
+// Parameters:
+//   path - Path of the image file to create
+//   geometry - Geometry of the volume
+//   shape - Shape of the content
+//   filesOut - Receives the number of files created
+// Returns: true if successful, false otherwise
+bool generateImage(const char* path, const ImageGeometry* geometry, ImageShape shape, uint32_t* filesOut)
+{
+    ImageBuilder builder;
+    memset(&builder, 0, sizeof(builder));
+    builder.Geometry = geometry;
+    builder.Random = 0x12345678;
+    computeImageLayout(&builder);
+
+    size_t size = (size_t) geometry->TotalSectors * BENCH_BYTES_PER_SECTOR;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) != 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    builder.Table = (uint32_t*) calloc(builder.ClusterCount + 2, sizeof(uint32_t));
+    if (map == MAP_FAILED || !builder.Table)
+    {
+        if (map != MAP_FAILED)
+            munmap(map, size);
+        free(builder.Table);
+        return false;
+    }
+    builder.Data = (uint8_t*) map;
+
+    // Root directory: fixed area for FAT12/16, one cluster for FAT32
+    DirectoryEntry* root;
+    uint32_t rootCluster = 0;
+    if (geometry->FatType == 32)
+    {
+        rootCluster = allocateChain(&builder, builder.ClusterSize, false, NULL);
+        root = (DirectoryEntry*) (builder.Data + ((uint64_t) builder.DataStart
+               + (uint64_t) (rootCluster - 2) * geometry->SectorsPerCluster) * BENCH_BYTES_PER_SECTOR);
+        memset(root, 0, builder.ClusterSize);
+    }
+    else
+    {
+        root = (DirectoryEntry*) (builder.Data + ((uint64_t) builder.DataStart
+               - geometry->RootEntries * sizeof(DirectoryEntry) / BENCH_BYTES_PER_SECTOR) * BENCH_BYTES_PER_SECTOR);
+    }
+
+    bool ok = true;
+    if (shape == SHAPE_SMALL)
+    {
+        // All small files live in one subdirectory, which is larger than any fixed root directory
+        uint32_t entryCount = geometry->SmallFiles + 2;
+        DirectoryEntry* entries = (DirectoryEntry*) calloc(entryCount, sizeof(DirectoryEntry));
+        ok = entries != NULL;
+        for (uint32_t i = 0; ok && i < geometry->SmallFiles; i++)
+        {
+            char name[32];
+            uint32_t fileSize = 1 + nextRandom(&builder) % geometry->SmallFileSize;
+            uint32_t cluster = allocateChain(&builder, fileSize, false, NULL);
+            snprintf(name, sizeof(name), "F%05u  BIN", i);
+            setEntry(&entries[i + 2], name, 0x20, cluster, fileSize);
+            ok = cluster != 0;
+        }
+
+        uint32_t directoryCluster = 0;
+        if (ok)
+        {
+            // Dot entries first, then the files; the chain is allocated after them, so set them last
+            uint64_t directorySize = (uint64_t) entryCount * sizeof(DirectoryEntry);
+            directoryCluster = allocateChain(&builder, directorySize, false, (const uint8_t*) entries);
+            DirectoryEntry* directory = (DirectoryEntry*) (builder.Data + ((uint64_t) builder.DataStart
+                                        + (uint64_t) (directoryCluster - 2) * geometry->SectorsPerCluster) * BENCH_BYTES_PER_SECTOR);
+            ok = directoryCluster != 0;
+            if (ok)
+            {
+                setEntry(&directory[0], ".          ", ATTRIBUTE_DIRECTORY, directoryCluster, 0);
+                setEntry(&directory[1], "..         ", ATTRIBUTE_DIRECTORY, 0, 0);
+            }
+        }
+        if (ok)
+            setEntry(&root[0], "FILES      ", ATTRIBUTE_DIRECTORY, directoryCluster, 0);
+        free(entries);
+        *filesOut = geometry->SmallFiles;
+    }
+    else
+    {
+        // One file using 90% of the volume
+        uint64_t fileSize = (uint64_t) builder.ClusterCount * builder.ClusterSize / 10 * 9;
+        uint32_t cluster = allocateChain(&builder, fileSize, shape == SHAPE_FRAGMENTED, NULL);
+        setEntry(&root[0], "HUGE    BIN", 0x20, cluster, (uint32_t) fileSize);
+        ok = cluster != 0;
+        *filesOut = 1;
+    }
+
+    if (ok)
+        writeImageMetadata(&builder, rootCluster);
+
+    munmap(map, size);
+    free(builder.Table);
+    return ok;
+}
+
+// =============================================================================
+// MEASUREMENT FUNCTIONS
+// =============================================================================
+
+// Gets the current time
+// Returns: Monotonic time in seconds
+double getTime()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Callback used while extracting: checksums the data so every byte is really read
+bool checksumChunk(const uint8_t* data, size_t size, void* context)
+{
+    uint64_t* checksum = (uint64_t*) context;
+    uint64_t sum = *checksum;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        sum ^= word;
+    }
+    for (; i < size; i++)
+        sum += data[i];
+
+    *checksum = sum;
+    return true;
+}
+
+// Benchmarks the fat tool on one image
+// Parameters:
+//   path - Path of the image
+//   shape - Shape of the image (decides which files are looked up)
+//   files - Number of files in the image
+//   result - Receives the timings
+// Returns: true if every phase succeeded, false otherwise
+bool benchmarkImage(const char* path, ImageShape shape, uint32_t files, BenchResult* result)
+{
+    Disk disk;
+    uint8_t scratch[64 * 1024];
+    memset(result, 0, sizeof(*result));
+    result->Files = files;
+
+    // Open: map the image, read the boot sector and the FAT
+    double start = getTime();
+    bool ok = diskOpen(&disk, path) && readBootSector(&disk) && readVolumeLayout() && readFat(&disk);
+    result->OpenTime = getTime() - start;
+
+    // Decode: build the cluster table
+    start = getTime();
+    ok = ok && buildClusterTable();
+    result->DecodeTime = getTime() - start;
+
+    // Lookup: read and index the directories, resolve every path
+    DirectoryEntry** entries = (DirectoryEntry**) malloc(files * sizeof(DirectoryEntry*));
+    start = getTime();
+    ok = ok && entries && readRootDirectory(&disk) && initRootDirectory();
+    for (uint32_t i = 0; ok && i < files; i++)
+    {
+        char name[32];
+        if (shape == SHAPE_SMALL)
+            snprintf(name, sizeof(name), "/FILES/F%05u.BIN", i);
+        else
+            snprintf(name, sizeof(name), "/HUGE.BIN");
+        entries[i] = findPath(&disk, name);
+        ok = entries[i] != NULL;
+    }
+    result->LookupTime = getTime() - start;
+
+    // Extract: stream every file through the fixed-size buffer
+    start = getTime();
+    for (uint32_t i = 0; ok && i < files; i++)
+    {
+        ok = streamFile(entries[i], &disk, scratch, sizeof(scratch), checksumChunk, &result->Checksum);
+        result->Bytes += entries[i]->Size;
+    }
+    result->ExtractTime = getTime() - start;
+
+    free(entries);
+    closeFilesystem(&disk);
+    return ok;
+}
+
+// =============================================================================
+// MAIN PROGRAM
+// =============================================================================
+
+int main(int argc, char** argv)
+{
+    // Check command line arguments
+    if (argc != 2) {
+        printf("Syntax: %s <work directory>\n", argv[0]);
+        return -1;
+    }
+
+    if (mkdir(argv[1], 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create work directory %s!\n", argv[1]);
+        return -1;
+    }
+
+    printf("%-6s %-11s %7s %9s %9s %10s %10s %11s %10s %11s\n", "Type", "Shape", "Files", "Size(MB)",
+           "Open(ms)", "Decode(ms)", "Lookup(ms)", "Extract(ms)", "MB/s", "Files/s");
+
+    int result = 0;
+    for (size_t g = 0; g < sizeof(g_Geometries) / sizeof(g_Geometries[0]); g++)
+    {
+        for (int shape = SHAPE_SMALL; shape <= SHAPE_FRAGMENTED; shape++)
+        {
+            char path[4096];
+            uint32_t files;
+            BenchResult bench;
+            snprintf(path, sizeof(path), "%s/%s_%s.img", argv[1], g_Geometries[g].Name, g_ShapeNames[shape]);
+
+            // Generate, measure and remove each image in turn to limit disk usage
+            if (!generateImage(path, &g_Geometries[g], (ImageShape) shape, &files)) {
+                fprintf(stderr, "Could not generate image %s!\n", path);
+                result = -1;
+                continue;
+            }
+
+            bool ok = benchmarkImage(path, (ImageShape) shape, files, &bench);
+            unlink(path);
+            if (!ok) {
+                fprintf(stderr, "Benchmark failed on %s!\n", path);
+                result = -1;
+                continue;
+            }
+
+            printf("%-6s %-11s %7u %9.1f %9.3f %10.3f %10.3f %11.3f %10.1f %11.0f\n",
+                   g_Geometries[g].Name, g_ShapeNames[shape], bench.Files, bench.Bytes / 1e6,
+                   bench.OpenTime * 1e3, bench.DecodeTime * 1e3, bench.LookupTime * 1e3, bench.ExtractTime * 1e3,
+                   bench.Bytes / 1e6 / bench.ExtractTime, bench.Files / bench.ExtractTime);
+        }
+    }
+
+    return result;
+}
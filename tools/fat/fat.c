@@ -1,70 +1,114 @@
 // =============================================================================
-// FAT12 FILESYSTEM READER
+// FAT12/16/32 FILESYSTEM TOOL
 // =============================================================================
 //
-// This program reads and extracts files from a FAT12 disk image
-// It can display the contents of text files found in the root directory
+// This program reads and extracts files from a FAT12, FAT16 or FAT32 disk image
+// It can display the contents of text files (by path, e.g. /BOOT/KERNEL.BIN),
+// list directories recursively, or extract many files (by name, shell
+// pattern or --all) to a directory in one run.
+// It can also format a new image and add many files to it in one run, and
+// pack a kernel for the stage2 bootloader (--pack) and verify a packed kernel
+// in an image (--verify)
+// The on-disk structures and the FAT logic shared with the kernel are in
+// the FAT library of src/common (fat.h)
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "fat.h"
 
 // =============================================================================
 // TYPE DEFINITIONS
 // =============================================================================
 
-// Boolean type definition for C (since C doesn't have built-in bool type in older standards)
-typedef uint8_t bool;
-#define true 1
-#define false 0
-
-// Boot Sector structure - represents the first sector of a FAT12 filesystem
-typedef struct 
-{
-    uint8_t BootJumpInstruction[3];    // Jump instruction to boot code
-    uint8_t OemIdentifier[8];          // OEM name/identifier
-    uint16_t BytesPerSector;           // Bytes per sector (usually 512)
-    uint8_t SectorsPerCluster;         // Sectors per cluster
-    uint16_t ReservedSectors;          // Number of reserved sectors
-    uint8_t FatCount;                  // Number of FAT tables (usually 2)
-    uint16_t DirEntryCount;            // Number of root directory entries
-    uint16_t TotalSectors;             // Total sectors in filesystem
-    uint8_t MediaDescriptorType;       // Media descriptor type
-    uint16_t SectorsPerFat;            // Sectors per FAT table
-    uint16_t SectorsPerTrack;          // Sectors per track
-    uint16_t Heads;                    // Number of heads
-    uint32_t HiddenSectors;            // Number of hidden sectors
-    uint32_t LargeSectorCount;         // Large sector count (if TotalSectors is 0)
-
-    // Extended boot record fields
-    uint8_t DriveNumber;               // Drive number
-    uint8_t _Reserved;                 // Reserved byte
-    uint8_t Signature;                 // Extended boot signature
-    uint32_t VolumeId;                 // Volume serial number
-    uint8_t VolumeLabel[11];           // Volume label (11 bytes, padded with spaces)
-    uint8_t SystemId[8];               // Filesystem type identifier
-
-} __attribute__((packed)) BootSector;
-
-// Directory Entry structure - represents a file or directory entry in FAT12
-typedef struct 
-{
-    uint8_t Name[11];                  // 8.3 filename (8 name + 3 extension)
-    uint8_t Attributes;                // File attributes (read-only, hidden, etc.)
-    uint8_t _Reserved;                 // Reserved byte
-    uint8_t CreatedTimeTenths;         // Created time tenths of seconds
-    uint16_t CreatedTime;              // Created time
-    uint16_t CreatedDate;              // Created date
-    uint16_t AccessedDate;             // Last accessed date
-    uint16_t FirstClusterHigh;         // High word of first cluster number (usually 0 in FAT12)
-    uint16_t ModifiedTime;             // Last modified time
-    uint16_t ModifiedDate;             // Last modified date
-    uint16_t FirstClusterLow;          // Low word of first cluster number
-    uint32_t Size;                     // File size in bytes
-
-} __attribute__((packed)) DirectoryEntry;
+// Disk image handle - the image is either memory-mapped, loaded into memory
+// (for pipes and other non-seekable inputs) or accessed with positional reads as fallback
+typedef struct
+{
+    FILE* File;                        // Underlying stream of the disk image
+    uint8_t* Data;                     // In-memory view of the whole image (NULL when using stdio)
+    size_t Size;                       // Size of the in-memory view in bytes
+    bool Mapped;                       // true if Data is an mmap'ed region, false if heap allocated
+    bool Writable;                     // true if the image was opened for writing
+
+} Disk;
+
+// Callback receiving consecutive chunks of a file while it is streamed
+// Parameters:
+//   data - File bytes (only valid during the call)
+//   size - Number of bytes
+//   context - Caller supplied context
+// Returns: true to continue, false to abort streaming
+typedef bool (*FileChunkCallback)(const uint8_t* data, size_t size, void* context);
+
+// Directory index structure - open-addressing hash table over the entries of a directory
+typedef struct
+{
+    DirectoryEntry* Entries;           // Indexed directory entries
+    uint32_t* Slots;                   // Hash slots: entry index + 1, 0 for an empty slot
+    uint32_t Mask;                     // Number of slots - 1 (slot count is a power of two)
+
+} DirectoryIndex;
+
+// Output writer structure - buffers output so that data is written in large blocks
+typedef struct
+{
+    int Fd;                            // Output file descriptor
+    size_t Length;                     // Number of bytes waiting in Buffer
+    bool Ok;                           // false once a write has failed
+    uint8_t Buffer[64 * 1024];         // Pending output
+
+} OutputWriter;
+
+// Directory structure - a loaded directory with its lookup index
+// Subdirectories are kept in the directory cache, keyed by their first cluster
+typedef struct Directory
+{
+    uint32_t FirstCluster;             // First cluster of the directory (0 for the root directory)
+    DirectoryEntry* Entries;           // Directory entries
+    uint32_t EntryCount;               // Number of entries
+    DirectoryIndex Index;              // Hash index over the entries
+    bool Listed;                       // Set once listed by a recursive listing (loop protection)
+    struct Directory* Next;            // Next directory in the same cache bucket
+
+} Directory;
+
+// Undo record - bytes of the image as they were before diskWriteAt changed them
+typedef struct
+{
+    uint64_t Offset;                   // Byte offset in the image
+    uint64_t Size;                     // Number of bytes
+    uint8_t* Data;                     // Previous contents
+
+} UndoRecord;
+
+// Undo log structure - growable array of undo records, see undoWrites
+typedef struct
+{
+    UndoRecord* Items;                 // Records in the order of the writes
+    uint32_t Count;                    // Number of records
+    uint32_t Capacity;                 // Allocated number of records
+    bool Enabled;                      // Set while diskWriteAt records the writes
+
+} UndoLog;
 
 // =============================================================================
 // GLOBAL VARIABLES
@@ -73,208 +117,3257 @@ typedef struct
 BootSector g_BootSector;               // Stores the boot sector data
 uint8_t* g_Fat = NULL;                 // Pointer to FAT table in memory
 DirectoryEntry* g_RootDirectory = NULL; // Pointer to root directory in memory
-uint32_t g_RootDirectoryEnd;           // LBA address where root directory ends
+FatLayout g_Layout;                    // Layout of the volume, derived from the boot sector
+uint32_t g_RootDirectoryEntryCount;    // Number of entries in g_RootDirectory
+uint32_t* g_ClusterTable = NULL;       // Decoded FAT: next cluster for every cluster number
+Directory g_Root;                      // Root directory with its hash index
+Directory** g_DirectoryCache = NULL;   // Cache of loaded subdirectories (hash buckets by first cluster)
+uint32_t g_DirectoryCacheMask;         // Number of cache buckets - 1 (bucket count is a power of two)
+uint32_t g_DirectoryCacheCount;        // Number of cached subdirectories
+uint64_t* g_FreeBitmap = NULL;         // Free cluster bitmap: one bit per cluster, set when the cluster is free
+uint32_t g_FreeClusterCount;           // Number of free clusters in g_FreeBitmap
+uint32_t g_ReleasedClusterCount;       // Clusters freed by this run, not reused before the FAT is written
+uint32_t g_FreeSearchStart;            // Lowest cluster number that may be free
+uint32_t g_RootFreeSearchStart;        // Lowest root directory entry that may be free
+bool g_FatDirty;                       // Set when g_Fat was changed outside of the cluster table
+bool g_RootDirectoryDirty;             // Set when the root directory was changed
+UndoLog g_UndoLog;                     // Writes of an update in place, undone if it fails
+
+// =============================================================================
+// DISK IMAGE BACKEND
+// =============================================================================
+
+// Opens a disk image for reading
+// Regular files are memory-mapped so that sectors can be accessed without any
+// system call, non-seekable inputs (pipes, "-" for stdin) are read into memory
+// once, and if mapping fails the image is accessed through positional reads
+// Parameters:
+//   disk - Disk handle to initialize
+//   path - Path to the disk image, or "-" for standard input
+// Returns: true if successful, false otherwise
+bool diskOpen(Disk* disk, const char* path)
+{
+    memset(disk, 0, sizeof(*disk));
+    disk->File = (strcmp(path, "-") == 0) ? stdin : fopen(path, "rb");
+    if (!disk->File)
+        return false;
+
+    struct stat st;
+    if (fstat(fileno(disk->File), &st) == 0 && S_ISREG(st.st_mode))
+    {
+        // Seekable image: map it read-only, keep stdio as fallback if mmap fails
+        if (st.st_size > 0)
+        {
+            void* map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fileno(disk->File), 0);
+            if (map != MAP_FAILED)
+            {
+                disk->Data = (uint8_t*) map;
+                disk->Size = (size_t) st.st_size;
+                disk->Mapped = true;
+            }
+        }
+        return true;
+    }
+
+    // Non-seekable input: read the whole stream into memory
+    size_t capacity = 0;
+    for (;;)
+    {
+        if (disk->Size == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 1024 * 1024;
+            uint8_t* data = (uint8_t*) realloc(disk->Data, capacity);
+            if (!data)
+                return false;
+            disk->Data = data;
+        }
+
+        size_t read = fread(disk->Data + disk->Size, 1, capacity - disk->Size, disk->File);
+        if (read == 0)
+            break;
+        disk->Size += read;
+    }
+    return !ferror(disk->File);
+}
+
+// Opens a disk image for reading and writing
+// The image is mapped shared, so that changes to the FAT, the directories and
+// the file data go straight to the image without any copy; if mapping fails
+// the image is accessed through positional reads and writes
+// Parameters:
+//   disk - Disk handle to initialize
+//   path - Path to the disk image
+//   createSize - Size in bytes of a new zero-filled image, 0 to open an existing image
+// Returns: true if successful, false otherwise
+bool diskOpenWritable(Disk* disk, const char* path, uint64_t createSize)
+{
+    memset(disk, 0, sizeof(*disk));
+    int fd = createSize ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0644) : open(path, O_RDWR);
+    if (fd < 0)
+        return false;
+
+    disk->File = fdopen(fd, "r+b");
+    if (!disk->File)
+    {
+        close(fd);
+        return false;
+    }
+    disk->Writable = true;
+
+    // A new image is created sparse, every sector reads as zero
+    struct stat st;
+    if ((createSize && ftruncate(fd, (off_t) createSize) != 0) || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+
+    if (st.st_size > 0)
+    {
+        void* map = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            disk->Data = (uint8_t*) map;
+            disk->Size = (size_t) st.st_size;
+            disk->Mapped = true;
+        }
+    }
+    return true;
+}
+
+// Closes a disk image and releases its in-memory view
+// Parameters:
+//   disk - Disk handle to close
+void diskClose(Disk* disk)
+{
+    if (disk->Mapped)
+        munmap(disk->Data, disk->Size);
+    else
+        free(disk->Data);
+
+    if (disk->File && disk->File != stdin)
+        fclose(disk->File);
+    memset(disk, 0, sizeof(*disk));
+}
+
+// Checks that a byte range lies inside the in-memory view of the disk image
+// Parameters:
+//   disk - Disk handle
+//   offset - Byte offset of the range
+//   size - Size of the range in bytes
+// Returns: true if the whole range is inside the image, false otherwise
+bool diskContains(Disk* disk, uint64_t offset, uint64_t size)
+{
+    return offset <= disk->Size && size <= disk->Size - offset;
+}
 
 // =============================================================================
-// DISK READING FUNCTIONS
+// DISK READING AND WRITING FUNCTIONS
 // =============================================================================
 
+// Reads bytes from the disk image file at a given offset
+// Uses positional reads so that several threads can read concurrently
+// without sharing a file position
+// Parameters:
+//   disk - Disk handle of the disk image
+//   offset - Byte offset to start reading from
+//   size - Number of bytes to read
+//   bufferOut - Pointer to buffer where data will be stored
+// Returns: true if all bytes were read, false otherwise
+bool diskReadAt(Disk* disk, uint64_t offset, uint64_t size, void* bufferOut)
+{
+    uint8_t* output = (uint8_t*) bufferOut;
+    while (size > 0)
+    {
+        ssize_t read = pread(fileno(disk->File), output, size, (off_t) offset);
+        if (read < 0 && errno == EINTR)
+            continue;
+        if (read <= 0)
+            return false;
+
+        output += read;
+        offset += read;
+        size -= read;
+    }
+    return true;
+}
+
+// Records the bytes a write is about to overwrite in the undo log
+// Parameters:
+//   disk - Disk handle of the disk image
+//   offset - Byte offset of the write
+//   size - Number of bytes of the write
+// Returns: true if successful, false otherwise (the write must not happen)
+bool recordUndo(Disk* disk, uint64_t offset, uint64_t size)
+{
+    if (g_UndoLog.Count == g_UndoLog.Capacity)
+    {
+        uint32_t capacity = g_UndoLog.Capacity ? g_UndoLog.Capacity * 2 : 64;
+        UndoRecord* items = (UndoRecord*) realloc(g_UndoLog.Items, capacity * sizeof(UndoRecord));
+        if (!items)
+            return false;
+        g_UndoLog.Items = items;
+        g_UndoLog.Capacity = capacity;
+    }
+
+    UndoRecord* record = &g_UndoLog.Items[g_UndoLog.Count];
+    record->Offset = offset;
+    record->Size = size;
+    record->Data = (uint8_t*) malloc(size ? size : 1);
+    bool mapped = disk->Data && diskContains(disk, offset, size);
+    if (record->Data && mapped)
+        memcpy(record->Data, disk->Data + offset, size);
+    if (!record->Data || (!mapped && !diskReadAt(disk, offset, size, record->Data)))
+    {
+        free(record->Data);
+        return false;
+    }
+    g_UndoLog.Count++;
+    return true;
+}
+
+// Releases the undo log and stops recording
+void freeUndoLog()
+{
+    for (uint32_t i = 0; i < g_UndoLog.Count; i++)
+        free(g_UndoLog.Items[i].Data);
+    free(g_UndoLog.Items);
+    memset(&g_UndoLog, 0, sizeof(g_UndoLog));
+}
+
+// Writes bytes to the disk image at a given offset
+// Parameters:
+//   disk - Disk handle of the disk image (opened with diskOpenWritable)
+//   offset - Byte offset to start writing at
+//   size - Number of bytes to write
+//   data - Bytes to write (may point into the in-memory image itself)
+// Returns: true if all bytes were written, false otherwise
+bool diskWriteAt(Disk* disk, uint64_t offset, uint64_t size, const void* data)
+{
+    if (!disk->Writable)
+        return false;
+
+    // An update in place keeps what it overwrites (see undoWrites)
+    if (g_UndoLog.Enabled && !recordUndo(disk, offset, size))
+        return false;
+
+    // Mapped image: data that was modified in place needs no copy at all
+    if (disk->Data)
+    {
+        if (!diskContains(disk, offset, size))
+            return false;
+        if (disk->Data + offset != data)
+            memmove(disk->Data + offset, data, size);
+        return true;
+    }
+
+    const uint8_t* input = (const uint8_t*) data;
+    while (size > 0)
+    {
+        ssize_t written = pwrite(fileno(disk->File), input, size, (off_t) offset);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+
+        input += written;
+        offset += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Restores everything diskWriteAt wrote since recording started, newest first,
+// then releases the undo log. Data written straight into the mapped image
+// is not recorded, so an update in place must go through diskWriteAt only
+// (compare mode of writeFileData, private FAT and root directory)
+// Parameters:
+//   disk - Disk handle of the disk image
+// Returns: true if the image is back as it was, false otherwise
+bool undoWrites(Disk* disk)
+{
+    bool ok = true;
+    g_UndoLog.Enabled = false;
+    for (uint32_t i = g_UndoLog.Count; i-- > 0; )
+        ok = diskWriteAt(disk, g_UndoLog.Items[i].Offset, g_UndoLog.Items[i].Size, g_UndoLog.Items[i].Data) && ok;
+    freeUndoLog();
+    return ok;
+}
+
+// Fills a byte range of the disk image with zeros
+// Parameters:
+//   disk - Disk handle of the disk image (opened with diskOpenWritable)
+//   offset - Byte offset of the range
+//   size - Size of the range in bytes
+// Returns: true if successful, false otherwise
+bool diskZeroAt(Disk* disk, uint64_t offset, uint64_t size)
+{
+    static const uint8_t zeros[4096];
+
+    if (disk->Data && disk->Writable)
+    {
+        if (!diskContains(disk, offset, size))
+            return false;
+        memset(disk->Data + offset, 0, size);
+        return true;
+    }
+
+    while (size > 0)
+    {
+        uint64_t chunk = size < sizeof(zeros) ? size : sizeof(zeros);
+        if (!diskWriteAt(disk, offset, chunk, zeros))
+            return false;
+        offset += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+// Writes one or more sectors to the disk image
+// Parameters:
+//   disk - Disk handle of the disk image (opened with diskOpenWritable)
+//   lba - Logical Block Address (sector number) to start writing at
+//   count - Number of sectors to write
+//   data - Sector data
+// Returns: true if successful, false otherwise
+bool writeSectors(Disk* disk, uint32_t lba, uint32_t count, const void* data)
+{
+    uint64_t offset = (uint64_t) lba * g_BootSector.BytesPerSector;
+    uint64_t size = (uint64_t) count * g_BootSector.BytesPerSector;
+    return diskWriteAt(disk, offset, size, data);
+}
+
 // Reads the boot sector from the disk image
 // Parameters:
-//   disk - FILE pointer to the disk image
+//   disk - Disk handle of the disk image
 // Returns: true if successful, false otherwise
-bool readBootSector(FILE* disk)
+bool readBootSector(Disk* disk)
 {
-    return fread(&g_BootSector, sizeof(g_BootSector), 1, disk) > 0;
+    if (disk->Data)
+    {
+        if (!diskContains(disk, 0, sizeof(g_BootSector)))
+            return false;
+        memcpy(&g_BootSector, disk->Data, sizeof(g_BootSector));
+        return true;
+    }
+
+    return diskReadAt(disk, 0, sizeof(g_BootSector), &g_BootSector);
 }
 
 // Reads one or more sectors from the disk image
 // Parameters:
-//   disk - FILE pointer to the disk image
+//   disk - Disk handle of the disk image
 //   lba - Logical Block Address (sector number) to start reading from
 //   count - Number of sectors to read
 //   bufferOut - Pointer to buffer where data will be stored
 // Returns: true if successful, false otherwise
-bool readSectors(FILE* disk, uint32_t lba, uint32_t count, void* bufferOut)
+bool readSectors(Disk* disk, uint32_t lba, uint32_t count, void* bufferOut)
 {
-    bool ok = true;
-    // Seek to the correct position in the disk image
-    ok = ok && (fseek(disk, lba * g_BootSector.BytesPerSector, SEEK_SET) == 0);
-    // Read the specified number of sectors
-    ok = ok && (fread(bufferOut, g_BootSector.BytesPerSector, count, disk) == count);
-    return ok;
+    uint64_t offset = (uint64_t) lba * g_BootSector.BytesPerSector;
+    uint64_t size = (uint64_t) count * g_BootSector.BytesPerSector;
+
+    // In-memory image: a single copy, no system call
+    if (disk->Data)
+    {
+        if (!diskContains(disk, offset, size))
+            return false;
+        memcpy(bufferOut, disk->Data + offset, size);
+        return true;
+    }
+
+    // Read the specified number of sectors at their position in the disk image
+    return diskReadAt(disk, offset, size, bufferOut);
+}
+
+// Gets a pointer to one or more sectors of the disk image
+// When the image is in memory the returned pointer refers directly to it and
+// no data is copied, otherwise the sectors are read into a newly allocated buffer
+// Parameters:
+//   disk - Disk handle of the disk image
+//   lba - Logical Block Address (sector number) to start from
+//   count - Number of sectors
+// Returns: Pointer to the sectors (release with releaseSectors), NULL on failure
+void* getSectors(Disk* disk, uint32_t lba, uint32_t count)
+{
+    uint64_t offset = (uint64_t) lba * g_BootSector.BytesPerSector;
+    uint64_t size = (uint64_t) count * g_BootSector.BytesPerSector;
+
+    if (disk->Data)
+        return diskContains(disk, offset, size) ? disk->Data + offset : NULL;
+
+    void* buffer = malloc(size);
+    if (buffer && !readSectors(disk, lba, count, buffer))
+    {
+        free(buffer);
+        buffer = NULL;
+    }
+    return buffer;
+}
+
+// Releases a buffer returned by getSectors or readClusterChain
+// Parameters:
+//   disk - Disk handle of the disk image
+//   buffer - Buffer to release (may be NULL)
+void releaseSectors(Disk* disk, void* buffer)
+{
+    // Pointers into the in-memory image are not owned by the caller
+    uint8_t* data = (uint8_t*) buffer;
+    if (!disk->Data || data < disk->Data || data >= disk->Data + disk->Size)
+        free(buffer);
+}
+
+// Gives a writable image a private copy of sectors returned by getSectors
+// Structures changed in memory (FAT, root directory) then only reach the
+// image when they are written back, so that a failed update leaves neither
+// half of a change behind. Other buffers are returned as they are
+// Parameters:
+//   disk - Disk handle of the disk image
+//   buffer - Sectors returned by getSectors or readClusterChain, may be NULL
+//   size - Size of the sectors in bytes
+// Returns: Buffer to use and release with releaseSectors, NULL on failure
+void* privateSectors(Disk* disk, void* buffer, size_t size)
+{
+    uint8_t* data = (uint8_t*) buffer;
+    if (!data || !disk->Writable || !disk->Data || data < disk->Data || data >= disk->Data + disk->Size)
+        return buffer;
+
+    uint8_t* copy = (uint8_t*) malloc(size);
+    if (copy)
+        memcpy(copy, data, size);
+    return copy;
+}
+
+// Determines the FAT type and the layout of the volume from the boot sector
+// Must be called after readBootSector
+// Returns: true if the boot sector describes a valid volume, false otherwise
+bool readVolumeLayout()
+{
+    return fatReadLayout(&g_BootSector, &g_Layout);
 }
 
 // Reads the FAT (File Allocation Table) from the disk image
+// A writable image gets a private copy, written back by writeFat
 // Parameters:
-//   disk - FILE pointer to the disk image
+//   disk - Disk handle of the disk image
+// Returns: true if successful, false otherwise
+bool readFat(Disk* disk)
+{
+    // The layout selects the active FAT copy (FAT32 can disable mirroring)
+    g_Fat = (uint8_t*) getSectors(disk, g_Layout.FatStart, g_Layout.SectorsPerFat);
+    g_Fat = (uint8_t*) privateSectors(disk, g_Fat, (size_t) g_Layout.SectorsPerFat * g_BootSector.BytesPerSector);
+    return g_Fat != NULL;
+}
+
+// =============================================================================
+// CLUSTER CHAIN FUNCTIONS
+// =============================================================================
+
+// Decodes the whole FAT into a flat next-cluster table
+// The decoder matching the FAT type is selected once, so the decoding loop and
+// every later chain walk work on plain 32-bit entries with no per-entry type test
+// Must be called after readVolumeLayout and readFat
 // Returns: true if successful, false otherwise
-bool readFat(FILE* disk)
+bool buildClusterTable()
+{
+    if (g_Layout.ClusterCount < 2)
+        return false;
+
+    // Allocate one extra entry so the pairwise FAT12 decode never needs a tail case
+    g_ClusterTable = (uint32_t*) malloc(((size_t) g_Layout.ClusterCount + 1) * sizeof(uint32_t));
+    if (!g_ClusterTable)
+        return false;
+
+    fatDecodeTable(&g_Layout, g_Fat, g_ClusterTable);
+    return true;
+}
+
+// Gets the first cluster of a directory entry
+// Parameters:
+//   entry - Pointer to the directory entry
+// Returns: First cluster number (the high word is only used by FAT32)
+uint32_t getFirstCluster(const DirectoryEntry* entry)
+{
+    return fatFirstCluster(&g_Layout, entry);
+}
+
+// Calculates the LBA address of a cluster
+// Parameters:
+//   cluster - Cluster number
+// Returns: LBA address of the first sector of the cluster
+uint32_t clusterToLba(uint32_t cluster)
+{
+    return fatClusterToLba(&g_Layout, cluster);
+}
+
+// Starts iterating over a cluster chain
+// Parameters:
+//   iterator - Iterator to initialize
+//   firstCluster - First cluster of the chain (0 for an empty file)
+void beginClusterChain(ClusterIterator* iterator, uint32_t firstCluster)
+{
+    fatBeginChain(iterator, &g_Layout, firstCluster);
+}
+
+// Looks up the next cluster in the decoded cluster table (inlined into nextExtent)
+static inline uint32_t nextTableCluster(void* context, uint32_t cluster)
+{
+    (void) context;
+    return g_ClusterTable[cluster];
+}
+
+// Gets the next extent of a cluster chain
+// Consecutive clusters are merged so that each extent can be read with a single I/O
+// Parameters:
+//   iterator - Cluster iterator
+//   extentOut - Receives the next run of contiguous clusters
+// Returns: true if an extent was returned, false at the end of the chain or
+//          if the chain is invalid (iterator->Ok is then false)
+bool nextExtent(ClusterIterator* iterator, Extent* extentOut)
+{
+    return fatNextExtent(iterator, &g_Layout, nextTableCluster, NULL, extentOut);
+}
+
+// Reads a whole cluster chain (such as a directory) into memory
+// Parameters:
+//   disk - Disk handle of the disk image
+//   firstCluster - First cluster of the chain
+//   sizeOut - Receives the size of the chain in bytes
+// Returns: Pointer to the data (release with releaseSectors), NULL on failure
+void* readClusterChain(Disk* disk, uint32_t firstCluster, uint32_t* sizeOut)
 {
-    // Allocate memory for the FAT table
-    g_Fat = (uint8_t*) malloc(g_BootSector.SectorsPerFat * g_BootSector.BytesPerSector);
-    // Read FAT from disk (located after reserved sectors)
-    return readSectors(disk, g_BootSector.ReservedSectors, g_BootSector.SectorsPerFat, g_Fat);
+    ClusterIterator iterator;
+    Extent extent;
+    uint32_t clusters = 0;
+    uint32_t extents = 0;
+
+    // First pass: measure the chain
+    beginClusterChain(&iterator, firstCluster);
+    while (nextExtent(&iterator, &extent))
+    {
+        clusters += extent.ClusterCount;
+        extents++;
+    }
+    if (!iterator.Ok || clusters == 0)
+        return NULL;
+
+    uint32_t sectorsPerCluster = g_BootSector.SectorsPerCluster;
+    *sizeOut = clusters * sectorsPerCluster * g_BootSector.BytesPerSector;
+
+    // A contiguous chain is used in place when the image is in memory
+    if (extents == 1)
+        return getSectors(disk, clusterToLba(firstCluster), clusters * sectorsPerCluster);
+
+    // Second pass: read every extent
+    uint8_t* buffer = (uint8_t*) malloc(*sizeOut);
+    uint8_t* output = buffer;
+    beginClusterChain(&iterator, firstCluster);
+    while (buffer && nextExtent(&iterator, &extent))
+    {
+        uint32_t sectors = extent.ClusterCount * sectorsPerCluster;
+        if (!readSectors(disk, clusterToLba(extent.FirstCluster), sectors, output))
+        {
+            free(buffer);
+            return NULL;
+        }
+        output += sectors * g_BootSector.BytesPerSector;
+    }
+    return buffer;
 }
 
 // Reads the root directory from the disk image
+// FAT12/16 have a fixed root directory before the data area, the FAT32
+// root directory is a cluster chain starting at RootCluster
+// Must be called after buildClusterTable
+// A writable image gets a private copy of the root directory (see
+// privateSectors): changes only reach the image with the FAT
 // Parameters:
-//   disk - FILE pointer to the disk image
+//   disk - Disk handle of the disk image
 // Returns: true if successful, false otherwise
-bool readRootDirectory(FILE* disk)
+bool readRootDirectory(Disk* disk)
 {
-    // Calculate LBA address of root directory (after reserved sectors and FAT tables)
-    uint32_t lba = g_BootSector.ReservedSectors + g_BootSector.SectorsPerFat * g_BootSector.FatCount;
-    // Calculate size of root directory in bytes
-    uint32_t size = sizeof(DirectoryEntry) * g_BootSector.DirEntryCount;
-    // Calculate how many sectors the root directory occupies
-    uint32_t sectors = (size / g_BootSector.BytesPerSector);
-    if (size % g_BootSector.BytesPerSector > 0)
-        sectors++;
-
-    // Store the end position of root directory for later calculations
-    g_RootDirectoryEnd = lba + sectors;
-    // Allocate memory for root directory
-    g_RootDirectory = (DirectoryEntry*) malloc(sectors * g_BootSector.BytesPerSector);
-    // Read root directory from disk
-    return readSectors(disk, lba, sectors, g_RootDirectory);
+    size_t size;
+    if (g_Layout.FatType == 32)
+    {
+        uint32_t chainSize;
+        g_RootDirectory = (DirectoryEntry*) readClusterChain(disk, g_BootSector.RootCluster, &chainSize);
+        g_RootDirectoryEntryCount = chainSize / sizeof(DirectoryEntry);
+        size = chainSize;
+    }
+    else
+    {
+        // Get root directory from disk (after reserved sectors and FAT tables), it ends where the data area starts
+        uint32_t lba = g_Layout.RootDirectoryStart;
+        g_RootDirectoryEntryCount = g_Layout.RootEntryCount;
+        g_RootDirectory = (DirectoryEntry*) getSectors(disk, lba, g_Layout.DataStart - lba);
+        size = (size_t) (g_Layout.DataStart - lba) * g_BootSector.BytesPerSector;
+    }
+    g_RootDirectory = (DirectoryEntry*) privateSectors(disk, g_RootDirectory, size);
+    return g_RootDirectory != NULL;
 }
 
 // =============================================================================
 // FILE OPERATION FUNCTIONS
 // =============================================================================
 
+// Inserts a directory entry into a directory index
+// The index always has room: it is sized for every entry of the directory.
+// If the name is already indexed the existing entry is kept
+// Parameters:
+//   index - Index of the directory
+//   entryIndex - Index of the entry in the directory
+void insertDirectoryIndex(DirectoryIndex* index, uint32_t entryIndex)
+{
+    const uint8_t* name = index->Entries[entryIndex].Name;
+
+    // Linear probing until a free slot or the same name is found
+    uint32_t slot = fatHashName(name, 11) & index->Mask;
+    while (index->Slots[slot] != 0
+           && memcmp(index->Entries[index->Slots[slot] - 1].Name, name, 11) != 0)
+        slot = (slot + 1) & index->Mask;
+
+    if (index->Slots[slot] == 0)
+        index->Slots[slot] = entryIndex + 1;
+}
+
+// Builds a hash index over the entries of a directory
+// Free, deleted and long file name entries are not indexed. When a name appears
+// more than once the first entry wins, like in a linear scan
+// Parameters:
+//   index - Index to build
+//   entries - Directory entries
+//   count - Number of directory entries
+// Returns: true if successful, false otherwise
+bool buildDirectoryIndex(DirectoryIndex* index, DirectoryEntry* entries, uint32_t count)
+{
+    // Keep the load factor at or below 1/2 so probe sequences stay short
+    uint32_t slots = 16;
+    while (slots < count * 2)
+        slots *= 2;
+
+    index->Entries = entries;
+    index->Mask = slots - 1;
+    index->Slots = (uint32_t*) calloc(slots, sizeof(uint32_t));
+    if (!index->Slots)
+        return false;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        // 0x00 marks the end of the directory
+        if (fatIsDirectoryEnd(&entries[i]))
+            break;
+        if (fatIsNamedEntry(&entries[i]))
+            insertDirectoryIndex(index, i);
+    }
+    return true;
+}
+
+// Releases the memory of a directory index
+// Parameters:
+//   index - Index to release
+void freeDirectoryIndex(DirectoryIndex* index)
+{
+    free(index->Slots);
+    memset(index, 0, sizeof(*index));
+}
+
+// Looks up a name in a directory index
+// Parameters:
+//   index - Index of the directory
+//   name - 11-character filename in 8.3 format (without dot)
+// Returns: Pointer to directory entry if found, NULL otherwise
+DirectoryEntry* lookupDirectoryIndex(const DirectoryIndex* index, const char* name)
+{
+    uint32_t slot = fatHashName((const uint8_t*) name, 11) & index->Mask;
+    while (index->Slots[slot] != 0)
+    {
+        DirectoryEntry* entry = &index->Entries[index->Slots[slot] - 1];
+        if (memcmp(name, entry->Name, 11) == 0)
+            return entry;
+        slot = (slot + 1) & index->Mask;
+    }
+
+    return NULL;
+}
+
 // Searches for a file in the root directory by name
 // Parameters:
 //   name - 11-character filename in 8.3 format (without dot)
 // Returns: Pointer to directory entry if found, NULL otherwise
 DirectoryEntry* findFile(const char* name)
 {
-    // Iterate through all root directory entries
-    for (uint32_t i = 0; i < g_BootSector.DirEntryCount; i++)
+    return lookupDirectoryIndex(&g_Root.Index, name);
+}
+
+// Drops mapped pages of the disk image that were already consumed
+// Keeps the resident memory of a long sequential stream bounded; the pages
+// are clean, so they are simply faulted in again from the image if needed
+// Parameters:
+//   disk - Disk handle of the disk image
+//   offset - Byte offset of the consumed range
+//   size - Size of the consumed range in bytes
+void diskDropPages(Disk* disk, uint64_t offset, uint64_t size)
+{
+    uint64_t pageSize = (uint64_t) sysconf(_SC_PAGESIZE);
+    uint64_t start = (offset + pageSize - 1) / pageSize * pageSize;
+    uint64_t end = (offset + size) / pageSize * pageSize;
+    if (disk->Mapped && end > start)
+        madvise(disk->Data + start, end - start, MADV_DONTNEED);
+}
+
+// Streams a file through a callback, chunk by chunk
+// Memory use does not depend on the file size: from an in-memory image every
+// extent is passed directly (in windows of at most scratchSize bytes), otherwise
+// the data is read into the caller's fixed-size scratch buffer and passed from there.
+// Streaming stops at the file size, and fails if the cluster chain is shorter
+// than the size claims (a corrupt size therefore never causes a large allocation)
+// Parameters:
+//   fileEntry - Pointer to the file's directory entry
+//   disk - Disk handle of the disk image
+//   scratch - Reusable buffer of at least one sector
+//   scratchSize - Size of the scratch buffer in bytes
+//   callback - Function receiving the file data
+//   context - Context passed to the callback
+// Returns: true if the whole file was streamed, false otherwise
+bool streamFile(DirectoryEntry* fileEntry, Disk* disk, uint8_t* scratch, size_t scratchSize,
+                FileChunkCallback callback, void* context)
+{
+    uint64_t remaining = fileEntry->Size;
+    uint64_t clusterSize = (uint64_t) g_BootSector.SectorsPerCluster * g_BootSector.BytesPerSector;
+    // Chunks are whole sectors so that unmapped reads stay sector aligned
+    uint64_t window = scratchSize / g_BootSector.BytesPerSector * g_BootSector.BytesPerSector;
+    if (window == 0)
+        return false;
+
+    ClusterIterator iterator;
+    Extent extent;
+    beginClusterChain(&iterator, getFirstCluster(fileEntry));
+    while (remaining > 0 && nextExtent(&iterator, &extent))
     {
-        // Compare filename with directory entry name
-        if (memcmp(name, g_RootDirectory[i].Name, 11) == 0)
-            return &g_RootDirectory[i];  // Return pointer to matching entry
+        uint64_t offset = (uint64_t) clusterToLba(extent.FirstCluster) * g_BootSector.BytesPerSector;
+        uint64_t size = extent.ClusterCount * clusterSize;
+        if (size > remaining)
+            size = remaining;
+        remaining -= size;
+
+        while (size > 0)
+        {
+            uint64_t chunk = size < window ? size : window;
+            if (disk->Data)
+            {
+                // In-memory image: no copy at all
+                if (!diskContains(disk, offset, chunk) || !callback(disk->Data + offset, chunk, context))
+                    return false;
+                diskDropPages(disk, offset, chunk);
+            }
+            else
+            {
+                if (!diskReadAt(disk, offset, chunk, scratch) || !callback(scratch, chunk, context))
+                    return false;
+            }
+            offset += chunk;
+            size -= chunk;
+        }
     }
 
-    return NULL;  // File not found
+    return iterator.Ok && remaining == 0;
+}
+
+// Callback used by readFile: appends a chunk to the output buffer
+bool copyChunk(const uint8_t* data, size_t size, void* context)
+{
+    uint8_t** output = (uint8_t**) context;
+    memcpy(*output, data, size);
+    *output += size;
+    return true;
 }
 
 // Reads a file from the disk image into memory
 // Parameters:
 //   fileEntry - Pointer to the file's directory entry
-//   disk - FILE pointer to the disk image
+//   disk - Disk handle of the disk image
 //   outputBuffer - Pointer to buffer where file content will be stored
+//                  (must hold the file size)
 // Returns: true if successful, false otherwise
-bool readFile(DirectoryEntry* fileEntry, FILE* disk, uint8_t* outputBuffer)
+bool readFile(DirectoryEntry* fileEntry, Disk* disk, uint8_t* outputBuffer)
 {
-    bool ok = true;
-    // Start with the file's first cluster
-    uint16_t currentCluster = fileEntry->FirstClusterLow;
-
-    // Follow cluster chain until end of file marker (0x0FF8 or higher)
-    do {
-        // Calculate LBA address of current cluster
-        // Formula: RootDirectoryEnd + (cluster - 2) * sectors per cluster
-        // (cluster numbers start at 2, with 0 and 1 being special values)
-        uint32_t lba = g_RootDirectoryEnd + (currentCluster - 2) * g_BootSector.SectorsPerCluster;
-        // Read the cluster into output buffer
-        ok = ok && readSectors(disk, lba, g_BootSector.SectorsPerCluster, outputBuffer);
-        // Advance output buffer pointer by cluster size
-        outputBuffer += g_BootSector.SectorsPerCluster * g_BootSector.BytesPerSector;
-
-        // Calculate index in FAT for next cluster
-        // FAT12 uses 12-bit entries, so we need special handling
-        uint32_t fatIndex = currentCluster * 3 / 2;
-        
-        // Extract next cluster number from FAT (depends on whether cluster is even or odd)
-        if (currentCluster % 2 == 0)
-            // Even cluster: take lower 12 bits of 16-bit value
-            currentCluster = (*(uint16_t*)(g_Fat + fatIndex)) & 0x0FFF;
-        else
-            // Odd cluster: take upper 12 bits of 16-bit value
-            currentCluster = (*(uint16_t*)(g_Fat + fatIndex)) >> 4;
-
-    } while (ok && currentCluster < 0x0FF8);  // Continue until end of file marker
-
-    return ok;
+    uint8_t scratch[16 * 1024];
+    return streamFile(fileEntry, disk, scratch, sizeof(scratch), copyChunk, &outputBuffer);
 }
 
 // =============================================================================
-// MAIN PROGRAM
+// DIRECTORY CACHE FUNCTIONS
 // =============================================================================
 
-int main(int argc, char** argv)
+// Initializes the root directory after readRootDirectory
+// Returns: true if successful, false otherwise
+bool initRootDirectory()
 {
-    // Check command line arguments
-    if (argc < 3) {
-        printf("Syntax: %s <disk image> <file name>\n", argv[0]);
-        return -1;
-    }
+    g_Root.FirstCluster = 0;
+    g_Root.Entries = g_RootDirectory;
+    g_Root.EntryCount = g_RootDirectoryEntryCount;
+    return buildDirectoryIndex(&g_Root.Index, g_Root.Entries, g_Root.EntryCount);
+}
 
-    // Open disk image file
-    FILE* disk = fopen(argv[1], "rb");
-    if (!disk) {
-        fprintf(stderr, "Cannot open disk image %s!\n", argv[1]);
-        return -1;
-    }
+// Gets the bucket of the directory cache for a first cluster
+static inline uint32_t directoryBucket(uint32_t firstCluster)
+{
+    return (firstCluster * 2654435761u) & g_DirectoryCacheMask;
+}
 
-    // Read boot sector (first step in reading FAT12 filesystem)
-    if (!readBootSector(disk)) {
-        fprintf(stderr, "Could not read boot sector!\n");
-        return -2;
-    }
+// Inserts a directory into the cache, doubling the bucket count when it becomes full
+// Parameters:
+//   directory - Directory to insert
+// Returns: true if successful, false otherwise
+bool cacheDirectory(Directory* directory)
+{
+    if (!g_DirectoryCache || g_DirectoryCacheCount > g_DirectoryCacheMask)
+    {
+        uint32_t oldBuckets = g_DirectoryCache ? g_DirectoryCacheMask + 1 : 0;
+        uint32_t newBuckets = oldBuckets ? oldBuckets * 2 : 64;
+        Directory** buckets = (Directory**) calloc(newBuckets, sizeof(Directory*));
+        if (!buckets)
+            return false;
 
-    // Read FAT table
-    if (!readFat(disk)) {
-        fprintf(stderr, "Could not read FAT!\n");
-        free(g_Fat);
-        return -3;
+        // Rehash the existing directories into the new buckets
+        Directory** oldCache = g_DirectoryCache;
+        g_DirectoryCache = buckets;
+        g_DirectoryCacheMask = newBuckets - 1;
+        for (uint32_t i = 0; i < oldBuckets; i++)
+        {
+            while (oldCache[i])
+            {
+                Directory* moved = oldCache[i];
+                oldCache[i] = moved->Next;
+                moved->Next = g_DirectoryCache[directoryBucket(moved->FirstCluster)];
+                g_DirectoryCache[directoryBucket(moved->FirstCluster)] = moved;
+            }
+        }
+        free(oldCache);
     }
 
-    // Read root directory
-    if (!readRootDirectory(disk)) {
-        fprintf(stderr, "Could not read FAT!\n");
-        free(g_Fat);
-        free(g_RootDirectory);
-        return -4;
+    uint32_t bucket = directoryBucket(directory->FirstCluster);
+    directory->Next = g_DirectoryCache[bucket];
+    g_DirectoryCache[bucket] = directory;
+    g_DirectoryCacheCount++;
+    return true;
+}
+
+// Opens a directory by its first cluster
+// Each subdirectory is read and indexed only once, later calls are served from the cache
+// Parameters:
+//   disk - Disk handle of the disk image
+//   firstCluster - First cluster of the directory (0 or the FAT32 root cluster for the root)
+// Returns: Pointer to the directory, NULL on failure
+Directory* openDirectory(Disk* disk, uint32_t firstCluster)
+{
+    if (firstCluster == 0 || (g_Layout.FatType == 32 && firstCluster == g_BootSector.RootCluster))
+        return &g_Root;
+
+    if (g_DirectoryCache)
+    {
+        for (Directory* cached = g_DirectoryCache[directoryBucket(firstCluster)]; cached; cached = cached->Next)
+            if (cached->FirstCluster == firstCluster)
+                return cached;
+    }
+
+    // Cache miss: read the directory cluster chain and index it
+    Directory* directory = (Directory*) calloc(1, sizeof(Directory));
+    uint32_t size;
+    if (!directory)
+        return NULL;
+
+    directory->FirstCluster = firstCluster;
+    directory->Entries = (DirectoryEntry*) readClusterChain(disk, firstCluster, &size);
+    directory->EntryCount = directory->Entries ? size / sizeof(DirectoryEntry) : 0;
+    if (!directory->Entries
+        || !buildDirectoryIndex(&directory->Index, directory->Entries, directory->EntryCount)
+        || !cacheDirectory(directory))
+    {
+        freeDirectoryIndex(&directory->Index);
+        releaseSectors(disk, directory->Entries);
+        free(directory);
+        return NULL;
+    }
+    return directory;
+}
+
+// Releases every cached directory
+// Parameters:
+//   disk - Disk handle of the disk image
+void freeDirectoryCache(Disk* disk)
+{
+    for (uint32_t i = 0; g_DirectoryCache && i <= g_DirectoryCacheMask; i++)
+    {
+        while (g_DirectoryCache[i])
+        {
+            Directory* directory = g_DirectoryCache[i];
+            g_DirectoryCache[i] = directory->Next;
+            freeDirectoryIndex(&directory->Index);
+            releaseSectors(disk, directory->Entries);
+            free(directory);
+        }
+    }
+
+    free(g_DirectoryCache);
+    g_DirectoryCache = NULL;
+    g_DirectoryCacheCount = 0;
+}
+
+// Looks up one path component in a directory
+// Parameters:
+//   directory - Directory to search
+//   name - Component name ("name.ext", 8.3, "." or "..")
+// Returns: Pointer to the directory entry if found, NULL otherwise
+DirectoryEntry* findInDirectory(Directory* directory, const char* name)
+{
+    char fatName[11];
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    {
+        // Dot entries are stored as-is, padded with spaces
+        memset(fatName, ' ', sizeof(fatName));
+        memcpy(fatName, name, strlen(name));
+    }
+    else if (!fatToName(name, strlen(name), fatName))
+    {
+        return NULL;
+    }
+
+    return lookupDirectoryIndex(&directory->Index, fatName);
+}
+
+// Resolves the directory part of a path such as "/BOOT/GRUB"
+// Parameters:
+//   disk - Disk handle of the disk image
+//   path - Path of the directory ("/" separated, relative paths start at the root)
+//   length - Number of characters of path to use
+// Returns: Pointer to the directory, NULL if it cannot be found
+Directory* findDirectory(Disk* disk, const char* path, size_t length)
+{
+    Directory* directory = &g_Root;
+    size_t position = 0;
+    while (directory && position < length)
+    {
+        // Extract the next component
+        char component[64];
+        size_t end = position;
+        while (end < length && path[end] != '/')
+            end++;
+
+        size_t componentLength = end - position;
+        if (componentLength > 0 && !(componentLength == 1 && path[position] == '.'))
+        {
+            if (componentLength >= sizeof(component))
+                return NULL;
+            memcpy(component, path + position, componentLength);
+            component[componentLength] = '\0';
+
+            DirectoryEntry* entry = findInDirectory(directory, component);
+            if (!entry || !(entry->Attributes & ATTRIBUTE_DIRECTORY))
+                return NULL;
+            directory = openDirectory(disk, getFirstCluster(entry));
+        }
+        position = end + 1;
+    }
+    return directory;
+}
+
+// Resolves a path such as "/BOOT/KERNEL.BIN" to its directory entry
+// Parameters:
+//   disk - Disk handle of the disk image
+//   path - Path of the file ("/" separated, relative paths start at the root)
+// Returns: Pointer to the directory entry if found, NULL otherwise
+DirectoryEntry* findPath(Disk* disk, const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    Directory* directory = slash ? findDirectory(disk, path, slash - path) : &g_Root;
+    const char* name = slash ? slash + 1 : path;
+    return directory ? findInDirectory(directory, name) : NULL;
+}
+
+// Lists a directory, and optionally all of its subdirectories
+// Parameters:
+//   disk - Disk handle of the disk image
+//   directory - Directory to list
+//   path - Path of the directory, used as heading
+//   recursive - List subdirectories as well (like ls -R)
+// Returns: true if successful, false if a subdirectory could not be read
+bool listDirectory(Disk* disk, Directory* directory, const char* path, bool recursive)
+{
+    bool ok = true;
+    directory->Listed = true;
+    printf("%s:\n", path);
+
+    for (uint32_t i = 0; i < directory->EntryCount; i++)
+    {
+        DirectoryEntry* entry = &directory->Entries[i];
+        char name[13];
+        if (entry->Name[0] == 0x00)
+            break;
+        if (entry->Name[0] == 0xE5 || (entry->Attributes & ATTRIBUTE_VOLUME_ID))
+            continue;
+
+        fatDisplayName(entry, name);
+        if (entry->Attributes & ATTRIBUTE_DIRECTORY)
+            printf("  %-12s      <DIR>\n", name);
+        else
+            printf("  %-12s %10u\n", name, entry->Size);
+    }
+
+    for (uint32_t i = 0; recursive && i < directory->EntryCount; i++)
+    {
+        DirectoryEntry* entry = &directory->Entries[i];
+        char name[13];
+        char subPath[4096];
+        if (entry->Name[0] == 0x00)
+            break;
+        if (entry->Name[0] == 0xE5 || entry->Name[0] == '.' || entry->Attributes == ATTRIBUTE_LFN
+            || !(entry->Attributes & ATTRIBUTE_DIRECTORY))
+            continue;
+
+        // Every directory is listed once, even if a damaged image links it twice
+        Directory* subDirectory = openDirectory(disk, getFirstCluster(entry));
+        if (!subDirectory)
+        {
+            ok = false;
+            continue;
+        }
+        if (subDirectory->Listed)
+            continue;
+
+        fatDisplayName(entry, name);
+        snprintf(subPath, sizeof(subPath), "%s%s%s", path, strcmp(path, "/") ? "/" : "", name);
+        printf("\n");
+        ok = listDirectory(disk, subDirectory, subPath, true) && ok;
+    }
+    return ok;
+}
+
+// =============================================================================
+// OUTPUT FUNCTIONS
+// =============================================================================
+
+// Writes a whole block of bytes to a file descriptor
+// Parameters:
+//   fd - Output file descriptor
+//   data - Bytes to write
+//   size - Number of bytes to write
+// Returns: true if all bytes were written, false otherwise
+bool writeAll(int fd, const uint8_t* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Initializes an output writer
+// Parameters:
+//   writer - Writer to initialize
+//   fd - Output file descriptor
+void writerInit(OutputWriter* writer, int fd)
+{
+    writer->Fd = fd;
+    writer->Length = 0;
+    writer->Ok = true;
+}
+
+// Writes all pending output of a writer
+// Parameters:
+//   writer - Output writer
+// Returns: true if everything written so far reached the output, false otherwise
+bool writerFlush(OutputWriter* writer)
+{
+    if (writer->Ok && writer->Length > 0)
+        writer->Ok = writeAll(writer->Fd, writer->Buffer, writer->Length);
+    writer->Length = 0;
+    return writer->Ok;
+}
+
+// Appends bytes to a writer
+// Blocks larger than the buffer bypass it and are written directly
+// Parameters:
+//   writer - Output writer
+//   data - Bytes to append
+//   size - Number of bytes
+void writerPut(OutputWriter* writer, const uint8_t* data, size_t size)
+{
+    if (writer->Length + size > sizeof(writer->Buffer))
+    {
+        writerFlush(writer);
+        if (size >= sizeof(writer->Buffer))
+        {
+            writer->Ok = writer->Ok && writeAll(writer->Fd, data, size);
+            return;
+        }
+    }
+
+    memcpy(writer->Buffer + writer->Length, data, size);
+    writer->Length += size;
+}
+
+// Finds the first byte that is not printable ASCII (0x20 - 0x7E)
+// Scans 32 or 16 bytes per step when AVX2 or SSE2 is available. Bytes are
+// compared as signed values, so 0x80 - 0xFF are negative and fail the lower bound
+// Parameters:
+//   data - Bytes to scan
+//   size - Number of bytes
+// Returns: Index of the first non-printable byte, or size if all are printable
+size_t findNonPrintable(const uint8_t* data, size_t size)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i low32 = _mm256_set1_epi8(0x1F);
+    const __m256i high32 = _mm256_set1_epi8(0x7F);
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i printable = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, low32), _mm256_cmpgt_epi8(high32, bytes));
+        uint32_t mask = ~(uint32_t) _mm256_movemask_epi8(printable);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+
+#if defined(__SSE2__)
+    const __m128i low = _mm_set1_epi8(0x1F);
+    const __m128i high = _mm_set1_epi8(0x7F);
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(bytes, low), _mm_cmplt_epi8(bytes, high));
+        uint32_t mask = ~(uint32_t) _mm_movemask_epi8(printable) & 0xFFFF;
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; i < size; i++)
+        if (data[i] < 0x20 || data[i] > 0x7E)
+            return i;
+    return size;
+}
+
+// Appends bytes to a writer, escaping non-printable bytes as "<xx>" hex codes
+// Runs of printable bytes are copied as a whole
+// Parameters:
+//   writer - Output writer
+//   data - Bytes to append
+//   size - Number of bytes
+void writeEscaped(OutputWriter* writer, const uint8_t* data, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    while (size > 0)
+    {
+        // Copy the printable run as-is
+        size_t run = findNonPrintable(data, size);
+        writerPut(writer, data, run);
+        data += run;
+        size -= run;
+
+        // Escape non-printable bytes one by one
+        while (size > 0 && (*data < 0x20 || *data > 0x7E))
+        {
+            uint8_t code[4] = { '<', hex[*data >> 4], hex[*data & 0x0F], '>' };
+            writerPut(writer, code, sizeof(code));
+            data++;
+            size--;
+        }
+    }
+}
+
+// Callback writing a chunk of a file to a file descriptor
+bool writeChunk(const uint8_t* data, size_t size, void* context)
+{
+    return writeAll(*(int*) context, data, size);
+}
+
+// Callback appending a chunk of a file to an output writer with escaping
+bool writeEscapedChunk(const uint8_t* data, size_t size, void* context)
+{
+    OutputWriter* writer = (OutputWriter*) context;
+    writeEscaped(writer, data, size);
+    return writer->Ok;
+}
+
+// Writes the raw contents of a file to a file descriptor
+// No intermediate file buffer is used: in-memory images are written directly
+// from the mapped clusters, otherwise data is moved with sendfile from the image
+// Parameters:
+//   fileEntry - Pointer to the file's directory entry
+//   disk - Disk handle of the disk image
+//   fd - Output file descriptor
+// Returns: true if successful, false otherwise
+bool writeRawFile(DirectoryEntry* fileEntry, Disk* disk, int fd)
+{
+    uint8_t bounce[16 * 1024];
+    if (disk->Data)
+        return streamFile(fileEntry, disk, bounce, sizeof(bounce), writeChunk, &fd);
+
+    uint64_t remaining = fileEntry->Size;
+    uint64_t clusterSize = (uint64_t) g_BootSector.SectorsPerCluster * g_BootSector.BytesPerSector;
+    ClusterIterator iterator;
+    Extent extent;
+    beginClusterChain(&iterator, getFirstCluster(fileEntry));
+    while (remaining > 0 && nextExtent(&iterator, &extent))
+    {
+        off_t position = (off_t) clusterToLba(extent.FirstCluster) * g_BootSector.BytesPerSector;
+        uint64_t left = extent.ClusterCount * clusterSize;
+        if (left > remaining)
+            left = remaining;
+        remaining -= left;
+
+        // Kernel to kernel copy, with a small bounce buffer if sendfile is not supported
+        while (left > 0)
+        {
+            ssize_t sent = sendfile(fd, fileno(disk->File), &position, left);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent <= 0)
+            {
+                size_t chunk = left < sizeof(bounce) ? left : sizeof(bounce);
+                if (!diskReadAt(disk, position, chunk, bounce) || !writeAll(fd, bounce, chunk))
+                    return false;
+                sent = chunk;
+                position += chunk;
+            }
+            left -= sent;
+        }
+    }
+
+    return iterator.Ok && remaining == 0;
+}
+
+// =============================================================================
+// BATCH EXTRACTION FUNCTIONS
+// =============================================================================
+
+// Extraction list structure - growable array of directory entries
+typedef struct
+{
+    DirectoryEntry** Items;            // Entries to extract
+    uint32_t Count;                    // Number of entries
+    uint32_t Capacity;                 // Allocated number of entries
+
+} EntryList;
+
+// Compares two directory entries by the position of their data on disk
+// Used with qsort to order extraction as a single forward sweep over the image
+int compareEntryLocation(const void* a, const void* b)
+{
+    const DirectoryEntry* entryA = *(DirectoryEntry* const*) a;
+    const DirectoryEntry* entryB = *(DirectoryEntry* const*) b;
+    uint32_t clusterA = getFirstCluster(entryA);
+    uint32_t clusterB = getFirstCluster(entryB);
+    if (clusterA != clusterB)
+        return clusterA < clusterB ? -1 : 1;
+    return entryA < entryB ? -1 : (entryA > entryB);
+}
+
+// Compares two directory entries by their 8.3 name
+// Used with qsort to find files of different directories with the same name
+int compareEntryName(const void* a, const void* b)
+{
+    const DirectoryEntry* entryA = *(DirectoryEntry* const*) a;
+    const DirectoryEntry* entryB = *(DirectoryEntry* const*) b;
+    return memcmp(entryA->Name, entryB->Name, sizeof(entryA->Name));
+}
+
+// Finds two different entries of the extraction list with the same name
+// Files are created in the output directory by name alone, so they would
+// overwrite each other (or be written by two workers at once)
+// Parameters:
+//   entries - Entries to extract, each one only once
+//   count - Number of entries
+// Returns: an entry whose name is taken by another one, NULL if the names are unique
+DirectoryEntry* findDuplicateName(DirectoryEntry** entries, uint32_t count)
+{
+    if (count < 2)
+        return NULL;
+
+    DirectoryEntry** sorted = (DirectoryEntry**) malloc(sizeof(DirectoryEntry*) * count);
+    DirectoryEntry* duplicate = NULL;
+    if (!sorted)
+        return NULL;
+
+    memcpy(sorted, entries, sizeof(DirectoryEntry*) * count);
+    qsort(sorted, count, sizeof(DirectoryEntry*), compareEntryName);
+    for (uint32_t i = 1; i < count && !duplicate; i++)
+        if (compareEntryName(&sorted[i - 1], &sorted[i]) == 0)
+            duplicate = sorted[i];
+
+    free(sorted);
+    return duplicate;
+}
+
+// Adds a directory entry to the extraction list
+// Parameters:
+//   list - Extraction list
+//   entry - Directory entry to add
+// Returns: true if successful, false if out of memory
+bool addExtractEntry(EntryList* list, DirectoryEntry* entry)
+{
+    if (list->Count == list->Capacity)
+    {
+        uint32_t capacity = list->Capacity ? list->Capacity * 2 : 64;
+        DirectoryEntry** items = (DirectoryEntry**) realloc(list->Items, capacity * sizeof(DirectoryEntry*));
+        if (!items)
+            return false;
+        list->Items = items;
+        list->Capacity = capacity;
+    }
+
+    list->Items[list->Count++] = entry;
+    return true;
+}
+
+// Writes one file from the disk image to the output directory
+// The file is streamed through a fixed-size buffer, whatever its size
+// Parameters:
+//   fileEntry - Pointer to the file's directory entry
+//   disk - Disk handle of the disk image
+//   outputDir - Directory where the file is created
+// Returns: true if successful, false otherwise
+bool extractFile(DirectoryEntry* fileEntry, Disk* disk, const char* outputDir)
+{
+    char name[13];
+    char path[4096];
+    uint8_t scratch[32 * 1024];
+    fatDisplayName(fileEntry, name);
+    snprintf(path, sizeof(path), "%s/%s", outputDir, name);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Could not write %s!\n", path);
+        return false;
+    }
+
+    bool ok = streamFile(fileEntry, disk, scratch, sizeof(scratch), writeChunk, &fd);
+    ok = (close(fd) == 0) && ok;
+    if (!ok)
+        fprintf(stderr, "Could not extract file %s!\n", name);
+    return ok;
+}
+
+// Shared state of the extraction worker threads
+// Workers only read the decoded FAT and directory, the only shared mutable state
+// is the index of the next file to extract and the result code
+typedef struct
+{
+    Disk* Disk;                        // Disk image (in-memory view or positional reads)
+    const char* OutputDir;             // Directory where the files are created
+    DirectoryEntry** Entries;          // Files to extract, in on-disk order
+    uint32_t Count;                    // Number of files to extract
+    uint32_t Next;                     // Index of the next file to extract (atomic)
+    int Result;                        // 0, or -6 if any file failed (atomic)
+
+} ExtractJob;
+
+// Worker thread: extracts files from the shared job until none are left
+// Files are taken one at a time so that the on-disk order is mostly preserved
+// Parameters:
+//   param - Pointer to the shared ExtractJob
+// Returns: NULL
+void* extractWorker(void* param)
+{
+    ExtractJob* job = (ExtractJob*) param;
+    for (;;)
+    {
+        uint32_t index = __atomic_fetch_add(&job->Next, 1, __ATOMIC_RELAXED);
+        if (index >= job->Count)
+            break;
+
+        if (!extractFile(job->Entries[index], job->Disk, job->OutputDir))
+            __atomic_store_n(&job->Result, -6, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// Extracts many files to an output directory in a single pass
+// The filesystem is loaded once and files are extracted in on-disk order
+// Parameters:
+//   disk - Disk handle of the disk image
+//   outputDir - Directory where the files are created
+//   patterns - File paths (8.3 or "name.ext" names) or shell patterns
+//              for the last path component to extract
+//   patternCount - Number of patterns
+//   all - Extract every file of the root directory, patterns are ignored
+//   threadCount - Number of worker threads extracting files in parallel
+// Returns: 0 if every file was extracted, -5 if a name was not found or two
+//          selected files have the same name, -6 on I/O errors
+int extractFiles(Disk* disk, const char* outputDir, char** patterns, int patternCount, bool all, int threadCount)
+{
+    int result = 0;
+    EntryList list = { NULL, 0, 0 };
+
+    if (mkdir(outputDir, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Cannot create output directory %s!\n", outputDir);
+        return -6;
+    }
+
+    // Collect the entries to extract
+    for (int p = 0; p < (all ? 1 : patternCount); p++)
+    {
+        bool matched = false;
+        const char* path = all ? "*" : patterns[p];
+        const char* slash = strrchr(path, '/');
+        const char* name = slash ? slash + 1 : path;
+        Directory* directory = slash ? findDirectory(disk, path, slash - path) : &g_Root;
+
+        if (directory && !strpbrk(name, "*?["))
+        {
+            // Plain name: direct lookup
+            DirectoryEntry* entry = findInDirectory(directory, name);
+            if (entry && fatIsFileEntry(entry))
+                matched = addExtractEntry(&list, entry);
+        }
+        else if (directory)
+        {
+            // Pattern (or --all): match against the display name of every file
+            // 8.3 names are stored upper-case, so matching is done on an upper-case pattern
+            char pattern[256] = "";
+            for (size_t i = 0; name[i] && i < sizeof(pattern) - 1; i++)
+            {
+                pattern[i] = toupper((unsigned char) name[i]);
+                pattern[i + 1] = '\0';
+            }
+
+            for (uint32_t i = 0; i < directory->EntryCount; i++)
+            {
+                DirectoryEntry* entry = &directory->Entries[i];
+                char entryName[13];
+                if (entry->Name[0] == 0x00)
+                    break;
+                if (!fatIsFileEntry(entry))
+                    continue;
+
+                fatDisplayName(entry, entryName);
+                if (fnmatch(pattern, entryName, 0) == 0)
+                    matched = addExtractEntry(&list, entry) || matched;
+            }
+        }
+
+        if (!matched && !all)
+        {
+            fprintf(stderr, "Could not find file %s!\n", patterns[p]);
+            result = -5;
+        }
+    }
+
+    // Extract in on-disk order so the image is read in one forward sweep;
+    // entries selected by several patterns end up next to each other
+    // (nothing selected: the list has no items at all)
+    if (list.Count > 1)
+        qsort(list.Items, list.Count, sizeof(DirectoryEntry*), compareEntryLocation);
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < list.Count; i++)
+        if (count == 0 || list.Items[count - 1] != list.Items[i])
+            list.Items[count++] = list.Items[i];
+
+    // Nothing is extracted when two selected files would get the same output file
+    DirectoryEntry* duplicate = findDuplicateName(list.Items, count);
+    if (duplicate)
+    {
+        char name[13];
+        fatDisplayName(duplicate, name);
+        fprintf(stderr, "Several selected files are named %s, they would overwrite each other in %s!\n", name, outputDir);
+        free(list.Items);
+        return -5;
+    }
+
+    // Worker threads pick files from the sorted list one at a time
+    ExtractJob job = { disk, outputDir, list.Items, count, 0, 0 };
+
+    if (threadCount > (int) count)
+        threadCount = count;
+
+    pthread_t* threads = (pthread_t*) malloc(sizeof(pthread_t) * (threadCount > 1 ? threadCount : 1));
+    int started = 0;
+    while (threads && threadCount > 1 && started < threadCount
+           && pthread_create(&threads[started], NULL, extractWorker, &job) == 0)
+        started++;
+
+    // The calling thread works too (and does all the work when running single-threaded)
+    extractWorker(&job);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    if (job.Result && !result)
+        result = job.Result;
+
+    free(threads);
+    free(list.Items);
+    return result;
+}
+
+// =============================================================================
+// CLUSTER ALLOCATION FUNCTIONS
+// =============================================================================
+
+// Marks a cluster as free in the free cluster bitmap
+static inline void markClusterFree(uint32_t cluster)
+{
+    g_FreeBitmap[cluster / 64] |= 1ull << (cluster % 64);
+    g_FreeClusterCount++;
+    if (cluster < g_FreeSearchStart)
+        g_FreeSearchStart = cluster;
+}
+
+// Marks a cluster as used in the free cluster bitmap
+static inline void markClusterUsed(uint32_t cluster)
+{
+    g_FreeBitmap[cluster / 64] &= ~(1ull << (cluster % 64));
+    g_FreeClusterCount--;
+}
+
+// Checks whether a cluster is free in the free cluster bitmap
+static inline bool isClusterFree(uint32_t cluster)
+{
+    return (g_FreeBitmap[cluster / 64] >> (cluster % 64)) & 1;
+}
+
+// Builds the free cluster bitmap from the cluster table
+// Allocation then never has to look at the FAT itself, and whole words
+// of used clusters are skipped at once while searching
+// Must be called after buildClusterTable
+// Returns: true if successful, false otherwise
+bool buildFreeBitmap()
+{
+    g_FreeBitmap = (uint64_t*) calloc((g_Layout.ClusterCount + 63) / 64, sizeof(uint64_t));
+    if (!g_FreeBitmap)
+        return false;
+
+    g_FreeClusterCount = 0;
+    g_ReleasedClusterCount = 0;
+    g_FreeSearchStart = g_Layout.ClusterCount;
+    for (uint32_t cluster = 2; cluster < g_Layout.ClusterCount; cluster++)
+        if (g_ClusterTable[cluster] == 0)
+            markClusterFree(cluster);
+    return true;
+}
+
+// Finds the first run of contiguous free clusters of a given length
+// Parameters:
+//   count - Number of clusters of the run
+// Returns: First cluster of the run, 0 if there is no such run
+uint32_t findFreeRun(uint32_t count)
+{
+    uint32_t runStart = 0;
+    uint32_t runLength = 0;
+    uint32_t cluster = g_FreeSearchStart;
+    while (cluster < g_Layout.ClusterCount)
+    {
+        uint64_t word = g_FreeBitmap[cluster / 64] >> (cluster % 64);
+        if (word == 0)
+        {
+            // No free cluster in the rest of this word
+            runLength = 0;
+            cluster = (cluster / 64 + 1) * 64;
+            continue;
+        }
+
+        if (cluster % 64 == 0 && word == UINT64_MAX && runLength + 64 < count)
+        {
+            // A whole word of free clusters that does not complete the run yet
+            if (runLength == 0)
+                runStart = cluster;
+            runLength += 64;
+            cluster += 64;
+            continue;
+        }
+
+        if (word & 1)
+        {
+            if (runLength++ == 0)
+                runStart = cluster;
+            if (runLength == count)
+                return runStart;
+            cluster++;
+        }
+        else
+        {
+            // Skip the used clusters up to the next free one
+            runLength = 0;
+            cluster += __builtin_ctzll(word);
+        }
+    }
+    return 0;
+}
+
+// Allocates a cluster chain
+// The chain is placed in the first run of contiguous free clusters that is long
+// enough, so that the file can be read back with a single I/O; only if the free
+// space is too fragmented, the first free clusters are chained together
+// Parameters:
+//   count - Number of clusters to allocate (at least 1)
+//   firstOut - Receives the first cluster of the chain
+// Returns: true if successful, false if the volume is full
+bool allocateClusters(uint32_t count, uint32_t* firstOut)
+{
+    if (count == 0 || count > g_FreeClusterCount)
+        return false;
+
+    uint32_t cluster = findFreeRun(count);
+    uint32_t previous = 0;
+    if (cluster == 0)
+        cluster = g_FreeSearchStart;
+
+    // Enough free clusters exist, so the loop ends before the end of the volume
+    for (; count > 0; cluster++)
+    {
+        if (!isClusterFree(cluster))
+            continue;
+
+        markClusterUsed(cluster);
+        g_ClusterTable[cluster] = CLUSTER_END;
+        if (previous)
+            g_ClusterTable[previous] = cluster;
+        else
+            *firstOut = cluster;
+        previous = cluster;
+        count--;
+    }
+
+    while (g_FreeSearchStart < g_Layout.ClusterCount && !isClusterFree(g_FreeSearchStart))
+        g_FreeSearchStart++;
+    return true;
+}
+
+// Frees a cluster chain
+// The clusters are free in the FAT written back, but are not allocated again
+// before: until then the image still holds the old file, which a failed run
+// leaves as it was
+// Parameters:
+//   firstCluster - First cluster of the chain (0 for an empty file)
+void freeClusterChain(uint32_t firstCluster)
+{
+    uint32_t cluster = firstCluster;
+    for (uint32_t visited = 0; cluster >= 2 && cluster < g_Layout.ClusterCount && visited < g_Layout.ClusterCount; visited++)
+    {
+        // A free cluster inside the chain means the FAT is damaged, stop there
+        uint32_t next = g_ClusterTable[cluster];
+        if (next == 0)
+            break;
+
+        g_ClusterTable[cluster] = 0;
+        g_ReleasedClusterCount++;
+        cluster = next;
+    }
+}
+
+// =============================================================================
+// FAT ENCODING FUNCTIONS
+// =============================================================================
+
+// Gets a raw entry of the FAT of the volume
+// Parameters:
+//   fat - FAT contents
+//   cluster - Cluster number
+// Returns: Raw entry value (the reserved FAT32 bits are masked out)
+uint32_t getFatEntry(const uint8_t* fat, uint32_t cluster)
+{
+    return fatGetEntry(g_Layout.FatType, fat, cluster);
+}
+
+// Sets a raw entry of the FAT of the volume
+// Parameters:
+//   fat - FAT contents
+//   cluster - Cluster number
+//   value - Raw entry value (the reserved FAT32 bits are preserved)
+void putFatEntry(uint8_t* fat, uint32_t cluster, uint32_t value)
+{
+    fatPutEntry(g_Layout.FatType, fat, cluster, value);
+}
+
+// Gets the end of chain marker of the FAT type of the volume
+uint32_t getEndOfChainMarker()
+{
+    return fatEndOfChain(g_Layout.FatType);
+}
+
+// Encodes the cluster table back into the FAT
+// Only entries whose meaning changed are rewritten, so bad cluster marks and
+// whatever end of chain values the FAT used are kept as they were
+// Returns: Number of FAT entries that were changed
+uint32_t encodeClusterTable()
+{
+    uint32_t endOfChain = getEndOfChainMarker();
+    uint32_t changed = 0;
+    for (uint32_t cluster = 2; cluster < g_Layout.ClusterCount; cluster++)
+    {
+        uint32_t value = g_ClusterTable[cluster];
+        if (fatNormalizeEntry(getFatEntry(g_Fat, cluster), g_Layout.ClusterCount) == value)
+            continue;
+
+        putFatEntry(g_Fat, cluster, value == CLUSTER_END ? endOfChain : value);
+        changed++;
+    }
+    return changed;
+}
+
+// =============================================================================
+// IMAGE WRITING FUNCTIONS
+// =============================================================================
+
+// Builds the default boot sector of a new image
+// The parameters are those of a 1.44MB floppy, as in the stage1 bootloader;
+// the boot code only halts, since the image is not meant to boot
+// Parameters:
+//   sector - Buffer of 512 bytes receiving the boot sector
+void buildDefaultBootSector(uint8_t* sector)
+{
+    static const uint8_t haltCode[] = { 0xFA, 0xF4, 0xEB, 0xFD };  // cli; hlt; jmp $-1
+    BootSector* boot = (BootSector*) sector;
+    memset(sector, 0, 512);
+
+    boot->BootJumpInstruction[0] = 0xEB;                           // jmp short over the BPB
+    boot->BootJumpInstruction[1] = 0x3C;
+    boot->BootJumpInstruction[2] = 0x90;
+    memcpy(boot->OemIdentifier, "MSWIN4.1", 8);
+    boot->BytesPerSector = 512;
+    boot->SectorsPerCluster = 1;
+    boot->ReservedSectors = 1;
+    boot->FatCount = 2;
+    boot->DirEntryCount = 224;
+    boot->TotalSectors = 2880;
+    boot->MediaDescriptorType = 0xF0;
+    boot->SectorsPerFat = 9;
+    boot->SectorsPerTrack = 18;
+    boot->Heads = 2;
+    boot->Signature = 0x29;
+    boot->VolumeId = (uint32_t) time(NULL);
+    memcpy(boot->VolumeLabel, "NO NAME    ", 11);
+    memcpy(boot->SystemId, "FAT12   ", 8);
+
+    memcpy(sector + 0x3E, haltCode, sizeof(haltCode));
+    sector[510] = 0x55;
+    sector[511] = 0xAA;
+}
+
+// Writes the metadata of a freshly created, zero-filled image
+// Sets the reserved FAT entries (media descriptor and end of chain) and, for
+// FAT32, allocates the root directory cluster and writes the FSInfo sector and
+// the boot sector copy. Must be called after readFat and before buildClusterTable
+// Parameters:
+//   disk - Disk handle of the disk image
+//   bootSector - Boot sector that was written to sector 0
+// Returns: true if successful, false otherwise
+bool formatVolume(Disk* disk, const uint8_t* bootSector)
+{
+    uint32_t endOfChain = getEndOfChainMarker();
+    putFatEntry(g_Fat, 0, (endOfChain & ~0xFFu) | g_BootSector.MediaDescriptorType);
+    putFatEntry(g_Fat, 1, endOfChain);
+    g_FatDirty = true;
+    if (g_Layout.FatType != 32)
+        return true;
+
+    uint32_t root = g_BootSector.RootCluster;
+    if (root < 2 || root >= g_Layout.ClusterCount)
+        return false;
+    putFatEntry(g_Fat, root, endOfChain);
+
+    if (g_BootSector.BackupBootSector != 0 && g_BootSector.BackupBootSector < g_BootSector.ReservedSectors
+        && !writeSectors(disk, g_BootSector.BackupBootSector, 1, bootSector))
+        return false;
+
+    if (g_BootSector.FsInfoSector == 0 || g_BootSector.FsInfoSector >= g_BootSector.ReservedSectors)
+        return true;
+
+    // FSInfo: signatures, free cluster count and next free cluster are unknown (updated on write back)
+    uint8_t* fsInfo = (uint8_t*) calloc(1, g_BootSector.BytesPerSector);
+    static const uint32_t fsInfoFields[][2] = {
+        { 0, 0x41615252 }, { 484, 0x61417272 }, { 488, 0xFFFFFFFF }, { 492, 0xFFFFFFFF }, { 508, 0xAA550000 }
+    };
+    if (!fsInfo)
+        return false;
+    for (size_t i = 0; i < sizeof(fsInfoFields) / sizeof(fsInfoFields[0]); i++)
+        memcpy(fsInfo + fsInfoFields[i][0], &fsInfoFields[i][1], sizeof(uint32_t));
+
+    bool ok = writeSectors(disk, g_BootSector.FsInfoSector, 1, fsInfo);
+    free(fsInfo);
+    return ok;
+}
+
+// Writes the root directory back to the disk image
+// Parameters:
+//   disk - Disk handle of the disk image
+// Returns: true if successful, false otherwise
+bool writeRootDirectory(Disk* disk)
+{
+    if (g_Layout.FatType != 32)
+    {
+        uint32_t lba = g_Layout.RootDirectoryStart;
+        return writeSectors(disk, lba, g_Layout.DataStart - lba, g_RootDirectory);
+    }
+
+    // FAT32: write the directory buffer back extent by extent
+    ClusterIterator iterator;
+    Extent extent;
+    const uint8_t* input = (const uint8_t*) g_RootDirectory;
+    beginClusterChain(&iterator, g_BootSector.RootCluster);
+    while (nextExtent(&iterator, &extent))
+    {
+        uint32_t sectors = extent.ClusterCount * g_BootSector.SectorsPerCluster;
+        if (!writeSectors(disk, clusterToLba(extent.FirstCluster), sectors, input))
+            return false;
+        input += sectors * g_BootSector.BytesPerSector;
+    }
+    return iterator.Ok;
+}
+
+// Writes the FAT back to every FAT copy of the disk image
+// Parameters:
+//   disk - Disk handle of the disk image
+// Returns: true if successful, false otherwise
+bool writeFat(Disk* disk)
+{
+    // FAT32 can disable mirroring, then only the active FAT is written
+    bool mirrored = g_Layout.FatType != 32 || !(g_BootSector.ExtendedFlags & 0x80);
+    for (uint32_t copy = 0; copy < g_BootSector.FatCount; copy++)
+    {
+        if (!mirrored && copy != (g_BootSector.ExtendedFlags & 0x0F))
+            continue;
+        if (!writeSectors(disk, g_BootSector.ReservedSectors + copy * g_Layout.SectorsPerFat, g_Layout.SectorsPerFat, g_Fat))
+            return false;
+    }
+
+    if (g_Layout.FatType != 32 || g_BootSector.FsInfoSector == 0 || g_BootSector.FsInfoSector >= g_BootSector.ReservedSectors)
+        return true;
+
+    // Keep the FSInfo hints of FAT32 in step with the free cluster bitmap
+    uint8_t* fsInfo = (uint8_t*) malloc(g_BootSector.BytesPerSector);
+    uint32_t signature = 0;
+    bool ok = fsInfo && readSectors(disk, g_BootSector.FsInfoSector, 1, fsInfo);
+    if (ok)
+        memcpy(&signature, fsInfo, sizeof(signature));
+    if (ok && signature == 0x41615252)
+    {
+        uint32_t nextFree = g_FreeSearchStart < g_Layout.ClusterCount ? g_FreeSearchStart : 0xFFFFFFFF;
+        uint32_t freeCount = g_FreeClusterCount + g_ReleasedClusterCount;
+        memcpy(fsInfo + 488, &freeCount, sizeof(uint32_t));
+        memcpy(fsInfo + 492, &nextFree, sizeof(uint32_t));
+        ok = writeSectors(disk, g_BootSector.FsInfoSector, 1, fsInfo);
+    }
+    free(fsInfo);
+    return ok;
+}
+
+// Writes all changes back to the disk image
+// File data is written as files are added, the FAT and the root directory
+// only once at the end, whatever the number of files, and only if they changed
+// Parameters:
+//   disk - Disk handle of the disk image
+// Returns: true if successful, false otherwise
+bool flushFilesystem(Disk* disk)
+{
+    if (encodeClusterTable() > 0)
+        g_FatDirty = true;
+
+    return (!g_FatDirty || writeFat(disk)) && (!g_RootDirectoryDirty || writeRootDirectory(disk));
+}
+
+// Adds a cluster to the FAT32 root directory when it is full
+// The directory grows in its private copy, which is written back with the FAT
+// Returns: true if successful, false otherwise
+bool growRootDirectory()
+{
+    uint32_t last = g_BootSector.RootCluster;
+    uint32_t cluster;
+    size_t size = (size_t) g_RootDirectoryEntryCount * sizeof(DirectoryEntry);
+    size_t clusterSize = (size_t) g_BootSector.SectorsPerCluster * g_BootSector.BytesPerSector;
+    DirectoryEntry* grown;
+    if (g_Layout.FatType != 32 || !(grown = (DirectoryEntry*) realloc(g_RootDirectory, size + clusterSize)))
+        return false;
+    g_RootDirectory = grown;
+    if (!allocateClusters(1, &cluster))
+        return false;
+
+    // The chain was validated when it was read, so it ends with CLUSTER_END
+    while (g_ClusterTable[last] != CLUSTER_END)
+        last = g_ClusterTable[last];
+    g_ClusterTable[last] = cluster;
+    memset((uint8_t*) grown + size, 0, clusterSize);
+    g_RootDirectoryEntryCount += clusterSize / sizeof(DirectoryEntry);
+    g_RootDirectoryDirty = true;
+
+    freeDirectoryIndex(&g_Root.Index);
+    return initRootDirectory();
+}
+
+// Gets a free entry of the root directory
+// Returns: Index of the free entry, or -1 if the root directory is full
+int64_t allocateRootEntry()
+{
+    for (;;)
+    {
+        for (; g_RootFreeSearchStart < g_Root.EntryCount; g_RootFreeSearchStart++)
+        {
+            uint8_t first = g_Root.Entries[g_RootFreeSearchStart].Name[0];
+            if (first == 0x00 || first == 0xE5)
+                return g_RootFreeSearchStart;
+        }
+
+        // FAT12/16 have a fixed root directory, FAT32 can grow it
+        if (!growRootDirectory())
+            return -1;
+    }
+}
+
+// Sets the date and time fields of a directory entry
+// Parameters:
+//   entry - Pointer to the directory entry
+//   timestamp - Time to store (dates before 1980 are stored as 1980-01-01)
+void setEntryTime(DirectoryEntry* entry, time_t timestamp)
+{
+    struct tm local;
+    uint16_t date = (1 << 5) | 1;
+    uint16_t time = 0;
+    if (localtime_r(&timestamp, &local) && local.tm_year >= 80)
+    {
+        date = ((local.tm_year - 80) << 9) | ((local.tm_mon + 1) << 5) | local.tm_mday;
+        time = (local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2);
+    }
+
+    entry->CreatedTimeTenths = 0;
+    entry->CreatedTime = time;
+    entry->CreatedDate = date;
+    entry->AccessedDate = date;
+    entry->ModifiedTime = time;
+    entry->ModifiedDate = date;
+}
+
+// Sets the volume label of the root directory
+// Parameters:
+//   label - Volume label (up to 11 characters)
+// Returns: true if successful, false otherwise
+bool setVolumeLabel(const char* label)
+{
+    size_t length = strlen(label);
+    if (length == 0 || length > 11)
+        return false;
+
+    // Reuse the existing label entry, otherwise take a free one
+    DirectoryEntry* entry = NULL;
+    for (uint32_t i = 0; i < g_Root.EntryCount && g_Root.Entries[i].Name[0] != 0x00; i++)
+    {
+        DirectoryEntry* candidate = &g_Root.Entries[i];
+        if (candidate->Name[0] != 0xE5 && candidate->Attributes != ATTRIBUTE_LFN
+            && (candidate->Attributes & ATTRIBUTE_VOLUME_ID))
+        {
+            entry = candidate;
+            break;
+        }
+    }
+    if (!entry)
+    {
+        int64_t index = allocateRootEntry();
+        if (index < 0)
+            return false;
+        entry = &g_Root.Entries[index];
+    }
+
+    char name[11];
+    memset(name, ' ', 11);
+    for (size_t i = 0; i < length; i++)
+        name[i] = toupper((unsigned char) label[i]);
+    if (entry->Attributes == ATTRIBUTE_VOLUME_ID && memcmp(entry->Name, name, 11) == 0)
+        return true;
+
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->Name, name, 11);
+    entry->Attributes = ATTRIBUTE_VOLUME_ID;
+    setEntryTime(entry, time(NULL));
+    g_RootDirectoryDirty = true;
+    return true;
+}
+
+// Writes bytes to the disk image, in compare mode only if they differ from it
+// Parameters:
+//   disk - Disk handle of the disk image
+//   offset - Byte offset to start writing at
+//   size - Number of bytes (at most 64KB in compare mode)
+//   data - Bytes to write
+//   compare - Compare with the image first and skip identical data
+//   changedOut - Set to true if the data was written
+// Returns: true if successful, false otherwise
+bool updateAt(Disk* disk, uint64_t offset, uint64_t size, const void* data, bool compare, bool* changedOut)
+{
+    uint8_t current[64 * 1024];
+
+    if (compare && disk->Data)
+    {
+        if (!diskContains(disk, offset, size))
+            return false;
+        if (memcmp(disk->Data + offset, data, size) == 0)
+            return true;
+    }
+    else if (compare && size <= sizeof(current))
+    {
+        if (!diskReadAt(disk, offset, size, current))
+            return false;
+        if (memcmp(current, data, size) == 0)
+            return true;
+    }
+
+    *changedOut = true;
+    return diskWriteAt(disk, offset, size, data);
+}
+
+// Copies the contents of a host file into a cluster chain of the disk image
+// A mapped image receives the data directly from read(), without a bounce buffer.
+// In compare mode (updating an image) only the chunks that differ from the
+// image are written, so that unchanged clusters are never touched.
+// The slack after the end of the file is zeroed
+// Parameters:
+//   disk - Disk handle of the disk image
+//   fd - Host file descriptor
+//   firstCluster - First cluster of the allocated chain
+//   size - Size of the file in bytes
+//   compare - Compare with the current contents of the clusters and skip identical data
+//   changedOut - Set to true if any data was written
+// Returns: true if successful, false otherwise
+bool writeFileData(Disk* disk, int fd, uint32_t firstCluster, uint64_t size, bool compare, bool* changedOut)
+{
+    uint8_t scratch[64 * 1024];
+    uint64_t clusterSize = (uint64_t) g_BootSector.SectorsPerCluster * g_BootSector.BytesPerSector;
+    uint64_t fileOffset = 0;
+    bool direct = disk->Data && !compare;
+
+    ClusterIterator iterator;
+    Extent extent;
+    beginClusterChain(&iterator, firstCluster);
+    while (nextExtent(&iterator, &extent))
+    {
+        uint64_t offset = (uint64_t) clusterToLba(extent.FirstCluster) * g_BootSector.BytesPerSector;
+        uint64_t extentSize = extent.ClusterCount * clusterSize;
+        uint64_t dataSize = size - fileOffset < extentSize ? size - fileOffset : extentSize;
+        if (disk->Data && !diskContains(disk, offset, extentSize))
+            return false;
+
+        for (uint64_t done = 0; done < dataSize; )
+        {
+            uint64_t chunk = dataSize - done;
+            uint8_t* target = direct ? disk->Data + offset + done : scratch;
+            if (!direct && chunk > sizeof(scratch))
+                chunk = sizeof(scratch);
+
+            ssize_t read = pread(fd, target, chunk, (off_t) (fileOffset + done));
+            if (read < 0 && errno == EINTR)
+                continue;
+            // The file is shorter than it was when its clusters were allocated
+            if (read <= 0)
+                return false;
+            if (direct)
+                *changedOut = true;
+            else if (!updateAt(disk, offset + done, read, scratch, compare, changedOut))
+                return false;
+            done += read;
+        }
+
+        if (!compare && !diskZeroAt(disk, offset + dataSize, extentSize - dataSize))
+            return false;
+
+        // Compare mode: zero the slack only where it is not zero already
+        memset(scratch, 0, sizeof(scratch));
+        for (uint64_t done = dataSize; compare && done < extentSize; )
+        {
+            uint64_t chunk = extentSize - done < sizeof(scratch) ? extentSize - done : sizeof(scratch);
+            if (!updateAt(disk, offset + done, chunk, scratch, true, changedOut))
+                return false;
+            done += chunk;
+        }
+        fileOffset += dataSize;
+    }
+    return iterator.Ok && fileOffset == size;
+}
+
+// Gets the clusters a host file needs and whether it can be written over the
+// chain of the file it replaces (see addFile)
+// Parameters:
+//   entry - File of the same name in the image, NULL if there is none
+//   size - Size of the host file
+//   update - Compare with the file already in the image and keep what did not change
+//   keepChainOut - Set to true if the existing chain is kept
+// Returns: Number of clusters of the file
+uint32_t planFileClusters(const DirectoryEntry* entry, uint64_t size, bool update, bool* keepChainOut)
+{
+    uint64_t clusterSize = (uint64_t) g_BootSector.SectorsPerCluster * g_BootSector.BytesPerSector;
+    uint32_t clusters = (uint32_t) ((size + clusterSize - 1) / clusterSize);
+    *keepChainOut = false;
+    if (!entry || !update || clusters == 0)
+        return clusters;
+
+    uint32_t oldClusters = (uint32_t) ((entry->Size + clusterSize - 1) / clusterSize);
+    ClusterIterator iterator;
+    Extent extent;
+    uint32_t chainLength = 0;
+    beginClusterChain(&iterator, getFirstCluster(entry));
+    while (nextExtent(&iterator, &extent))
+        chainLength += extent.ClusterCount;
+
+    *keepChainOut = iterator.Ok && chainLength == clusters && oldClusters == clusters;
+    return clusters;
+}
+
+// Adds a host file to the root directory of the disk image
+// The clusters are taken from the free cluster bitmap, contiguous whenever
+// possible; a file with the same name is replaced. When updating, a file that
+// still needs the same number of clusters keeps its chain and only the clusters
+// whose contents changed are rewritten, an identical file is not written at all.
+// The FAT and the directory are only updated in memory, see flushFilesystem;
+// a file that cannot be added leaves both unchanged, and the file it would
+// have replaced intact
+// Parameters:
+//   disk - Disk handle of the disk image
+//   hostPath - Path of the file to add
+//   name - Name of the file in the image ("name.ext" or 8.3)
+//   update - Compare with the file already in the image and keep what did not change
+// Returns: true if successful, false otherwise
+bool addFile(Disk* disk, const char* hostPath, const char* name, bool update)
+{
+    char fatName[11];
+    if (!fatToName(name, strlen(name), fatName))
+    {
+        fprintf(stderr, "Invalid 8.3 file name %s!\n", name);
+        return false;
+    }
+
+    int fd = open(hostPath, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t) st.st_size > UINT32_MAX)
+    {
+        fprintf(stderr, "Cannot read file %s!\n", hostPath);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    // Replace a file of the same name, otherwise take a free root directory entry
+    DirectoryEntry* entry = findFile(fatName);
+    if (entry && !fatIsFileEntry(entry))
+    {
+        fprintf(stderr, "%s exists and is not a file!\n", name);
+        close(fd);
+        return false;
+    }
+
+    // The clusters of a replaced file are not reused (see freeClusterChain), so
+    // check for space before anything changes
+    bool keepChain;
+    uint32_t clusters = planFileClusters(entry, (uint64_t) st.st_size, update, &keepChain);
+    uint32_t firstCluster = keepChain ? getFirstCluster(entry) : 0;
+    if (!keepChain && clusters > 0 && !allocateClusters(clusters, &firstCluster))
+    {
+        fprintf(stderr, "Disk full, cannot add %s!\n", name);
+        close(fd);
+        return false;
+    }
+
+    if (entry && !keepChain)
+        freeClusterChain(getFirstCluster(entry));
+    else if (!entry)
+    {
+        int64_t index = allocateRootEntry();
+        if (index < 0)
+        {
+            fprintf(stderr, "Root directory is full, cannot add %s!\n", name);
+            freeClusterChain(firstCluster);
+            close(fd);
+            return false;
+        }
+        entry = &g_Root.Entries[index];
+        memset(entry, 0, sizeof(*entry));
+        memcpy(entry->Name, fatName, 11);
+        insertDirectoryIndex(&g_Root.Index, (uint32_t) index);
+        g_RootDirectoryDirty = true;
+    }
+
+    // A relocated chain may still land on the same clusters, so compare there too
+    bool changed = false;
+    bool ok = clusters == 0 || writeFileData(disk, fd, firstCluster, (uint64_t) st.st_size, update, &changed);
+    close(fd);
+    if (!ok)
+    {
+        fprintf(stderr, "Could not write file %s!\n", name);
+        return false;
+    }
+
+    if (!changed && entry->Attributes == ATTRIBUTE_ARCHIVE && getFirstCluster(entry) == firstCluster
+        && entry->Size == (uint32_t) st.st_size)
+        return true;
+
+    entry->Attributes = ATTRIBUTE_ARCHIVE;
+    entry->FirstClusterHigh = (uint16_t) (firstCluster >> 16);
+    entry->FirstClusterLow = (uint16_t) firstCluster;
+    entry->Size = (uint32_t) st.st_size;
+    setEntryTime(entry, st.st_mtime);
+    g_RootDirectoryDirty = true;
+    return true;
+}
+
+// =============================================================================
+// PACKED KERNEL IMAGES
+// =============================================================================
+//
+// A packed kernel is a 16-byte header followed by one LZ4 block (the block
+// format of the LZ4 project), unpacked by the stage2 bootloader in place at
+// 1MB (src/bootloader/stage2/unpack.inc, same layout):
+//   offset 0   "NBLZ"
+//   offset 4   size of the kernel once unpacked
+//   offset 8   margin: bytes past the end of the unpacked kernel the block
+//              is moved to end at before stage2 decodes it forward to 1MB
+//   offset 12  FNV-1a hash of the unpacked kernel
+// The packer spends time on the ratio (hash chains, lazy matching), since
+// every byte saved is floppy time at every boot and packing happens once.
+// Stage2 does not check the block, so every packed kernel is verified by
+// unpacking it exactly the way stage2 does, in the same memory
+
+#define PACKED_MAGIC            "NBLZ"
+#define PACKED_HEADER_SIZE      16
+#define PACKED_MAX_SIZE         0xF00000        // KERNEL_MAX_SIZE of stage2 (1MB up to 16MB)
+#define PACKED_MOVE_SLACK       3               // Stage2 moves the block in whole dwords
+
+#define LZ4_MIN_MATCH           4               // Shortest match
+#define LZ4_LAST_LITERALS       5               // The block ends with at least 5 literals
+#define LZ4_MATCH_LIMIT         12              // The last match starts at least 12 bytes before the end
+#define LZ4_MAX_OFFSET          65535
+#define LZ4_HASH_BITS           16
+#define LZ4_SEARCH_DEPTH        256             // Candidates tried per position
+
+// Match found by the packer
+typedef struct
+{
+    uint32_t Length;                   // 0 if none
+    uint32_t Offset;                   // Distance back to the earlier copy
+
+} PackMatch;
+
+// State of the packer
+typedef struct
+{
+    const uint8_t* Input;
+    uint32_t Size;
+    int32_t* Head;                     // Last position of each hash, -1 if none
+    int32_t* Previous;                 // Earlier position with the same hash (by position modulo 64KB)
+    uint32_t Inserted;                 // Positions before it are in the hash chains
+    uint8_t* Output;
+    size_t Length;                     // Bytes written to Output
+    int64_t Ahead;                     // Largest lead of the unpacked over the packed bytes at a sequence
+
+} Packer;
+
+static inline uint32_t packRead32(const uint8_t* data)
+{
+    return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t) data[3] << 24;
+}
+
+static inline void packWrite32(uint8_t* data, uint32_t value)
+{
+    data[0] = (uint8_t) value;
+    data[1] = (uint8_t) (value >> 8);
+    data[2] = (uint8_t) (value >> 16);
+    data[3] = (uint8_t) (value >> 24);
+}
+
+static inline uint32_t packHashPosition(const uint8_t* data)
+{
+    return (packRead32(data) * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// Adds every position before end to the hash chains
+static void packInsert(Packer* packer, uint32_t end)
+{
+    for (; packer->Inserted < end; packer->Inserted++)
+    {
+        uint32_t hash = packHashPosition(packer->Input + packer->Inserted);
+        packer->Previous[packer->Inserted & LZ4_MAX_OFFSET] = packer->Head[hash];
+        packer->Head[hash] = (int32_t) packer->Inserted;
+    }
+}
+
+// Finds the longest earlier match of a position within the LZ4 window
+static PackMatch packFindMatch(Packer* packer, uint32_t position)
+{
+    PackMatch best = { 0, 0 };
+    const uint8_t* current = packer->Input + position;
+    uint32_t limit = packer->Size - LZ4_LAST_LITERALS - position;  // Longest match allowed here
+
+    packInsert(packer, position);
+    int32_t candidate = packer->Head[packHashPosition(current)];
+    for (unsigned depth = 0; candidate >= 0 && depth < LZ4_SEARCH_DEPTH; depth++)
+    {
+        if (position - (uint32_t) candidate > LZ4_MAX_OFFSET)
+            break;
+
+        const uint8_t* earlier = packer->Input + candidate;
+        if (earlier[best.Length] == current[best.Length])
+        {
+            uint32_t length = 0;
+            while (length < limit && earlier[length] == current[length])
+                length++;
+            if (length > best.Length)
+            {
+                best.Length = length;
+                best.Offset = position - (uint32_t) candidate;
+                if (length == limit)
+                    break;
+            }
+        }
+
+        // Slots are reused every 64KB: anything not older ends the chain
+        int32_t next = packer->Previous[candidate & LZ4_MAX_OFFSET];
+        if (next >= candidate)
+            break;
+        candidate = next;
+    }
+
+    if (best.Length < LZ4_MIN_MATCH)
+        best.Length = 0;
+    return best;
+}
+
+// Writes an LZ4 length extension (after a 15 in the token)
+static void packLength(Packer* packer, uint32_t length)
+{
+    for (; length >= 255; length -= 255)
+        packer->Output[packer->Length++] = 255;
+    packer->Output[packer->Length++] = (uint8_t) length;
+}
+
+// Writes a sequence: literals from anchor to position, then the match (none for the last one)
+static void packSequence(Packer* packer, uint32_t anchor, uint32_t position, PackMatch match)
+{
+    // In-place unpacking: the output must not overtake the block where a sequence starts
+    int64_t ahead = (int64_t) anchor - (int64_t) packer->Length;
+    if (ahead > packer->Ahead)
+        packer->Ahead = ahead;
+
+    uint32_t literals = position - anchor;
+    uint32_t matchLength = match.Length ? match.Length - LZ4_MIN_MATCH : 0;
+    packer->Output[packer->Length++] = (uint8_t) ((literals < 15 ? literals : 15) << 4
+                                                  | (matchLength < 15 ? matchLength : 15));
+    if (literals >= 15)
+        packLength(packer, literals - 15);
+    memcpy(packer->Output + packer->Length, packer->Input + anchor, literals);
+    packer->Length += literals;
+
+    if (!match.Length)
+        return;
+    packer->Output[packer->Length++] = (uint8_t) match.Offset;
+    packer->Output[packer->Length++] = (uint8_t) (match.Offset >> 8);
+    if (matchLength >= 15)
+        packLength(packer, matchLength - 15);
+}
+
+// Packs a kernel
+// Parameters:
+//   input - Kernel
+//   size - Size of the kernel in bytes
+//   sizeOut - Receives the size of the packed kernel
+// Returns: the packed kernel with its header (to be freed), NULL if out of memory
+uint8_t* packKernel(const uint8_t* input, uint32_t size, size_t* sizeOut)
+{
+    Packer packer;
+    memset(&packer, 0, sizeof(packer));
+    packer.Input = input;
+    packer.Size = size;
+    packer.Head = malloc(sizeof(int32_t) << LZ4_HASH_BITS);
+    packer.Previous = malloc(sizeof(int32_t) * (LZ4_MAX_OFFSET + 1));
+    uint8_t* packed = malloc(PACKED_HEADER_SIZE + size + size / 255 + 16);  // Worst case: literals only
+    if (!packer.Head || !packer.Previous || !packed)
+    {
+        free(packer.Head);
+        free(packer.Previous);
+        free(packed);
+        return NULL;
+    }
+    memset(packer.Head, 0xFF, sizeof(int32_t) << LZ4_HASH_BITS);
+    packer.Output = packed + PACKED_HEADER_SIZE;
+
+    // Greedy parsing with one step of lazy matching: a longer match at the
+    // next position is worth a literal
+    uint32_t anchor = 0, position = 0;
+    while (size >= LZ4_MATCH_LIMIT && position <= size - LZ4_MATCH_LIMIT)
+    {
+        PackMatch match = packFindMatch(&packer, position);
+        if (!match.Length)
+        {
+            position++;
+            continue;
+        }
+        while (position + 1 <= size - LZ4_MATCH_LIMIT)
+        {
+            PackMatch next = packFindMatch(&packer, position + 1);
+            if (next.Length <= match.Length)
+                break;
+            position++;
+            match = next;
+        }
+
+        packSequence(&packer, anchor, position, match);
+        position += match.Length;
+        anchor = position;
+    }
+    packSequence(&packer, anchor, size, (PackMatch) { 0, 0 });
+    free(packer.Head);
+    free(packer.Previous);
+
+    // The block ends at size + margin once moved, which keeps every sequence
+    // start behind the output (the end itself gives margin >= 0) and puts
+    // the moved block at least above the header, so stage2 only moves it up
+    int64_t ahead = (int64_t) size - (int64_t) packer.Length;
+    if (ahead > packer.Ahead)
+        packer.Ahead = ahead;
+    if (packer.Ahead < PACKED_HEADER_SIZE)
+        packer.Ahead = PACKED_HEADER_SIZE;
+    uint32_t margin = (uint32_t) (packer.Ahead - ahead);
+
+    memcpy(packed, PACKED_MAGIC, 4);
+    packWrite32(packed + 4, size);
+    packWrite32(packed + 8, margin);
+    packWrite32(packed + 12, fatHashName(input, size));
+    *sizeOut = PACKED_HEADER_SIZE + packer.Length;
+    return packed;
+}
+
+// Tells whether a file is a packed kernel
+bool isPackedKernel(const uint8_t* data, size_t size)
+{
+    return size >= PACKED_HEADER_SIZE && memcmp(data, PACKED_MAGIC, 4) == 0;
+}
+
+// Unpacks a packed kernel the way stage2 does: in one buffer standing for
+// the memory from 1MB on, the block is moved up to end at the unpacked size
+// plus the margin and decoded to offset 0. Every sequence is checked, as
+// well as that no output byte overwrites the block before it was read
+// Parameters:
+//   packed - Packed kernel with its header
+//   size - Size of the packed kernel in bytes
+//   sizeOut - Receives the size of the unpacked kernel
+// Returns: the unpacked kernel (to be freed), NULL if it is damaged or
+//          cannot be unpacked in place (the reason is printed)
+uint8_t* unpackKernel(const uint8_t* packed, size_t size, uint32_t* sizeOut)
+{
+    uint32_t unpackedSize = packRead32(packed + 4);
+    uint32_t margin = packRead32(packed + 8);
+    uint64_t blockSize = size - PACKED_HEADER_SIZE;
+    uint64_t blockEnd = (uint64_t) unpackedSize + margin;
+    if (blockEnd > PACKED_MAX_SIZE - PACKED_MOVE_SLACK || size > PACKED_MAX_SIZE)
+    {
+        fprintf(stderr, "Packed kernel does not fit below 16MB once unpacked!\n");
+        return NULL;
+    }
+    if (blockEnd < blockSize + PACKED_HEADER_SIZE)
+    {
+        fprintf(stderr, "Packed kernel margin %u too small to move its block up!\n", margin);
+        return NULL;
+    }
+
+    uint8_t* memory = calloc(1, blockEnd + PACKED_MOVE_SLACK);
+    if (!memory)
+        return NULL;
+    memcpy(memory, packed, size);
+    uint64_t input = blockEnd - blockSize, output = 0;
+    memmove(memory + input, memory + PACKED_HEADER_SIZE, blockSize);
+
+    const char* error = NULL;
+    while (!error)
+    {
+        if (output > input)
+        {
+            error = "unpacked data overwrites the block before it is read";
+            break;
+        }
+        if (input >= blockEnd)
+        {
+            error = "block ends without its last literals";
+            break;
+        }
+
+        // Literals
+        uint8_t token = memory[input++];
+        uint64_t literals = token >> 4;
+        uint8_t extension = 255;
+        while (literals >= 15 && extension == 255 && input < blockEnd)
+            literals += extension = memory[input++];
+        if (literals > blockEnd - input || literals > unpackedSize - output)
+        {
+            error = "literals past the end";
+            break;
+        }
+        memmove(memory + output, memory + input, literals);
+        output += literals;
+        input += literals;
+        if (input == blockEnd)
+            break;
+
+        // Match
+        if (blockEnd - input < 2)
+        {
+            error = "match offset past the end";
+            break;
+        }
+        uint32_t offset = memory[input] | memory[input + 1] << 8;
+        input += 2;
+        uint64_t length = (token & 15) + LZ4_MIN_MATCH;
+        extension = 255;
+        while ((token & 15) == 15 && extension == 255 && input < blockEnd)
+            length += extension = memory[input++];
+        if (offset == 0 || offset > output)
+            error = "match before the start of the kernel";
+        else if (length > unpackedSize - output)
+            error = "match past the end";
+        else
+        {
+            for (uint64_t i = 0; i < length; i++, output++)
+                memory[output] = memory[output - offset];  // Byte by byte like rep movsb
+        }
+    }
+
+    if (!error && output != unpackedSize)
+        error = "unpacked size does not match the header";
+    if (!error && fatHashName(memory, unpackedSize) != packRead32(packed + 12))
+        error = "hash of the unpacked kernel does not match the header";
+    if (error)
+    {
+        fprintf(stderr, "Packed kernel is damaged: %s!\n", error);
+        free(memory);
+        return NULL;
+    }
+
+    *sizeOut = unpackedSize;
+    return memory;                     // The unpacked kernel is at its start
+}
+
+// Prints the sizes of a packed kernel
+static void printPackedKernel(const char* name, uint32_t unpackedSize, size_t packedSize, uint32_t margin)
+{
+    printf("%s: %u bytes packed to %zu (%.1f%%, %u sectors instead of %u), unpacked in place with a margin of %u bytes\n",
+           name, unpackedSize, packedSize, unpackedSize ? 100.0 * (double) packedSize / unpackedSize : 100.0,
+           (uint32_t) ((packedSize + 511) / 512), (unpackedSize + 511) / 512, margin);
+}
+
+// Packs a kernel file for stage2 and verifies the result before writing it
+// Parameters:
+//   inputPath - Kernel to pack (kernel.bin)
+//   outputPath - File receiving the packed kernel
+// Returns: 0 if successful, negative error code otherwise
+int packKernelFile(const char* inputPath, const char* outputPath)
+{
+    int fd = open(inputPath, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > PACKED_MAX_SIZE)
+    {
+        fprintf(stderr, "Cannot read kernel %s!\n", inputPath);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    uint32_t size = (uint32_t) st.st_size;
+    uint8_t* kernel = malloc(size + 1);
+    bool ok = kernel && pread(fd, kernel, size, 0) == (ssize_t) size;
+    close(fd);
+    if (!ok || isPackedKernel(kernel, size))
+    {
+        fprintf(stderr, ok ? "%s is packed already!\n" : "Cannot read kernel %s!\n", inputPath);
+        free(kernel);
+        return -1;
+    }
+
+    size_t packedSize;
+    uint8_t* packed = packKernel(kernel, size, &packedSize);
+    if (!packed)
+    {
+        free(kernel);
+        return -2;
+    }
+
+    uint32_t unpackedSize;
+    uint8_t* unpacked = unpackKernel(packed, packedSize, &unpackedSize);
+    ok = unpacked && unpackedSize == size && memcmp(unpacked, kernel, size) == 0;
+    free(unpacked);
+    free(kernel);
+    if (!ok)
+    {
+        fprintf(stderr, "Packed kernel does not unpack to %s!\n", inputPath);
+        free(packed);
+        return -3;
     }
 
-    // Search for requested file in root directory
-    DirectoryEntry* fileEntry = findFile(argv[2]);
-    if (!fileEntry) {
-        fprintf(stderr, "Could not find file %s!\n", argv[2]);
-        free(g_Fat);
-        free(g_RootDirectory);
+    fd = open(outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = fd >= 0 && writeAll(fd, packed, packedSize);
+    if (fd >= 0 && close(fd) != 0)
+        ok = false;
+    if (!ok)
+        fprintf(stderr, "Cannot write packed kernel %s!\n", outputPath);
+    else
+        printPackedKernel(outputPath, size, packedSize, packRead32(packed + 8));
+    free(packed);
+    return ok ? 0 : -4;
+}
+
+// Verifies a file of the image that stage2 may unpack (KERNEL.BIN)
+// Parameters:
+//   disk - Disk handle of the disk image
+//   name - Path of the file
+// Returns: 0 if the file is a valid packed kernel or not packed at all,
+//          -5 if it cannot be found or read, -8 if it cannot be unpacked
+int verifyFile(Disk* disk, const char* name)
+{
+    DirectoryEntry* fileEntry = findPath(disk, name);
+    uint8_t* data = fileEntry && fatIsFileEntry(fileEntry) ? malloc(fileEntry->Size + 1u) : NULL;
+    if (!data || !readFile(fileEntry, disk, data)) {
+        fprintf(stderr, "Could not read file %s!\n", name);
+        free(data);
         return -5;
     }
 
-    // Allocate buffer for file content (with extra sector for safety)
-    uint8_t* buffer = (uint8_t*) malloc(fileEntry->Size + g_BootSector.BytesPerSector);
-    if (!readFile(fileEntry, disk, buffer)) {
-        fprintf(stderr, "Could not read file %s!\n", argv[2]);
-        free(g_Fat);
-        free(g_RootDirectory);
-        free(buffer);
+    if (!isPackedKernel(data, fileEntry->Size)) {
+        printf("%s: %u bytes, not packed\n", name, fileEntry->Size);
+        free(data);
+        return 0;
+    }
+
+    uint32_t unpackedSize;
+    uint8_t* unpacked = unpackKernel(data, fileEntry->Size, &unpackedSize);
+    bool ok = unpacked != NULL;
+    if (ok)
+        printPackedKernel(name, unpackedSize, fileEntry->Size, packRead32(data + 8));
+    free(unpacked);
+    free(data);
+    return ok ? 0 : -8;
+}
+
+// =============================================================================
+// FILESYSTEM CHECK
+// =============================================================================
+//
+// fat <image> --check walks every directory and claims the cluster chain of
+// each file and directory. The volume is consistent when every chain ends
+// properly, holds as many clusters as its file size needs, shares none of
+// them with another chain, and every allocated cluster is claimed (bad
+// cluster marks aside). Problems are reported, never repaired
+
+typedef struct
+{
+    uint8_t* Owned;                    // One byte per cluster, set once a chain claimed it
+    uint32_t Problems;                 // Number of problems found
+    uint32_t Files;                    // Number of files checked
+    uint32_t Directories;              // Number of directories checked (root included)
+
+} CheckState;
+
+// Claims the clusters of a chain
+// Parameters:
+//   state - State of the check
+//   path - Path of the file or directory, for the report
+//   firstCluster - First cluster of the chain (0 for an empty file)
+//   clustersOut - Receives the number of clusters claimed
+// Returns: true if the chain is valid, false if it was reported
+bool checkChain(CheckState* state, const char* path, uint32_t firstCluster, uint32_t* clustersOut)
+{
+    *clustersOut = 0;
+    for (uint32_t cluster = firstCluster; cluster != 0 && cluster != CLUSTER_END; )
+    {
+        if (cluster < 2 || cluster >= g_Layout.ClusterCount || g_ClusterTable[cluster] == 0)
+        {
+            fprintf(stderr, "%s: chain reaches free or invalid cluster %u\n", path, cluster);
+            state->Problems++;
+            return false;
+        }
+        // A loop in the chain comes back to a cluster it claimed itself
+        if (state->Owned[cluster])
+        {
+            fprintf(stderr, "%s: cluster %u is cross-linked\n", path, cluster);
+            state->Problems++;
+            return false;
+        }
+        state->Owned[cluster] = 1;
+        (*clustersOut)++;
+        cluster = g_ClusterTable[cluster];
+    }
+    return true;
+}
+
+// Checks the entries of a directory and its subdirectories
+// Parameters:
+//   disk - Disk handle of the disk image
+//   state - State of the check
+//   directory - Directory to check, its own chain already claimed
+//   path - Path of the directory, for the report
+void checkDirectory(Disk* disk, CheckState* state, Directory* directory, const char* path)
+{
+    uint64_t clusterSize = (uint64_t) g_BootSector.SectorsPerCluster * g_BootSector.BytesPerSector;
+    state->Directories++;
+
+    for (uint32_t i = 0; i < directory->EntryCount; i++)
+    {
+        DirectoryEntry* entry = &directory->Entries[i];
+        char name[13];
+        char entryPath[4096];
+        if (entry->Name[0] == 0x00)
+            break;
+        if (entry->Name[0] == 0xE5 || entry->Name[0] == '.' || entry->Attributes == ATTRIBUTE_LFN
+            || (entry->Attributes & ATTRIBUTE_VOLUME_ID))
+            continue;
+
+        fatDisplayName(entry, name);
+        snprintf(entryPath, sizeof(entryPath), "%s%s%s", path, strcmp(path, "/") ? "/" : "", name);
+        uint32_t firstCluster = getFirstCluster(entry);
+        uint32_t clusters;
+        bool valid = checkChain(state, entryPath, firstCluster, &clusters);
+        if (entry->Attributes & ATTRIBUTE_DIRECTORY)
+        {
+            // Only a chain claimed here is read, so a directory linked twice is not walked twice
+            Directory* subDirectory = valid && clusters > 0 ? openDirectory(disk, firstCluster) : NULL;
+            if (subDirectory)
+                checkDirectory(disk, state, subDirectory, entryPath);
+            else if (valid)
+            {
+                fprintf(stderr, "%s: cannot read directory\n", entryPath);
+                state->Problems++;
+            }
+            continue;
+        }
+
+        state->Files++;
+        uint64_t expected = (entry->Size + clusterSize - 1) / clusterSize;
+        if (valid && clusters != expected)
+        {
+            fprintf(stderr, "%s: %u bytes in %u clusters\n", entryPath, entry->Size, clusters);
+            state->Problems++;
+        }
+    }
+}
+
+// Checks the consistency of the FAT and the directories
+// Parameters:
+//   disk - Disk handle of the disk image
+// Returns: 0 if the volume is consistent, -9 if problems were found
+int checkFilesystem(Disk* disk)
+{
+    CheckState state;
+    uint32_t clusters;
+    memset(&state, 0, sizeof(state));
+    state.Owned = (uint8_t*) calloc(g_Layout.ClusterCount, 1);
+    if (!state.Owned)
+        return -9;
+
+    if (g_Layout.FatType != 32 || checkChain(&state, "/", g_BootSector.RootCluster, &clusters))
+        checkDirectory(disk, &state, &g_Root, "/");
+
+    // Allocated clusters no chain claimed, bad cluster marks aside
+    uint32_t bad = getEndOfChainMarker() - 8;
+    uint32_t used = 0;
+    uint32_t lost = 0;
+    for (uint32_t cluster = 2; cluster < g_Layout.ClusterCount; cluster++)
+    {
+        used += state.Owned[cluster];
+        if (g_ClusterTable[cluster] != 0 && !state.Owned[cluster] && getFatEntry(g_Fat, cluster) != bad)
+            lost++;
+    }
+    if (lost > 0)
+    {
+        fprintf(stderr, "%u lost clusters are allocated but not part of any file\n", lost);
+        state.Problems++;
+    }
+    free(state.Owned);
+
+    printf("%u files, %u directories, %u of %u clusters used, %u problems\n", state.Files, state.Directories,
+           used, g_Layout.ClusterCount - 2, state.Problems);
+    return state.Problems ? -9 : 0;
+}
+
+// =============================================================================
+// MAIN PROGRAM
+// =============================================================================
+
+// Releases all filesystem structures and closes the disk image
+// Parameters:
+//   disk - Disk handle of the disk image
+void closeFilesystem(Disk* disk)
+{
+    free(g_ClusterTable);
+    free(g_FreeBitmap);
+    freeDirectoryCache(disk);
+    freeDirectoryIndex(&g_Root.Index);
+    releaseSectors(disk, g_RootDirectory);
+    releaseSectors(disk, g_Fat);
+    freeUndoLog();
+    g_ClusterTable = NULL;
+    g_FreeBitmap = NULL;
+    g_RootDirectory = NULL;
+    g_Fat = NULL;
+    diskClose(disk);
+}
+
+// Displays the contents of one file
+// Printable characters are shown as-is, non-printable as hex codes,
+// or in raw mode the file is written to stdout unchanged
+// Parameters:
+//   disk - Disk handle of the disk image
+//   name - Path of the file ("/" separated 8.3 or "name.ext" components)
+//   raw - Write the file contents without escaping
+// Returns: 0 if successful, -5 if the file cannot be found or read, -6 if output fails
+int displayFile(Disk* disk, const char* name, bool raw)
+{
+    // Search for requested file
+    DirectoryEntry* fileEntry = findPath(disk, name);
+    if (!fileEntry || !fatIsFileEntry(fileEntry)) {
+        fprintf(stderr, "Could not find file %s!\n", name);
+        return -5;
+    }
+
+    // Raw mode: clusters go straight to stdout
+    if (raw) {
+        if (!writeRawFile(fileEntry, disk, STDOUT_FILENO)) {
+            fprintf(stderr, "Could not read file %s!\n", name);
+            return -5;
+        }
+        return 0;
+    }
+
+    // Display file content through a buffered writer
+    OutputWriter* writer = (OutputWriter*) malloc(sizeof(OutputWriter));
+    uint8_t scratch[32 * 1024];
+    if (!writer)
+        return -6;
+
+    writerInit(writer, STDOUT_FILENO);
+    bool ok = streamFile(fileEntry, disk, scratch, sizeof(scratch), writeEscapedChunk, writer);
+    writerPut(writer, (const uint8_t*) "\n", 1);
+    bool written = writerFlush(writer);
+    free(writer);
+
+    if (!ok) {
+        fprintf(stderr, "Could not read file %s!\n", name);
+        return -5;
+    }
+    return written ? 0 : -6;
+}
+
+// Lists the files of a directory
+// Parameters:
+//   disk - Disk handle of the disk image
+//   path - Path of the directory ("/" for the root directory)
+//   recursive - List all subdirectories as well
+// Returns: 0 if successful, -5 if the directory cannot be found or read
+int listFiles(Disk* disk, const char* path, bool recursive)
+{
+    Directory* directory = findDirectory(disk, path, strlen(path));
+    if (!directory) {
+        fprintf(stderr, "Could not find directory %s!\n", path);
         return -5;
     }
 
-    // Display file content
-    // Printable characters are shown as-is, non-printable as hex codes
-    for (size_t i = 0; i < fileEntry->Size; i++)
+    return listDirectory(disk, directory, path, recursive) ? 0 : -5;
+}
+
+// Reads the boot sector for a new or updated image
+// The boot sector is used as-is, like dd of a bootloader over a formatted image
+// Parameters:
+//   bootPath - File holding the boot sector, NULL for the default 1.44MB FAT12 floppy
+//   label - Volume label to store in the default boot sector, may be NULL
+//   bootSectorOut - Buffer of 4096 bytes receiving the boot sector
+// Returns: true if successful, false otherwise
+bool loadBootSector(const char* bootPath, const char* label, uint8_t* bootSectorOut)
+{
+    memset(bootSectorOut, 0, 4096);
+    if (bootPath)
+    {
+        FILE* bootFile = fopen(bootPath, "rb");
+        size_t read = bootFile ? fread(bootSectorOut, 1, 4096, bootFile) : 0;
+        if (bootFile)
+            fclose(bootFile);
+        if (read < 512)
+        {
+            fprintf(stderr, "Cannot read boot sector %s!\n", bootPath);
+            return false;
+        }
+    }
+    else
+    {
+        buildDefaultBootSector(bootSectorOut);
+        if (label)
+        {
+            BootSector* boot = (BootSector*) bootSectorOut;
+            memset(boot->VolumeLabel, ' ', 11);
+            for (size_t i = 0; i < strlen(label) && i < 11; i++)
+                boot->VolumeLabel[i] = toupper((unsigned char) label[i]);
+        }
+    }
+
+    memcpy(&g_BootSector, bootSectorOut, sizeof(g_BootSector));
+    if (!readVolumeLayout() || g_BootSector.BytesPerSector > 4096)
+    {
+        fprintf(stderr, "Invalid boot sector!\n");
+        return false;
+    }
+    return true;
+}
+
+// Checks whether an existing image can be updated in place
+// Parameters:
+//   path - Path to the disk image
+//   bootSector - Boot sector the image should use, NULL to accept any valid volume
+// Returns: true if the image exists, holds a valid volume and, if a boot
+//          sector is given, has the same geometry, false if it must be formatted
+bool canUpdateImage(const char* path, const uint8_t* bootSector)
+{
+    BootSector wanted;
+    Disk disk;
+    if (bootSector)
+        memcpy(&wanted, bootSector, sizeof(wanted));
+    if (access(path, F_OK) != 0 || !diskOpen(&disk, path))
+        return false;
+
+    // Everything from BytesPerSector up to LargeSectorCount, plus the FAT32 layout fields
+    bool ok = readBootSector(&disk) && readVolumeLayout();
+    size_t end = g_Layout.FatType == 32 ? offsetof(BootSector, _Reserved32) : offsetof(BootSector, DriveNumber);
+    size_t start = offsetof(BootSector, BytesPerSector);
+    if (ok && bootSector)
+        ok = memcmp((uint8_t*) &g_BootSector + start, (uint8_t*) &wanted + start, end - start) == 0;
+    diskClose(&disk);
+    return ok;
+}
+
+// Splits a file argument of writeImage into host path and name in the image
+// Parameters:
+//   file - "path" or "path=NAME.EXT"
+//   hostPath - Buffer for the host path
+//   size - Size of the buffer
+// Returns: Name of the file in the image, inside file
+const char* splitFileArgument(const char* file, char* hostPath, size_t size)
+{
+    // "path=NAME.EXT" names the file explicitly, otherwise the host file name is used
+    const char* separator = strrchr(file, '=');
+    const char* name = separator ? separator + 1 : file;
+    size_t length = separator ? (size_t) (separator - file) : strlen(file);
+    if (length >= size)
+        length = size - 1;
+    memcpy(hostPath, file, length);
+    hostPath[length] = '\0';
+    if (!separator && strrchr(name, '/'))
+        name = strrchr(name, '/') + 1;
+    return name;
+}
+
+// Checks that every file of writeImage can be added before any is, so that
+// only an I/O error can stop the update halfway (and then nothing is flushed)
+// Parameters:
+//   files - Files to add ("path" or "path=NAME.EXT")
+//   fileCount - Number of files
+//   update - Compare with the files already in the image and keep what did not change
+// Returns: true if all files fit, false otherwise
+bool checkFiles(char** files, int fileCount, bool update)
+{
+    char (*names)[11] = (char (*)[11]) malloc((size_t) fileCount * 11 + 1);
+    uint64_t clusters = 0;
+    uint32_t newEntries = 0;
+    bool ok = names != NULL;
+    for (int i = 0; ok && i < fileCount; i++)
+    {
+        char hostPath[4096];
+        const char* name = splitFileArgument(files[i], hostPath, sizeof(hostPath));
+        if (!fatToName(name, strlen(name), names[i]))
+        {
+            fprintf(stderr, "Invalid 8.3 file name %s!\n", name);
+            ok = false;
+            break;
+        }
+        for (int j = 0; j < i; j++)
+            if (memcmp(names[j], names[i], 11) == 0)
+            {
+                fprintf(stderr, "%s is added twice!\n", name);
+                ok = false;
+            }
+
+        int fd = open(hostPath, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t) st.st_size > UINT32_MAX)
+        {
+            fprintf(stderr, "Cannot read file %s!\n", hostPath);
+            ok = false;
+        }
+        if (fd >= 0)
+            close(fd);
+        if (!ok)
+            break;
+
+        DirectoryEntry* entry = findFile(names[i]);
+        if (entry && !fatIsFileEntry(entry))
+        {
+            fprintf(stderr, "%s exists and is not a file!\n", name);
+            ok = false;
+            break;
+        }
+
+        bool keepChain;
+        uint32_t fileClusters = planFileClusters(entry, (uint64_t) st.st_size, update, &keepChain);
+        if (!keepChain)
+            clusters += fileClusters;
+        if (!entry)
+            newEntries++;
+    }
+    free(names);
+    if (!ok)
+        return false;
+
+    // New entries past the free ones of the root directory: FAT32 grows it by clusters
+    uint32_t freeEntries = 0;
+    for (uint32_t i = g_RootFreeSearchStart; i < g_Root.EntryCount; i++)
+        if (g_Root.Entries[i].Name[0] == 0x00 || g_Root.Entries[i].Name[0] == 0xE5)
+            freeEntries++;
+    if (newEntries > freeEntries)
+    {
+        if (g_Layout.FatType != 32)
+        {
+            fprintf(stderr, "Root directory is full, cannot add %u files!\n", newEntries);
+            return false;
+        }
+        uint32_t entriesPerCluster = g_BootSector.SectorsPerCluster * g_BootSector.BytesPerSector / sizeof(DirectoryEntry);
+        clusters += (newEntries - freeEntries + entriesPerCluster - 1) / entriesPerCluster;
+    }
+
+    if (clusters > g_FreeClusterCount)
+    {
+        fprintf(stderr, "Disk full, the files need %llu clusters, %u are free!\n",
+                (unsigned long long) clusters, g_FreeClusterCount);
+        return false;
+    }
+    return true;
+}
+
+// Creates or updates a disk image and adds files to it
+// An image updated in place is left as it was, contents and modification
+// time, unless every file was added: every file is checked first, the boot
+// sector, the FAT and the directory are written at the end, and whatever the
+// run overwrote (data rewritten over a kept chain) is restored if an I/O
+// error stops it (see undoWrites)
+// Parameters:
+//   path - Path to the disk image
+//   format - Create a new, empty filesystem instead of opening an existing one
+//   update - Update the image in place, writing only what changed; the image is
+//            formatted if it does not exist yet or its geometry differs from the boot sector
+//   bootPath - Boot sector for the filesystem (its BPB sets the geometry),
+//              NULL for a 1.44MB FAT12 floppy
+//   label - Volume label to set, NULL to keep the current one
+//   files - Files to add ("path" or "path=NAME.EXT")
+//   fileCount - Number of files
+// Returns: 0 if successful, negative error code otherwise
+int writeImage(const char* path, bool format, bool update, const char* bootPath, const char* label,
+               char** files, int fileCount)
+{
+    Disk disk;
+    uint8_t bootSector[4096];
+    uint64_t createSize = 0;
+    bool bootChanged = false;
+    memset(&disk, 0, sizeof(disk));
+
+    // An update formats the image only if it cannot be reused
+    if ((format || update) && !loadBootSector(bootPath, label, bootSector))
+        return -2;
+    if (update)
+        format = !canUpdateImage(path, bootPath ? bootSector : NULL);
+    if (format)
+    {
+        memcpy(&g_BootSector, bootSector, sizeof(g_BootSector));
+        uint32_t totalSectors = g_BootSector.TotalSectors ? g_BootSector.TotalSectors : g_BootSector.LargeSectorCount;
+        createSize = (uint64_t) totalSectors * g_BootSector.BytesPerSector;
+    }
+
+    // Open (or create) the disk image for writing, then write the boot sector
+    // of a new filesystem (an update writes it at the end, if it changed)
+    uint32_t bootSize = format || update ? ((BootSector*) bootSector)->BytesPerSector : 0;
+    if (!diskOpenWritable(&disk, path, createSize)
+        || (format && !updateAt(&disk, 0, bootSize, bootSector, false, &bootChanged))) {
+        fprintf(stderr, "Cannot open disk image %s for writing!\n", path);
+        diskClose(&disk);
+        return -1;
+    }
+
+    // From here on, an update in place records what it overwrites
+    struct stat imageStat;
+    bool undo = update && !format && fstat(fileno(disk.File), &imageStat) == 0;
+    g_UndoLog.Enabled = undo;
+
+    // Load the filesystem like the read modes, then build the free cluster bitmap
+    if (!readBootSector(&disk) || !readVolumeLayout()) {
+        fprintf(stderr, "Could not read boot sector!\n");
+        closeFilesystem(&disk);
+        return -2;
+    }
+    if (!readFat(&disk) || (format && !formatVolume(&disk, bootSector))
+        || !buildClusterTable() || !buildFreeBitmap()) {
+        fprintf(stderr, "Could not read FAT!\n");
+        closeFilesystem(&disk);
+        return -3;
+    }
+    if (!readRootDirectory(&disk) || !initRootDirectory()) {
+        fprintf(stderr, "Could not read root directory!\n");
+        closeFilesystem(&disk);
+        return -4;
+    }
+
+    bool ok = !label || setVolumeLabel(label);
+    if (!ok)
+        fprintf(stderr, "Invalid volume label %s!\n", label);
+    ok = ok && checkFiles(files, fileCount, update && !format);
+
+    for (int i = 0; ok && i < fileCount; i++)
+    {
+        char hostPath[4096];
+        const char* name = splitFileArgument(files[i], hostPath, sizeof(hostPath));
+        ok = addFile(&disk, hostPath, name, update && !format);
+    }
+
+    // The FAT and the root directory are written once for all files, then the
+    // bootloader of an updated image (same geometry, see canUpdateImage)
+    if (ok && (!flushFilesystem(&disk)
+               || (update && !format && bootPath && !updateAt(&disk, 0, bootSize, bootSector, true, &bootChanged)))) {
+        fprintf(stderr, "Could not write filesystem to %s!\n", path);
+        ok = false;
+    }
+
+    // An update that found nothing to change still brings the image up to date,
+    // so that make does not run it again; a failed one puts back the image and
+    // its time stamps, so that make runs it again
+    if (ok && update)
+        futimens(fileno(disk.File), NULL);
+    if (!ok && undo)
     {
-        if (isprint(buffer[i])) 
-            fputc(buffer[i], stdout);  // Print printable characters
-        else 
-            printf("<%02x>", buffer[i]);  // Show hex code for non-printable
+        struct timespec times[2] = { imageStat.st_atim, imageStat.st_mtim };
+        if (!undoWrites(&disk) || futimens(fileno(disk.File), times) != 0)
+            fprintf(stderr, "Could not restore disk image %s!\n", path);
+    }
+
+    closeFilesystem(&disk);
+    return ok ? 0 : -7;
+}
+
+// FAT_TOOL_NO_MAIN leaves out the entry point, so that the tool can be compiled
+// into other programs such as the benchmark (bench_fat.c)
+#ifndef FAT_TOOL_NO_MAIN
+
+int main(int argc, char** argv)
+{
+    // Packing works on host files, there is no disk image
+    if (argc >= 2 && strcmp(argv[1], "--pack") == 0) {
+        if (argc != 4) {
+            printf("Syntax: %s --pack <kernel> <packed kernel>\n", argv[0]);
+            return -1;
+        }
+        return packKernelFile(argv[2], argv[3]);
+    }
+
+    // Check command line arguments
+    bool extract = argc >= 3 && strcmp(argv[2], "-x") == 0;
+    bool raw = argc >= 4 && strcmp(argv[2], "--raw") == 0;
+    bool list = argc >= 3 && strcmp(argv[2], "--ls") == 0;
+    bool verify = argc == 4 && strcmp(argv[2], "--verify") == 0;
+    bool check = argc == 3 && strcmp(argv[2], "--check") == 0;
+    bool recursive = list && argc >= 4 && strcmp(argv[3], "-R") == 0;
+    const char* listPath = argc > 3 + recursive ? argv[3 + recursive] : "/";
+    int firstPattern = 4;
+    int threadCount = 1;
+    if (extract && argc >= 6 && strcmp(argv[4], "-j") == 0) {
+        threadCount = atoi(argv[5]);
+        firstPattern = 6;
+    }
+
+    // Write mode: format and label options, then the files to add
+    bool write = argc >= 3 && (strcmp(argv[2], "--format") == 0 || strcmp(argv[2], "--update") == 0
+                               || strcmp(argv[2], "--label") == 0 || strcmp(argv[2], "--add") == 0);
+    bool format = false;
+    bool update = false;
+    const char* bootPath = NULL;
+    const char* label = NULL;
+    int firstFile = argc;
+    bool writeSyntax = true;
+    for (int i = 2; write && i < argc; i++) {
+        if (strcmp(argv[i], "--add") == 0) {
+            firstFile = i + 1;
+            break;
+        }
+        if (strcmp(argv[i], "--format") == 0)
+            format = true;
+        else if (strcmp(argv[i], "--update") == 0)
+            update = true;
+        else if (strcmp(argv[i], "--boot") == 0 && i + 1 < argc)
+            bootPath = argv[++i];
+        else if (strcmp(argv[i], "--label") == 0 && i + 1 < argc)
+            label = argv[++i];
+        else
+            writeSyntax = false;
+    }
+
+    bool all = extract && argc == firstPattern + 1 && strcmp(argv[firstPattern], "--all") == 0;
+    if (argc < 3 || (extract && argc <= firstPattern) || threadCount < 1 || (list && argc > 4 + recursive)
+        || (!verify && strcmp(argv[2], "--verify") == 0) || (!check && strcmp(argv[2], "--check") == 0)
+        || (write && (!writeSyntax || (bootPath && !format && !update) || (format && update)))) {
+        printf("Syntax: %s <disk image> [--raw] <file path>\n", argv[0]);
+        printf("        %s <disk image> --ls [-R] [<directory>]\n", argv[0]);
+        printf("        %s <disk image> -x <output dir> [-j <threads>] (--all | <file name or pattern>...)\n", argv[0]);
+        printf("        %s <disk image> [--format | --update] [--boot <boot sector>] [--label <label>] [--add <file>[=<name>]...]\n", argv[0]);
+        printf("        %s <disk image> --verify <file path>\n", argv[0]);
+        printf("        %s <disk image> --check\n", argv[0]);
+        printf("        %s --pack <kernel> <packed kernel>\n", argv[0]);
+        return -1;
+    }
+
+    // Writing opens the image itself, it may not exist yet
+    if (write)
+        return writeImage(argv[1], format, update, bootPath, label, argv + firstFile, argc - firstFile);
+
+    // Open disk image file
+    Disk disk;
+    if (!diskOpen(&disk, argv[1])) {
+        fprintf(stderr, "Cannot open disk image %s!\n", argv[1]);
+        diskClose(&disk);
+        return -1;
+    }
+
+    // Read boot sector (first step in reading the filesystem) and detect the FAT type
+    if (!readBootSector(&disk) || !readVolumeLayout()) {
+        fprintf(stderr, "Could not read boot sector!\n");
+        closeFilesystem(&disk);
+        return -2;
+    }
+
+    // Read FAT table and decode it into the cluster table
+    if (!readFat(&disk) || !buildClusterTable()) {
+        fprintf(stderr, "Could not read FAT!\n");
+        closeFilesystem(&disk);
+        return -3;
+    }
+
+    // Read root directory and index it for constant time lookups
+    if (!readRootDirectory(&disk)
+        || !initRootDirectory()) {
+        fprintf(stderr, "Could not read root directory!\n");
+        closeFilesystem(&disk);
+        return -4;
     }
-    printf("\n");
+
+    // Everything is loaded once, then either display one file, list directories, extract many files,
+    // verify a packed kernel or check the whole volume
+    int result = extract ? extractFiles(&disk, argv[3], argv + firstPattern, argc - firstPattern, all, threadCount)
+               : list    ? listFiles(&disk, listPath, recursive)
+               : verify  ? verifyFile(&disk, argv[3])
+               : check   ? checkFilesystem(&disk)
+                         : displayFile(&disk, argv[raw ? 3 : 2], raw);
 
     // Clean up allocated memory
-    free(buffer);
-    free(g_Fat);
-    free(g_RootDirectory);
-    
-    return 0;
-}
\ No newline at end of file
+    closeFilesystem(&disk);
+    return result;
+}
+
+#endif
@@ -0,0 +1,811 @@
+// =============================================================================
+// KERNEL PROFILE VIEWER
+// =============================================================================
+//
+// This program reads the profile a -DPROFILE kernel dumps over the serial
+// port (see src/kernel/profile.h) from a capture of the serial log and
+// resolves its addresses with the symbols of kernel.elf. It reports the
+// samples per thread, the functions with the most samples and the counts
+// and durations of the tracepoints, and can write the samples as folded
+// stacks (the input of flamegraph.pl and speedscope) or as a flame graph
+// in SVG.
+//
+// Every sample becomes a stack "thread;outermost function;...;function of
+// the EIP". Return addresses are resolved one byte back, to the call
+// instruction, so a call at the very end of a function stays attributed to it
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// =============================================================================
+// DUMP FORMAT
+// =============================================================================
+
+#define PROFILE_MAGIC           "NBPROF01"      // Start of a dump
+#define PROFILE_END_MAGIC       "NBPROFEN"      // End of a dump, after its hash
+#define PROFILE_DEPTH           8               // Addresses per sample at most
+#define PROFILE_SAMPLE          0               // Record type of samples
+#define TRACE_END               0x80            // Type flag: ends a span
+#define MAX_TYPES               128
+
+// ELF definitions (32-bit little endian only, like the kernel)
+#define ELF_SHT_SYMTAB          2
+#define ELF_STT_FUNC            2
+#define ELF_STT_NOTYPE          0
+
+// =============================================================================
+// TYPE DEFINITIONS
+// =============================================================================
+
+// One record of the dump
+typedef struct
+{
+    uint64_t Timestamp;                // TSC
+    uint8_t Type;                      // Record type, with TRACE_END
+    uint8_t Count;                     // Entries of Data
+    uint16_t Thread;                   // ID of the running thread
+    uint32_t Cpu;
+    uint32_t Data[PROFILE_DEPTH];      // Samples: EIP, return addresses; tracepoints: argument
+
+} Record;
+
+// Whole dump after parsing
+typedef struct
+{
+    uint32_t TscKhz;                   // 0 if the TSC was not calibrated
+    uint32_t CpuCount;
+    uint32_t TypeCount;
+    char* TypeNames[MAX_TYPES];
+    uint32_t ThreadCount;
+    uint16_t* ThreadIds;
+    char** ThreadNames;
+    Record* Records;
+    size_t RecordCount;
+    uint64_t Lost;                     // Records overwritten in the rings
+
+} Profile;
+
+// Function symbol of the kernel
+typedef struct
+{
+    uint32_t Address;
+    uint32_t Size;
+    const char* Name;
+
+} Symbol;
+
+// Node of the call tree of the flame graph
+typedef struct Node
+{
+    const char* Name;
+    uint64_t Count;                    // Samples in this node and below
+    struct Node* Child;                // First child (most samples first after sorting)
+    struct Node* Sibling;
+
+} Node;
+
+// Bounds checked reader of the dump bytes
+typedef struct
+{
+    const uint8_t* Data;
+    size_t Size;
+    size_t Position;
+    bool Error;                        // Read past the end
+
+} Reader;
+
+static Symbol* g_Symbols;
+static size_t g_SymbolCount;
+
+// =============================================================================
+// FILES
+// =============================================================================
+
+// Reads a whole file into memory
+// Parameters:
+//   path - File to read
+//   sizeOut - Receives the size of the file
+// Returns: the contents (to be freed), NULL on an error
+static uint8_t* readFile(const char* path, size_t* sizeOut)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+
+    size_t size = 0, capacity = 0;
+    uint8_t* data = NULL;
+    for (;;)
+    {
+        if (size == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 1024 * 1024;
+            uint8_t* grown = realloc(data, capacity);
+            if (!grown)
+            {
+                free(data);
+                fclose(file);
+                return NULL;
+            }
+            data = grown;
+        }
+        size_t read = fread(data + size, 1, capacity - size, file);
+        if (read == 0)
+            break;
+        size += read;
+    }
+
+    bool ok = !ferror(file);
+    fclose(file);
+    if (!ok)
+    {
+        free(data);
+        return NULL;
+    }
+    *sizeOut = size;
+    return data;
+}
+
+// =============================================================================
+// DUMP PARSING
+// =============================================================================
+
+static const uint8_t* readBytes(Reader* reader, size_t size)
+{
+    if (reader->Error || reader->Size - reader->Position < size)
+    {
+        reader->Error = true;
+        return NULL;
+    }
+    const uint8_t* bytes = reader->Data + reader->Position;
+    reader->Position += size;
+    return bytes;
+}
+
+static uint32_t readWord(Reader* reader)
+{
+    const uint8_t* bytes = readBytes(reader, 4);
+    return bytes ? bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t) bytes[3] << 24 : 0;
+}
+
+static uint16_t readHalf(Reader* reader)
+{
+    const uint8_t* bytes = readBytes(reader, 2);
+    return bytes ? (uint16_t) (bytes[0] | bytes[1] << 8) : 0;
+}
+
+// Reads a name preceded by its length byte
+static char* readName(Reader* reader)
+{
+    const uint8_t* length = readBytes(reader, 1);
+    const uint8_t* bytes = length ? readBytes(reader, *length) : NULL;
+    if (!bytes)
+        return NULL;
+
+    char* name = malloc(*length + 1u);
+    memcpy(name, bytes, *length);
+    name[*length] = '\0';
+    return name;
+}
+
+// Finds the last dump in a serial capture (a capture may hold several boots)
+static const uint8_t* findDump(const uint8_t* data, size_t size)
+{
+    const uint8_t* found = NULL;
+    for (size_t i = 0; i + 8 <= size; i++)
+    {
+        if (memcmp(data + i, PROFILE_MAGIC, 8) == 0)
+            found = data + i;
+    }
+    return found;
+}
+
+// Parses the last dump of a serial capture
+// Parameters:
+//   data - Serial capture
+//   size - Size of the capture
+//   profile - Receives the dump
+// Returns: true if successful, false if there is no intact dump
+static bool parseDump(const uint8_t* data, size_t size, Profile* profile)
+{
+    const uint8_t* start = findDump(data, size);
+    if (!start)
+    {
+        fprintf(stderr, "No profile dump found (is the kernel built with -DPROFILE?)\n");
+        return false;
+    }
+
+    Reader reader = { start, size - (size_t) (start - data), 8, false };
+    memset(profile, 0, sizeof(*profile));
+    profile->TscKhz = readWord(&reader);
+    profile->CpuCount = readWord(&reader);
+
+    profile->TypeCount = readWord(&reader);
+    if (profile->TypeCount > MAX_TYPES)
+        reader.Error = true;
+    for (uint32_t i = 0; i < profile->TypeCount && !reader.Error; i++)
+        profile->TypeNames[i] = readName(&reader);
+
+    profile->ThreadCount = readWord(&reader);
+    if (profile->ThreadCount > 65536)
+        reader.Error = true;
+    profile->ThreadIds = calloc(profile->ThreadCount + 1, sizeof(uint16_t));
+    profile->ThreadNames = calloc(profile->ThreadCount + 1, sizeof(char*));
+    for (uint32_t i = 0; i < profile->ThreadCount && !reader.Error; i++)
+    {
+        profile->ThreadIds[i] = readHalf(&reader);
+        profile->ThreadNames[i] = readName(&reader);
+    }
+
+    size_t capacity = 0;
+    for (uint32_t cpu = 0; cpu < profile->CpuCount && !reader.Error; cpu++)
+    {
+        uint32_t count = readWord(&reader);
+        profile->Lost += readWord(&reader);
+        for (uint32_t n = 0; n < count && !reader.Error; n++)
+        {
+            if (profile->RecordCount == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 4096;
+                profile->Records = realloc(profile->Records, capacity * sizeof(Record));
+            }
+
+            Record* record = &profile->Records[profile->RecordCount];
+            uint32_t low = readWord(&reader);
+            record->Timestamp = (uint64_t) readWord(&reader) << 32 | low;
+            const uint8_t* header = readBytes(&reader, 2);
+            record->Thread = readHalf(&reader);
+            record->Cpu = cpu;
+            if (!header || header[1] == 0 || header[1] > PROFILE_DEPTH)
+            {
+                reader.Error = true;
+                break;
+            }
+            record->Type = header[0];
+            record->Count = header[1];
+            for (unsigned i = 0; i < record->Count; i++)
+                record->Data[i] = readWord(&reader);
+            profile->RecordCount++;
+        }
+    }
+
+    // FNV-1a of every byte before the hash
+    size_t hashed = reader.Position;
+    uint32_t expected = readWord(&reader);
+    const uint8_t* end = readBytes(&reader, 8);
+    if (reader.Error || !end || memcmp(end, PROFILE_END_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "Profile dump is truncated or damaged\n");
+        return false;
+    }
+
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < hashed; i++)
+        hash = (hash ^ start[i]) * 16777619u;
+    if (hash != expected)
+    {
+        fprintf(stderr, "Profile dump is damaged (hash %08x, expected %08x)\n", hash, expected);
+        return false;
+    }
+    return true;
+}
+
+// =============================================================================
+// SYMBOLS
+// =============================================================================
+
+static int compareSymbols(const void* a, const void* b)
+{
+    uint32_t x = ((const Symbol*) a)->Address, y = ((const Symbol*) b)->Address;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t elfWord(const uint8_t* p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint16_t elfHalf(const uint8_t* p)
+{
+    return (uint16_t) (p[0] | p[1] << 8);
+}
+
+// Loads the function symbols of a 32-bit ELF file (functions of the C
+// sources, labels of the assembly sources), sorted by address
+// Returns: true if successful, false if the file is no 32-bit ELF file with symbols
+static bool loadSymbols(const char* path)
+{
+    size_t size;
+    uint8_t* elf = readFile(path, &size);
+    if (!elf || size < 52 || memcmp(elf, "\x7F" "ELF", 4) != 0 || elf[4] != 1 || elf[5] != 1)
+    {
+        fprintf(stderr, "%s is not a 32-bit little endian ELF file\n", path);
+        return false;
+    }
+
+    uint32_t sectionOffset = elfWord(elf + 32);
+    uint16_t sectionSize = elfHalf(elf + 46);
+    uint16_t sectionCount = elfHalf(elf + 48);
+    if (sectionSize < 40 || (uint64_t) sectionOffset + (uint64_t) sectionSize * sectionCount > size)
+        return false;
+
+    for (uint16_t i = 0; i < sectionCount; i++)
+    {
+        const uint8_t* section = elf + sectionOffset + i * sectionSize;
+        if (elfWord(section + 4) != ELF_SHT_SYMTAB)
+            continue;
+
+        uint32_t offset = elfWord(section + 16), bytes = elfWord(section + 20);
+        uint32_t link = elfWord(section + 24), entrySize = elfWord(section + 36);
+        if (link >= sectionCount || entrySize < 16 || (uint64_t) offset + bytes > size)
+            return false;
+        const uint8_t* strings = elf + sectionOffset + link * sectionSize;
+        uint32_t stringOffset = elfWord(strings + 16), stringBytes = elfWord(strings + 20);
+        if ((uint64_t) stringOffset + stringBytes > size)
+            return false;
+
+        g_Symbols = calloc(bytes / entrySize, sizeof(Symbol));
+        for (uint32_t n = 0; n < bytes / entrySize; n++)
+        {
+            const uint8_t* symbol = elf + offset + n * entrySize;
+            uint32_t name = elfWord(symbol), value = elfWord(symbol + 4);
+            uint8_t type = symbol[12] & 0x0F;
+            uint16_t sectionIndex = elfHalf(symbol + 14);
+            if ((type != ELF_STT_FUNC && type != ELF_STT_NOTYPE) || sectionIndex == 0 || sectionIndex >= 0xFF00
+                || value == 0 || name == 0 || name >= stringBytes)
+                continue;
+
+            const char* text = (const char*) elf + stringOffset + name;
+            if (type == ELF_STT_NOTYPE && (text[0] == '_' || text[0] == '.'))
+                continue;                      // Linker script symbols and local labels
+            g_Symbols[g_SymbolCount++] = (Symbol) { value, elfWord(symbol + 8), text };
+        }
+        qsort(g_Symbols, g_SymbolCount, sizeof(Symbol), compareSymbols);
+        return true;                           // The ELF data stays loaded for the names
+    }
+
+    fprintf(stderr, "%s has no symbol table\n", path);
+    return false;
+}
+
+// Resolves an address to the function that contains it
+// Returns: the name, or the address in hexadecimal in a static buffer
+static const char* symbolName(uint32_t address)
+{
+    size_t low = 0, high = g_SymbolCount;
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        if (g_Symbols[middle].Address <= address)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    if (low > 0)
+    {
+        const Symbol* symbol = &g_Symbols[low - 1];
+        if (symbol->Size == 0 || address - symbol->Address < symbol->Size)
+            return symbol->Name;
+    }
+
+    static char unknown[16];
+    snprintf(unknown, sizeof(unknown), "0x%08x", address);
+    return unknown;
+}
+
+// =============================================================================
+// CALL TREE
+// =============================================================================
+
+static const char* threadName(const Profile* profile, uint16_t id)
+{
+    for (uint32_t i = 0; i < profile->ThreadCount; i++)
+    {
+        if (profile->ThreadIds[i] == id && profile->ThreadNames[i])
+            return profile->ThreadNames[i];
+    }
+    static char unknown[16];
+    snprintf(unknown, sizeof(unknown), "thread %u", id);
+    return unknown;
+}
+
+static Node* childNode(Node* parent, const char* name)
+{
+    for (Node* child = parent->Child; child; child = child->Sibling)
+    {
+        if (strcmp(child->Name, name) == 0)
+            return child;
+    }
+
+    Node* child = calloc(1, sizeof(Node));
+    child->Name = strdup(name);
+    child->Sibling = parent->Child;
+    parent->Child = child;
+    return child;
+}
+
+// Names the frames of a sample from the outermost one, the thread first
+// Returns: Number of names
+static unsigned sampleFrames(const Profile* profile, const Record* record, const char** names)
+{
+    unsigned count = 0;
+    names[count++] = strdup(threadName(profile, record->Thread));
+    for (unsigned i = record->Count; i-- > 0;)
+        names[count++] = strdup(symbolName(i ? record->Data[i] - 1 : record->Data[i]));
+    return count;
+}
+
+// Builds the call tree of every sample
+static Node* buildTree(const Profile* profile)
+{
+    Node* root = calloc(1, sizeof(Node));
+    root->Name = "all";
+    for (size_t n = 0; n < profile->RecordCount; n++)
+    {
+        const Record* record = &profile->Records[n];
+        if (record->Type != PROFILE_SAMPLE)
+            continue;
+
+        const char* names[PROFILE_DEPTH + 1];
+        unsigned count = sampleFrames(profile, record, names);
+        Node* node = root;
+        root->Count++;
+        for (unsigned i = 0; i < count; i++)
+        {
+            node = childNode(node, names[i]);
+            node->Count++;
+            free((char*) names[i]);
+        }
+    }
+    return root;
+}
+
+// Sorts the children of every node by name, so the graph is the same for the same samples
+static void sortTree(Node* node)
+{
+    // Insertion sort of the sibling list
+    Node* sorted = NULL;
+    while (node->Child)
+    {
+        Node* child = node->Child;
+        node->Child = child->Sibling;
+        Node** link = &sorted;
+        while (*link && strcmp((*link)->Name, child->Name) < 0)
+            link = &(*link)->Sibling;
+        child->Sibling = *link;
+        *link = child;
+    }
+    node->Child = sorted;
+    for (Node* child = node->Child; child; child = child->Sibling)
+        sortTree(child);
+}
+
+// =============================================================================
+// OUTPUT
+// =============================================================================
+
+// Writes the folded stacks of a node and its descendants ("a;b;c count")
+static void writeFolded(FILE* file, const Node* node, char* path, size_t length)
+{
+    uint64_t childSamples = 0;
+    for (const Node* child = node->Child; child; child = child->Sibling)
+    {
+        size_t nameLength = strlen(child->Name);
+        if (length + nameLength + 2 > 4096)
+            continue;
+        if (length)
+            path[length] = ';';
+        memcpy(path + length + (length != 0), child->Name, nameLength + 1);
+        writeFolded(file, child, path, length + (length != 0) + nameLength);
+        childSamples += child->Count;
+    }
+    path[length] = '\0';
+    if (length && node->Count > childSamples)
+        fprintf(file, "%s %llu\n", path, (unsigned long long) (node->Count - childSamples));
+}
+
+static void writeXmlText(FILE* file, const char* text, size_t maximum)
+{
+    for (size_t i = 0; text[i] && i < maximum; i++)
+    {
+        if (i + 2 == maximum && text[i + 1] && text[i + 2])
+        {
+            fputs("..", file);
+            return;
+        }
+        switch (text[i])
+        {
+        case '&':  fputs("&amp;", file); break;
+        case '<':  fputs("&lt;", file); break;
+        case '>':  fputs("&gt;", file); break;
+        case '"':  fputs("&quot;", file); break;
+        default:   fputc(text[i], file); break;
+        }
+    }
+}
+
+static unsigned treeDepth(const Node* node)
+{
+    unsigned depth = 0;
+    for (const Node* child = node->Child; child; child = child->Sibling)
+    {
+        unsigned childDepth = treeDepth(child);
+        if (childDepth > depth)
+            depth = childDepth;
+    }
+    return depth + 1;
+}
+
+#define SVG_WIDTH               1200.0
+#define SVG_FRAME_HEIGHT        16
+#define SVG_CHAR_WIDTH          7.0            // Of the 12px monospace font
+
+// Writes the frames of a node and its descendants, the root at the bottom
+static void writeSvgFrames(FILE* file, const Node* node, uint64_t total, double x, unsigned depth, unsigned height)
+{
+    double width = SVG_WIDTH * (double) node->Count / (double) total;
+    if (width < 0.1)
+        return;
+
+    // Warm colors from a hash of the name, like flamegraph.pl
+    uint32_t hash = 2166136261u;
+    for (const char* c = node->Name; *c; c++)
+        hash = (hash ^ (uint8_t) *c) * 16777619u;
+    unsigned red = 205 + hash % 50, green = (hash >> 8) % 230, blue = (hash >> 16) % 55;
+
+    double y = height - (depth + 1.0) * SVG_FRAME_HEIGHT;
+    fputs("<g><title>", file);
+    writeXmlText(file, node->Name, SIZE_MAX);
+    fprintf(file, " (%llu samples, %.2f%%)</title>", (unsigned long long) node->Count,
+            100.0 * (double) node->Count / (double) total);
+    fprintf(file, "<rect x=\"%.1f\" y=\"%.1f\" width=\"%.1f\" height=\"%d\" fill=\"rgb(%u,%u,%u)\" rx=\"2\"/>",
+            x, y, width, SVG_FRAME_HEIGHT - 1, red, green, blue);
+    size_t characters = (size_t) ((width - 6) / SVG_CHAR_WIDTH);
+    if (characters >= 3)
+    {
+        fprintf(file, "<text x=\"%.1f\" y=\"%.1f\">", x + 3, y + SVG_FRAME_HEIGHT - 4);
+        writeXmlText(file, node->Name, characters);
+        fputs("</text>", file);
+    }
+    fputs("</g>\n", file);
+
+    for (const Node* child = node->Child; child; child = child->Sibling)
+    {
+        writeSvgFrames(file, child, total, x, depth + 1, height);
+        x += SVG_WIDTH * (double) child->Count / (double) total;
+    }
+}
+
+// Writes a flame graph of the call tree
+static bool writeSvg(const char* path, const Node* root)
+{
+    FILE* file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    unsigned height = treeDepth(root) * SVG_FRAME_HEIGHT + 2 * SVG_FRAME_HEIGHT;
+    fprintf(file, "<?xml version=\"1.0\" standalone=\"no\"?>\n"
+                  "<svg version=\"1.1\" width=\"%.0f\" height=\"%u\" xmlns=\"http://www.w3.org/2000/svg\">\n"
+                  "<style>text { font-family: monospace; font-size: 12px; fill: black; }</style>\n"
+                  "<rect width=\"100%%\" height=\"100%%\" fill=\"rgb(250,250,240)\"/>\n"
+                  "<text x=\"%.0f\" y=\"%d\" text-anchor=\"middle\">NBOS kernel profile, %llu samples</text>\n",
+            SVG_WIDTH, height, SVG_WIDTH / 2, SVG_FRAME_HEIGHT, (unsigned long long) root->Count);
+    if (root->Count)
+        writeSvgFrames(file, root, root->Count, 0, 0, height);
+    fputs("</svg>\n", file);
+    return fclose(file) == 0;
+}
+
+// Per function counts of the flat profile
+typedef struct
+{
+    const char* Name;
+    uint64_t Self;                     // Samples with the EIP in the function
+    uint64_t Total;                    // Samples with the function anywhere on the stack
+
+} FunctionCount;
+
+static int compareSelf(const void* a, const void* b)
+{
+    const FunctionCount* x = a;
+    const FunctionCount* y = b;
+    return x->Self < y->Self ? 1 : x->Self > y->Self ? -1 : strcmp(x->Name, y->Name);
+}
+
+static FunctionCount* functionCount(FunctionCount* counts, size_t* count, const char* name)
+{
+    for (size_t i = 0; i < *count; i++)
+    {
+        if (strcmp(counts[i].Name, name) == 0)
+            return &counts[i];
+    }
+    counts[*count] = (FunctionCount) { strdup(name), 0, 0 };
+    return &counts[(*count)++];
+}
+
+// Prints the functions with the most samples
+static void printFunctions(const Profile* profile, uint64_t samples, unsigned top)
+{
+    FunctionCount* counts = calloc(profile->RecordCount * PROFILE_DEPTH + 1, sizeof(FunctionCount));
+    size_t count = 0;
+    for (size_t n = 0; n < profile->RecordCount; n++)
+    {
+        const Record* record = &profile->Records[n];
+        if (record->Type != PROFILE_SAMPLE)
+            continue;
+
+        const char* seen[PROFILE_DEPTH];
+        for (unsigned i = 0; i < record->Count; i++)
+        {
+            const char* name = symbolName(i ? record->Data[i] - 1 : record->Data[i]);
+            FunctionCount* function = functionCount(counts, &count, name);
+            if (i == 0)
+                function->Self++;
+
+            // Recursion counts once per sample
+            bool again = false;
+            for (unsigned j = 0; j < i; j++)
+                again |= seen[j] == function->Name;
+            if (!again)
+                function->Total++;
+            seen[i] = function->Name;
+        }
+    }
+    qsort(counts, count, sizeof(FunctionCount), compareSelf);
+
+    printf("\nFunctions by samples (self: EIP in the function, total: on the stack):\n");
+    printf("  %8s %7s %8s %7s  %s\n", "self", "", "total", "", "function");
+    for (size_t i = 0; i < count && i < top; i++)
+        printf("  %8llu %6.2f%% %8llu %6.2f%%  %s\n", (unsigned long long) counts[i].Self,
+               100.0 * (double) counts[i].Self / (double) samples, (unsigned long long) counts[i].Total,
+               100.0 * (double) counts[i].Total / (double) samples, counts[i].Name);
+}
+
+static int compareTimestamps(const void* a, const void* b)
+{
+    const Record* x = a;
+    const Record* y = b;
+    return x->Timestamp < y->Timestamp ? -1 : x->Timestamp > y->Timestamp;
+}
+
+// Prints the events and the spans (begin to end in the same thread) of every tracepoint
+static void printTracepoints(Profile* profile)
+{
+    qsort(profile->Records, profile->RecordCount, sizeof(Record), compareTimestamps);
+
+    uint64_t events[MAX_TYPES] = { 0 }, spans[MAX_TYPES] = { 0 };
+    uint64_t total[MAX_TYPES] = { 0 }, longest[MAX_TYPES] = { 0 };
+    uint64_t* begins = calloc(65536 * (size_t) MAX_TYPES, sizeof(uint64_t));  // Open span per thread and type
+
+    for (size_t n = 0; n < profile->RecordCount; n++)
+    {
+        const Record* record = &profile->Records[n];
+        unsigned type = record->Type & ~TRACE_END;
+        if (type == PROFILE_SAMPLE || type >= MAX_TYPES)
+            continue;
+
+        uint64_t* begin = &begins[(size_t) record->Thread * MAX_TYPES + type];
+        if (!(record->Type & TRACE_END))
+        {
+            events[type]++;
+            *begin = record->Timestamp;
+        }
+        else if (*begin)
+        {
+            uint64_t duration = record->Timestamp - *begin;
+            spans[type]++;
+            total[type] += duration;
+            if (duration > longest[type])
+                longest[type] = duration;
+            *begin = 0;
+        }
+    }
+    free(begins);
+
+    const char* unit = profile->TscKhz ? "us" : "cycles";
+    double scale = profile->TscKhz ? 1000.0 / profile->TscKhz : 1.0;
+    printf("\nTracepoints (durations of spans in %s):\n", unit);
+    printf("  %-24s %10s %10s %12s %12s %12s\n", "tracepoint", "events", "spans", "total", "average", "longest");
+    for (unsigned type = 1; type < profile->TypeCount; type++)
+    {
+        const char* name = profile->TypeNames[type] ? profile->TypeNames[type] : "?";
+        if (!spans[type])
+        {
+            printf("  %-24s %10llu\n", name, (unsigned long long) events[type]);
+            continue;
+        }
+        printf("  %-24s %10llu %10llu %12.1f %12.1f %12.1f\n", name, (unsigned long long) events[type],
+               (unsigned long long) spans[type], (double) total[type] * scale,
+               (double) total[type] * scale / (double) spans[type], (double) longest[type] * scale);
+    }
+}
+
+// Prints the samples of every thread
+static void printThreads(const Node* root)
+{
+    printf("\nSamples by thread:\n");
+    for (const Node* thread = root->Child; thread; thread = thread->Sibling)
+        printf("  %8llu %6.2f%%  %s\n", (unsigned long long) thread->Count,
+               100.0 * (double) thread->Count / (double) root->Count, thread->Name);
+}
+
+// =============================================================================
+// MAIN
+// =============================================================================
+
+int main(int argc, char** argv)
+{
+    const char* foldedPath = NULL;
+    const char* svgPath = NULL;
+    unsigned top = 20;
+    bool syntax = argc >= 3;
+    for (int i = 3; syntax && i < argc; i++)
+    {
+        if (strcmp(argv[i], "--folded") == 0 && i + 1 < argc)
+            foldedPath = argv[++i];
+        else if (strcmp(argv[i], "--svg") == 0 && i + 1 < argc)
+            svgPath = argv[++i];
+        else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc)
+            top = (unsigned) atoi(argv[++i]);
+        else
+            syntax = false;
+    }
+    if (!syntax)
+    {
+        fprintf(stderr, "Syntax: %s <serial log> <kernel.elf> [--folded <file>] [--svg <file>] [--top <count>]\n",
+                argv[0]);
+        return -1;
+    }
+
+    size_t size;
+    uint8_t* capture = readFile(argv[1], &size);
+    if (!capture)
+    {
+        fprintf(stderr, "Could not read %s\n", argv[1]);
+        return -2;
+    }
+
+    Profile profile;
+    if (!parseDump(capture, size, &profile) || !loadSymbols(argv[2]))
+        return -3;
+
+    Node* root = buildTree(&profile);
+    sortTree(root);
+
+    printf("Profile: %llu samples on %u CPUs, %zu records, %llu lost (ring overwritten)",
+           (unsigned long long) root->Count, profile.CpuCount, profile.RecordCount,
+           (unsigned long long) profile.Lost);
+    if (profile.TscKhz)
+        printf(", TSC at %u kHz", profile.TscKhz);
+    printf("\n");
+
+    if (root->Count)
+    {
+        printThreads(root);
+        printFunctions(&profile, root->Count, top);
+    }
+    printTracepoints(&profile);
+
+    if (foldedPath)
+    {
+        FILE* file = fopen(foldedPath, "w");
+        char path[4096] = "";
+        if (!file)
+        {
+            fprintf(stderr, "Could not write %s\n", foldedPath);
+            return -4;
+        }
+        writeFolded(file, root, path, 0);
+        fclose(file);
+    }
+    if (svgPath && !writeSvg(svgPath, root))
+    {
+        fprintf(stderr, "Could not write %s\n", svgPath);
+        return -4;
+    }
+    return 0;
+}